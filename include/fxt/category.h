@@ -0,0 +1,212 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/scope.h"
+#include "fxt/writer.h"
+
+#include <stdint.h>
+
+#include <atomic>
+
+namespace fxt {
+
+/**
+ * @brief The number of bits in the runtime mask. Bit 0 is always set, so one less category can be registered
+ *
+ * Categories past that can't be turned off at runtime
+ */
+constexpr unsigned kMaxCategories = 256;
+
+namespace internal {
+
+/**
+ * @brief One bit per registered category, set while the category is enabled
+ *
+ * Bit 0 stands in for categories that didn't get a bit of their own, so it is always set. That includes categories
+ * used before their registration ran, since their bit index is still zero then
+ */
+extern std::atomic<uint64_t> gCategoryMask[kMaxCategories / 64];
+
+/**
+ * @brief Gives the category a bit in the mask. Registering the same name again returns the same bit
+ *
+ * @param name    The category string
+ * @return        The index of the category's bit. 0 if all the bits are taken
+ */
+unsigned RegisterCategory(const char *name);
+
+inline bool IsCategoryBitSet(unsigned bit) {
+	return ((gCategoryMask[bit / 64].load(std::memory_order_relaxed) >> (bit % 64)) & 1) != 0;
+}
+
+} // End of namespace internal
+
+/**
+ * @brief Turns a category on or off at runtime. Every category starts enabled
+ *
+ * This only sets a bit, so it is safe to call from any thread. If a writer is given, a marker is written to it, so
+ * readers can tell when the filter changed. The marker is an "fxt" / "Category Filter" instant event, with the category
+ * name and the new state as arguments
+ *
+ * @param category     The category string. It is registered if it hasn't been already
+ * @param enabled      Whether events of the category should be written
+ * @param writer       Optional. The writer to write the marker to
+ * @param processID    The process ID to write the marker with
+ * @param threadID     The thread ID to write the marker with
+ * @param timestamp    The timestamp of the marker
+ * @return             0 on success. FXT_ERR_INVALID_CONFIG if there are no bits left. Otherwise, the error from writing
+ *                     the marker
+ */
+int SetCategoryEnabled(const char *category, bool enabled, Writer *writer, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp);
+
+/**
+ * @brief Checks whether a category is enabled at runtime
+ *
+ * @param category    The category string
+ * @return            True if the category is enabled, or was never registered
+ */
+bool IsCategoryEnabled(const char *category);
+
+} // End of namespace fxt
+
+/**
+ * Compile-time categories
+ *
+ * Each category is declared once, with a constant expression that says whether it is compiled in. The FXT_CATEGORY_*
+ * macros below take the category's identifier instead of its name string. When the category is compiled out, they
+ * expand to a discarded `if constexpr` branch. So none of their arguments are evaluated, and no code is generated.
+ *
+ * Categories that are compiled in get a bit in a runtime mask when the program starts. The macros test the bit before
+ * touching any of their arguments. So a category turned off with SetCategoryEnabled() costs a relaxed load and a branch.
+ *
+ * Defining FXT_DISABLE_ALL_CATEGORIES compiles out every category.
+ *
+ * Example:
+ *     // In a header shared by the instrumented code
+ *     FXT_DEFINE_CATEGORY(Render, "render", true);
+ *     FXT_DEFINE_CATEGORY(Network, "network", MYAPP_TRACE_NETWORK);
+ *
+ *     FXT_CATEGORY_ADD_INSTANT_EVENT(Network, &writer, "Send", pid, tid, timestamp, "bytes", ComputeSize());
+ */
+
+#define FXT_INTERNAL_CATEGORY(id) FxtCategory_##id
+
+#if defined(FXT_DISABLE_ALL_CATEGORIES)
+#	define FXT_INTERNAL_CATEGORY_COMPILED_IN(enabled) false
+#else
+#	define FXT_INTERNAL_CATEGORY_COMPILED_IN(enabled) (enabled)
+#endif
+
+/**
+ * @brief Declares a category. This must be at namespace scope, and visible to every use of the category
+ *
+ * @param id         The identifier the FXT_CATEGORY_* macros refer to the category by
+ * @param name       The category string written to the trace
+ * @param enabled    A constant expression. If false, every use of the category is compiled out
+ *
+ * The runtime bit is registered during static initialization. Code that runs during the static initialization of other
+ * translation units may see the category as always enabled
+ */
+#define FXT_DEFINE_CATEGORY(id, name, enabled)                                                        \
+	struct FXT_INTERNAL_CATEGORY(id) {                                                                \
+		static constexpr const char *kName = name;                                                    \
+		static constexpr bool kCompiledIn = FXT_INTERNAL_CATEGORY_COMPILED_IN(enabled);               \
+		static inline const unsigned kBit = kCompiledIn ? fxt::internal::RegisterCategory(name) : 0u; \
+	}
+
+/**
+ * @brief A constant expression that is true if the category is compiled in
+ */
+#define FXT_CATEGORY_COMPILED_IN(id) (FXT_INTERNAL_CATEGORY(id)::kCompiledIn)
+/**
+ * @brief The category string of the category
+ */
+#define FXT_CATEGORY_NAME(id) (FXT_INTERNAL_CATEGORY(id)::kName)
+
+/**
+ * @brief True if the category is compiled in, and enabled at runtime
+ */
+#define FXT_CATEGORY_ENABLED(id) (FXT_CATEGORY_COMPILED_IN(id) && fxt::internal::IsCategoryBitSet(FXT_INTERNAL_CATEGORY(id)::kBit))
+
+/**
+ * @brief Runs the statement only if the category is compiled in and enabled. If it is compiled out, the statement is
+ * discarded without being evaluated
+ */
+#define FXT_IF_CATEGORY(id, ...)                                                    \
+	do {                                                                            \
+		if constexpr (FXT_CATEGORY_COMPILED_IN(id)) {                               \
+			if (fxt::internal::IsCategoryBitSet(FXT_INTERNAL_CATEGORY(id)::kBit)) { \
+				__VA_ARGS__;                                                        \
+			}                                                                       \
+		}                                                                           \
+	} while (0)
+
+#define FXT_CATEGORY_ADD_INSTANT_EVENT(id, writer, name, processID, threadID, timestamp, ...) \
+	FXT_IF_CATEGORY(id, FXT_ADD_INSTANT_EVENT(writer, FXT_CATEGORY_NAME(id), name, processID, threadID, timestamp, __VA_ARGS__))
+
+#define FXT_CATEGORY_ADD_COUNTER_EVENT(id, writer, name, processID, threadID, timestamp, counterID, ...) \
+	FXT_IF_CATEGORY(id, FXT_ADD_COUNTER_EVENT(writer, FXT_CATEGORY_NAME(id), name, processID, threadID, timestamp, counterID, __VA_ARGS__))
+
+#define FXT_CATEGORY_ADD_DURATION_BEGIN_EVENT(id, writer, name, processID, threadID, timestamp, ...) \
+	FXT_IF_CATEGORY(id, FXT_ADD_DURATION_BEGIN_EVENT(writer, FXT_CATEGORY_NAME(id), name, processID, threadID, timestamp, __VA_ARGS__))
+
+#define FXT_CATEGORY_ADD_DURATION_END_EVENT(id, writer, name, processID, threadID, timestamp, ...) \
+	FXT_IF_CATEGORY(id, FXT_ADD_DURATION_END_EVENT(writer, FXT_CATEGORY_NAME(id), name, processID, threadID, timestamp, __VA_ARGS__))
+
+#define FXT_CATEGORY_ADD_DURATION_COMPLETE_EVENT(id, writer, name, processID, threadID, beginTimestamp, endTimestamp, ...) \
+	FXT_IF_CATEGORY(id, FXT_ADD_DURATION_COMPLETE_EVENT(writer, FXT_CATEGORY_NAME(id), name, processID, threadID, beginTimestamp, endTimestamp, __VA_ARGS__))
+
+#define FXT_CATEGORY_ADD_ASYNC_BEGIN_EVENT(id, writer, name, processID, threadID, timestamp, asyncCorrelationID, ...) \
+	FXT_IF_CATEGORY(id, FXT_ADD_ASYNC_BEGIN_EVENT(writer, FXT_CATEGORY_NAME(id), name, processID, threadID, timestamp, asyncCorrelationID, __VA_ARGS__))
+
+#define FXT_CATEGORY_ADD_ASYNC_INSTANT_EVENT(id, writer, name, processID, threadID, timestamp, asyncCorrelationID, ...) \
+	FXT_IF_CATEGORY(id, FXT_ADD_ASYNC_INSTANT_EVENT(writer, FXT_CATEGORY_NAME(id), name, processID, threadID, timestamp, asyncCorrelationID, __VA_ARGS__))
+
+#define FXT_CATEGORY_ADD_ASYNC_END_EVENT(id, writer, name, processID, threadID, timestamp, asyncCorrelationID, ...) \
+	FXT_IF_CATEGORY(id, FXT_ADD_ASYNC_END_EVENT(writer, FXT_CATEGORY_NAME(id), name, processID, threadID, timestamp, asyncCorrelationID, __VA_ARGS__))
+
+#define FXT_CATEGORY_ADD_FLOW_BEGIN_EVENT(id, writer, name, processID, threadID, timestamp, flowCorrelationID, ...) \
+	FXT_IF_CATEGORY(id, FXT_ADD_FLOW_BEGIN_EVENT(writer, FXT_CATEGORY_NAME(id), name, processID, threadID, timestamp, flowCorrelationID, __VA_ARGS__))
+
+#define FXT_CATEGORY_ADD_FLOW_STEP_EVENT(id, writer, name, processID, threadID, timestamp, flowCorrelationID, ...) \
+	FXT_IF_CATEGORY(id, FXT_ADD_FLOW_STEP_EVENT(writer, FXT_CATEGORY_NAME(id), name, processID, threadID, timestamp, flowCorrelationID, __VA_ARGS__))
+
+#define FXT_CATEGORY_ADD_FLOW_END_EVENT(id, writer, name, processID, threadID, timestamp, flowCorrelationID, ...) \
+	FXT_IF_CATEGORY(id, FXT_ADD_FLOW_END_EVENT(writer, FXT_CATEGORY_NAME(id), name, processID, threadID, timestamp, flowCorrelationID, __VA_ARGS__))
+
+namespace fxt {
+namespace internal {
+
+// Stands in for a ScopedDuration when the category is compiled out
+struct CompiledOutScope {};
+
+// The runtime check is made once, on entry. So a scope that was entered before its category was turned off is still
+// written, and one entered before it was turned on isn't
+template <bool kCompiledIn, typename GetWriterFunc, typename Func>
+auto MakeCategoryScope(unsigned bit, GetWriterFunc getWriter, Func func) {
+	if constexpr (kCompiledIn) {
+		return ScopedDuration<Func>(IsCategoryBitSet(bit) ? getWriter() : nullptr, func, true);
+	} else {
+		return CompiledOutScope();
+	}
+}
+
+} // End of namespace internal
+} // End of namespace fxt
+
+/**
+ * @brief Same as FXT_SCOPE(), but compiled out along with the category. Even the writer expression isn't evaluated
+ *
+ * If the category is turned off at runtime when the scope is entered, nothing is written for it
+ */
+#define FXT_CATEGORY_SCOPE(id, writer, name, ...)                                                                                                                                              \
+	[[maybe_unused]] auto FXT_INTERNAL_CONCAT(fxtScope, __LINE__) = fxt::internal::MakeCategoryScope<FXT_CATEGORY_COMPILED_IN(id)>(FXT_INTERNAL_CATEGORY(id)::kBit,                            \
+	        [&]() { return writer; },                                                                                                                                                          \
+	        [&](fxt::Writer *fxtWriter, uint64_t fxtBeginTimestamp) {                                                                                                                          \
+		        return FXT_ADD_DURATION_COMPLETE_EVENT(fxtWriter, FXT_CATEGORY_NAME(id), name, fxt::kCurrentProcess, fxt::kCurrentThread, fxtBeginTimestamp, fxt::kTimestampNow, __VA_ARGS__); \
+	        })
@@ -0,0 +1,156 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/err.h"
+#include "fxt/writer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fxt {
+
+struct CollectorPendingEvent {
+	uint64_t timestamp;
+	/**
+	 * @brief The size of the event, plus the records that came before it in its stream
+	 */
+	size_t size;
+};
+
+struct CollectorStream {
+	ProviderID providerID;
+	std::string providerName;
+	bool announced;
+	/**
+	 * @brief The number of records taken from the stream. Magic Number and provider records are dropped, so they aren't
+	 * counted
+	 */
+	uint64_t recordsCollected;
+
+	/**
+	 * @brief Records held back by the timestamp merge. Only used when Collector::orderByTimestamp is set
+	 *
+	 * Every event is queued together with the records in front of it. IE, the String and Thread records it refers to.
+	 * Records after the last event stay at the end of pendingData, until the next event shows up
+	 */
+	std::vector<uint8_t> pendingData;
+	size_t pendingStart = 0;
+	std::deque<CollectorPendingEvent> pendingEvents;
+	size_t pendingEventBytes = 0;
+};
+
+/**
+ * @brief Merges the record streams of several providers into a single FXT stream
+ *
+ * Each input stream is a complete FXT stream from one provider, as written by its own Writer. The collector writes a
+ * single Magic Number record, and drops the ones from the inputs. Whenever the output switches from one input to
+ * another, it writes a Provider Section record, so readers keep the String and Thread tables of each provider apart.
+ * Provider Info / Section records from the inputs are dropped too. The stream is filed under the provider given to
+ * AddCollectorStream(), whatever the producer called itself.
+ *
+ * By default, records are written out in the order they are collected. Streams usually arrive in blocks, so the events
+ * of different streams end up interleaved by block, rather than by time. Setting orderByTimestamp makes the collector
+ * hold events back, and merge them across the streams by timestamp. Each stream must be in timestamp order on its own.
+ * Duration Complete events are written when their span ends, so they are ordered by their end timestamp. That keeps
+ * streams from FXT_SCOPE() in order, even though a parent's begin comes before its children's. An event is written once the newest timestamp seen on any stream is reorderWindow ticks past it. So events stay in
+ * order, as long as no stream lags behind the others by more than the window. Events that arrive later than that are
+ * still written, but out of order, and counted in lateRecords. Call FlushCollector() at the end, to write out
+ * everything that is still held back.
+ *
+ * Example:
+ *     fxt::Collector collector(&file, WriteToFile);
+ *     unsigned stream;
+ *     AddCollectorStream(&collector, 1, "Server", &stream);
+ *     ...
+ *     CollectRecords(&collector, stream, data, len);
+ */
+struct Collector {
+	Collector(void *userContext, WriteFunc writeFunc)
+	        : writer(userContext, writeFunc) {
+	}
+
+	Collector(const Collector &) = delete;
+	Collector &operator=(const Collector &) = delete;
+
+	/**
+	 * @brief The output. Only used directly for the metadata records. Records are copied straight to writeFunc
+	 */
+	Writer writer;
+	std::vector<CollectorStream> streams;
+
+	bool wroteMagic = false;
+	/**
+	 * @brief The stream whose provider section the output is currently in. -1 if none
+	 */
+	int currentStream = -1;
+
+	/**
+	 * @brief Optional. Merge the events of the streams by timestamp, instead of writing them in the order they arrive
+	 */
+	bool orderByTimestamp = false;
+	/**
+	 * @brief How far behind the newest timestamp an event is held back for, in ticks
+	 */
+	uint64_t reorderWindow = 0;
+	/**
+	 * @brief The number of events that arrived after a later event had already been written, so they are out of order
+	 */
+	uint64_t lateRecords = 0;
+
+	/**
+	 * @brief The head of each stream with pending events, keyed by the head's timestamp
+	 */
+	std::priority_queue<std::pair<uint64_t, unsigned>, std::vector<std::pair<uint64_t, unsigned>>, std::greater<std::pair<uint64_t, unsigned>>> mergeHeap;
+	uint64_t newestTimestamp = 0;
+	uint64_t lastWrittenTimestamp = 0;
+};
+
+/**
+ * @brief Registers a new input stream
+ *
+ * @param collector      The collector to add to
+ * @param providerID     The provider ID of the stream. This should be unique among the streams
+ * @param providerName   The provider name of the stream
+ * @param streamIndex    Filled with the index to pass to CollectRecords()
+ * @return               0 on success. Non-zero for failure
+ */
+int AddCollectorStream(Collector *collector, ProviderID providerID, const char *providerName, unsigned *streamIndex);
+
+/**
+ * @brief Copies a batch of records from one of the input streams to the output
+ *
+ * If Collector::orderByTimestamp is set, the records are queued instead, and written out once they are outside the
+ * reorder window
+ *
+ * @param collector      The collector to use
+ * @param streamIndex    The index of the stream the records came from
+ * @param records        The record data. It must only contain complete records
+ * @param len            The length of the record data
+ * @return               0 on success. FXT_ERR_INVALID_TRACE if the data doesn't hold complete records. Otherwise, the
+ *                       error returned by the output writeFunc
+ */
+int CollectRecords(Collector *collector, unsigned streamIndex, const void *records, size_t len);
+
+/**
+ * @brief Writes out all the records held back by the timestamp merge, in timestamp order
+ *
+ * Call this once all the streams are done. It does nothing if Collector::orderByTimestamp isn't set
+ *
+ * @param collector    The collector to flush
+ * @return             0 on success. Otherwise, the error returned by the output writeFunc
+ */
+int FlushCollector(Collector *collector);
+
+} // End of namespace fxt
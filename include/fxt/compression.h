@@ -0,0 +1,140 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/err.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace fxt {
+
+enum class CompressionCodec : uint8_t {
+	/**
+	 * @brief The payload is the raw data. Used when compressing doesn't make the data smaller
+	 */
+	Stored = 0,
+	/**
+	 * @brief The payload is a single LZ4 block
+	 */
+	LZ4 = 1,
+};
+
+namespace internal {
+
+static constexpr uint32_t kCompressedFrameMagic = 0x5a545846; // "FXTZ"
+
+/**
+ * @brief The header at the start of each compressed frame. The payload directly follows it
+ */
+struct CompressedFrameHeader {
+	uint32_t magic;
+	CompressionCodec codec;
+	uint8_t reserved[3];
+	uint32_t rawSize;
+	uint32_t payloadSize;
+	/**
+	 * @brief XXH3 64 of the raw data
+	 */
+	uint64_t rawChecksum;
+};
+static_assert(sizeof(CompressedFrameHeader) == 24, "The frame header is part of the file format");
+
+/**
+ * @brief Fills in a frame header. This is async-signal-safe
+ */
+void InitCompressedFrameHeader(CompressedFrameHeader *header, CompressionCodec codec, const void *data, size_t len, size_t payloadSize);
+
+} // End of namespace internal
+
+/**
+ * @brief The largest frame that CompressFrame() can produce for len bytes of data
+ */
+size_t GetMaxCompressedFrameSize(size_t len);
+
+/**
+ * @brief Compresses data into a single, independently decodable, frame
+ *
+ * Compressed traces are a sequence of these frames. Each frame is stored uncompressed if LZ4 doesn't make it smaller.
+ *
+ * The frames are our own container around a standard LZ4 block, not the LZ4 frame format. So the lz4 command line tool
+ * can't read compressed traces. Use DecompressTraceFile(), or the fxt-decompress tool, instead
+ *
+ * @param data             The data to compress
+ * @param len              The length of the data array. Must be less than 2 GB
+ * @param frame            The buffer to write the frame to
+ * @param frameCapacity    The size of the frame buffer. GetMaxCompressedFrameSize(len) always fits
+ * @param frameSize        Filled with the size of the frame
+ * @return                 0 on success. Non-zero for failure
+ */
+int CompressFrame(const void *data, size_t len, void *frame, size_t frameCapacity, size_t *frameSize);
+
+typedef int (*ReadFunc)(void *userContext, void *data, size_t len, size_t *bytesRead);
+
+/**
+ * @brief Decompresses a stream of frames written by CompressFrame(), and hands out the original trace bytes
+ *
+ * Example:
+ *     fxt::DecompressingReader reader(file, ReadFromFile);
+ *     size_t bytesRead;
+ *     while (ReadDecompressed(&reader, buffer, sizeof(buffer), &bytesRead) == 0 && bytesRead > 0) {
+ *         ...
+ *     }
+ */
+struct DecompressingReader {
+	DecompressingReader(void *userContext, ReadFunc readFunc)
+	        : userContext(userContext), readFunc(readFunc) {
+	}
+
+	DecompressingReader(const DecompressingReader &) = delete;
+	DecompressingReader &operator=(const DecompressingReader &) = delete;
+
+	void *userContext;
+	/**
+	 * @brief Reads the compressed stream. It should fill the whole buffer, unless the stream has ended
+	 */
+	ReadFunc readFunc;
+	/**
+	 * @brief Frames that claim to hold more raw data than this are treated as corrupt, before anything is allocated
+	 *
+	 * Frames hold one sink buffer each. So this only has to be raised for sinks with buffers larger than 64 MiB
+	 */
+	size_t maxFrameSize = 64 * 1024 * 1024;
+
+	std::vector<uint8_t> payload;
+	/**
+	 * @brief The decompressed data of the current frame
+	 */
+	std::vector<uint8_t> raw;
+	size_t rawOffset = 0;
+};
+
+/**
+ * @brief Reads the next len bytes of decompressed data
+ *
+ * @param reader       The reader to read from
+ * @param data         The buffer to fill
+ * @param len          The length of the data buffer
+ * @param bytesRead    Filled with the number of bytes read. Less than len only at the end of the stream, or on failure
+ * @return             0 on success. FXT_ERR_INVALID_TRACE if a frame is corrupt or cut off. Non-zero for other failures
+ */
+int ReadDecompressed(DecompressingReader *reader, void *data, size_t len, size_t *bytesRead);
+
+/**
+ * @brief Decompresses a whole trace file, so it can be loaded by trace viewers
+ *
+ * If the file ends with a partial frame, everything before it is still written out
+ *
+ * @param inputPath     The path of the compressed trace
+ * @param outputPath    The path to write the decompressed trace to
+ * @return              0 on success. Non-zero for failure
+ */
+int DecompressTraceFile(const char *inputPath, const char *outputPath);
+
+} // End of namespace fxt
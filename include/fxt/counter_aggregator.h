@@ -0,0 +1,244 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/clock.h"
+#include "fxt/err.h"
+#include "fxt/histogram.h"
+#include "fxt/sampling.h"
+#include "fxt/thread_identity.h"
+#include "fxt/writer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fxt {
+
+struct CounterAggregatorConfig {
+	/**
+	 * @brief How often the background thread writes every counter
+	 *
+	 * 0 disables the thread. Counters are then only written by FlushCounterAggregator()
+	 */
+	uint32_t intervalMs = 100;
+	/**
+	 * @brief The process ID to write the counter events with
+	 */
+	KernelObjectID processID = kCurrentProcess;
+	/**
+	 * @brief The thread ID to write the counter events with. fxt::kCurrentThread is the aggregator's own thread
+	 */
+	KernelObjectID threadID = kCurrentThread;
+};
+
+/**
+ * @brief A counter that is updated with atomics, and written by a CounterAggregator once per interval
+ */
+struct AggregatedCounter {
+	AggregatedCounter() = default;
+
+	AggregatedCounter(const AggregatedCounter &) = delete;
+	AggregatedCounter &operator=(const AggregatedCounter &) = delete;
+
+	std::string category;
+	std::string name;
+	uint64_t counterID = 0;
+
+	std::atomic<int64_t> value{ 0 };
+	/**
+	 * @brief Whether updates keep track of min and max. Set when the counter is registered
+	 */
+	bool trackExtremes = false;
+	/**
+	 * @brief The lowest and highest values reached since the last report. Only updated if trackExtremes is set
+	 */
+	std::atomic<int64_t> min{ 0 };
+	std::atomic<int64_t> max{ 0 };
+
+	/**
+	 * @brief The value as of the last report. Only touched under the aggregator's lock
+	 */
+	int64_t reportedValue = 0;
+};
+
+/**
+ * @brief Downsamples high frequency counters into one counter event per counter per interval
+ *
+ * Updating a counter is an atomic add (or store) of its value. Nothing is written to the trace.
+ *
+ * A background thread writes every registered counter once per interval, as a single counter event with "last" and
+ * "sum" arguments. "last" is the value at the time of the report. "sum" is the net amount added during the interval.
+ * IE, the bytes sent for a byte counter, or the change in depth for a queue depth counter.
+ *
+ * Counters can also track the interval's "min" and "max", which suits values that go up and down, like a queue depth.
+ * That's opt-in, since every update that reaches a new extreme has to compare-and-swap it. For a counter that only ever
+ * grows, that's every single update.
+ *
+ * LatencyHistograms and Samplers can be registered too. Each interval, the thread writes the histograms' percentiles
+ * with AddHistogramCounterEvent(), and the samplers' totals with AddSamplerTotalCounterEvent(), so nothing else has to
+ * drive them.
+ *
+ * The aggregator writes from its own thread, so the writer must not be used by anything else. Give it a writer of its
+ * own, with its own sink. The writer needs a clock, since the events are written with fxt::kTimestampNow.
+ *
+ * Example:
+ *     fxt::CounterAggregator aggregator;
+ *     InitCounterAggregator(&aggregator, &counterWriter, fxt::CounterAggregatorConfig());
+ *
+ *     fxt::AggregatedCounter *queueDepth;
+ *     RegisterAggregatedCounter(&aggregator, "Network", "Send Queue Depth", 1, true, &queueDepth);
+ *
+ *     // On any thread
+ *     AddToAggregatedCounter(queueDepth, 1);
+ *     ...
+ *     AddToAggregatedCounter(queueDepth, -1);
+ *
+ *     CloseCounterAggregator(&aggregator);
+ */
+struct CounterAggregator {
+	CounterAggregator() = default;
+	~CounterAggregator();
+
+	CounterAggregator(const CounterAggregator &) = delete;
+	CounterAggregator &operator=(const CounterAggregator &) = delete;
+
+	CounterAggregatorConfig config;
+	/**
+	 * @brief nullptr until the aggregator is initialized, and again once it's closed
+	 */
+	Writer *writer = nullptr;
+
+	// Guards the list of counters, the writer, and the fields below. Never taken on the hot path
+	std::mutex mutex;
+	std::vector<std::unique_ptr<AggregatedCounter>> counters;
+	std::vector<LatencyHistogram *> histograms;
+	std::vector<Sampler *> samplers;
+	/**
+	 * @brief The first error hit while writing
+	 */
+	int error = 0;
+
+	std::condition_variable condition;
+	bool shutdown = false;
+	std::thread thread;
+};
+
+/**
+ * @brief Sets up the aggregator, and starts its background thread
+ *
+ * @param aggregator    The aggregator to initialize
+ * @param writer        The writer to write the counter events to. It must not be used by anything else
+ * @param config        The aggregator configuration
+ * @return              0 on success. FXT_ERR_INVALID_CONFIG if the aggregator is already open, or there's no writer
+ */
+int InitCounterAggregator(CounterAggregator *aggregator, Writer *writer, CounterAggregatorConfig config);
+
+/**
+ * @brief Adds a counter to the aggregator. It starts at 0
+ *
+ * @param aggregator       The aggregator to add the counter to
+ * @param category         The category of the counter events
+ * @param name             The name of the counter events
+ * @param counterID        The counter ID of the counter events
+ * @param trackExtremes    Also write the "min" and "max" of each interval. This makes updates more expensive
+ * @param counter          Filled with the counter. It stays valid until the aggregator is closed
+ * @return                 0 on success. FXT_ERR_INVALID_CONFIG if the aggregator isn't open
+ */
+int RegisterAggregatedCounter(CounterAggregator *aggregator, const char *category, const char *name, uint64_t counterID, bool trackExtremes, AggregatedCounter **counter);
+
+/**
+ * @brief Has the aggregator write the histogram's percentiles every interval, after the counters
+ *
+ * The aggregator takes the histogram's snapshots from then on, so nothing else may call AddHistogramCounterEvent() or
+ * TakeHistogramSnapshot() on it. The histogram must outlive the aggregator, or at least stay valid until it is closed
+ *
+ * @param aggregator    The aggregator to add the histogram to
+ * @param histogram     The histogram to report
+ * @return              0 on success. FXT_ERR_INVALID_CONFIG if the aggregator isn't open
+ */
+int RegisterAggregatedHistogram(CounterAggregator *aggregator, LatencyHistogram *histogram);
+
+/**
+ * @brief Has the aggregator write the sampler's kept / sampled out counts, summed over every thread, every interval
+ *
+ * The sampler must outlive the aggregator, or at least stay valid until it is closed
+ *
+ * @param aggregator    The aggregator to add the sampler to
+ * @param sampler       The sampler to report
+ * @return              0 on success. FXT_ERR_INVALID_CONFIG if the aggregator isn't open
+ */
+int RegisterAggregatedSampler(CounterAggregator *aggregator, Sampler *sampler);
+
+namespace internal {
+
+inline void UpdateAggregatedCounterExtremes(AggregatedCounter *counter, int64_t value) {
+	int64_t current = counter->min.load(std::memory_order_relaxed);
+	while (value < current && !counter->min.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+	}
+	current = counter->max.load(std::memory_order_relaxed);
+	while (value > current && !counter->max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+	}
+}
+
+} // End of namespace internal
+
+/**
+ * @brief Adds to the counter. Safe to call from any thread
+ *
+ * @param counter    The counter to update
+ * @param delta      The amount to add. Can be negative
+ */
+inline void AddToAggregatedCounter(AggregatedCounter *counter, int64_t delta) {
+	const int64_t value = counter->value.fetch_add(delta, std::memory_order_relaxed) + delta;
+	if (counter->trackExtremes) {
+		internal::UpdateAggregatedCounterExtremes(counter, value);
+	}
+}
+
+/**
+ * @brief Sets the counter to a value. Safe to call from any thread
+ *
+ * @param counter    The counter to update
+ * @param value      The new value
+ */
+inline void SetAggregatedCounter(AggregatedCounter *counter, int64_t value) {
+	counter->value.store(value, std::memory_order_relaxed);
+	if (counter->trackExtremes) {
+		internal::UpdateAggregatedCounterExtremes(counter, value);
+	}
+}
+
+/**
+ * @brief Writes every counter, histogram, and sampler now, and starts a new interval
+ *
+ * An update racing with the report may have its min / max counted in either interval
+ *
+ * @param aggregator    The aggregator to flush
+ * @param timestamp     The timestamp of the events
+ * @return              0 on success. Non-zero for failure
+ */
+int FlushCounterAggregator(CounterAggregator *aggregator, uint64_t timestamp);
+
+/**
+ * @brief Stops the background thread, and writes every counter, histogram, and sampler one last time
+ *
+ * The counters are freed, and the histograms and samplers are unregistered. Closing an aggregator that is already closed does nothing
+ *
+ * @param aggregator    The aggregator to close
+ * @return              0 on success. Otherwise, the first error hit while writing
+ */
+int CloseCounterAggregator(CounterAggregator *aggregator);
+
+} // End of namespace fxt
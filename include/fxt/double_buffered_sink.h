@@ -0,0 +1,295 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/err.h"
+#include "fxt/numa.h"
+#include "fxt/page_pool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace fxt {
+
+struct DoubleBufferedSinkConfig {
+	/**
+	 * @brief The size of each buffer in bytes
+	 */
+	size_t bufferSize = 4 * 1024 * 1024;
+	/**
+	 * @brief The number of buffers to allocate. Must be at least 2
+	 *
+	 * One buffer is always being filled by the producer. The rest are either waiting to be flushed, or are free.
+	 * Adding more buffers allows the producer to absorb bursts that are larger than a single buffer without stalling.
+	 */
+	unsigned numBuffers = 2;
+	/**
+	 * @brief The maximum amount of time data should sit in a partially filled buffer before it is flushed
+	 *
+	 * 0 disables the timer. Buffers will then only be flushed when they are full, or in FlushAndWait()
+	 */
+	uint32_t flushIntervalMs = 100;
+	/**
+	 * @brief Compress each buffer into an independently decodable frame before writing it. See CompressFrame()
+	 *
+	 * The compression runs on the flush thread. The file must be read back with a DecompressingReader
+	 */
+	bool compress = false;
+	/**
+	 * @brief The NUMA node to allocate the buffers on, and pin the flush thread to. Only supported on Linux
+	 *
+	 * Use kNumaNodeLocal to pick the node of the thread that calls InitDoubleBufferedSink(). With one sink per writer
+	 * thread, each thread then fills node-local memory, and each node gets its own flush thread
+	 */
+	int numaNode = kNumaNodeAny;
+	/**
+	 * @brief Optional. Carve the buffers out of a shared PagePool, instead of allocating them up front
+	 *
+	 * bufferSize is replaced by the pool's page size, and numBuffers becomes the most pages this sink can hold at once.
+	 * A page is only taken from the pool once the producer writes to it, and goes back as soon as it has been flushed.
+	 * If the producer stops writing for a whole flush interval, its partially filled page is flushed and given back too.
+	 * So flushIntervalMs must not be 0, or an idle sink could hold on to a page forever. The buffers are not placed on
+	 * numaNode.
+	 *
+	 * If the pool has an acquire timeout and it elapses, the write fails with FXT_ERR_POOL_EXHAUSTED, and so does every
+	 * write after it. The record may have been cut in half, so the trace ends there. RecoverTraceFile() can trim it
+	 */
+	PagePool *pool = nullptr;
+};
+
+struct DoubleBufferedSinkMetrics {
+	/**
+	 * @brief The number of buffers written to the file descriptor
+	 */
+	uint64_t buffersFlushed;
+	/**
+	 * @brief The number of bytes written to the file descriptor
+	 */
+	uint64_t bytesFlushed;
+	/**
+	 * @brief The number of trace bytes in the flushed buffers. The same as bytesFlushed, unless compression is enabled
+	 */
+	uint64_t rawBytesFlushed;
+	/**
+	 * @brief The total time spent compressing buffers
+	 */
+	uint64_t totalCompressNs;
+	/**
+	 * @brief The sum of the time spent writing each buffer to the file descriptor
+	 */
+	uint64_t totalFlushLatencyNs;
+	/**
+	 * @brief The longest time spent writing a single buffer to the file descriptor
+	 */
+	uint64_t maxFlushLatencyNs;
+	/**
+	 * @brief The number of buffers that were handed off because they were full
+	 */
+	uint64_t fullSwaps;
+	/**
+	 * @brief The number of partially-filled buffers that were handed off because the flush interval elapsed
+	 */
+	uint64_t timerSwaps;
+	/**
+	 * @brief The largest number of buffers that were waiting to be flushed at the same time
+	 */
+	uint32_t maxQueuedBuffers;
+	/**
+	 * @brief The number of times the producer had to wait for the flush thread to free up a buffer
+	 */
+	uint64_t producerStalls;
+	/**
+	 * @brief The total amount of time the producer spent waiting for a free buffer
+	 */
+	uint64_t producerStallNs;
+	/**
+	 * @brief The number of partially filled pool pages that the flush thread took back from the producer
+	 */
+	uint64_t idlePagesReclaimed;
+};
+
+namespace internal {
+
+enum class SinkBufferState : uint32_t {
+	Free = 0,
+	Active = 1,
+	Queued = 2,
+	Flushing = 3,
+	// Written to the file descriptor, but not yet returned to the free list
+	Written = 4,
+};
+
+struct SinkBuffer {
+	/**
+	 * @brief nullptr while a buffer from a PagePool doesn't hold a page
+	 */
+	uint8_t *data = nullptr;
+	size_t used = 0;
+	uint64_t sequence = 0;
+	std::atomic<SinkBufferState> state{ SinkBufferState::Free };
+};
+
+} // End of namespace internal
+
+/**
+ * @brief A sink that moves all file I/O off of the instrumenting thread
+ *
+ * The producer (the thread calling the Writer functions) only ever copies data into the active buffer. When the active
+ * buffer fills up, or the flush interval elapses, it is handed off to a dedicated flush thread, which writes it to the
+ * file descriptor. The producer then continues on with the next free buffer.
+ *
+ * Like the Writer itself, a sink must only be written to by a single thread at a time. Everything written to it must be
+ * whole FXT records, since the producer uses the record headers to tell when it is safe for the flush thread to take a
+ * partially filled buffer.
+ *
+ * Example:
+ *     fxt::DoubleBufferedSink sink;
+ *     InitDoubleBufferedSink(&sink, fd, fxt::DoubleBufferedSinkConfig());
+ *     fxt::Writer writer(&sink, fxt::WriteToDoubleBufferedSink);
+ *     ...
+ *     CloseDoubleBufferedSink(&sink);
+ */
+struct DoubleBufferedSink {
+	DoubleBufferedSink() = default;
+	~DoubleBufferedSink();
+
+	DoubleBufferedSink(const DoubleBufferedSink &) = delete;
+	DoubleBufferedSink &operator=(const DoubleBufferedSink &) = delete;
+
+	DoubleBufferedSinkConfig config;
+	int fd = -1;
+	/**
+	 * @brief The node the buffers live on. kNumaNodeAny if placement was left to the OS
+	 */
+	int numaNode = kNumaNodeAny;
+
+	internal::SinkBuffer *buffers = nullptr;
+	internal::SinkBuffer *active = nullptr;
+	/**
+	 * @brief Holds the compressed frame of the buffer being flushed. Only used by the flush thread
+	 */
+	uint8_t *frame = nullptr;
+	size_t frameCapacity = 0;
+	uint64_t nextSequence = 0;
+	unsigned queuedBuffers = 0;
+
+	/**
+	 * @brief Set by the flush thread when the flush interval elapses. The producer checks it on the next write
+	 */
+	std::atomic<bool> swapRequested{ false };
+	/**
+	 * @brief The first error the flush thread encountered while writing, or the producer hit getting a page from the
+	 * pool. Reported back to the producer on the next write
+	 */
+	std::atomic<int> flushError{ 0 };
+	/**
+	 * @brief Set by EmergencyFlush(). The flush thread stops picking up new buffers, and all writes fail
+	 */
+	std::atomic<bool> emergency{ false };
+	/**
+	 * @brief Who is using the active buffer. The flush thread claims it to flush a partial buffer the producer isn't
+	 * writing to
+	 */
+	std::atomic<uint32_t> activeOwner{ 0 };
+	/**
+	 * @brief Only used by the producer. It follows the record headers in the written data, so it only has to claim the
+	 * active buffer once per record, and can give it back once the record is complete
+	 */
+	uint64_t recordBytesLeft = 0;
+	uint64_t partialHeader = 0;
+	size_t partialHeaderBytes = 0;
+	bool shutdown = false;
+
+	std::mutex mutex;
+	std::condition_variable flushCondition;
+	std::condition_variable freeCondition;
+	std::thread flushThread;
+	std::chrono::steady_clock::time_point lastSwapTime;
+
+	DoubleBufferedSinkMetrics metrics = {};
+};
+
+/**
+ * @brief Allocates the sink buffers and starts the flush thread
+ *
+ * The sink does not take ownership of the file descriptor. The caller must keep it open until the sink has been closed
+ *
+ * @param sink      The sink to initialize
+ * @param fd        The file descriptor to write to
+ * @param config    The sink configuration
+ * @return          0 on success. Non-zero for failure
+ */
+int InitDoubleBufferedSink(DoubleBufferedSink *sink, int fd, DoubleBufferedSinkConfig config);
+
+/**
+ * @brief A WriteFunc that copies the data into the active buffer of a DoubleBufferedSink
+ *
+ * @param userContext    A pointer to the DoubleBufferedSink
+ * @param data           The data to write
+ * @param len            The length of the data array
+ * @return               0 on success. Non-zero for failure
+ */
+int WriteToDoubleBufferedSink(void *userContext, const void *data, size_t len);
+
+/**
+ * @brief Hands off the active buffer and blocks until every buffer has been written to the file descriptor
+ *
+ * This must be called from the producer thread, or while the producer is not writing
+ *
+ * @param sink    The sink to flush
+ * @return        0 on success. Otherwise, the first error encountered while writing to the file descriptor
+ */
+int FlushAndWait(DoubleBufferedSink *sink);
+
+/**
+ * @brief Writes every pending buffer to the file descriptor, from inside a signal handler
+ *
+ * This is async-signal-safe, so it can be called from a SIGSEGV / SIGABRT handler. It never takes the sink mutex, so
+ * it works even if the crashing thread was holding it. It waits up to timeoutMs for the flush thread to finish the
+ * buffer it is currently writing, and then writes the queued buffers and the active buffer itself, in order.
+ *
+ * If the producer was interrupted in the middle of a record, the trace will end with a partial record. Use
+ * RecoverTraceFile() to trim it off. If compression is enabled, the buffers are written as stored frames, so no time
+ * is spent compressing them.
+ *
+ * After this is called, all writes fail with FXT_ERR_SINK_CLOSED. The sink should still be closed, if the process
+ * survives
+ *
+ * @param sink         The sink to flush
+ * @param timeoutMs    The maximum amount of time to wait for an in-progress write by the flush thread
+ * @return             0 on success. FXT_ERR_FLUSH_TIMEOUT if the flush thread didn't finish in time, in which case
+ *                     nothing is written. Otherwise, the first error encountered while writing to the file descriptor
+ */
+int EmergencyFlush(DoubleBufferedSink *sink, uint32_t timeoutMs);
+
+/**
+ * @brief Flushes all pending data, stops the flush thread, and frees the buffers
+ *
+ * It is safe to call this multiple times
+ *
+ * @param sink    The sink to close
+ * @return        0 on success. Otherwise, the first error encountered while writing to the file descriptor
+ */
+int CloseDoubleBufferedSink(DoubleBufferedSink *sink);
+
+/**
+ * @brief Gets a snapshot of the flush latency and buffer occupancy metrics
+ *
+ * This can be called from any thread
+ *
+ * @param sink       The sink to query
+ * @param metrics    The metrics struct to fill
+ */
+void GetDoubleBufferedSinkMetrics(DoubleBufferedSink *sink, DoubleBufferedSinkMetrics *metrics);
+
+} // End of namespace fxt
@@ -15,3 +15,12 @@
 #define FXT_ERR_INVALID_ARG_TYPE -3006
 #define FXT_ERR_ARG_NAME_TOO_LONG -3007
 #define FXT_ERR_ARG_STR_VALUE_TOO_LONG -3008
+#define FXT_ERR_INVALID_CONFIG -3009
+#define FXT_ERR_OUT_OF_MEMORY -3010
+#define FXT_ERR_SINK_CLOSED -3011
+#define FXT_ERR_OPEN_FAILED -3012
+#define FXT_ERR_FLUSH_TIMEOUT -3013
+#define FXT_ERR_INVALID_TRACE -3014
+#define FXT_ERR_READ_FROM_STREAM_FAILED -3015
+#define FXT_ERR_UNBALANCED_SPAN -3016
+#define FXT_ERR_POOL_EXHAUSTED -3017
@@ -0,0 +1,192 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/clock.h"
+#include "fxt/err.h"
+#include "fxt/internal/thread_slots.h"
+#include "fxt/scope.h"
+#include "fxt/writer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fxt {
+
+struct HistogramConfig {
+	/**
+	 * @brief Each power of two is split into 2^(subBucketBits - 1) linear buckets. From 1 to 16
+	 *
+	 * Reported values are within 1 / 2^(subBucketBits - 1) of the real ones. Each thread's histogram takes
+	 * (66 - subBucketBits) * 2^(subBucketBits - 1) * 8 bytes. IE, 15 KiB for the default of 6
+	 */
+	unsigned subBucketBits = 6;
+};
+
+namespace internal {
+
+// One thread's counts. Only that thread writes them, and only AddHistogramCounterEvent() reads them
+struct HistogramShard {
+	std::unique_ptr<std::atomic<uint64_t>[]> counts;
+	/**
+	 * @brief The counts as of the last report, so each report only covers its own interval
+	 */
+	std::vector<uint64_t> reported;
+};
+
+} // End of namespace internal
+
+/**
+ * @brief Records values into per-thread log-linear histograms, and writes their percentiles as counter events
+ *
+ * Recording a value bumps one bucket of the calling thread's histogram, with a relaxed load and store. Nothing is
+ * shared between threads, and nothing is written to the trace. AddHistogramCounterEvent() merges every thread's
+ * histogram, and writes the p50 / p90 / p99 / max of the values recorded since its last call, as one counter event.
+ * Call it periodically, for a percentile track in the trace viewer at a tiny fraction of the cost of tracing each span.
+ * Nothing calls it on its own. Either call it from a thread that is already tracing, or register the histogram with a
+ * CounterAggregator (see RegisterAggregatedHistogram()), whose thread then writes it every interval.
+ *
+ * Buckets are reported by their upper bound, so percentiles are never under-reported.
+ *
+ * Example:
+ *     fxt::LatencyHistogram histogram;
+ *     InitLatencyHistogram(&histogram, "Requests", "Latency", 1, fxt::HistogramConfig());
+ *
+ *     {
+ *         FXT_HISTOGRAM_SCOPE(&histogram, clock);
+ *         ...
+ *     }
+ *
+ *     // Every interval, on one thread
+ *     AddHistogramCounterEvent(&writer, &histogram, pid, tid, fxt::kTimestampNow);
+ *
+ *     // Or, once, to have a CounterAggregator's thread do it
+ *     RegisterAggregatedHistogram(&aggregator, &histogram);
+ */
+struct LatencyHistogram {
+	LatencyHistogram() = default;
+	~LatencyHistogram();
+
+	LatencyHistogram(const LatencyHistogram &) = delete;
+	LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+	std::string category;
+	std::string name;
+	uint64_t counterID = 0;
+	HistogramConfig config;
+	size_t numBuckets = 0;
+
+	/**
+	 * @brief Where the histogram's shard lives in each thread's shard array
+	 */
+	internal::ThreadSlot slot;
+
+	// Guards the list of shards, not their counts
+	std::mutex mutex;
+	std::vector<std::unique_ptr<internal::HistogramShard>> shards;
+};
+
+/**
+ * @brief Sets up the histogram
+ *
+ * @param histogram    The histogram to initialize
+ * @param category     The category of the counter events
+ * @param name         The name of the counter events
+ * @param counterID    The counter ID of the counter events
+ * @param config       The histogram configuration
+ * @return             0 on success. Non-zero for failure
+ */
+int InitLatencyHistogram(LatencyHistogram *histogram, const char *category, const char *name, uint64_t counterID, HistogramConfig config);
+
+/**
+ * @brief Records a value into the calling thread's histogram
+ *
+ * @param histogram    The histogram to record into
+ * @param value        The value to record
+ */
+void RecordHistogramValue(LatencyHistogram *histogram, uint64_t value);
+
+struct HistogramSnapshot {
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t max;
+	/**
+	 * @brief The number of values recorded in the interval
+	 */
+	uint64_t count;
+};
+
+/**
+ * @brief Merges every thread's histogram, and computes the percentiles of the values recorded since the last snapshot
+ *
+ * Only one thread at a time may take snapshots of a given histogram
+ *
+ * @param histogram    The histogram to snapshot
+ * @param snapshot     Filled with the percentiles. All zero if nothing was recorded
+ */
+void TakeHistogramSnapshot(LatencyHistogram *histogram, HistogramSnapshot *snapshot);
+
+/**
+ * @brief Takes a snapshot of the histogram, and writes it as a counter event
+ *
+ * The event has "p50", "p90", "p99", "max", and "count" arguments. If nothing was recorded, nothing is written
+ *
+ * @param writer       The writer to use
+ * @param histogram    The histogram to report
+ * @param processID    The process ID to write the event with
+ * @param threadID     The thread ID to write the event with
+ * @param timestamp    The timestamp of the event
+ * @return             0 on success. Non-zero for failure
+ */
+int AddHistogramCounterEvent(Writer *writer, LatencyHistogram *histogram, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp);
+
+namespace internal {
+
+inline uint64_t ClockTicksToNs(const Clock *clock, uint64_t ticks) {
+	const uint64_t ticksPerSecond = clock->ticksPerSecond.load(std::memory_order_relaxed);
+	if (ticksPerSecond == 1000000000 || ticksPerSecond == 0) {
+		return ticks;
+	}
+	return (uint64_t)((double)ticks * 1e9 / (double)ticksPerSecond);
+}
+
+// What FXT_HISTOGRAM_SCOPE creates. It only needs a clock, not a writer
+struct HistogramScope {
+	HistogramScope(LatencyHistogram *histogram, const Clock *clock)
+	        : histogram(histogram),
+	          clock(clock),
+	          beginTimestamp(ReadClock(clock)) {
+	}
+	~HistogramScope() {
+		const uint64_t endTimestamp = ReadClock(clock);
+		RecordHistogramValue(histogram, ClockTicksToNs(clock, endTimestamp > beginTimestamp ? endTimestamp - beginTimestamp : 0));
+	}
+
+	HistogramScope(const HistogramScope &) = delete;
+	HistogramScope &operator=(const HistogramScope &) = delete;
+
+	LatencyHistogram *histogram;
+	const Clock *clock;
+	uint64_t beginTimestamp;
+};
+
+} // End of namespace internal
+
+} // End of namespace fxt
+
+/**
+ * @brief Records how long the rest of the enclosing scope takes, in nanoseconds, into the histogram
+ */
+#define FXT_HISTOGRAM_SCOPE(histogram, clock) \
+	fxt::internal::HistogramScope FXT_INTERNAL_CONCAT(fxtHistogramScope, __LINE__)(histogram, clock)
@@ -0,0 +1,41 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/internal/constants.h"
+#include "fxt/internal/fields.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace fxt::internal {
+
+/**
+ * @brief The first word of every FXT trace
+ */
+inline constexpr uint64_t kMagicNumberRecord = 0x0016547846040010ull;
+
+/**
+ * @brief Decodes the size of a record from its header word
+ *
+ * @param header    The first word of the record
+ * @return          The size of the whole record in words. 0 if the header is not a valid record header
+ */
+inline constexpr uint64_t GetRecordSizeInWords(uint64_t header) {
+	const uint32_t type = RecordFields::Type::Get<uint32_t>(header);
+	if (type == (uint32_t)RecordType::LargeBlob) {
+		return LargeRecordFields::RecordSize::Get<uint64_t>(header);
+	}
+	if (type > (uint32_t)RecordType::Log) {
+		// Reserved record types
+		return 0;
+	}
+
+	return RecordFields::RecordSize::Get<uint64_t>(header);
+}
+
+} // End of namespace fxt::internal
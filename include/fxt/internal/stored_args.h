@@ -0,0 +1,49 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/record_args.h"
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+namespace fxt {
+namespace internal {
+
+// A copy of a RecordArgument that owns its strings, for events that are written after the caller's arguments are gone
+struct StoredArgument {
+	std::string name;
+	RecordArgumentValue value;
+	std::string stringValue;
+};
+
+inline void StoreArguments(std::vector<StoredArgument> *stored, const RecordArgument *args, size_t numArgs) {
+	for (size_t i = 0; i < numArgs; ++i) {
+		StoredArgument copy { std::string(args[i].name, args[i].nameLen), args[i].value, std::string() };
+		if (args[i].value.type == ArgumentType::String) {
+			copy.stringValue.assign(args[i].value.stringValue, args[i].value.stringLen);
+		}
+		stored->push_back(std::move(copy));
+	}
+}
+
+// The loaded arguments point into stored, so they are only valid until it changes
+inline void LoadArguments(const std::vector<StoredArgument> &stored, std::vector<RecordArgument> *args) {
+	args->clear();
+	for (const StoredArgument &arg : stored) {
+		if (arg.value.type == ArgumentType::String) {
+			args->emplace_back(arg.name.c_str(), RecordArgumentValue::CharArray(const_cast<char *>(arg.stringValue.data()), (unsigned)arg.stringValue.size()));
+		} else {
+			args->emplace_back(arg.name.c_str(), arg.value);
+		}
+	}
+}
+
+} // End of namespace internal
+} // End of namespace fxt
@@ -0,0 +1,99 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace fxt {
+namespace internal {
+
+// Where an object's state lives in each thread's slot array. The serial is never reused, so a thread can tell that its
+// slot still holds the state of an earlier object that had the same index
+struct ThreadSlot {
+	size_t index = SIZE_MAX;
+	uint64_t serial = 0;
+};
+
+// Hands out slot indices for one type of object. Indices are only taken and given back in Init / destruction, never
+// on the hot path. Freed indices are handed out again, so the slot arrays only grow with the number of live objects
+struct ThreadSlotAllocator {
+	std::mutex mutex;
+	std::vector<size_t> freeIndices;
+	size_t nextIndex = 0;
+	uint64_t nextSerial = 1;
+};
+
+// Leaked, so objects with static storage can still give their slot back during shutdown
+template <typename Owner>
+inline ThreadSlotAllocator *GetThreadSlotAllocator() {
+	static ThreadSlotAllocator *allocator = new ThreadSlotAllocator();
+	return allocator;
+}
+
+// Gives back the slot the owner already holds, if any, so a re-initialized owner starts with fresh state on every thread
+template <typename Owner>
+inline void AcquireThreadSlot(ThreadSlot *slot) {
+	ThreadSlotAllocator *allocator = GetThreadSlotAllocator<Owner>();
+
+	std::lock_guard<std::mutex> lock(allocator->mutex);
+	if (slot->index != SIZE_MAX) {
+		allocator->freeIndices.push_back(slot->index);
+	}
+	if (!allocator->freeIndices.empty()) {
+		slot->index = allocator->freeIndices.back();
+		allocator->freeIndices.pop_back();
+	} else {
+		slot->index = allocator->nextIndex++;
+	}
+	slot->serial = allocator->nextSerial++;
+}
+
+template <typename Owner>
+inline void ReleaseThreadSlot(ThreadSlot *slot) {
+	if (slot->index == SIZE_MAX) {
+		return;
+	}
+
+	ThreadSlotAllocator *allocator = GetThreadSlotAllocator<Owner>();
+
+	std::lock_guard<std::mutex> lock(allocator->mutex);
+	allocator->freeIndices.push_back(slot->index);
+	*slot = ThreadSlot();
+}
+
+template <typename T>
+struct ThreadSlotEntry {
+	uint64_t serial = 0;
+	T value = T();
+};
+
+// A thread's state for every object of one type. A deque, so growing it never moves the existing state
+template <typename T>
+using ThreadSlots = std::deque<ThreadSlotEntry<T>>;
+
+// Returns the thread's state for the slot. State left behind by an earlier owner of the index is reset first
+template <typename T>
+inline T *GetThreadSlot(ThreadSlots<T> *slots, const ThreadSlot &slot) {
+	if (slot.index >= slots->size()) {
+		slots->resize(slot.index + 1);
+	}
+
+	ThreadSlotEntry<T> &entry = (*slots)[slot.index];
+	if (entry.serial != slot.serial) {
+		entry.value = T();
+		entry.serial = slot.serial;
+	}
+	return &entry.value;
+}
+
+} // End of namespace internal
+} // End of namespace fxt
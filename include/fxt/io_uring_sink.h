@@ -0,0 +1,185 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/err.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+namespace fxt {
+
+struct IoUringSinkConfig {
+	/**
+	 * @brief The size of each buffer in bytes
+	 *
+	 * When useDirectIO is set, this must be a multiple of alignment
+	 */
+	size_t bufferSize = 1024 * 1024;
+	/**
+	 * @brief The number of buffers. Up to (numBuffers - 1) buffers can be in flight while the producer fills the last one
+	 */
+	unsigned numBuffers = 4;
+	/**
+	 * @brief Open the file with O_DIRECT, so writes bypass the page cache
+	 *
+	 * Every write stays aligned. If the kernel only writes part of a buffer, the rest is written again from the start of
+	 * the last partially written block
+	 */
+	bool useDirectIO = false;
+	/**
+	 * @brief The alignment of the buffers and file offsets. O_DIRECT generally requires the logical block size of the device
+	 */
+	size_t alignment = 4096;
+	/**
+	 * @brief Skip io_uring entirely and write each buffer with pwrite()
+	 *
+	 * The sink automatically falls back to pwrite() when the kernel doesn't support io_uring (or it's disabled by
+	 * seccomp / sysctl). This forces that path, which is mostly useful for testing and benchmarking
+	 */
+	bool forcePwrite = false;
+};
+
+namespace internal {
+
+struct IoUringSinkBuffer {
+	uint8_t *data;
+	size_t used;
+	// The file offset this buffer was submitted at, and the part that hasn't been written yet
+	uint64_t offset;
+	size_t pendingStart;
+	bool inFlight;
+	// The kernel reads the iovec when the write is submitted, so it has to outlive the submission call
+	struct iovec iov;
+};
+
+// The memory mapped submission and completion queues
+// We talk to the kernel directly, rather than depend on liburing
+struct IoUring {
+	int ringFd = -1;
+
+	void *sqRing = nullptr;
+	size_t sqRingSize = 0;
+	void *cqRing = nullptr;
+	size_t cqRingSize = 0;
+	void *sqes = nullptr;
+	size_t sqesSize = 0;
+
+	unsigned *sqHead = nullptr;
+	unsigned *sqTail = nullptr;
+	unsigned *sqMask = nullptr;
+	unsigned *sqArray = nullptr;
+
+	unsigned *cqHead = nullptr;
+	unsigned *cqTail = nullptr;
+	unsigned *cqMask = nullptr;
+	void *cqes = nullptr;
+};
+
+} // End of namespace internal
+
+/**
+ * @brief A Linux file sink that keeps several aligned buffers in flight using io_uring
+ *
+ * The producer fills one buffer while the kernel writes the others. Each full buffer is submitted as an asynchronous
+ * write at its final file offset, so the producer only pays for a memcpy per write, and one io_uring_enter() per buffer.
+ *
+ * Like the Writer itself, a sink must only be written to by a single thread at a time.
+ *
+ * Example:
+ *     fxt::IoUringSink sink;
+ *     OpenIoUringSink(&sink, "trace.fxt", fxt::IoUringSinkConfig());
+ *     fxt::Writer writer(&sink, fxt::WriteToIoUringSink);
+ *     ...
+ *     CloseIoUringSink(&sink);
+ */
+struct IoUringSink {
+	IoUringSink() = default;
+	~IoUringSink();
+
+	IoUringSink(const IoUringSink &) = delete;
+	IoUringSink &operator=(const IoUringSink &) = delete;
+
+	IoUringSinkConfig config;
+	int fd = -1;
+
+	internal::IoUringSinkBuffer *buffers = nullptr;
+	unsigned active = 0;
+	unsigned inFlight = 0;
+	uint64_t nextOffset = 0;
+
+	/**
+	 * @brief True if writes are submitted through io_uring. False if we fell back to pwrite()
+	 */
+	bool usingIoUring = false;
+	internal::IoUring ring;
+
+	/**
+	 * @brief The first error encountered by an asynchronous write. Reported back on the next write
+	 */
+	int error = 0;
+};
+
+/**
+ * @brief Creates / truncates the file at path, and prepares the sink buffers and io_uring
+ *
+ * @param sink      The sink to initialize
+ * @param path      The path of the file to write
+ * @param config    The sink configuration
+ * @return          0 on success. Non-zero for failure
+ */
+int OpenIoUringSink(IoUringSink *sink, const char *path, IoUringSinkConfig config);
+
+/**
+ * @brief A WriteFunc that copies the data into the active buffer of an IoUringSink
+ *
+ * @param userContext    A pointer to the IoUringSink
+ * @param data           The data to write
+ * @param len            The length of the data array
+ * @return               0 on success. Non-zero for failure
+ */
+int WriteToIoUringSink(void *userContext, const void *data, size_t len);
+
+/**
+ * @brief Submits the active buffer and blocks until every in-flight write has completed
+ *
+ * With O_DIRECT, a partially filled active buffer is kept instead, since an unaligned write is only possible once,
+ * when the sink is closed
+ *
+ * @param sink    The sink to flush
+ * @return        0 on success. Otherwise, the first error encountered while writing
+ */
+int FlushAndWait(IoUringSink *sink);
+
+/**
+ * @brief Writes the active buffer to the file, from inside a signal handler
+ *
+ * This is async-signal-safe, so it can be called from a SIGSEGV / SIGABRT handler. The active buffer is written with
+ * pwrite() at its final file offset, so it doesn't have to wait for the writes that are already in flight. Those are
+ * left to the kernel. With O_DIRECT the tail is zero padded up to the alignment, and the file is left at that length.
+ *
+ * After this is called, all writes fail with FXT_ERR_SINK_CLOSED. The sink should still be closed, if the process
+ * survives
+ *
+ * @param sink    The sink to flush
+ * @return        0 on success. Non-zero for failure
+ */
+int EmergencyFlush(IoUringSink *sink);
+
+/**
+ * @brief Writes all remaining data, trims the file to its exact length, and closes it
+ *
+ * With O_DIRECT, the unaligned tail is written zero-padded up to the alignment, and then the file is truncated back
+ * to the real length. It is safe to call this multiple times
+ *
+ * @param sink    The sink to close
+ * @return        0 on success. Otherwise, the first error encountered while writing
+ */
+int CloseIoUringSink(IoUringSink *sink);
+
+} // End of namespace fxt
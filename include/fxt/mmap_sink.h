@@ -0,0 +1,111 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/err.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace fxt {
+
+struct MmapSinkConfig {
+	/**
+	 * @brief The size of each preallocated and mapped region of the file in bytes
+	 *
+	 * Must be a multiple of the system page size
+	 */
+	size_t extentSize = 64 * 1024 * 1024;
+};
+
+/**
+ * @brief A POSIX file sink that writes directly into a memory mapping of the output file
+ *
+ * The file is preallocated one extent at a time, and the current extent is mapped into memory. Writes are a plain
+ * memcpy into the mapping, so there is no syscall per flush, and no copy from user-space into the kernel. When an
+ * extent fills up, it is unmapped and the next one is allocated and mapped.
+ *
+ * Since the data lands in the page cache as soon as it is written, the kernel will still write it out if the process
+ * crashes. In that case the file is left at its preallocated length, with zeros after the last record.
+ *
+ * Like the Writer itself, a sink must only be written to by a single thread at a time.
+ *
+ * Example:
+ *     fxt::MmapSink sink;
+ *     OpenMmapSink(&sink, "trace.fxt", fxt::MmapSinkConfig());
+ *     fxt::Writer writer(&sink, fxt::WriteToMmapSink);
+ *     ...
+ *     CloseMmapSink(&sink);
+ */
+struct MmapSink {
+	MmapSink() = default;
+	~MmapSink();
+
+	MmapSink(const MmapSink &) = delete;
+	MmapSink &operator=(const MmapSink &) = delete;
+
+	MmapSinkConfig config;
+	int fd = -1;
+
+	/**
+	 * @brief The currently mapped extent
+	 */
+	uint8_t *mapping = nullptr;
+	/**
+	 * @brief The file offset of the start of the mapped extent
+	 */
+	uint64_t mappingOffset = 0;
+	/**
+	 * @brief The number of bytes written into the mapped extent
+	 */
+	size_t mappingUsed = 0;
+
+	int error = 0;
+};
+
+/**
+ * @brief Creates / truncates the file at path, and maps the first extent
+ *
+ * @param sink      The sink to initialize
+ * @param path      The path of the file to write
+ * @param config    The sink configuration
+ * @return          0 on success. Non-zero for failure
+ */
+int OpenMmapSink(MmapSink *sink, const char *path, MmapSinkConfig config);
+
+/**
+ * @brief A WriteFunc that copies the data into the mapped extent of an MmapSink
+ *
+ * @param userContext    A pointer to the MmapSink
+ * @param data           The data to write
+ * @param len            The length of the data array
+ * @return               0 on success. Non-zero for failure
+ */
+int WriteToMmapSink(void *userContext, const void *data, size_t len);
+
+/**
+ * @brief Blocks until everything written so far, in every extent, has been written back to the file
+ *
+ * This is only needed to survive an OS crash or power loss. The data is already visible to other processes, and
+ * survives a crash of this process, as soon as it is written
+ *
+ * @param sink    The sink to flush
+ * @return        0 on success. Non-zero for failure
+ */
+int FlushAndWait(MmapSink *sink);
+
+/**
+ * @brief Unmaps the file, truncates it to the exact length of the data written, and closes it
+ *
+ * It is safe to call this multiple times
+ *
+ * @param sink    The sink to close
+ * @return        0 on success. Non-zero for failure
+ */
+int CloseMmapSink(MmapSink *sink);
+
+} // End of namespace fxt
@@ -0,0 +1,78 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/err.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace fxt {
+
+/**
+ * @brief Leave memory and thread placement up to the OS
+ */
+static constexpr int kNumaNodeAny = -1;
+/**
+ * @brief Use the NUMA node of the calling thread
+ */
+static constexpr int kNumaNodeLocal = -2;
+
+/**
+ * @brief Gets the number of NUMA nodes in the system
+ *
+ * NUMA placement is only supported on Linux. Other platforms always report a single node
+ *
+ * @return    The number of nodes. At least 1
+ */
+int GetNumaNodeCount();
+
+/**
+ * @brief Gets the NUMA node of the CPU the calling thread is currently running on
+ *
+ * @return    The node index. 0 if it can't be determined
+ */
+int GetCurrentNumaNode();
+
+/**
+ * @brief Restricts the calling thread to the CPUs of a NUMA node
+ *
+ * Useful for pinning each writer thread to the node that its sink's buffers were allocated on
+ *
+ * @param node    The node to pin to
+ * @return        0 on success. FXT_ERR_INVALID_CONFIG if the node doesn't exist. Non-zero for other failures
+ */
+int PinCurrentThreadToNumaNode(int node);
+
+namespace internal {
+
+/**
+ * @brief Resolves kNumaNodeLocal to an actual node, and checks that the node exists
+ *
+ * @param node        The requested node
+ * @param resolved    Filled with the node to use. kNumaNodeAny if placement is left to the OS
+ * @return            0 on success. FXT_ERR_INVALID_CONFIG if the node doesn't exist
+ */
+int ResolveNumaNode(int node, int *resolved);
+
+/**
+ * @brief Allocates memory on a NUMA node. The pages are touched up front, so they are placed before they are used
+ *
+ * @param size    The size of the allocation in bytes
+ * @param node    The node to allocate on, or kNumaNodeAny
+ * @return        The allocation, or nullptr on failure
+ */
+uint8_t *AllocateOnNumaNode(size_t size, int node);
+
+/**
+ * @brief Frees memory from AllocateOnNumaNode(). The size and node must match the allocation
+ */
+void FreeOnNumaNode(uint8_t *ptr, size_t size, int node);
+
+} // End of namespace internal
+
+} // End of namespace fxt
@@ -0,0 +1,162 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/err.h"
+#include "fxt/writer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+namespace fxt {
+
+struct PagePoolConfig {
+	/**
+	 * @brief The size of each page in bytes. Sinks that use the pool get buffers of this size
+	 */
+	size_t pageSize = 64 * 1024;
+	/**
+	 * @brief The most memory the pool will ever allocate. Must hold at least 2 pages
+	 */
+	size_t budgetBytes = 64 * 1024 * 1024;
+	/**
+	 * @brief How long AcquirePage() waits for a page when the whole budget is in use
+	 *
+	 * 0 waits as long as it takes. Otherwise, AcquirePage() gives up with FXT_ERR_POOL_EXHAUSTED, so a stalled flush
+	 * can't block the traced threads forever
+	 */
+	uint32_t acquireTimeoutMs = 0;
+};
+
+struct PagePoolMetrics {
+	uint64_t budgetBytes;
+	/**
+	 * @brief The memory allocated so far. Pages are allocated on first use, and kept until the pool is destroyed
+	 */
+	uint64_t allocatedBytes;
+	/**
+	 * @brief The memory currently handed out to sinks
+	 */
+	uint64_t inUseBytes;
+	uint64_t peakInUseBytes;
+	/**
+	 * @brief The number of times a sink had to wait for a page, because the whole budget was in use
+	 */
+	uint64_t waits;
+	uint64_t waitNs;
+	/**
+	 * @brief The number of times a sink gave up waiting for a page, because PagePoolConfig::acquireTimeoutMs elapsed
+	 */
+	uint64_t timeouts;
+};
+
+/**
+ * @brief A fixed memory budget for tracing, shared by any number of sinks
+ *
+ * Sinks carve their buffers out of the pool one page at a time, instead of each allocating their own. A busy sink can
+ * hold many pages, while an idle one holds at most one. Pages go back to the pool as soon as they are flushed. So the
+ * total tracing memory stays within the budget, no matter how many threads are tracing.
+ *
+ * Example:
+ *     fxt::PagePool pool;
+ *     InitPagePool(&pool, fxt::PagePoolConfig());
+ *
+ *     // On each thread
+ *     fxt::DoubleBufferedSinkConfig config;
+ *     config.pool = &pool;
+ *     config.numBuffers = 16;
+ *     InitDoubleBufferedSink(&sink, fd, config);
+ */
+struct PagePool {
+	PagePool() = default;
+	~PagePool();
+
+	PagePool(const PagePool &) = delete;
+	PagePool &operator=(const PagePool &) = delete;
+
+	PagePoolConfig config;
+	size_t maxPages = 0;
+
+	std::mutex mutex;
+	std::condition_variable pageReleased;
+	std::vector<uint8_t *> freePages;
+	size_t allocatedPages = 0;
+	size_t pagesInUse = 0;
+	size_t peakPagesInUse = 0;
+	uint64_t waits = 0;
+	uint64_t waitNs = 0;
+	uint64_t timeouts = 0;
+};
+
+/**
+ * @brief Sets up the pool. No memory is allocated until pages are acquired
+ *
+ * @param pool      The pool to initialize
+ * @param config    The pool configuration
+ * @return          0 on success. Non-zero for failure
+ */
+int InitPagePool(PagePool *pool, PagePoolConfig config);
+
+/**
+ * @brief Frees all the pages. Every sink using the pool should be closed first
+ *
+ * Anyone still waiting in AcquirePage() is woken up, and fails with FXT_ERR_SINK_CLOSED. Pages that are still in use
+ * are freed when they are released. The PagePool itself must outlive those releases.
+ *
+ * It is safe to call this multiple times
+ *
+ * @param pool    The pool to destroy
+ */
+void DestroyPagePool(PagePool *pool);
+
+/**
+ * @brief Takes a page from the pool, waiting for one to be released if the whole budget is in use
+ *
+ * @param pool    The pool to take from
+ * @param page    Filled with the page, which is PagePoolConfig::pageSize bytes long
+ * @return        0 on success. FXT_ERR_POOL_EXHAUSTED if PagePoolConfig::acquireTimeoutMs elapsed before a page was
+ *                released. FXT_ERR_SINK_CLOSED if the pool isn't initialized, or is destroyed while waiting
+ */
+int AcquirePage(PagePool *pool, uint8_t **page);
+
+/**
+ * @brief Gives a page back to the pool, and wakes up anyone waiting for one
+ *
+ * If the pool has already been destroyed, the page is freed instead
+ *
+ * @param pool    The pool the page came from
+ * @param page    The page to release
+ */
+void ReleasePage(PagePool *pool, uint8_t *page);
+
+/**
+ * @brief Gets a snapshot of the pool's memory use. This can be called from any thread
+ *
+ * @param pool       The pool to query
+ * @param metrics    The metrics struct to fill
+ */
+void GetPagePoolMetrics(PagePool *pool, PagePoolMetrics *metrics);
+
+/**
+ * @brief Writes the pool's memory use to the trace, as an "fxt" / "Trace Memory" counter event
+ *
+ * Call this periodically, IE, from a thread that is already tracing, to get a counter track of the tracing memory
+ *
+ * @param writer       The writer to use
+ * @param pool         The pool to report on
+ * @param processID    The process ID to write the event with
+ * @param threadID     The thread ID to write the event with
+ * @param timestamp    The timestamp of the event
+ * @return             0 on success. Non-zero for failure
+ */
+int AddPagePoolCounterEvent(Writer *writer, PagePool *pool, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp);
+
+} // End of namespace fxt
@@ -0,0 +1,227 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/err.h"
+#include "fxt/writer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fxt {
+
+struct PerCpuSinkConfig {
+	/**
+	 * @brief The size of each CPU's ring buffer in bytes. Must be a power of 2
+	 */
+	size_t bufferSize = 1024 * 1024;
+	/**
+	 * @brief How often the drain thread writes out the buffers. 0 only drains on FlushPerCpuSink() and when a buffer fills up
+	 */
+	uint32_t flushIntervalMs = 100;
+	/**
+	 * @brief Reserve space with a restartable sequence (rseq), when the kernel and libc support it
+	 *
+	 * Otherwise, or when this is false, space is reserved with an atomic compare-and-swap on the buffer of the CPU the
+	 * thread is currently running on
+	 */
+	bool useRseq = true;
+	/**
+	 * @brief The header records the sink writes at the start of the stream
+	 */
+	ProviderID providerID = 0;
+	const char *providerName = nullptr;
+	/**
+	 * @brief 0 skips the Initialization record
+	 */
+	uint64_t numTicksPerSecond = 0;
+};
+
+struct PerCpuSinkMetrics {
+	/**
+	 * @brief The number of bytes written to the file descriptor
+	 */
+	uint64_t bytesFlushed;
+	/**
+	 * @brief The number of record groups thrown away because their CPU's buffer was full
+	 */
+	uint64_t droppedRecords;
+	uint64_t droppedBytes;
+	/**
+	 * @brief The number of times a reservation was restarted, because the thread was preempted or migrated in the middle of it
+	 */
+	uint64_t rseqRestarts;
+};
+
+namespace internal {
+
+struct alignas(64) PerCpuBuffer {
+	uint8_t *data = nullptr;
+	/**
+	 * @brief The end of the space handed out to producers. Only written from the buffer's own CPU in rseq mode
+	 */
+	alignas(64) std::atomic<uint64_t> reservedPos{ 0 };
+	/**
+	 * @brief The total number of bytes that producers have finished copying in
+	 */
+	std::atomic<uint64_t> committedBytes{ 0 };
+	/**
+	 * @brief Everything before this has been written out by the drain thread
+	 */
+	alignas(64) std::atomic<uint64_t> consumedPos{ 0 };
+};
+
+} // End of namespace internal
+
+/**
+ * @brief A sink shared by every thread in the process, with one buffer per CPU instead of one per thread
+ *
+ * With many mostly idle threads, per-thread buffers waste memory. Here, memory is O(CPUs): each thread only keeps a
+ * Writer and a small staging area for the record it is writing. Once a record is complete, it is copied into the ring
+ * buffer of the CPU the thread is running on, with no locks. On Linux x86-64, the space is reserved with a restartable
+ * sequence, so the append is a plain load / compare / store that the kernel restarts if the thread is preempted or
+ * migrated, like the kernel's own perf ring buffers. Otherwise, it is reserved with an atomic compare-and-swap.
+ *
+ * Records from different threads end up interleaved in the output, so they can't share String and Thread records. The
+ * sink resets the intern tables of each writer before every record, so every record is written together with the String
+ * and Thread records that it references, and carries the writing thread's ref as usual.
+ *
+ * A drain thread writes out the buffers. If a CPU's buffer is full, the record is dropped and counted, rather than
+ * blocking the writing thread. Records from different CPUs are not ordered by timestamp in the output.
+ *
+ * Example:
+ *     fxt::PerCpuSink sink;
+ *     OpenPerCpuSink(&sink, fd, config);
+ *
+ *     // On each thread
+ *     fxt::PerCpuSinkProducer producer;
+ *     fxt::Writer writer(&producer, fxt::WriteToPerCpuSink);
+ *     AttachPerCpuSinkProducer(&producer, &writer, &sink);
+ *     ...
+ *
+ *     ClosePerCpuSink(&sink);
+ */
+struct PerCpuSink {
+	PerCpuSink() = default;
+	~PerCpuSink();
+
+	PerCpuSink(const PerCpuSink &) = delete;
+	PerCpuSink &operator=(const PerCpuSink &) = delete;
+
+	PerCpuSinkConfig config;
+	int fd = -1;
+	bool useRseq = false;
+
+	internal::PerCpuBuffer *buffers = nullptr;
+	unsigned numBuffers = 0;
+
+	std::atomic<uint64_t> droppedRecords{ 0 };
+	std::atomic<uint64_t> droppedBytes{ 0 };
+	std::atomic<uint64_t> rseqRestarts{ 0 };
+	/**
+	 * @brief The first error the drain thread encountered while writing
+	 */
+	std::atomic<int> drainError{ 0 };
+
+	std::mutex mutex;
+	std::condition_variable drainCondition;
+	std::condition_variable drainedCondition;
+	std::thread drainThread;
+	/**
+	 * @brief Bumped to ask the drain thread for a complete drain. drainsCompleted catches up once it's done
+	 */
+	uint64_t drainRequests = 0;
+	uint64_t drainsCompleted = 0;
+	bool shutdown = false;
+	uint64_t bytesFlushed = 0;
+};
+
+/**
+ * @brief A single thread's connection to a PerCpuSink
+ *
+ * It holds the record that the thread is currently writing, until it is complete
+ */
+struct PerCpuSinkProducer {
+	PerCpuSink *sink = nullptr;
+	Writer *writer = nullptr;
+
+	std::vector<uint8_t> staging;
+	/**
+	 * @brief The end of the last complete record in staging
+	 */
+	size_t completeEnd = 0;
+};
+
+/**
+ * @brief Allocates a buffer for every CPU, writes the header records, and starts the drain thread
+ *
+ * The sink does not take ownership of the file descriptor. The caller must keep it open until the sink has been closed
+ *
+ * @param sink      The sink to initialize
+ * @param fd        The file descriptor to write to
+ * @param config    The sink configuration
+ * @return          0 on success. Non-zero for failure
+ */
+int OpenPerCpuSink(PerCpuSink *sink, int fd, PerCpuSinkConfig config);
+
+/**
+ * @brief Connects a thread's writer to the sink, and hooks into its record boundaries
+ *
+ * The writer must already be set up to write to the producer. The producer and writer must only be used by one thread
+ *
+ * @param producer    The producer to initialize
+ * @param writer      The writer that writes to this producer
+ * @param sink        The sink to append to
+ * @return            0 on success. Non-zero for failure
+ */
+int AttachPerCpuSinkProducer(PerCpuSinkProducer *producer, Writer *writer, PerCpuSink *sink);
+
+/**
+ * @brief A WriteFunc that stages the data, and appends each complete record to the buffer of the current CPU
+ *
+ * @param userContext    A pointer to the PerCpuSinkProducer
+ * @param data           The data to write
+ * @param len            The length of the data array
+ * @return               0 on success, including when the record was dropped. Non-zero for failure
+ */
+int WriteToPerCpuSink(void *userContext, const void *data, size_t len);
+
+/**
+ * @brief Blocks until everything appended so far has been written to the file descriptor
+ *
+ * This can be called from any thread
+ *
+ * @param sink    The sink to flush
+ * @return        0 on success. Otherwise, the first error encountered while writing to the file descriptor
+ */
+int FlushPerCpuSink(PerCpuSink *sink);
+
+/**
+ * @brief Writes out the remaining data, stops the drain thread, and frees the buffers
+ *
+ * Every producer must be done writing. It is safe to call this multiple times
+ *
+ * @param sink    The sink to close
+ * @return        0 on success. Otherwise, the first error encountered while writing to the file descriptor
+ */
+int ClosePerCpuSink(PerCpuSink *sink);
+
+/**
+ * @brief Gets a snapshot of the sink metrics. This can be called from any thread
+ *
+ * @param sink       The sink to query
+ * @param metrics    The metrics struct to fill
+ */
+void GetPerCpuSinkMetrics(PerCpuSink *sink, PerCpuSinkMetrics *metrics);
+
+} // End of namespace fxt
@@ -0,0 +1,77 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/err.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace fxt {
+
+struct TraceRecoveryResult {
+	/**
+	 * @brief The length of the trace, up to the end of the last complete record
+	 */
+	uint64_t validBytes;
+	/**
+	 * @brief The number of complete records
+	 */
+	uint64_t recordCount;
+	/**
+	 * @brief The number of bytes after the last complete record. IE, the partial record, plus any preallocated / padded tail
+	 */
+	uint64_t discardedBytes;
+};
+
+/**
+ * @brief Walks the records of an in-memory trace, using the size field in each record header, and finds where the last
+ * complete record ends
+ *
+ * A record is considered incomplete if its size runs past the end of the data. A header with a size of 0, or a
+ * reserved record type, also ends the scan. This catches the zero-filled tail left behind by sinks that preallocate or
+ * pad the file.
+ *
+ * @param data      The trace data
+ * @param len       The length of the data array
+ * @param result    Filled with the scan result
+ * @return          0 on success. FXT_ERR_INVALID_TRACE if the data doesn't start with the FXT magic number
+ */
+int ScanTrace(const void *data, size_t len, TraceRecoveryResult *result);
+
+/**
+ * @brief Finds the next checkpoint in a trace, so the trace can be split into pieces that decode independently
+ *
+ * Checkpoints start with a Magic Number record, and records are always 8 byte aligned. So this only has to look at
+ * every aligned word, rather than walk each record. The start of the trace is also a checkpoint
+ *
+ * Record payloads are not skipped, and argument or blob data can contain the magic number. A match only counts if it
+ * is followed by an Initialization record, with only Provider Info / Section records in between, like the ones
+ * WriteCheckpoint() writes. A piece without an Initialization record couldn't be decoded on its own anyway
+ *
+ * @param data      The trace data
+ * @param len       The length of the data array
+ * @param offset    The offset to start searching from. Rounded up to a multiple of 8
+ * @return          The offset of the next checkpoint. Or len, if there are no more
+ *
+ * @see WriteCheckpoint
+ */
+size_t FindNextCheckpoint(const void *data, size_t len, size_t offset);
+
+/**
+ * @brief Copies every complete record of a truncated trace file to a new file
+ *
+ * The trace is streamed record by record, so only the largest record has to fit in memory
+ *
+ * @param inputPath     The path of the truncated trace
+ * @param outputPath    The path to write the recovered trace to. It must not be the same file as inputPath
+ * @param result        Filled with the scan result. May be nullptr
+ * @return              0 on success. Non-zero for failure
+ */
+int RecoverTraceFile(const char *inputPath, const char *outputPath, TraceRecoveryResult *result);
+
+} // End of namespace fxt
@@ -0,0 +1,134 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/err.h"
+#include "fxt/writer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+
+namespace fxt {
+
+struct RotatingFileSinkConfig {
+	/**
+	 * @brief The path prefix of the chunk files. Chunks are named <basePath>-0000.fxt, <basePath>-0001.fxt, etc.
+	 */
+	const char *basePath = "trace";
+	/**
+	 * @brief Start a new chunk once the current one is at least this many bytes. 0 disables size based rotation
+	 *
+	 * Chunks only end at record boundaries, so a chunk can be slightly larger than this
+	 */
+	uint64_t maxChunkBytes = 256 * 1024 * 1024;
+	/**
+	 * @brief Start a new chunk once the current one has been open for this long. 0 disables time based rotation
+	 */
+	uint32_t maxChunkDurationMs = 0;
+
+	/**
+	 * @brief The provider info written at the start of every chunk
+	 */
+	ProviderID providerID = 0;
+	const char *providerName = "fxt";
+	/**
+	 * @brief The Initialization record value written at the start of the first chunk
+	 *
+	 * Later chunks start with the rate of the last Initialization record written. IE, the rate of the writer's clock
+	 */
+	uint64_t numTicksPerSecond = 1000000000;
+};
+
+/**
+ * @brief A file sink that splits the trace into self-contained chunk files
+ *
+ * A new chunk is started at the first record boundary after the current chunk exceeds the size or time limit. Every
+ * chunk starts with a Magic Number, Provider Info, Provider Section, and Initialization record. And the intern tables
+ * of the Writer are reset, so every String and Thread record that is referenced in a chunk is also defined in it. So
+ * each chunk can be loaded on its own.
+ *
+ * The sink writes those header records itself, including for the first chunk
+ *
+ * Example:
+ *     fxt::RotatingFileSink sink;
+ *     fxt::Writer writer(&sink, fxt::WriteToRotatingFileSink);
+ *     OpenRotatingFileSink(&sink, &writer, config);
+ *     ...
+ *     CloseRotatingFileSink(&sink);
+ */
+struct RotatingFileSink {
+	RotatingFileSink() = default;
+	~RotatingFileSink();
+
+	RotatingFileSink(const RotatingFileSink &) = delete;
+	RotatingFileSink &operator=(const RotatingFileSink &) = delete;
+
+	RotatingFileSinkConfig config;
+	// Owned copies of the config strings
+	std::string basePath;
+	std::string providerName;
+
+	Writer *writer = nullptr;
+	FILE *file = nullptr;
+
+	/**
+	 * @brief The index of the next chunk to be opened
+	 */
+	unsigned nextChunkIndex = 0;
+	uint64_t chunkBytes = 0;
+	std::chrono::steady_clock::time_point chunkStartTime;
+
+	int error = 0;
+};
+
+/**
+ * @brief Opens the first chunk, writes its header records, and hooks the sink into the writer
+ *
+ * The writer must have been created with the sink as the userContext, and WriteToRotatingFileSink as the writeFunc
+ *
+ * @param sink      The sink to initialize
+ * @param writer    The writer that writes to this sink
+ * @param config    The sink configuration
+ * @return          0 on success. Non-zero for failure
+ */
+int OpenRotatingFileSink(RotatingFileSink *sink, Writer *writer, RotatingFileSinkConfig config);
+
+/**
+ * @brief A WriteFunc that writes the data to the current chunk of a RotatingFileSink
+ *
+ * @param userContext    A pointer to the RotatingFileSink
+ * @param data           The data to write
+ * @param len            The length of the data array
+ * @return               0 on success. Non-zero for failure
+ */
+int WriteToRotatingFileSink(void *userContext, const void *data, size_t len);
+
+/**
+ * @brief Closes the current chunk, and starts a new one, regardless of the limits
+ *
+ * This must only be called in between records
+ *
+ * @param sink    The sink to rotate
+ * @return        0 on success. Non-zero for failure
+ */
+int RotateChunk(RotatingFileSink *sink);
+
+/**
+ * @brief Closes the current chunk, and unhooks the sink from the writer
+ *
+ * It is safe to call this multiple times
+ *
+ * @param sink    The sink to close
+ * @return        0 on success. Non-zero for failure
+ */
+int CloseRotatingFileSink(RotatingFileSink *sink);
+
+} // End of namespace fxt
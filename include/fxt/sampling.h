@@ -0,0 +1,277 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/clock.h"
+#include "fxt/err.h"
+#include "fxt/internal/thread_slots.h"
+#include "fxt/scope.h"
+#include "fxt/writer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fxt {
+
+struct SamplingConfig {
+	/**
+	 * @brief Keep every Nth event. 1 keeps them all
+	 */
+	uint32_t oneInN = 1;
+	/**
+	 * @brief Keep each event with this probability, from 0.0 to 1.0
+	 */
+	double probability = 1.0;
+	/**
+	 * @brief The most events kept per second, on each thread. 0 is unlimited
+	 */
+	uint64_t maxEventsPerSecond = 0;
+	/**
+	 * @brief The most events kept in a burst, before the rate limit kicks in. 0 means maxEventsPerSecond
+	 */
+	uint64_t burst = 0;
+	/**
+	 * @brief Optional. The rate limit reads this clock instead of the OS monotonic clock
+	 */
+	const Clock *clock = nullptr;
+};
+
+namespace internal {
+
+// One thread's counts. Only that thread writes them. Anyone holding the sampler's lock can read them
+struct SamplerShard {
+	std::atomic<uint64_t> kept{ 0 };
+	std::atomic<uint64_t> sampledOut{ 0 };
+	/**
+	 * @brief The counter ID AddSamplerCounterEvent() writes this thread's counts with. Starts at 1, in the order the
+	 * threads first used the sampler
+	 */
+	uint64_t counterID = 0;
+};
+
+} // End of namespace internal
+
+/**
+ * @brief Thins out the events of one category before they reach the writer
+ *
+ * Events are kept if they pass every configured filter: 1 in N, then a random draw, then a token bucket. All the state
+ * is per thread, so deciding never touches a shared atomic. That makes the rate limit per thread as well.
+ *
+ * Begin / End pairs must be decided together, so the End of a span that was sampled out is dropped too. The
+ * FXT_SAMPLED_* macros below take care of that: the Begin macro returns the decision, and the End macro takes it.
+ *
+ * Each thread counts how many events it kept and dropped, so the real rates can be reconstructed. Only the thread itself
+ * writes its counts, with a relaxed load and store. AddSamplerTotalCounterEvent() writes the sum over every thread, and
+ * AddSamplerCounterEvent() writes the calling thread's own counts. Nothing calls them on its own. Either call them
+ * periodically, or register the sampler with a CounterAggregator (see RegisterAggregatedSampler()), whose thread then
+ * writes the totals every interval.
+ *
+ * Example:
+ *     fxt::SamplingConfig config;
+ *     config.oneInN = 100;
+ *     fxt::Sampler sampler;
+ *     InitSampler(&sampler, "Allocator", config);
+ *
+ *     const bool sampled = FXT_SAMPLED_ADD_DURATION_BEGIN_EVENT(&sampler, &writer, "Alloc", pid, tid, timestamp);
+ *     ...
+ *     FXT_SAMPLED_ADD_DURATION_END_EVENT(&sampler, sampled, &writer, "Alloc", pid, tid, timestamp);
+ */
+struct Sampler {
+	Sampler() = default;
+	~Sampler();
+
+	Sampler(const Sampler &) = delete;
+	Sampler &operator=(const Sampler &) = delete;
+
+	std::string category;
+	/**
+	 * @brief The name of the counter AddSamplerCounterEvent() writes. IE, "Sampling: <category>"
+	 */
+	std::string counterName;
+	SamplingConfig config;
+
+	/**
+	 * @brief Where the sampler's state lives in each thread's state array
+	 */
+	internal::ThreadSlot slot;
+	/**
+	 * @brief config.probability, scaled to compare against a random uint64_t
+	 */
+	uint64_t probabilityThreshold = 0;
+
+	// Guards the list of shards, not their counts
+	std::mutex mutex;
+	std::vector<std::unique_ptr<internal::SamplerShard>> shards;
+};
+
+/**
+ * @brief Sets up the sampler
+ *
+ * @param sampler     The sampler to initialize
+ * @param category    The category of the events it samples
+ * @param config      The sampling configuration
+ * @return            0 on success. Non-zero for failure
+ */
+int InitSampler(Sampler *sampler, const char *category, SamplingConfig config);
+
+/**
+ * @brief Decides whether to keep the next event, and counts the decision for the calling thread
+ *
+ * @param sampler    The sampler to use
+ * @return           True if the event should be written
+ */
+bool SampleEvent(Sampler *sampler);
+
+/**
+ * @brief Writes the number of events the calling thread has kept and dropped so far, as a counter event
+ *
+ * The counter is in the "fxt" category, named Sampler::counterName, with "kept" and "sampledOut" arguments. Both are
+ * totals since the thread first used the sampler. Each thread writes with a counter ID of its own, starting at 1, so
+ * their tracks don't overwrite each other
+ *
+ * @param writer       The writer to use
+ * @param sampler      The sampler to report on
+ * @param processID    The process ID to write the event with
+ * @param threadID     The thread ID to write the event with
+ * @param timestamp    The timestamp of the event
+ * @return             0 on success. Non-zero for failure
+ */
+int AddSamplerCounterEvent(Writer *writer, Sampler *sampler, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp);
+
+/**
+ * @brief Writes the number of events every thread has kept and dropped so far, as a counter event
+ *
+ * Same as AddSamplerCounterEvent(), but with the counts summed over every thread that has used the sampler, and a
+ * counter ID of 0. It can be called from any thread
+ *
+ * @param writer       The writer to use
+ * @param sampler      The sampler to report on
+ * @param processID    The process ID to write the event with
+ * @param threadID     The thread ID to write the event with
+ * @param timestamp    The timestamp of the event
+ * @return             0 on success. Non-zero for failure
+ */
+int AddSamplerTotalCounterEvent(Writer *writer, Sampler *sampler, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp);
+
+/**
+ * @brief The seed CorrelationSampler uses unless told otherwise
+ */
+constexpr uint64_t kDefaultCorrelationSamplingSeed = 0x6678742D73616D70ull;
+
+/**
+ * @brief Keeps or drops whole async / flow chains, by hashing their correlation IDs
+ *
+ * The decision only depends on the correlation ID, the seed, and the probability. So every Async* / Flow* event of a
+ * given ID is kept or dropped together, on any thread, and in any process configured the same way. A probability of
+ * 0.1 gives complete traces for about a tenth of the requests. The sampler is immutable after InitCorrelationSampler(),
+ * so it can be shared between threads freely.
+ *
+ * Example:
+ *     fxt::CorrelationSampler sampler;
+ *     InitCorrelationSampler(&sampler, "Requests", 0.1, fxt::kDefaultCorrelationSamplingSeed);
+ *
+ *     FXT_CORRELATED_ADD_ASYNC_BEGIN_EVENT(&sampler, &writer, "Request", pid, tid, timestamp, requestID);
+ *     ...
+ *     FXT_CORRELATED_ADD_ASYNC_END_EVENT(&sampler, &writer, "Request", pid, tid, timestamp, requestID);
+ */
+struct CorrelationSampler {
+	std::string category;
+	double probability = 1.0;
+	uint64_t seed = kDefaultCorrelationSamplingSeed;
+	/**
+	 * @brief probability, scaled to compare against the hash of a correlation ID
+	 */
+	uint64_t threshold = UINT64_MAX;
+};
+
+/**
+ * @brief Sets up the sampler
+ *
+ * @param sampler        The sampler to initialize
+ * @param category       The category of the events it samples
+ * @param probability    The fraction of correlation IDs to keep, from 0.0 to 1.0
+ * @param seed           The hash seed. Every process that should agree on the decisions has to use the same one
+ * @return               0 on success. Non-zero for failure
+ */
+int InitCorrelationSampler(CorrelationSampler *sampler, const char *category, double probability, uint64_t seed);
+
+/**
+ * @brief Decides whether the events of a correlation ID should be written. The same ID always gets the same answer
+ *
+ * @param sampler          The sampler to use
+ * @param correlationID    The async or flow correlation ID
+ * @return                 True if the events should be written
+ */
+bool SampleCorrelationID(const CorrelationSampler *sampler, uint64_t correlationID);
+
+} // End of namespace fxt
+
+#define FXT_SAMPLED_ADD_INSTANT_EVENT(sampler, writer, name, processID, threadID, timestamp, ...)                                        \
+	do {                                                                                                                                \
+		if (fxt::SampleEvent(sampler)) {                                                                                                \
+			FXT_ADD_INSTANT_EVENT(writer, (sampler)->category.c_str(), name, processID, threadID, timestamp, __VA_ARGS__);              \
+		}                                                                                                                               \
+	} while (0)
+
+#define FXT_SAMPLED_ADD_COUNTER_EVENT(sampler, writer, name, processID, threadID, timestamp, counterID, ...)                            \
+	do {                                                                                                                                \
+		if (fxt::SampleEvent(sampler)) {                                                                                                \
+			FXT_ADD_COUNTER_EVENT(writer, (sampler)->category.c_str(), name, processID, threadID, timestamp, counterID, __VA_ARGS__);   \
+		}                                                                                                                               \
+	} while (0)
+
+/**
+ * @brief Samples a span. Evaluates to true if it was kept, which must be passed on to FXT_SAMPLED_ADD_DURATION_END_EVENT()
+ */
+#define FXT_SAMPLED_ADD_DURATION_BEGIN_EVENT(sampler, writer, name, processID, threadID, timestamp, ...) \
+	(fxt::SampleEvent(sampler) ? (FXT_ADD_DURATION_BEGIN_EVENT(writer, (sampler)->category.c_str(), name, processID, threadID, timestamp, __VA_ARGS__), true) : false)
+
+#define FXT_SAMPLED_ADD_DURATION_END_EVENT(sampler, sampled, writer, name, processID, threadID, timestamp, ...)                        \
+	do {                                                                                                                               \
+		if (sampled) {                                                                                                                 \
+			FXT_ADD_DURATION_END_EVENT(writer, (sampler)->category.c_str(), name, processID, threadID, timestamp, __VA_ARGS__);        \
+		}                                                                                                                              \
+	} while (0)
+
+/**
+ * @brief Same as FXT_SCOPE(), but sampled. The decision is made when the scope is entered
+ */
+#define FXT_SAMPLED_SCOPE(sampler, writer, name, ...)                                                                                                                                \
+	auto FXT_INTERNAL_CONCAT(fxtScope, __LINE__) = fxt::MakeScopedDuration(fxt::SampleEvent(sampler) ? (writer) : nullptr, [&](fxt::Writer *fxtWriter, uint64_t fxtBeginTimestamp) { \
+		return FXT_ADD_DURATION_COMPLETE_EVENT(fxtWriter, (sampler)->category.c_str(), name, fxt::kCurrentProcess, fxt::kCurrentThread, fxtBeginTimestamp, fxt::kTimestampNow, __VA_ARGS__);   \
+	})
+
+#define FXT_INTERNAL_CORRELATED_EVENT(sampler, correlationID, ...) \
+	do {                                                           \
+		if (fxt::SampleCorrelationID(sampler, correlationID)) {    \
+			__VA_ARGS__;                                           \
+		}                                                          \
+	} while (0)
+
+#define FXT_CORRELATED_ADD_ASYNC_BEGIN_EVENT(sampler, writer, name, processID, threadID, timestamp, asyncCorrelationID, ...) \
+	FXT_INTERNAL_CORRELATED_EVENT(sampler, asyncCorrelationID, FXT_ADD_ASYNC_BEGIN_EVENT(writer, (sampler)->category.c_str(), name, processID, threadID, timestamp, asyncCorrelationID, __VA_ARGS__))
+
+#define FXT_CORRELATED_ADD_ASYNC_INSTANT_EVENT(sampler, writer, name, processID, threadID, timestamp, asyncCorrelationID, ...) \
+	FXT_INTERNAL_CORRELATED_EVENT(sampler, asyncCorrelationID, FXT_ADD_ASYNC_INSTANT_EVENT(writer, (sampler)->category.c_str(), name, processID, threadID, timestamp, asyncCorrelationID, __VA_ARGS__))
+
+#define FXT_CORRELATED_ADD_ASYNC_END_EVENT(sampler, writer, name, processID, threadID, timestamp, asyncCorrelationID, ...) \
+	FXT_INTERNAL_CORRELATED_EVENT(sampler, asyncCorrelationID, FXT_ADD_ASYNC_END_EVENT(writer, (sampler)->category.c_str(), name, processID, threadID, timestamp, asyncCorrelationID, __VA_ARGS__))
+
+#define FXT_CORRELATED_ADD_FLOW_BEGIN_EVENT(sampler, writer, name, processID, threadID, timestamp, flowCorrelationID, ...) \
+	FXT_INTERNAL_CORRELATED_EVENT(sampler, flowCorrelationID, FXT_ADD_FLOW_BEGIN_EVENT(writer, (sampler)->category.c_str(), name, processID, threadID, timestamp, flowCorrelationID, __VA_ARGS__))
+
+#define FXT_CORRELATED_ADD_FLOW_STEP_EVENT(sampler, writer, name, processID, threadID, timestamp, flowCorrelationID, ...) \
+	FXT_INTERNAL_CORRELATED_EVENT(sampler, flowCorrelationID, FXT_ADD_FLOW_STEP_EVENT(writer, (sampler)->category.c_str(), name, processID, threadID, timestamp, flowCorrelationID, __VA_ARGS__))
+
+#define FXT_CORRELATED_ADD_FLOW_END_EVENT(sampler, writer, name, processID, threadID, timestamp, flowCorrelationID, ...) \
+	FXT_INTERNAL_CORRELATED_EVENT(sampler, flowCorrelationID, FXT_ADD_FLOW_END_EVENT(writer, (sampler)->category.c_str(), name, processID, threadID, timestamp, flowCorrelationID, __VA_ARGS__))
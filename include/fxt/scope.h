@@ -0,0 +1,88 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/clock.h"
+#include "fxt/thread_identity.h"
+#include "fxt/writer.h"
+
+#include <stdint.h>
+
+namespace fxt {
+
+namespace internal {
+
+inline uint64_t BeginScopedDuration(Writer *writer, bool writePendingRecord) {
+	if (writer == nullptr) {
+		return 0;
+	}
+	if (writePendingRecord && writer->pendingRecordFunc != nullptr) {
+		// Same as the end of the scope, an error here has nowhere to go
+		WritePendingRecord(writer);
+	}
+	return writer->clock != nullptr ? ReadClock(writer->clock) : 0;
+}
+
+} // End of namespace internal
+
+/**
+ * @brief Reads the writer's clock when it is created, and calls func with that timestamp when it is destroyed
+ *
+ * Entering the scope writes the writer's pending record, so it can't straddle the begin of the scope. Unless
+ * writePendingRecord is false, which only the scopes that create pending records use.
+ *
+ * A null writer makes it do nothing. Use FXT_SCOPE() rather than creating these directly
+ */
+template <typename Func>
+struct ScopedDuration {
+	ScopedDuration(Writer *writer, Func func, bool writePendingRecord)
+	        : writer(writer),
+	          func(func),
+	          beginTimestamp(internal::BeginScopedDuration(writer, writePendingRecord)) {
+	}
+	~ScopedDuration() {
+		// There is nowhere to report an error from a destructor. Same as a failed write of any other event, it is dropped
+		if (writer != nullptr) {
+			func(writer, beginTimestamp);
+		}
+	}
+
+	ScopedDuration(const ScopedDuration &) = delete;
+	ScopedDuration &operator=(const ScopedDuration &) = delete;
+
+	Writer *writer;
+	Func func;
+	uint64_t beginTimestamp;
+};
+
+template <typename Func>
+ScopedDuration<Func> MakeScopedDuration(Writer *writer, Func func) {
+	return ScopedDuration<Func>(writer, func, true);
+}
+
+} // End of namespace fxt
+
+#define FXT_INTERNAL_CONCAT_(a, b) a##b
+#define FXT_INTERNAL_CONCAT(a, b) FXT_INTERNAL_CONCAT_(a, b)
+
+/**
+ * @brief Traces the rest of the enclosing scope as a single Duration Complete event, on the calling thread
+ *
+ * The writer must have a clock. The begin timestamp is read when the scope is entered. The end timestamp, and the
+ * arguments, are only evaluated when the scope exits, so they can refer to values computed inside the scope.
+ *
+ * Example:
+ *     size_t count = 0;
+ *     FXT_SCOPE(&writer, "IO", "ReadFiles", "count", count);
+ *     for (...) {
+ *         ++count;
+ *     }
+ */
+#define FXT_SCOPE(writer, category, name, ...)                                                                                                                            \
+	auto FXT_INTERNAL_CONCAT(fxtScope, __LINE__) = fxt::MakeScopedDuration(writer, [&](fxt::Writer *fxtWriter, uint64_t fxtBeginTimestamp) {                              \
+		return FXT_ADD_DURATION_COMPLETE_EVENT(fxtWriter, category, name, fxt::kCurrentProcess, fxt::kCurrentThread, fxtBeginTimestamp, fxt::kTimestampNow, __VA_ARGS__); \
+	})
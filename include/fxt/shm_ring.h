@@ -0,0 +1,230 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/collector.h"
+#include "fxt/err.h"
+#include "fxt/writer.h"
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace fxt {
+
+namespace internal {
+
+static constexpr uint64_t kShmRingMagic = 0x676e6952747866ull; // "fxtRing"
+static constexpr uint32_t kShmRingVersion = 1;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "The ring positions are shared between processes, so they must be lock-free");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "The ring flags are shared between processes, so they must be lock-free");
+
+/**
+ * @brief The header at the start of the shared memory object. The ring data directly follows it
+ *
+ * The positions only ever increase. The offset into the ring data is the position modulo the capacity
+ */
+struct ShmRingHeader {
+	/**
+	 * @brief Stored last, once the rest of the header is filled in
+	 */
+	std::atomic<uint64_t> magic;
+	uint32_t version;
+	uint32_t providerID;
+	uint64_t capacity;
+	int64_t producerPid;
+	char providerName[128];
+
+	/**
+	 * @brief Set once the producer has closed the sink. Nothing more will be published after this
+	 */
+	std::atomic<uint32_t> closed;
+
+	/**
+	 * @brief The end of the last complete record. Written by the producer
+	 */
+	alignas(64) std::atomic<uint64_t> publishedPos;
+	/**
+	 * @brief The end of the data the collector has consumed. Written by the collector
+	 */
+	alignas(64) std::atomic<uint64_t> consumedPos;
+};
+
+inline constexpr size_t ShmRingDataOffset() {
+	return (sizeof(ShmRingHeader) + 63) & ~(size_t)63;
+}
+
+} // End of namespace internal
+
+struct ShmRingSinkConfig {
+	/**
+	 * @brief The size of the ring data in bytes. Must be a power of 2, and larger than the largest record
+	 */
+	size_t capacity = 16 * 1024 * 1024;
+	/**
+	 * @brief The provider the collector will file this process' records under. Should be unique among the processes
+	 */
+	ProviderID providerID = 0;
+	const char *providerName = "fxt";
+	/**
+	 * @brief How long a write will wait for the collector to make room in a full ring, before failing the sink
+	 *
+	 * 0 means wait forever
+	 */
+	uint32_t fullTimeoutMs = 1000;
+};
+
+/**
+ * @brief A sink that writes into a POSIX shared memory ring, to be drained by a collector in another process
+ *
+ * Writes are a plain memcpy into the shared memory, so the instrumented process does no file I/O. The sink follows the
+ * record headers in the stream, and only publishes a record to the collector once all of it has been written. So the
+ * collector never sees a partial record, and everything published so far survives a crash of this process.
+ *
+ * If the ring is full, the write waits for the collector to catch up. If that takes longer than
+ * ShmRingSinkConfig::fullTimeoutMs, the sink fails, and all further writes return an error.
+ *
+ * Like the Writer itself, a sink must only be written to by a single thread at a time.
+ *
+ * Example:
+ *     fxt::ShmRingSinkConfig config;
+ *     config.providerID = getpid();
+ *     config.providerName = "Server";
+ *     fxt::ShmRingSink sink;
+ *     OpenShmRingSink(&sink, "/fxt-server", config);
+ *     fxt::Writer writer(&sink, fxt::WriteToShmRingSink);
+ *     ...
+ *     CloseShmRingSink(&sink);
+ */
+struct ShmRingSink {
+	ShmRingSink() = default;
+	~ShmRingSink();
+
+	ShmRingSink(const ShmRingSink &) = delete;
+	ShmRingSink &operator=(const ShmRingSink &) = delete;
+
+	ShmRingSinkConfig config;
+	std::string name;
+
+	internal::ShmRingHeader *header = nullptr;
+	uint8_t *data = nullptr;
+	size_t mappingSize = 0;
+
+	/**
+	 * @brief The end of the data written so far. Only published once it reaches the end of a record
+	 */
+	uint64_t writePos = 0;
+	/**
+	 * @brief The bytes left in the current record. 0 when the next write starts a new record
+	 */
+	uint64_t recordRemaining = 0;
+	/**
+	 * @brief Holds the start of a record header that was split across writes
+	 */
+	uint8_t partialHeader[8];
+	size_t partialHeaderLen = 0;
+
+	int error = 0;
+};
+
+/**
+ * @brief Creates the shared memory object for the ring, and maps it
+ *
+ * If an object with the same name already exists, it is replaced
+ *
+ * @param sink      The sink to initialize
+ * @param name      The name of the shared memory object. IE, "/fxt-server". See shm_open()
+ * @param config    The sink configuration
+ * @return          0 on success. Non-zero for failure
+ */
+int OpenShmRingSink(ShmRingSink *sink, const char *name, ShmRingSinkConfig config);
+
+/**
+ * @brief A WriteFunc that copies the data into the ring of a ShmRingSink
+ *
+ * @param userContext    A pointer to the ShmRingSink
+ * @param data           The data to write
+ * @param len            The length of the data array
+ * @return               0 on success. Non-zero for failure
+ */
+int WriteToShmRingSink(void *userContext, const void *data, size_t len);
+
+/**
+ * @brief Marks the ring as closed, and unmaps it
+ *
+ * The shared memory object is left in place, so the collector can drain it. The collector removes it once it is done.
+ * It is safe to call this multiple times
+ *
+ * @param sink    The sink to close
+ * @return        0 on success. Non-zero for failure
+ */
+int CloseShmRingSink(ShmRingSink *sink);
+
+/**
+ * @brief The collector side of a ShmRingSink
+ */
+struct ShmRingReader {
+	ShmRingReader() = default;
+	~ShmRingReader();
+
+	ShmRingReader(const ShmRingReader &) = delete;
+	ShmRingReader &operator=(const ShmRingReader &) = delete;
+
+	std::string name;
+	internal::ShmRingHeader *header = nullptr;
+	const uint8_t *data = nullptr;
+	size_t mappingSize = 0;
+
+	/**
+	 * @brief The collector stream that the records of this ring are copied to
+	 */
+	unsigned streamIndex = 0;
+	/**
+	 * @brief Set once the producer is gone, and everything it published has been collected
+	 */
+	bool finished = false;
+
+	/**
+	 * @brief Used to make the data contiguous when it wraps around the end of the ring
+	 */
+	std::vector<uint8_t> scratch;
+};
+
+/**
+ * @brief Maps an existing ring, and registers it as a new stream of the collector
+ *
+ * @param reader       The reader to initialize
+ * @param collector    The collector to copy the records to
+ * @param name         The name of the shared memory object
+ * @return             0 on success. FXT_ERR_OPEN_FAILED if the ring doesn't exist yet. Non-zero for other failures
+ */
+int OpenShmRingReader(ShmRingReader *reader, Collector *collector, const char *name);
+
+/**
+ * @brief Copies all the records published since the last poll to the collector
+ *
+ * Once the producer has closed the ring, or died, and everything has been collected, the reader is marked as finished
+ * and the shared memory object is removed
+ *
+ * @param reader            The reader to poll
+ * @param collector         The collector the reader was opened with
+ * @param bytesCollected    Filled with the number of bytes consumed from the ring. May be nullptr
+ * @return                  0 on success. Non-zero for failure
+ */
+int PollShmRingReader(ShmRingReader *reader, Collector *collector, size_t *bytesCollected);
+
+/**
+ * @brief Unmaps the ring. It is safe to call this multiple times
+ *
+ * @param reader    The reader to close
+ */
+void CloseShmRingReader(ShmRingReader *reader);
+
+} // End of namespace fxt
@@ -0,0 +1,134 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/err.h"
+#include "fxt/internal/thread_slots.h"
+#include "fxt/scope.h"
+#include "fxt/writer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace fxt {
+
+struct SpanCoalescerConfig {
+	/**
+	 * @brief Spans that start at most this long after the previous one ended are merged into it, in timestamp ticks
+	 */
+	uint64_t maxGap = 1000;
+	/**
+	 * @brief Spans that last longer than this are always written on their own, in timestamp ticks
+	 */
+	uint64_t maxSpanDuration = 10000;
+	/**
+	 * @brief The most spans merged into one record. 0 is unlimited
+	 */
+	uint64_t maxCount = 0;
+};
+
+/**
+ * @brief Merges runs of short, identical spans on a thread into a single Duration Complete record
+ *
+ * Finished spans are held back, one run per thread. The next span extends the run if it has the same category, name,
+ * and thread, and starts within maxGap of the run's end. Otherwise the run is written, and a new one starts. A run of
+ * several spans is written from the begin of its first span to the end of its last, with "count", "total_ns", and
+ * "max_ns" arguments. A run of one span is written as is.
+ *
+ * The run is the writer's pending record (see Writer::pendingRecordFunc). So it is also written as soon as anything
+ * else is written to the writer, or an FXT_SCOPE() is entered on it. That way a run never merges spans from either
+ * side of another span, and never straddles the begin or end of the scope around it. The writer must only be used by
+ * the thread whose run it holds.
+ *
+ * Category and name strings must stay valid until the run is written. Coalesced spans don't take arguments, since
+ * merging them would lose all but one set.
+ *
+ * Call FlushCoalescedSpans() on each thread before the writer is closed, and before the thread exits, since the writer
+ * points at the thread's run until it is written.
+ *
+ * Example:
+ *     fxt::SpanCoalescer coalescer;
+ *     InitSpanCoalescer(&coalescer, fxt::SpanCoalescerConfig());
+ *
+ *     for (...) {
+ *         FXT_COALESCED_SCOPE(&coalescer, &writer, "Parser", "ParseField");
+ *         ...
+ *     }
+ *     FlushCoalescedSpans(&coalescer, &writer);
+ */
+struct SpanCoalescer {
+	SpanCoalescer() = default;
+	~SpanCoalescer();
+
+	SpanCoalescer(const SpanCoalescer &) = delete;
+	SpanCoalescer &operator=(const SpanCoalescer &) = delete;
+
+	SpanCoalescerConfig config;
+
+	/**
+	 * @brief Where the coalescer's runs live in each thread's state array
+	 */
+	internal::ThreadSlot slot;
+};
+
+/**
+ * @brief Sets up the coalescer
+ *
+ * @param coalescer    The coalescer to initialize
+ * @param config       The coalescing configuration
+ * @return             0 on success. Non-zero for failure
+ */
+int InitSpanCoalescer(SpanCoalescer *coalescer, SpanCoalescerConfig config);
+
+/**
+ * @brief Adds a finished span to the calling thread's run, writing the previous run if the span doesn't extend it
+ *
+ * @param coalescer         The coalescer to use
+ * @param writer            The writer to use
+ * @param category          The category string
+ * @param name              The name string
+ * @param processID         The process ID to write the event with
+ * @param threadID          The thread ID to write the event with
+ * @param beginTimestamp    The begin timestamp of the span
+ * @param endTimestamp      The end timestamp of the span
+ * @return                  0 on success. Otherwise, the error from writing the previous run
+ */
+int AddCoalescedSpan(SpanCoalescer *coalescer, Writer *writer, const char *category, const char *name, KernelObjectID processID, KernelObjectID threadID, uint64_t beginTimestamp, uint64_t endTimestamp);
+
+/**
+ * @brief Writes the calling thread's run, if it has one
+ *
+ * @param coalescer    The coalescer to use
+ * @param writer       The writer to use
+ * @return             0 on success. Non-zero for failure
+ */
+int FlushCoalescedSpans(SpanCoalescer *coalescer, Writer *writer);
+
+namespace internal {
+
+// Entering a coalesced scope mustn't write the run it's about to extend
+template <typename Func>
+ScopedDuration<Func> MakeCoalescedScope(Writer *writer, Func func) {
+	return ScopedDuration<Func>(writer, func, false);
+}
+
+} // End of namespace internal
+
+} // End of namespace fxt
+
+/**
+ * @brief Same as FXT_SCOPE(), but the span goes through the coalescer, and takes no arguments
+ */
+#define FXT_COALESCED_SCOPE(coalescer, writer, category, name)                                                                                               \
+	auto FXT_INTERNAL_CONCAT(fxtScope, __LINE__) = fxt::internal::MakeCoalescedScope(writer, [&](fxt::Writer *fxtWriter, uint64_t fxtBeginTimestamp) {       \
+		uint64_t fxtEndTimestamp = fxt::kTimestampNow;                                                                                                       \
+		const int fxtRet = fxt::ResolveTimestamp(fxtWriter, &fxtEndTimestamp);                                                                               \
+		if (fxtRet != 0) {                                                                                                                                   \
+			return fxtRet;                                                                                                                                   \
+		}                                                                                                                                                    \
+		return fxt::AddCoalescedSpan(coalescer, fxtWriter, category, name, fxt::kCurrentProcess, fxt::kCurrentThread, fxtBeginTimestamp, fxtEndTimestamp); \
+	})
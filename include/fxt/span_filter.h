@@ -0,0 +1,157 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/err.h"
+#include "fxt/internal/thread_slots.h"
+#include "fxt/scope.h"
+#include "fxt/writer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <initializer_list>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fxt {
+
+/**
+ * @brief Drops spans shorter than a threshold before they are encoded
+ *
+ * Filtered Begin calls push the span onto a stack of the calling thread, and write nothing. The matching End pops it.
+ * If the span lasted at least the threshold of its category, it is written as a single Duration Complete event, with
+ * the Begin and End arguments. Otherwise it is dropped. Children end before their parents, so they are written first.
+ * Every written event carries its own begin and end timestamps, so readers still nest children inside their parents.
+ *
+ * The thresholds are in timestamp ticks. Spans given fxt::kTimestampNow read the writer's clock, on Begin and End.
+ * Category and name strings must stay valid until the span ends. Arguments are copied.
+ *
+ * AddSpanFilterCounterEvent() writes how many spans the calling thread wrote and suppressed.
+ *
+ * Example:
+ *     fxt::SpanFilter filter;
+ *     InitSpanFilter(&filter, 1000);
+ *     SetSpanFilterCategoryMinDuration(&filter, "Locks", 100);
+ *
+ *     FXT_FILTERED_ADD_DURATION_BEGIN_EVENT(&filter, &writer, "Locks", "Acquire", pid, tid, fxt::kTimestampNow);
+ *     ...
+ *     FXT_FILTERED_ADD_DURATION_END_EVENT(&filter, &writer, fxt::kTimestampNow, "contended", contended);
+ */
+struct SpanFilter {
+	SpanFilter() = default;
+	~SpanFilter();
+
+	SpanFilter(const SpanFilter &) = delete;
+	SpanFilter &operator=(const SpanFilter &) = delete;
+
+	uint64_t minDuration = 0;
+	/**
+	 * @brief Thresholds that override minDuration. Searched linearly, so meant for a handful of categories
+	 */
+	std::vector<std::pair<std::string, uint64_t>> categoryMinDurations;
+
+	/**
+	 * @brief Where the filter's stack lives in each thread's state array. The index is also the filter's counter ID
+	 */
+	internal::ThreadSlot slot;
+};
+
+/**
+ * @brief Sets up the filter
+ *
+ * @param filter         The filter to initialize
+ * @param minDuration    Spans shorter than this are dropped, unless their category has its own threshold
+ * @return               0 on success. Non-zero for failure
+ */
+int InitSpanFilter(SpanFilter *filter, uint64_t minDuration);
+
+/**
+ * @brief Gives a category its own threshold. This must be done before any thread uses the filter
+ *
+ * @param filter         The filter to change
+ * @param category       The category string
+ * @param minDuration    Spans of the category shorter than this are dropped
+ * @return               0 on success. Non-zero for failure
+ */
+int SetSpanFilterCategoryMinDuration(SpanFilter *filter, const char *category, uint64_t minDuration);
+
+/**
+ * @brief Starts a span on the calling thread. Nothing is written until it ends
+ *
+ * @param filter       The filter to use
+ * @param writer       The writer whose clock resolves fxt::kTimestampNow
+ * @param category     The category string
+ * @param name         The name string
+ * @param processID    The process ID to write the event with
+ * @param threadID     The thread ID to write the event with
+ * @param timestamp    The begin timestamp
+ * @param args         The arguments. They are copied
+ * @return             0 on success. Non-zero for failure
+ */
+int BeginFilteredSpan(SpanFilter *filter, Writer *writer, const char *category, const char *name, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp, std::initializer_list<RecordArgument> args);
+
+/**
+ * @brief Ends the innermost span of the calling thread, and writes it if it was long enough
+ *
+ * @param filter       The filter to use
+ * @param writer       The writer to use
+ * @param timestamp    The end timestamp
+ * @param args         Arguments to add to the ones given at Begin
+ * @return             0 on success. FXT_ERR_UNBALANCED_SPAN if the thread has no span open. Otherwise, the error from
+ *                     writing the event
+ */
+int EndFilteredSpan(SpanFilter *filter, Writer *writer, uint64_t timestamp, std::initializer_list<RecordArgument> args);
+
+/**
+ * @brief Writes the number of spans the calling thread has written and suppressed so far, as a counter event
+ *
+ * The counter is in the "fxt" category, named "Span Filter", with "emitted" and "suppressed" arguments
+ *
+ * @param writer       The writer to use
+ * @param filter       The filter to report on
+ * @param processID    The process ID to write the event with
+ * @param threadID     The thread ID to write the event with
+ * @param timestamp    The timestamp of the event
+ * @return             0 on success. Non-zero for failure
+ */
+int AddSpanFilterCounterEvent(Writer *writer, SpanFilter *filter, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp);
+
+namespace internal {
+
+/**
+ * @brief Checks a finished span against the threshold of its category, and counts it for the calling thread
+ *
+ * @return    True if the span should be written
+ */
+bool KeepFilteredSpan(SpanFilter *filter, const char *category, uint64_t beginTimestamp, uint64_t endTimestamp);
+
+} // End of namespace internal
+
+} // End of namespace fxt
+
+#define FXT_FILTERED_ADD_DURATION_BEGIN_EVENT(filter, writer, category, name, processID, threadID, timestamp, ...) \
+	fxt::BeginFilteredSpan(filter, writer, category, name, processID, threadID, timestamp, { FXT_INTERNAL_APPLY_PAIRWISE_CSV(FXT_INTERNAL_DECLARE_ARG, __VA_ARGS__) })
+
+#define FXT_FILTERED_ADD_DURATION_END_EVENT(filter, writer, timestamp, ...) \
+	fxt::EndFilteredSpan(filter, writer, timestamp, { FXT_INTERNAL_APPLY_PAIRWISE_CSV(FXT_INTERNAL_DECLARE_ARG, __VA_ARGS__) })
+
+/**
+ * @brief Same as FXT_SCOPE(), but the event is only written if the scope lasted at least the filter's threshold
+ *
+ * The scope doesn't use the filter's stack, so its arguments are never copied
+ */
+#define FXT_FILTERED_SCOPE(filter, writer, category, name, ...)                                                                                                 \
+	auto FXT_INTERNAL_CONCAT(fxtScope, __LINE__) = fxt::MakeScopedDuration(writer, [&](fxt::Writer *fxtWriter, uint64_t fxtBeginTimestamp) {                    \
+		uint64_t fxtEndTimestamp = fxt::kTimestampNow;                                                                                                          \
+		const int fxtRet = fxt::ResolveTimestamp(fxtWriter, &fxtEndTimestamp);                                                                                  \
+		if (fxtRet != 0 || !fxt::internal::KeepFilteredSpan(filter, category, fxtBeginTimestamp, fxtEndTimestamp)) {                                            \
+			return fxtRet;                                                                                                                                      \
+		}                                                                                                                                                       \
+		return FXT_ADD_DURATION_COMPLETE_EVENT(fxtWriter, category, name, fxt::kCurrentProcess, fxt::kCurrentThread, fxtBeginTimestamp, fxtEndTimestamp, __VA_ARGS__); \
+	})
@@ -0,0 +1,242 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/err.h"
+#include "fxt/internal/stored_args.h"
+#include "fxt/sampling.h"
+#include "fxt/writer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <initializer_list>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace fxt {
+
+/**
+ * @brief A summary of a finished request, for TailSamplingConfig::policy
+ */
+struct TailSampledRequest {
+	uint64_t correlationID;
+	/**
+	 * @brief The timestamps of the first and last staged events of the request
+	 */
+	uint64_t beginTimestamp;
+	uint64_t endTimestamp;
+	/**
+	 * @brief True if the request was finished as failed, or one of its events had an error argument
+	 */
+	bool failed;
+	size_t numEvents;
+};
+
+/**
+ * @brief A user-defined function that decides whether to keep a finished request
+ *
+ * It is called with the sampler's mutex held, so it must not call back into the sampler
+ *
+ * @param request        The finished request
+ * @param userContext    The policyContext value of the config
+ * @return               True to write the request's events, false to discard them
+ */
+typedef bool (*TailSamplingPolicyFunc)(const TailSampledRequest *request, void *userContext);
+
+struct TailSamplingConfig {
+	/**
+	 * @brief Keep requests that last at least this long, in timestamp ticks. UINT64_MAX disables it
+	 */
+	uint64_t minLatency = UINT64_MAX;
+	/**
+	 * @brief Keep requests with an event that has an argument of this name, set to anything but false, 0, or null.
+	 * nullptr disables it
+	 */
+	const char *errorArgName = "error";
+	/**
+	 * @brief Keep this fraction of the remaining requests, from 0.0 to 1.0
+	 *
+	 * The decision hashes the correlation ID, the same way CorrelationSampler does. So processes with the same seed and
+	 * probability keep the same requests
+	 */
+	double keepProbability = 0.0;
+	uint64_t seed = kDefaultCorrelationSamplingSeed;
+	/**
+	 * @brief Optional. Replaces the checks above
+	 */
+	TailSamplingPolicyFunc policy = nullptr;
+	void *policyContext = nullptr;
+
+	/**
+	 * @brief The most unfinished requests staged at once. Past that, the least recently used one is discarded
+	 */
+	size_t maxRequests = 1024;
+	/**
+	 * @brief The most events staged for one request. Past that, its events are dropped, but the request is still decided
+	 */
+	size_t maxEventsPerRequest = 256;
+};
+
+struct TailSamplerMetrics {
+	uint64_t requestsKept;
+	uint64_t requestsDiscarded;
+	/**
+	 * @brief Unfinished requests discarded to make room for new ones
+	 */
+	uint64_t requestsEvicted;
+	/**
+	 * @brief Events dropped because their request already had maxEventsPerRequest staged
+	 */
+	uint64_t eventsDropped;
+	size_t requestsStaged;
+};
+
+namespace internal {
+
+struct TailSampledEvent {
+	EventType type;
+	std::string category;
+	std::string name;
+	KernelObjectID processID;
+	KernelObjectID threadID;
+	uint64_t timestamp;
+	std::vector<StoredArgument> args;
+};
+
+struct TailSampledRequestState {
+	std::vector<TailSampledEvent> events;
+	uint64_t beginTimestamp = 0;
+	uint64_t endTimestamp = 0;
+	bool hasError = false;
+	std::list<uint64_t>::iterator lruPosition;
+};
+
+} // End of namespace internal
+
+/**
+ * @brief Holds the async / flow events of each request until it finishes, and only writes the interesting ones
+ *
+ * Events are staged per correlation ID. FinishTailSampledRequest() then runs the policy on the whole request, and
+ * either writes all of its events to the writer, or discards them. Slow and failed requests are kept in full, without
+ * paying to write every fast one.
+ *
+ * Staged events copy their strings and arguments, and kCurrentProcess / kCurrentThread / kTimestampNow are resolved
+ * when they are staged. The number of staged requests and events is bounded by the config. Async and flow IDs share
+ * one namespace here, so a request can mix both kinds of events.
+ *
+ * Every call takes the sampler's mutex, and the writer is only written to with it held. So any thread can stage
+ * events, but nothing else may use the writer at the same time.
+ *
+ * Example:
+ *     fxt::TailSamplingConfig config;
+ *     config.minLatency = 50 * 1000 * 1000;
+ *     fxt::TailSampler sampler;
+ *     InitTailSampler(&sampler, &writer, config);
+ *
+ *     FXT_TAIL_SAMPLED_ADD_ASYNC_BEGIN_EVENT(&sampler, "Requests", "Request", pid, tid, timestamp, requestID);
+ *     ...
+ *     FXT_TAIL_SAMPLED_ADD_ASYNC_END_EVENT(&sampler, "Requests", "Request", pid, tid, timestamp, requestID, "error", failed);
+ *     FinishTailSampledRequest(&sampler, requestID, false, nullptr);
+ */
+struct TailSampler {
+	TailSampler() = default;
+
+	TailSampler(const TailSampler &) = delete;
+	TailSampler &operator=(const TailSampler &) = delete;
+
+	Writer *writer = nullptr;
+	TailSamplingConfig config;
+	CorrelationSampler randomKeep;
+
+	std::mutex mutex;
+	std::unordered_map<uint64_t, internal::TailSampledRequestState> requests;
+	/**
+	 * @brief Correlation IDs of the staged requests, least recently used first
+	 */
+	std::list<uint64_t> lru;
+
+	uint64_t requestsKept = 0;
+	uint64_t requestsDiscarded = 0;
+	uint64_t requestsEvicted = 0;
+	uint64_t eventsDropped = 0;
+};
+
+/**
+ * @brief Sets up the sampler
+ *
+ * @param sampler    The sampler to initialize
+ * @param writer     The writer kept requests are written to
+ * @param config     The sampling configuration
+ * @return           0 on success. Non-zero for failure
+ */
+int InitTailSampler(TailSampler *sampler, Writer *writer, TailSamplingConfig config);
+
+/**
+ * @brief Decides the request, and writes or discards its staged events
+ *
+ * A correlation ID with nothing staged is counted as discarded
+ *
+ * @param sampler          The sampler to use
+ * @param correlationID    The correlation ID of the request
+ * @param failed           True if the request failed. Failed requests are always kept, unless a policy function is set
+ * @param kept             Optional. Set to true if the request was written
+ * @return                 0 on success. Otherwise, the error from writing the events
+ */
+int FinishTailSampledRequest(TailSampler *sampler, uint64_t correlationID, bool failed, bool *kept);
+
+/**
+ * @brief Discards every staged request, without writing anything
+ *
+ * @param sampler    The sampler to clear
+ */
+void DiscardTailSampledRequests(TailSampler *sampler);
+
+/**
+ * @brief Gets the counters of the sampler
+ *
+ * @param sampler    The sampler to query
+ * @param metrics    Filled with the counters
+ */
+void GetTailSamplerMetrics(TailSampler *sampler, TailSamplerMetrics *metrics);
+
+namespace internal {
+
+/**
+ * @brief Stages an event. Use the FXT_TAIL_SAMPLED_* macros rather than calling this directly
+ *
+ * @return    0 on success. Non-zero for failure
+ */
+int StageTailSampledEvent(TailSampler *sampler, EventType type, const char *category, const char *name, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp, uint64_t correlationID, std::initializer_list<RecordArgument> args);
+
+} // End of namespace internal
+
+} // End of namespace fxt
+
+#define FXT_INTERNAL_STAGE_TAIL_SAMPLED_EVENT(sampler, eventType, category, name, processID, threadID, timestamp, correlationID, ...) \
+	fxt::internal::StageTailSampledEvent(sampler, fxt::internal::EventType::eventType, category, name, processID, threadID, timestamp, correlationID, { FXT_INTERNAL_APPLY_PAIRWISE_CSV(FXT_INTERNAL_DECLARE_ARG, __VA_ARGS__) })
+
+#define FXT_TAIL_SAMPLED_ADD_ASYNC_BEGIN_EVENT(sampler, category, name, processID, threadID, timestamp, asyncCorrelationID, ...) \
+	FXT_INTERNAL_STAGE_TAIL_SAMPLED_EVENT(sampler, AsyncBegin, category, name, processID, threadID, timestamp, asyncCorrelationID, __VA_ARGS__)
+
+#define FXT_TAIL_SAMPLED_ADD_ASYNC_INSTANT_EVENT(sampler, category, name, processID, threadID, timestamp, asyncCorrelationID, ...) \
+	FXT_INTERNAL_STAGE_TAIL_SAMPLED_EVENT(sampler, AsyncInstant, category, name, processID, threadID, timestamp, asyncCorrelationID, __VA_ARGS__)
+
+#define FXT_TAIL_SAMPLED_ADD_ASYNC_END_EVENT(sampler, category, name, processID, threadID, timestamp, asyncCorrelationID, ...) \
+	FXT_INTERNAL_STAGE_TAIL_SAMPLED_EVENT(sampler, AsyncEnd, category, name, processID, threadID, timestamp, asyncCorrelationID, __VA_ARGS__)
+
+#define FXT_TAIL_SAMPLED_ADD_FLOW_BEGIN_EVENT(sampler, category, name, processID, threadID, timestamp, flowCorrelationID, ...) \
+	FXT_INTERNAL_STAGE_TAIL_SAMPLED_EVENT(sampler, FlowBegin, category, name, processID, threadID, timestamp, flowCorrelationID, __VA_ARGS__)
+
+#define FXT_TAIL_SAMPLED_ADD_FLOW_STEP_EVENT(sampler, category, name, processID, threadID, timestamp, flowCorrelationID, ...) \
+	FXT_INTERNAL_STAGE_TAIL_SAMPLED_EVENT(sampler, FlowStep, category, name, processID, threadID, timestamp, flowCorrelationID, __VA_ARGS__)
+
+#define FXT_TAIL_SAMPLED_ADD_FLOW_END_EVENT(sampler, category, name, processID, threadID, timestamp, flowCorrelationID, ...) \
+	FXT_INTERNAL_STAGE_TAIL_SAMPLED_EVENT(sampler, FlowEnd, category, name, processID, threadID, timestamp, flowCorrelationID, __VA_ARGS__)
@@ -0,0 +1,71 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/internal/defines.h"
+
+#include <stdint.h>
+
+namespace fxt {
+
+struct Writer;
+
+/**
+ * @brief Pass this as the processID of any Add*Event call, to use the ID of the calling process
+ */
+constexpr KernelObjectID kCurrentProcess = UINT64_MAX;
+/**
+ * @brief Pass this as the threadID of any Add*Event call, to use the ID of the calling thread
+ *
+ * The IDs are looked up once per thread, and again in the child after a fork(). When both kCurrentProcess and
+ * kCurrentThread are passed, the writer also remembers the thread's Thread record index, so the event skips the
+ * thread table lookup.
+ *
+ * Example:
+ *     AddInstantEvent(&writer, "Foo", "Bar", fxt::kCurrentProcess, fxt::kCurrentThread, timestamp);
+ */
+constexpr KernelObjectID kCurrentThread = UINT64_MAX;
+
+namespace internal {
+
+struct ThreadIdentity {
+	KernelObjectID processID;
+	KernelObjectID threadID;
+	/**
+	 * @brief The fork count the IDs were looked up in. The child of a fork() has to look them up again
+	 */
+	uint64_t forkGeneration = 0;
+
+	/**
+	 * @brief The Thread record index the thread last got, and the writer it was for
+	 *
+	 * The index is only valid while the writer's thread table still holds threadHash at that index. A reset of the
+	 * intern tables, or another thread taking over the slot, invalidates it
+	 */
+	const Writer *writer = nullptr;
+	uint64_t threadHash = 0;
+	uint16_t threadIndex = 0;
+};
+
+/**
+ * @brief Gets the identity cache of the calling thread, filling it in if needed
+ *
+ * @return    The calling thread's cache
+ */
+ThreadIdentity *GetThreadIdentity();
+
+} // End of namespace internal
+
+/**
+ * @brief Gets the IDs of the calling process and thread, from the thread's cache
+ *
+ * @param processID    Filled with the process ID
+ * @param threadID     Filled with the thread ID
+ */
+void GetCurrentThreadIdentity(KernelObjectID *processID, KernelObjectID *threadID);
+
+} // End of namespace fxt
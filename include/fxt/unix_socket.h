@@ -0,0 +1,248 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/collector.h"
+#include "fxt/err.h"
+#include "fxt/writer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace fxt {
+
+namespace internal {
+
+static constexpr uint64_t kUnixSocketHelloMagic = 0x6f6c6c6548747866ull; // "fxtHello"
+static constexpr uint32_t kUnixSocketVersion = 1;
+
+/**
+ * @brief The first message a client sends after connecting. Everything after it is FXT records
+ */
+struct UnixSocketHello {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t providerID;
+	char providerName[128];
+};
+
+} // End of namespace internal
+
+struct UnixSocketSinkConfig {
+	/**
+	 * @brief Data is sent once this many bytes have been buffered. The buffer can go over this by up to one record
+	 */
+	size_t bufferSize = 256 * 1024;
+	/**
+	 * @brief The maximum amount of time data should sit in the buffer before it is sent
+	 *
+	 * There is no background thread. The interval is only checked when the next record is written, so the last records
+	 * before the writer goes quiet stay buffered until it writes again. If that matters, call FlushUnixSocketSink()
+	 * from the writing thread when it goes idle, IE, before it blocks waiting for work.
+	 *
+	 * 0 disables the timer. Data will then only be sent when the buffer is full, or in FlushUnixSocketSink()
+	 */
+	uint32_t flushIntervalMs = 100;
+	/**
+	 * @brief The provider the collector will file this client's records under. Should be unique among the clients
+	 */
+	ProviderID providerID = 0;
+	const char *providerName = "fxt";
+	/**
+	 * @brief How long CloseUnixSocketSink() will wait for the collector to take the remaining data
+	 */
+	uint32_t closeTimeoutMs = 1000;
+
+	/**
+	 * @brief The IDs that the drop counter events are written with
+	 */
+	KernelObjectID processID = 0;
+	KernelObjectID threadID = 0;
+};
+
+struct UnixSocketSinkMetrics {
+	/**
+	 * @brief The number of bytes handed to the socket
+	 */
+	uint64_t bytesSent;
+	/**
+	 * @brief The number of buffers thrown away because the collector hadn't taken the previous one yet
+	 */
+	uint64_t droppedBuffers;
+	/**
+	 * @brief The number of bytes thrown away with those buffers
+	 */
+	uint64_t droppedBytes;
+};
+
+/**
+ * @brief A sink that streams the trace to a collector over a Unix domain socket, without ever blocking the writer
+ *
+ * Records are buffered, and the buffer is handed to the socket in a single large send() once it fills up, or the flush
+ * interval has elapsed by the next record. The socket is non-blocking. If the collector hasn't taken everything from
+ * the previous send yet, a full buffer is dropped rather than waiting. A partially filled buffer just keeps filling up.
+ *
+ * A dropped buffer can hold String / Thread records or the Initialization record that later records depend on. So after
+ * a drop, the sink writes a checkpoint (see WriteCheckpoint()), followed by an "fxt" / "Dropped" counter event with the
+ * running totals of dropped buffers and bytes. The drops show up in the trace itself, next to the gap they left.
+ *
+ * The sink hooks into the writer's record boundaries, so it only ever sends or drops whole records. Like the Writer
+ * itself, a sink must only be written to by a single thread at a time. The writer needs a clock, since the drop counter
+ * events are written with fxt::kTimestampNow.
+ *
+ * Example:
+ *     fxt::UnixSocketSink sink;
+ *     fxt::Writer writer(&sink, fxt::WriteToUnixSocketSink);
+ *     writer.clock = &clock;
+ *     fxt::UnixSocketSinkConfig config;
+ *     config.providerID = getpid();
+ *     config.providerName = "Server";
+ *     OpenUnixSocketSink(&sink, &writer, "/tmp/fxt.sock", config);
+ *     ...
+ *     CloseUnixSocketSink(&sink);
+ */
+struct UnixSocketSink {
+	UnixSocketSink() = default;
+	~UnixSocketSink();
+
+	UnixSocketSink(const UnixSocketSink &) = delete;
+	UnixSocketSink &operator=(const UnixSocketSink &) = delete;
+
+	UnixSocketSinkConfig config;
+	std::string providerName;
+	Writer *writer = nullptr;
+	int fd = -1;
+
+	/**
+	 * @brief The records written since the last send
+	 */
+	std::vector<uint8_t> buffer;
+	/**
+	 * @brief The last buffer handed to the socket. The socket may have only taken part of it so far
+	 */
+	std::vector<uint8_t> sending;
+	size_t sendingOffset = 0;
+
+	std::chrono::steady_clock::time_point lastSendTime;
+	/**
+	 * @brief Set while the sink writes its own records, so they don't trigger another send
+	 */
+	bool inRecordBoundary = false;
+
+	UnixSocketSinkMetrics metrics = {};
+	int error = 0;
+};
+
+/**
+ * @brief Connects to the collector listening at path, and hooks the sink into the writer's record boundaries
+ *
+ * The writer must already be set up to write to this sink, and have a clock
+ *
+ * @param sink      The sink to initialize
+ * @param writer    The writer that writes to this sink
+ * @param path      The path of the collector's socket
+ * @param config    The sink configuration
+ * @return          0 on success. FXT_ERR_OPEN_FAILED if the collector isn't listening. FXT_ERR_INVALID_CONFIG if the
+ *                  writer has no clock. Non-zero for other failures
+ */
+int OpenUnixSocketSink(UnixSocketSink *sink, Writer *writer, const char *path, UnixSocketSinkConfig config);
+
+/**
+ * @brief A WriteFunc that appends the data to the buffer of a UnixSocketSink
+ *
+ * @param userContext    A pointer to the UnixSocketSink
+ * @param data           The data to write
+ * @param len            The length of the data array
+ * @return               0 on success. Non-zero for failure
+ */
+int WriteToUnixSocketSink(void *userContext, const void *data, size_t len);
+
+/**
+ * @brief Hands the buffered records to the socket, without blocking. If the socket is still busy, they are dropped
+ *
+ * This must only be called in between records, from the thread that uses the writer
+ *
+ * @param sink    The sink to flush
+ * @return        0 on success, including when the records were dropped. Non-zero if the connection failed
+ */
+int FlushUnixSocketSink(UnixSocketSink *sink);
+
+/**
+ * @brief Sends the remaining records, waiting up to UnixSocketSinkConfig::closeTimeoutMs, then closes the connection
+ *
+ * It is safe to call this multiple times
+ *
+ * @param sink    The sink to close
+ * @return        0 on success. Non-zero for failure
+ */
+int CloseUnixSocketSink(UnixSocketSink *sink);
+
+struct UnixSocketClient {
+	int fd;
+	/**
+	 * @brief The collector stream of this client. Only valid once the hello has been received
+	 */
+	unsigned streamIndex;
+	bool receivedHello;
+	/**
+	 * @brief Received data that doesn't make up a whole record yet. Holds the hello until it's complete
+	 */
+	std::vector<uint8_t> partial;
+};
+
+/**
+ * @brief The collector side of UnixSocketSink. Accepts any number of clients, and copies their records to a Collector
+ */
+struct UnixSocketCollector {
+	UnixSocketCollector() = default;
+	~UnixSocketCollector();
+
+	UnixSocketCollector(const UnixSocketCollector &) = delete;
+	UnixSocketCollector &operator=(const UnixSocketCollector &) = delete;
+
+	std::string path;
+	int listenFd = -1;
+	std::vector<UnixSocketClient> clients;
+	/**
+	 * @brief The receive buffer shared by all the clients
+	 */
+	std::vector<uint8_t> receiveBuffer;
+};
+
+/**
+ * @brief Creates the listening socket at path. Any existing socket file at path is replaced
+ *
+ * @param collector    The socket collector to initialize
+ * @param path         The path to listen on
+ * @return             0 on success. Non-zero for failure
+ */
+int OpenUnixSocketCollector(UnixSocketCollector *collector, const char *path);
+
+/**
+ * @brief Waits up to timeoutMs for activity, then accepts new clients and copies all the complete records received
+ *
+ * @param socketCollector    The socket collector to poll
+ * @param collector          The collector to copy the records to
+ * @param timeoutMs          How long to wait for activity. 0 returns immediately
+ * @param bytesCollected     Filled with the number of bytes received. May be nullptr
+ * @return                   0 on success. Non-zero for failure
+ */
+int PollUnixSocketCollector(UnixSocketCollector *socketCollector, Collector *collector, uint32_t timeoutMs, size_t *bytesCollected);
+
+/**
+ * @brief Disconnects all the clients, and removes the socket. It is safe to call this multiple times
+ *
+ * @param collector    The socket collector to close
+ */
+void CloseUnixSocketCollector(UnixSocketCollector *collector);
+
+} // End of namespace fxt
@@ -29,6 +29,30 @@ namespace fxt {
  */
 typedef int (*WriteFunc)(void *userContext, const void *data, size_t len);
 
+struct Writer;
+struct Clock;
+
+/**
+ * @brief A user-defined function that is called right before the Writer starts each record
+ *
+ * Nothing has been written for the record yet, so this is a safe point to start a new self-contained stream. IE, to
+ * rotate the output file, write a new set of header records, and call ResetInternTables()
+ *
+ * @param writer         The writer that is about to write a record
+ * @param userContext    The recordBoundaryContext value of the writer
+ * @return               0 on success. Non-zero aborts the record, and is returned to the caller
+ */
+typedef int (*RecordBoundaryFunc)(Writer *writer, void *userContext);
+
+/**
+ * @brief A user-defined function that writes a record the Writer has been holding back
+ *
+ * @param writer         The writer holding the record
+ * @param userContext    The pendingRecordContext value of the writer
+ * @return               0 on success. Non-zero aborts whatever was about to be written, and is returned to the caller
+ */
+typedef int (*PendingRecordFunc)(Writer *writer, void *userContext);
+
 struct Writer {
 	Writer(void *userContext, WriteFunc writeFunc)
 	        : userContext(userContext),
@@ -82,8 +106,87 @@ struct Writer {
 
 	void *userContext;
 	WriteFunc writeFunc;
+
+	/**
+	 * @brief Optional. Called before each event, object, blob, and scheduling record
+	 *
+	 * Magic Number, Provider, and Initialization records don't trigger it, so the callback can write them itself
+	 *
+	 * @see RecordBoundaryFunc
+	 */
+	RecordBoundaryFunc recordBoundaryFunc = nullptr;
+	void *recordBoundaryContext = nullptr;
+
+	/**
+	 * @brief Optional. Writes a record that is being held back, IE, a run of coalesced spans
+	 *
+	 * It is cleared and called before any other record, before any Initialization or Provider record, and when a scope
+	 * is entered. So the held back record can't end up after, or straddle, anything that was traced after it
+	 *
+	 * @see WritePendingRecord
+	 */
+	PendingRecordFunc pendingRecordFunc = nullptr;
+	void *pendingRecordContext = nullptr;
+
+	/**
+	 * @brief Optional. Write a checkpoint at the first record boundary after this many bytes. 0 disables checkpoints
+	 *
+	 * @see WriteCheckpoint
+	 */
+	uint64_t checkpointIntervalBytes = 0;
+	/**
+	 * @brief The total number of bytes written to the stream
+	 */
+	uint64_t bytesWritten = 0;
+	uint64_t lastCheckpointOffset = 0;
+
+	/**
+	 * @brief Optional. Records given fxt::kTimestampNow as a timestamp read it from this clock
+	 *
+	 * The writer also writes an Initialization record with the clock's rate before the first of them, and again after
+	 * every recalibration that changes the rate
+	 *
+	 * @see Clock
+	 */
+	const Clock *clock = nullptr;
+	uint64_t clockGeneration = 0;
+
+	// The stream state that every checkpoint has to repeat
+	uint64_t numTicksPerSecond = 0;
+	ProviderID providerID = 0;
+	bool hasProvider = false;
+	/**
+	 * @brief The last Provider Info record written, so checkpoints can define the provider again
+	 */
+	ProviderID namedProviderID = 0;
+	char providerName[internal::ProviderInfoMetadataRecordFields::kMaxNameLength + 1] = {};
+	bool hasProviderName = false;
 };
 
+/**
+ * @brief Forgets every String and Thread record written so far
+ *
+ * Subsequent records will write new String and Thread records for everything they reference. Use this when the Writer
+ * starts a new stream that has to be readable on its own
+ *
+ * @param writer    The writer to reset
+ */
+void ResetInternTables(Writer *writer);
+
+/**
+ * @brief Writes a checkpoint, after which the stream can be decoded without anything that came before it
+ *
+ * A checkpoint is a Magic Number record, followed by the last Initialization record, the last Provider Info record, and
+ * a Provider Section record if the current provider isn't the one named there. Then the intern tables are reset, so every String and Thread record used after the checkpoint is written again after it.
+ * Readers can find checkpoints with FindNextCheckpoint(), and decode the pieces in between independently.
+ *
+ * This must only be called in between records. Setting Writer::checkpointIntervalBytes calls it automatically
+ *
+ * @param writer    The writer to use
+ * @return          0 on success. Non-zero for failure
+ */
+int WriteCheckpoint(Writer *writer);
+
 /**
  * @brief Adds a Magic Number record to the stream
  *
@@ -144,6 +247,27 @@ int AddProviderEventRecord(Writer *writer, ProviderID providerID, ProviderEventT
  */
 int AddInitializationRecord(Writer *writer, uint64_t numTicksPerSecond);
 
+/**
+ * @brief Swaps fxt::kTimestampNow for a reading of the writer's clock. Other timestamps are left as they are
+ *
+ * Like the Add* calls, this writes an Initialization record with the clock's rate first, if the writer hasn't written
+ * one for the current rate yet. Use it to get the timestamp of an event that will be written later
+ *
+ * @param writer       The writer to use
+ * @param timestamp    The timestamp to resolve
+ * @return             0 on success. FXT_ERR_INVALID_CONFIG if the writer has no clock. Otherwise, the error from
+ *                     writing the Initialization record
+ */
+int ResolveTimestamp(Writer *writer, uint64_t *timestamp);
+
+/**
+ * @brief Writes the record the writer is holding back, if it has one, and clears Writer::pendingRecordFunc
+ *
+ * @param writer    The writer to use
+ * @return          0 on success. Otherwise, the error from writing the record
+ */
+int WritePendingRecord(Writer *writer);
+
 /**
  * @brief Adds a kernel object record to give a human-readable name to a process ID.
  *
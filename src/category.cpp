@@ -0,0 +1,93 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/category.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace fxt {
+
+namespace internal {
+
+// Constant initialized, so it is ready before any registration runs
+std::atomic<uint64_t> gCategoryMask[kMaxCategories / 64] = { { 1 } };
+
+} // End of namespace internal
+
+struct CategoryRegistry {
+	std::mutex mutex;
+	std::unordered_map<std::string, unsigned> bits;
+	unsigned nextBit = 1;
+};
+
+// Categories register themselves during static initialization, so this can't depend on the order of initialization
+static CategoryRegistry *GetCategoryRegistry() {
+	static CategoryRegistry registry;
+	return &registry;
+}
+
+// The registry mutex must be held
+static unsigned RegisterCategoryLocked(CategoryRegistry *registry, const char *name) {
+	const auto found = registry->bits.find(name);
+	if (found != registry->bits.end()) {
+		return found->second;
+	}
+	if (registry->nextBit == kMaxCategories) {
+		return 0;
+	}
+
+	const unsigned bit = registry->nextBit++;
+	internal::gCategoryMask[bit / 64].fetch_or(uint64_t(1) << (bit % 64), std::memory_order_relaxed);
+	registry->bits.emplace(name, bit);
+
+	return bit;
+}
+
+unsigned internal::RegisterCategory(const char *name) {
+	CategoryRegistry *registry = GetCategoryRegistry();
+	std::lock_guard<std::mutex> lock(registry->mutex);
+
+	return RegisterCategoryLocked(registry, name);
+}
+
+int SetCategoryEnabled(const char *category, bool enabled, Writer *writer, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp) {
+	CategoryRegistry *registry = GetCategoryRegistry();
+	{
+		std::lock_guard<std::mutex> lock(registry->mutex);
+
+		const unsigned bit = RegisterCategoryLocked(registry, category);
+		if (bit == 0) {
+			return FXT_ERR_INVALID_CONFIG;
+		}
+
+		const uint64_t mask = uint64_t(1) << (bit % 64);
+		if (enabled) {
+			internal::gCategoryMask[bit / 64].fetch_or(mask, std::memory_order_relaxed);
+		} else {
+			internal::gCategoryMask[bit / 64].fetch_and(~mask, std::memory_order_relaxed);
+		}
+	}
+
+	if (writer == nullptr) {
+		return 0;
+	}
+	return FXT_ADD_INSTANT_EVENT(writer, "fxt", "Category Filter", processID, threadID, timestamp, "category", category, "enabled", enabled);
+}
+
+bool IsCategoryEnabled(const char *category) {
+	CategoryRegistry *registry = GetCategoryRegistry();
+	std::lock_guard<std::mutex> lock(registry->mutex);
+
+	const auto found = registry->bits.find(category);
+	if (found == registry->bits.end()) {
+		return true;
+	}
+	return internal::IsCategoryBitSet(found->second);
+}
+
+} // End of namespace fxt
@@ -0,0 +1,128 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/clock.h"
+
+#include <thread>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#	include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#	include <cpuid.h>
+#endif
+
+namespace fxt {
+
+// The counter has to tick at a constant rate, no matter the frequency scaling or sleep states of the core
+static bool HasConstantRateCycleCounter() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	int regs[4];
+	__cpuid(regs, 0x80000000);
+	if ((unsigned)regs[0] < 0x80000007) {
+		return false;
+	}
+	__cpuid(regs, 0x80000007);
+	return (regs[3] & (1 << 8)) != 0;
+#elif defined(__x86_64__) || defined(__i386__)
+	unsigned eax, ebx, ecx, edx;
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0) {
+		return false;
+	}
+	// Invariant TSC
+	return (edx & (1 << 8)) != 0;
+#elif defined(__aarch64__)
+	// The generic timer always runs at a fixed frequency
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Samples the counter and the monotonic clock as close together as we can
+static void SampleClocks(uint64_t *ticks, uint64_t *ns) {
+	*ns = internal::ReadMonotonicNs();
+	*ticks = internal::ReadCycleCounter();
+}
+
+static uint64_t MeasureTicksPerSecond(const Clock *clock, uint64_t ticks, uint64_t ns) {
+	const uint64_t elapsedNs = ns - clock->baseNs;
+	if (elapsedNs == 0) {
+		return 0;
+	}
+
+	return (uint64_t)((double)(ticks - clock->baseTicks) * 1e9 / (double)elapsedNs + 0.5);
+}
+
+int InitClock(Clock *clock, ClockConfig config) {
+	if (config.calibrationMs == 0) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	clock->config = config;
+	clock->useCycleCounter = config.useCycleCounter && HasConstantRateCycleCounter();
+	if (!clock->useCycleCounter) {
+		clock->ticksPerSecond.store(1000000000, std::memory_order_relaxed);
+		clock->generation.fetch_add(1, std::memory_order_release);
+		return 0;
+	}
+
+	SampleClocks(&clock->baseTicks, &clock->baseNs);
+	// Unsigned arithmetic wraps, so this is the same as subtracting baseTicks
+	clock->tickOffset.store(0 - clock->baseTicks, std::memory_order_relaxed);
+	std::this_thread::sleep_for(std::chrono::milliseconds(config.calibrationMs));
+
+	uint64_t ticks;
+	uint64_t ns;
+	SampleClocks(&ticks, &ns);
+	const uint64_t ticksPerSecond = MeasureTicksPerSecond(clock, ticks, ns);
+	if (ticksPerSecond == 0) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	clock->ticksPerSecond.store(ticksPerSecond, std::memory_order_relaxed);
+	clock->generation.fetch_add(1, std::memory_order_release);
+
+	return 0;
+}
+
+int RecalibrateClock(Clock *clock, bool *recalibrated) {
+	if (recalibrated != nullptr) {
+		*recalibrated = false;
+	}
+	if (!clock->useCycleCounter) {
+		// The monotonic clock is already in nanoseconds
+		return 0;
+	}
+
+	uint64_t ticks;
+	uint64_t ns;
+	SampleClocks(&ticks, &ns);
+	const uint64_t measured = MeasureTicksPerSecond(clock, ticks, ns);
+	if (measured == 0) {
+		return 0;
+	}
+
+	const uint64_t current = clock->ticksPerSecond.load(std::memory_order_relaxed);
+	const uint64_t drift = measured > current ? measured - current : current - measured;
+	if ((double)drift * 1e6 <= (double)current * clock->config.driftTolerancePpm) {
+		return 0;
+	}
+
+	// Rebase, so the timestamp of this moment is the same time in the new rate as in the old one
+	const uint64_t timestamp = ticks + clock->tickOffset.load(std::memory_order_relaxed);
+	const uint64_t rebased = (uint64_t)((double)timestamp * (double)measured / (double)current + 0.5);
+	clock->tickOffset.store(rebased - ticks, std::memory_order_relaxed);
+
+	clock->ticksPerSecond.store(measured, std::memory_order_relaxed);
+	clock->generation.fetch_add(1, std::memory_order_release);
+	if (recalibrated != nullptr) {
+		*recalibrated = true;
+	}
+
+	return 0;
+}
+
+} // End of namespace fxt
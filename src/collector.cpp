@@ -0,0 +1,272 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/collector.h"
+
+#include "fxt/internal/records.h"
+
+#include <string.h>
+
+namespace fxt {
+
+int AddCollectorStream(Collector *collector, ProviderID providerID, const char *providerName, unsigned *streamIndex) {
+	if (providerName == nullptr) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	CollectorStream stream;
+	stream.providerID = providerID;
+	stream.providerName = providerName;
+	stream.announced = false;
+	stream.recordsCollected = 0;
+
+	*streamIndex = (unsigned)collector->streams.size();
+	collector->streams.push_back(stream);
+
+	return 0;
+}
+
+// Makes sure the records that follow are attributed to the stream's provider
+static int SwitchToStream(Collector *collector, unsigned streamIndex) {
+	int ret;
+	if (!collector->wroteMagic) {
+		ret = WriteMagicNumberRecord(&collector->writer);
+		if (ret != 0) {
+			return ret;
+		}
+		collector->wroteMagic = true;
+	}
+
+	if (collector->currentStream == (int)streamIndex) {
+		return 0;
+	}
+
+	CollectorStream *stream = &collector->streams[streamIndex];
+	if (!stream->announced) {
+		ret = AddProviderInfoRecord(&collector->writer, stream->providerID, stream->providerName.c_str());
+		if (ret != 0) {
+			return ret;
+		}
+		stream->announced = true;
+	}
+
+	// Provider Info also starts a section. But it doesn't hurt to be explicit
+	ret = AddProviderSectionRecord(&collector->writer, stream->providerID);
+	if (ret != 0) {
+		return ret;
+	}
+	collector->currentStream = (int)streamIndex;
+
+	return 0;
+}
+
+// Magic Number records, and the provider records a producer writes about itself. The collector writes its own, and
+// a producer's provider record would take the following records out of the section the collector put them in
+static bool IsDroppedRecord(uint64_t header) {
+	using namespace internal;
+
+	if (header == kMagicNumberRecord) {
+		return true;
+	}
+	if (RecordFields::Type::Get<RecordType>(header) != RecordType::Metadata) {
+		return false;
+	}
+
+	const MetadataType metadataType = MetadataRecordFields::MetadataType::Get<MetadataType>(header);
+	return metadataType == MetadataType::ProviderInfo || metadataType == MetadataType::ProviderSection;
+}
+
+// The time the event was written at. Duration Complete events are written when the span ends, stamped with its begin.
+// So they are merged by their end timestamp, which keeps each stream in order
+static uint64_t GetMergeTimestamp(const uint8_t *record, size_t recordSize, uint64_t header) {
+	uint64_t timestamp;
+	if (internal::EventRecordFields::EventType::Get<internal::EventType>(header) == internal::EventType::DurationComplete) {
+		memcpy(&timestamp, record + recordSize - sizeof(uint64_t), sizeof(timestamp));
+	} else {
+		memcpy(&timestamp, record + sizeof(uint64_t), sizeof(timestamp));
+	}
+
+	return timestamp;
+}
+
+// Queues a record of the stream for the timestamp merge
+static void QueueRecord(Collector *collector, unsigned streamIndex, const uint8_t *record, size_t recordSize, uint64_t header) {
+	CollectorStream *stream = &collector->streams[streamIndex];
+	stream->pendingData.insert(stream->pendingData.end(), record, record + recordSize);
+
+	// Only events are ordered. Everything else just goes out with the next event of its stream
+	if (internal::RecordFields::Type::Get<internal::RecordType>(header) != internal::RecordType::Event) {
+		return;
+	}
+
+	const uint64_t timestamp = GetMergeTimestamp(record, recordSize, header);
+
+	CollectorPendingEvent event;
+	event.timestamp = timestamp;
+	event.size = stream->pendingData.size() - stream->pendingStart - stream->pendingEventBytes;
+	stream->pendingEventBytes += event.size;
+
+	if (stream->pendingEvents.empty()) {
+		collector->mergeHeap.emplace(timestamp, streamIndex);
+	}
+	stream->pendingEvents.push_back(event);
+
+	if (timestamp < collector->lastWrittenTimestamp) {
+		++collector->lateRecords;
+	}
+	if (timestamp > collector->newestTimestamp) {
+		collector->newestTimestamp = timestamp;
+	}
+}
+
+static int WritePendingBytes(Collector *collector, unsigned streamIndex, size_t size) {
+	int ret = SwitchToStream(collector, streamIndex);
+	if (ret != 0) {
+		return ret;
+	}
+
+	CollectorStream *stream = &collector->streams[streamIndex];
+	ret = collector->writer.writeFunc(collector->writer.userContext, stream->pendingData.data() + stream->pendingStart, size);
+	if (ret != 0) {
+		return ret;
+	}
+	stream->pendingStart += size;
+
+	// Shift the rest down once the written part is the bigger half, so the buffer doesn't grow without bound
+	if (stream->pendingStart == stream->pendingData.size()) {
+		stream->pendingData.clear();
+		stream->pendingStart = 0;
+	} else if (stream->pendingStart > stream->pendingData.size() / 2) {
+		stream->pendingData.erase(stream->pendingData.begin(), stream->pendingData.begin() + (ptrdiff_t)stream->pendingStart);
+		stream->pendingStart = 0;
+	}
+
+	return 0;
+}
+
+// Pops stream heads off the heap, oldest first, and writes them out
+// Stops at the first head that is still inside the reorder window, unless everything is being flushed
+static int WritePendingEvents(Collector *collector, bool flushAll) {
+	while (!collector->mergeHeap.empty()) {
+		const uint64_t timestamp = collector->mergeHeap.top().first;
+		const unsigned streamIndex = collector->mergeHeap.top().second;
+		if (!flushAll && collector->newestTimestamp - timestamp < collector->reorderWindow) {
+			break;
+		}
+
+		CollectorStream *stream = &collector->streams[streamIndex];
+		const CollectorPendingEvent event = stream->pendingEvents.front();
+		const int ret = WritePendingBytes(collector, streamIndex, event.size);
+		if (ret != 0) {
+			return ret;
+		}
+
+		collector->mergeHeap.pop();
+		stream->pendingEvents.pop_front();
+		stream->pendingEventBytes -= event.size;
+		if (!stream->pendingEvents.empty()) {
+			collector->mergeHeap.emplace(stream->pendingEvents.front().timestamp, streamIndex);
+		}
+
+		if (timestamp > collector->lastWrittenTimestamp) {
+			collector->lastWrittenTimestamp = timestamp;
+		}
+	}
+
+	return 0;
+}
+
+int CollectRecords(Collector *collector, unsigned streamIndex, const void *records, size_t len) {
+	if (streamIndex >= collector->streams.size()) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	int ret;
+	if (!collector->orderByTimestamp) {
+		ret = SwitchToStream(collector, streamIndex);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	CollectorStream *stream = &collector->streams[streamIndex];
+	const uint8_t *bytes = (const uint8_t *)records;
+
+	// Copy runs of records in a single write. Only the magic numbers and provider records need to be cut out
+	size_t runStart = 0;
+	size_t offset = 0;
+	while (offset < len) {
+		if (len - offset < sizeof(uint64_t)) {
+			return FXT_ERR_INVALID_TRACE;
+		}
+
+		uint64_t header;
+		memcpy(&header, bytes + offset, sizeof(header));
+		const uint64_t recordSize = internal::WordsToBytes(internal::GetRecordSizeInWords(header));
+		if (recordSize == 0 || recordSize > len - offset) {
+			return FXT_ERR_INVALID_TRACE;
+		}
+
+		if (IsDroppedRecord(header)) {
+			if (offset > runStart && !collector->orderByTimestamp) {
+				ret = collector->writer.writeFunc(collector->writer.userContext, bytes + runStart, offset - runStart);
+				if (ret != 0) {
+					return ret;
+				}
+			}
+			runStart = offset + recordSize;
+		} else {
+			if (collector->orderByTimestamp) {
+				QueueRecord(collector, streamIndex, bytes + offset, recordSize, header);
+			}
+			++stream->recordsCollected;
+		}
+
+		offset += recordSize;
+	}
+
+	if (collector->orderByTimestamp) {
+		return WritePendingEvents(collector, false);
+	}
+
+	if (offset > runStart) {
+		ret = collector->writer.writeFunc(collector->writer.userContext, bytes + runStart, offset - runStart);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+int FlushCollector(Collector *collector) {
+	if (!collector->orderByTimestamp) {
+		return 0;
+	}
+
+	int ret = WritePendingEvents(collector, true);
+	if (ret != 0) {
+		return ret;
+	}
+
+	// Whatever is left came after the last event of its stream
+	for (unsigned i = 0; i < (unsigned)collector->streams.size(); ++i) {
+		const CollectorStream *stream = &collector->streams[i];
+		if (stream->pendingData.size() > stream->pendingStart) {
+			ret = WritePendingBytes(collector, i, stream->pendingData.size() - stream->pendingStart);
+			if (ret != 0) {
+				return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+} // End of namespace fxt
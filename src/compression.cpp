@@ -0,0 +1,210 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/compression.h"
+
+#include "lz4.h"
+
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace fxt {
+
+namespace internal {
+
+void InitCompressedFrameHeader(CompressedFrameHeader *header, CompressionCodec codec, const void *data, size_t len, size_t payloadSize) {
+	memset(header, 0, sizeof(*header));
+	header->magic = kCompressedFrameMagic;
+	header->codec = codec;
+	header->rawSize = (uint32_t)len;
+	header->payloadSize = (uint32_t)payloadSize;
+	header->rawChecksum = XXH3_64bits(data, len);
+}
+
+} // End of namespace internal
+
+size_t GetMaxCompressedFrameSize(size_t len) {
+	return sizeof(internal::CompressedFrameHeader) + lz4::CompressBound(len);
+}
+
+int CompressFrame(const void *data, size_t len, void *frame, size_t frameCapacity, size_t *frameSize) {
+	if (len > lz4::kMaxInputSize) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (frameCapacity < sizeof(internal::CompressedFrameHeader)) {
+		return FXT_ERR_OUT_OF_MEMORY;
+	}
+
+	uint8_t *payload = (uint8_t *)frame + sizeof(internal::CompressedFrameHeader);
+	const size_t payloadCapacity = frameCapacity - sizeof(internal::CompressedFrameHeader);
+
+	uint32_t hashTable[lz4::kHashTableSize];
+	size_t payloadSize = lz4::CompressBlock((const uint8_t *)data, len, payload, payloadCapacity, hashTable);
+
+	CompressionCodec codec = CompressionCodec::LZ4;
+	if (payloadSize == 0 || payloadSize >= len) {
+		// Not worth it. Store the data as-is
+		if (len > payloadCapacity) {
+			return FXT_ERR_OUT_OF_MEMORY;
+		}
+		memcpy(payload, data, len);
+		payloadSize = len;
+		codec = CompressionCodec::Stored;
+	}
+
+	internal::CompressedFrameHeader header;
+	internal::InitCompressedFrameHeader(&header, codec, data, len, payloadSize);
+	memcpy(frame, &header, sizeof(header));
+
+	*frameSize = sizeof(header) + payloadSize;
+	return 0;
+}
+
+// Reads exactly len bytes. Returns 1 at a clean end of stream
+static int ReadExactly(DecompressingReader *reader, void *data, size_t len) {
+	uint8_t *dst = (uint8_t *)data;
+	size_t total = 0;
+	while (total < len) {
+		size_t bytesRead = 0;
+		const int ret = reader->readFunc(reader->userContext, dst + total, len - total, &bytesRead);
+		if (ret != 0) {
+			return ret;
+		}
+		if (bytesRead == 0) {
+			return total == 0 ? 1 : FXT_ERR_INVALID_TRACE;
+		}
+		total += bytesRead;
+	}
+
+	return 0;
+}
+
+// Decompresses the next frame into reader->raw. Returns 1 at the end of the stream
+static int ReadNextFrame(DecompressingReader *reader) {
+	internal::CompressedFrameHeader header;
+	int ret = ReadExactly(reader, &header, sizeof(header));
+	if (ret != 0) {
+		return ret;
+	}
+	if (header.magic != internal::kCompressedFrameMagic || header.rawSize > lz4::kMaxInputSize || header.payloadSize > lz4::CompressBound(header.rawSize)) {
+		return FXT_ERR_INVALID_TRACE;
+	}
+	// A corrupt size would otherwise have us allocate up to 2 GB before reading any of the payload
+	if (header.rawSize > reader->maxFrameSize) {
+		return FXT_ERR_INVALID_TRACE;
+	}
+
+	reader->raw.resize(header.rawSize);
+	reader->rawOffset = 0;
+
+	switch (header.codec) {
+	case CompressionCodec::Stored:
+		if (header.payloadSize != header.rawSize) {
+			return FXT_ERR_INVALID_TRACE;
+		}
+		ret = ReadExactly(reader, reader->raw.data(), header.rawSize);
+		break;
+	case CompressionCodec::LZ4: {
+		reader->payload.resize(header.payloadSize);
+		ret = ReadExactly(reader, reader->payload.data(), header.payloadSize);
+		if (ret != 0) {
+			break;
+		}
+		const int64_t rawSize = lz4::DecompressBlock(reader->payload.data(), header.payloadSize, reader->raw.data(), header.rawSize);
+		if (rawSize != (int64_t)header.rawSize) {
+			return FXT_ERR_INVALID_TRACE;
+		}
+		break;
+	}
+	default:
+		return FXT_ERR_INVALID_TRACE;
+	}
+
+	if (ret != 0) {
+		// The stream ended in the middle of the frame
+		return ret == 1 ? FXT_ERR_INVALID_TRACE : ret;
+	}
+	if (XXH3_64bits(reader->raw.data(), reader->raw.size()) != header.rawChecksum) {
+		return FXT_ERR_INVALID_TRACE;
+	}
+
+	return 0;
+}
+
+int ReadDecompressed(DecompressingReader *reader, void *data, size_t len, size_t *bytesRead) {
+	uint8_t *dst = (uint8_t *)data;
+	*bytesRead = 0;
+
+	while (*bytesRead < len) {
+		if (reader->rawOffset == reader->raw.size()) {
+			const int ret = ReadNextFrame(reader);
+			if (ret == 1) {
+				break;
+			}
+			if (ret != 0) {
+				return ret;
+			}
+			continue;
+		}
+
+		const size_t available = reader->raw.size() - reader->rawOffset;
+		const size_t toCopy = len - *bytesRead < available ? len - *bytesRead : available;
+		memcpy(dst + *bytesRead, reader->raw.data() + reader->rawOffset, toCopy);
+		reader->rawOffset += toCopy;
+		*bytesRead += toCopy;
+	}
+
+	return 0;
+}
+
+static int ReadFromFile(void *userContext, void *data, size_t len, size_t *bytesRead) {
+	FILE *file = (FILE *)userContext;
+	*bytesRead = fread(data, 1, len, file);
+	if (*bytesRead < len && ferror(file)) {
+		return FXT_ERR_READ_FROM_STREAM_FAILED;
+	}
+	return 0;
+}
+
+int DecompressTraceFile(const char *inputPath, const char *outputPath) {
+	FILE *input = fopen(inputPath, "rb");
+	if (input == nullptr) {
+		return FXT_ERR_OPEN_FAILED;
+	}
+	FILE *output = fopen(outputPath, "wb");
+	if (output == nullptr) {
+		fclose(input);
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	DecompressingReader reader(input, ReadFromFile);
+	int ret = 0;
+	uint8_t chunk[64 * 1024];
+	while (true) {
+		size_t bytesRead;
+		ret = ReadDecompressed(&reader, chunk, sizeof(chunk), &bytesRead);
+		// Keep everything before a truncated / corrupt frame
+		if (fwrite(chunk, 1, bytesRead, output) != bytesRead) {
+			ret = FXT_ERR_WRITE_TO_STREAM_FAILED;
+			break;
+		}
+		if (ret != 0 || bytesRead == 0) {
+			break;
+		}
+	}
+
+	fclose(input);
+	if (fclose(output) != 0 && ret == 0) {
+		ret = FXT_ERR_WRITE_TO_STREAM_FAILED;
+	}
+
+	return ret;
+}
+
+} // End of namespace fxt
@@ -0,0 +1,166 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/counter_aggregator.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace fxt {
+
+static void AggregatorThreadMain(CounterAggregator *aggregator);
+
+int InitCounterAggregator(CounterAggregator *aggregator, Writer *writer, CounterAggregatorConfig config) {
+	if (writer == nullptr || aggregator->writer != nullptr) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	aggregator->config = config;
+	aggregator->writer = writer;
+	aggregator->error = 0;
+	aggregator->shutdown = false;
+
+	if (config.intervalMs != 0) {
+		aggregator->thread = std::thread(AggregatorThreadMain, aggregator);
+	}
+
+	return 0;
+}
+
+int RegisterAggregatedCounter(CounterAggregator *aggregator, const char *category, const char *name, uint64_t counterID, bool trackExtremes, AggregatedCounter **counter) {
+	std::unique_ptr<AggregatedCounter> newCounter(new AggregatedCounter());
+	newCounter->category = category;
+	newCounter->name = name;
+	newCounter->counterID = counterID;
+	newCounter->trackExtremes = trackExtremes;
+
+	std::lock_guard<std::mutex> lock(aggregator->mutex);
+	if (aggregator->writer == nullptr) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	*counter = newCounter.get();
+	aggregator->counters.push_back(std::move(newCounter));
+
+	return 0;
+}
+
+int RegisterAggregatedHistogram(CounterAggregator *aggregator, LatencyHistogram *histogram) {
+	std::lock_guard<std::mutex> lock(aggregator->mutex);
+	if (aggregator->writer == nullptr) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	aggregator->histograms.push_back(histogram);
+
+	return 0;
+}
+
+int RegisterAggregatedSampler(CounterAggregator *aggregator, Sampler *sampler) {
+	std::lock_guard<std::mutex> lock(aggregator->mutex);
+	if (aggregator->writer == nullptr) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	aggregator->samplers.push_back(sampler);
+
+	return 0;
+}
+
+// The caller must hold the aggregator's lock
+static int WriteCounters(CounterAggregator *aggregator, uint64_t timestamp) {
+	for (const auto &counter : aggregator->counters) {
+		const int64_t last = counter->value.load(std::memory_order_relaxed);
+		const int64_t sum = last - counter->reportedValue;
+		counter->reportedValue = last;
+
+		int ret;
+		if (counter->trackExtremes) {
+			// The next interval starts from the value we report, so its min / max include it
+			const int64_t min = std::min(counter->min.exchange(last, std::memory_order_relaxed), last);
+			const int64_t max = std::max(counter->max.exchange(last, std::memory_order_relaxed), last);
+			ret = FXT_ADD_COUNTER_EVENT(aggregator->writer, counter->category.c_str(), counter->name.c_str(), aggregator->config.processID, aggregator->config.threadID, timestamp, counter->counterID, "min", min, "max", max, "last", last, "sum", sum);
+		} else {
+			ret = FXT_ADD_COUNTER_EVENT(aggregator->writer, counter->category.c_str(), counter->name.c_str(), aggregator->config.processID, aggregator->config.threadID, timestamp, counter->counterID, "last", last, "sum", sum);
+		}
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	for (LatencyHistogram *histogram : aggregator->histograms) {
+		const int ret = AddHistogramCounterEvent(aggregator->writer, histogram, aggregator->config.processID, aggregator->config.threadID, timestamp);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	for (Sampler *sampler : aggregator->samplers) {
+		const int ret = AddSamplerTotalCounterEvent(aggregator->writer, sampler, aggregator->config.processID, aggregator->config.threadID, timestamp);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+int FlushCounterAggregator(CounterAggregator *aggregator, uint64_t timestamp) {
+	std::lock_guard<std::mutex> lock(aggregator->mutex);
+	if (aggregator->writer == nullptr) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	return WriteCounters(aggregator, timestamp);
+}
+
+CounterAggregator::~CounterAggregator() {
+	CloseCounterAggregator(this);
+}
+
+int CloseCounterAggregator(CounterAggregator *aggregator) {
+	{
+		std::lock_guard<std::mutex> lock(aggregator->mutex);
+		if (aggregator->writer == nullptr || aggregator->shutdown) {
+			return aggregator->error;
+		}
+		aggregator->shutdown = true;
+	}
+	aggregator->condition.notify_all();
+	if (aggregator->thread.joinable()) {
+		aggregator->thread.join();
+	}
+
+	std::lock_guard<std::mutex> lock(aggregator->mutex);
+	const int ret = WriteCounters(aggregator, kTimestampNow);
+	if (ret != 0 && aggregator->error == 0) {
+		aggregator->error = ret;
+	}
+	aggregator->counters.clear();
+	aggregator->histograms.clear();
+	aggregator->samplers.clear();
+	aggregator->writer = nullptr;
+
+	return aggregator->error;
+}
+
+static void AggregatorThreadMain(CounterAggregator *aggregator) {
+	const auto interval = std::chrono::milliseconds(aggregator->config.intervalMs);
+	auto nextReport = std::chrono::steady_clock::now() + interval;
+
+	std::unique_lock<std::mutex> lock(aggregator->mutex);
+	while (true) {
+		// Waiting until a deadline, rather than for an interval, keeps the cadence from drifting by the time spent writing
+		if (aggregator->condition.wait_until(lock, nextReport, [aggregator]() { return aggregator->shutdown; })) {
+			break;
+		}
+		nextReport += interval;
+
+		const int ret = WriteCounters(aggregator, kTimestampNow);
+		if (ret != 0 && aggregator->error == 0) {
+			// Only keep the first error. We keep going, since a later write may still succeed
+			aggregator->error = ret;
+		}
+	}
+}
+
+} // End of namespace fxt
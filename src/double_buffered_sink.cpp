@@ -0,0 +1,643 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/double_buffered_sink.h"
+
+#include "fxt/compression.h"
+#include "fxt/internal/records.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#	include <io.h>
+#else
+#	include <time.h>
+#	include <unistd.h>
+#endif
+
+#include <new>
+
+namespace fxt {
+
+using internal::SinkBuffer;
+using internal::SinkBufferState;
+
+enum class HandOffReason {
+	Full,
+	Timer,
+	Flush,
+};
+
+// The values of DoubleBufferedSink::activeOwner
+static constexpr uint32_t kActiveOwnerNone = 0;
+static constexpr uint32_t kActiveOwnerProducer = 1;
+static constexpr uint32_t kActiveOwnerFlushThread = 2;
+
+static void FlushThreadMain(DoubleBufferedSink *sink);
+
+static uint64_t ElapsedNs(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+}
+
+static int WriteAllToFd(int fd, const uint8_t *data, size_t len) {
+	while (len > 0) {
+#if defined(_WIN32)
+		const unsigned chunk = len > INT_MAX ? INT_MAX : (unsigned)len;
+		const int written = _write(fd, data, chunk);
+#else
+		const ssize_t written = write(fd, data, len);
+#endif
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return FXT_ERR_WRITE_TO_STREAM_FAILED;
+		}
+
+		data += written;
+		len -= (size_t)written;
+	}
+
+	return 0;
+}
+
+static void FreeBuffers(DoubleBufferedSink *sink) {
+	if (sink->buffers == nullptr) {
+		return;
+	}
+
+	for (unsigned i = 0; i < sink->config.numBuffers; ++i) {
+		if (sink->config.pool == nullptr) {
+			internal::FreeOnNumaNode(sink->buffers[i].data, sink->config.bufferSize, sink->numaNode);
+		} else if (sink->buffers[i].data != nullptr) {
+			ReleasePage(sink->config.pool, sink->buffers[i].data);
+		}
+	}
+	delete[] sink->buffers;
+	internal::FreeOnNumaNode(sink->frame, sink->frameCapacity, sink->numaNode);
+
+	sink->buffers = nullptr;
+	sink->active = nullptr;
+	sink->frame = nullptr;
+	sink->frameCapacity = 0;
+}
+
+// Must be called with the sink mutex held
+static SinkBuffer *FindFreeBuffer(DoubleBufferedSink *sink) {
+	for (unsigned i = 0; i < sink->config.numBuffers; ++i) {
+		if (sink->buffers[i].state.load(std::memory_order_relaxed) == SinkBufferState::Free) {
+			return &sink->buffers[i];
+		}
+	}
+
+	return nullptr;
+}
+
+// Must be called with the sink mutex held
+static SinkBuffer *FindOldestQueuedBuffer(DoubleBufferedSink *sink) {
+	SinkBuffer *oldest = nullptr;
+	for (unsigned i = 0; i < sink->config.numBuffers; ++i) {
+		SinkBuffer *buffer = &sink->buffers[i];
+		if (buffer->state.load(std::memory_order_relaxed) != SinkBufferState::Queued) {
+			continue;
+		}
+		if (oldest == nullptr || buffer->sequence < oldest->sequence) {
+			oldest = buffer;
+		}
+	}
+
+	return oldest;
+}
+
+// Must be called with the sink mutex held
+static void QueueActiveBuffer(DoubleBufferedSink *sink, HandOffReason reason) {
+	SinkBuffer *buffer = sink->active;
+	buffer->sequence = sink->nextSequence++;
+	buffer->state.store(SinkBufferState::Queued, std::memory_order_release);
+
+	++sink->queuedBuffers;
+	if (sink->queuedBuffers > sink->metrics.maxQueuedBuffers) {
+		sink->metrics.maxQueuedBuffers = sink->queuedBuffers;
+	}
+	if (reason == HandOffReason::Full) {
+		++sink->metrics.fullSwaps;
+	} else if (reason == HandOffReason::Timer) {
+		++sink->metrics.timerSwaps;
+	}
+
+	sink->active = nullptr;
+	sink->lastSwapTime = std::chrono::steady_clock::now();
+	sink->swapRequested.store(false, std::memory_order_relaxed);
+	sink->flushCondition.notify_one();
+}
+
+// Queues the active buffer for flushing, and makes a free buffer active
+// This may block if all the other buffers are still waiting to be flushed
+static void HandOffActiveBuffer(DoubleBufferedSink *sink, HandOffReason reason) {
+	std::unique_lock<std::mutex> lock(sink->mutex);
+
+	QueueActiveBuffer(sink, reason);
+
+	SinkBuffer *next = FindFreeBuffer(sink);
+	if (next == nullptr) {
+		const auto stallStart = std::chrono::steady_clock::now();
+		sink->freeCondition.wait(lock, [&]() {
+			next = FindFreeBuffer(sink);
+			return next != nullptr;
+		});
+
+		++sink->metrics.producerStalls;
+		sink->metrics.producerStallNs += ElapsedNs(stallStart, std::chrono::steady_clock::now());
+	}
+
+	next->used = 0;
+	next->state.store(SinkBufferState::Active, std::memory_order_relaxed);
+	sink->active = next;
+}
+
+int InitDoubleBufferedSink(DoubleBufferedSink *sink, int fd, DoubleBufferedSinkConfig config) {
+	if (config.numBuffers < 2 || config.bufferSize == 0 || fd < 0) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (sink->buffers != nullptr) {
+		// Already initialized
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	// Frames store their sizes in 32 bits
+	if (config.compress && config.bufferSize > INT32_MAX / 2) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	int numaNode;
+	if (internal::ResolveNumaNode(config.numaNode, &numaNode) != 0) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	if (config.pool != nullptr) {
+		if (config.pool->maxPages == 0 || config.flushIntervalMs == 0) {
+			return FXT_ERR_INVALID_CONFIG;
+		}
+		config.bufferSize = config.pool->config.pageSize;
+	}
+
+	sink->config = config;
+	sink->numaNode = numaNode;
+	sink->buffers = new (std::nothrow) SinkBuffer[config.numBuffers];
+	if (sink->buffers == nullptr) {
+		return FXT_ERR_OUT_OF_MEMORY;
+	}
+	// Pooled buffers get their pages when they are first written to
+	for (unsigned i = 0; i < config.numBuffers && config.pool == nullptr; ++i) {
+		sink->buffers[i].data = internal::AllocateOnNumaNode(config.bufferSize, numaNode);
+		if (sink->buffers[i].data == nullptr) {
+			FreeBuffers(sink);
+			return FXT_ERR_OUT_OF_MEMORY;
+		}
+	}
+	if (config.compress) {
+		sink->frameCapacity = GetMaxCompressedFrameSize(config.bufferSize);
+		sink->frame = internal::AllocateOnNumaNode(sink->frameCapacity, numaNode);
+		if (sink->frame == nullptr) {
+			FreeBuffers(sink);
+			return FXT_ERR_OUT_OF_MEMORY;
+		}
+	}
+
+	sink->fd = fd;
+	sink->active = &sink->buffers[0];
+	sink->active->state.store(SinkBufferState::Active, std::memory_order_relaxed);
+	sink->nextSequence = 0;
+	sink->queuedBuffers = 0;
+	sink->swapRequested.store(false, std::memory_order_relaxed);
+	sink->flushError.store(0, std::memory_order_relaxed);
+	sink->emergency.store(false, std::memory_order_relaxed);
+	sink->activeOwner.store(kActiveOwnerNone, std::memory_order_relaxed);
+	sink->recordBytesLeft = 0;
+	sink->partialHeaderBytes = 0;
+	sink->shutdown = false;
+	sink->lastSwapTime = std::chrono::steady_clock::now();
+	sink->metrics = {};
+
+	sink->flushThread = std::thread(FlushThreadMain, sink);
+
+	return 0;
+}
+
+// The flush thread can take the active buffer away from an idle producer. So the producer has to claim it before it
+// starts a record, and hold it until the record is complete
+static void ClaimActiveBuffer(DoubleBufferedSink *sink) {
+	uint32_t expected = kActiveOwnerNone;
+	while (!sink->activeOwner.compare_exchange_weak(expected, kActiveOwnerProducer, std::memory_order_acquire)) {
+		expected = kActiveOwnerNone;
+		std::this_thread::yield();
+	}
+}
+
+static void ReleaseActiveBuffer(DoubleBufferedSink *sink) {
+	sink->activeOwner.store(kActiveOwnerNone, std::memory_order_release);
+}
+
+static int WriteToActiveBuffer(DoubleBufferedSink *sink, const void *data, size_t len) {
+	const int flushError = sink->flushError.load(std::memory_order_relaxed);
+	if (flushError != 0) {
+		return flushError;
+	}
+	if (sink->active == nullptr || sink->emergency.load(std::memory_order_relaxed)) {
+		return FXT_ERR_SINK_CLOSED;
+	}
+
+	if (sink->swapRequested.load(std::memory_order_relaxed)) {
+		if (sink->active->used > 0) {
+			HandOffActiveBuffer(sink, HandOffReason::Timer);
+		} else {
+			sink->swapRequested.store(false, std::memory_order_relaxed);
+		}
+	}
+
+	const uint8_t *src = (const uint8_t *)data;
+	const size_t bufferSize = sink->config.bufferSize;
+	while (len > 0) {
+		SinkBuffer *buffer = sink->active;
+		if (buffer->data == nullptr) {
+			const int ret = AcquirePage(sink->config.pool, &buffer->data);
+			if (ret != 0) {
+				// Part of the record may already be queued, so anything written after it would be garbage. Stop here,
+				// and leave a trace that is only truncated
+				int expected = 0;
+				sink->flushError.compare_exchange_strong(expected, ret, std::memory_order_relaxed);
+				return ret;
+			}
+		}
+
+		const size_t space = bufferSize - buffer->used;
+		const size_t toCopy = len < space ? len : space;
+		memcpy(buffer->data + buffer->used, src, toCopy);
+		buffer->used += toCopy;
+		src += toCopy;
+		len -= toCopy;
+
+		if (buffer->used == bufferSize) {
+			HandOffActiveBuffer(sink, HandOffReason::Full);
+		}
+	}
+
+	return 0;
+}
+
+// Follows the record headers through the written data
+// Returns true if the data ends exactly at the end of a record
+static bool TrackRecordBoundaries(DoubleBufferedSink *sink, const void *data, size_t len) {
+	// Most writes are a single word in the middle of a record
+	if (len <= sink->recordBytesLeft) {
+		sink->recordBytesLeft -= len;
+		return sink->recordBytesLeft == 0;
+	}
+
+	const uint8_t *src = (const uint8_t *)data;
+	while (len > 0) {
+		if (sink->recordBytesLeft > 0) {
+			const size_t toSkip = len < sink->recordBytesLeft ? len : (size_t)sink->recordBytesLeft;
+			sink->recordBytesLeft -= toSkip;
+			src += toSkip;
+			len -= toSkip;
+			continue;
+		}
+
+		// The header itself may be split across writes
+		const size_t wanted = sizeof(sink->partialHeader) - sink->partialHeaderBytes;
+		const size_t toCopy = len < wanted ? len : wanted;
+		memcpy((uint8_t *)&sink->partialHeader + sink->partialHeaderBytes, src, toCopy);
+		sink->partialHeaderBytes += toCopy;
+		src += toCopy;
+		len -= toCopy;
+		if (sink->partialHeaderBytes < sizeof(sink->partialHeader)) {
+			break;
+		}
+
+		sink->partialHeaderBytes = 0;
+		const uint64_t recordSize = internal::WordsToBytes(internal::GetRecordSizeInWords(sink->partialHeader));
+		// An invalid header is treated as a one word record, so the flush thread can still take the buffer
+		sink->recordBytesLeft = recordSize > sizeof(sink->partialHeader) ? recordSize - sizeof(sink->partialHeader) : 0;
+	}
+
+	return sink->recordBytesLeft == 0 && sink->partialHeaderBytes == 0;
+}
+
+int WriteToDoubleBufferedSink(void *userContext, const void *data, size_t len) {
+	DoubleBufferedSink *sink = (DoubleBufferedSink *)userContext;
+
+	// Only the producer ever sets kActiveOwnerProducer, so it can check its own claim without synchronization
+	if (sink->activeOwner.load(std::memory_order_relaxed) != kActiveOwnerProducer) {
+		ClaimActiveBuffer(sink);
+	}
+	const int ret = WriteToActiveBuffer(sink, data, len);
+	const bool recordComplete = TrackRecordBoundaries(sink, data, len);
+	if (recordComplete || ret != 0) {
+		ReleaseActiveBuffer(sink);
+	}
+
+	return ret;
+}
+
+int FlushAndWait(DoubleBufferedSink *sink) {
+	if (sink->emergency.load(std::memory_order_acquire)) {
+		// The flush thread has stopped, so nothing would ever be flushed
+		return sink->flushError.load(std::memory_order_relaxed);
+	}
+
+	// The producer may have stopped part way through a record, in which case it still holds the claim
+	if (sink->activeOwner.load(std::memory_order_relaxed) != kActiveOwnerProducer) {
+		ClaimActiveBuffer(sink);
+	}
+	if (sink->active != nullptr && sink->active->used > 0) {
+		HandOffActiveBuffer(sink, HandOffReason::Flush);
+	}
+	ReleaseActiveBuffer(sink);
+
+	std::unique_lock<std::mutex> lock(sink->mutex);
+	sink->freeCondition.wait(lock, [&]() {
+		return sink->queuedBuffers == 0;
+	});
+
+	return sink->flushError.load(std::memory_order_relaxed);
+}
+
+int CloseDoubleBufferedSink(DoubleBufferedSink *sink) {
+	if (sink->buffers == nullptr) {
+		return sink->flushError.load(std::memory_order_relaxed);
+	}
+
+	const int ret = FlushAndWait(sink);
+
+	{
+		std::lock_guard<std::mutex> lock(sink->mutex);
+		sink->shutdown = true;
+	}
+	sink->flushCondition.notify_all();
+	if (sink->flushThread.joinable()) {
+		sink->flushThread.join();
+	}
+
+	FreeBuffers(sink);
+
+	return ret;
+}
+
+// Writes a buffer from EmergencyFlush(). Compressed sinks get a stored frame, so we don't spend time compressing
+static int EmergencyWriteBuffer(DoubleBufferedSink *sink, SinkBuffer *buffer) {
+	if (sink->config.compress) {
+		internal::CompressedFrameHeader header;
+		internal::InitCompressedFrameHeader(&header, CompressionCodec::Stored, buffer->data, buffer->used, buffer->used);
+		const int ret = WriteAllToFd(sink->fd, (const uint8_t *)&header, sizeof(header));
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return WriteAllToFd(sink->fd, buffer->data, buffer->used);
+}
+
+// Sleeps for a millisecond, in an async-signal-safe way
+static void EmergencySleep() {
+#if defined(_WIN32)
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#else
+	struct timespec duration = { 0, 1000 * 1000 };
+	nanosleep(&duration, nullptr);
+#endif
+}
+
+static bool IsAnyBufferFlushing(DoubleBufferedSink *sink) {
+	for (unsigned i = 0; i < sink->config.numBuffers; ++i) {
+		if (sink->buffers[i].state.load() == SinkBufferState::Flushing) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int EmergencyFlush(DoubleBufferedSink *sink, uint32_t timeoutMs) {
+	if (sink->buffers == nullptr) {
+		return FXT_ERR_SINK_CLOSED;
+	}
+	bool expectedEmergency = false;
+	if (!sink->emergency.compare_exchange_strong(expectedEmergency, true)) {
+		// Someone else already flushed
+		return FXT_ERR_SINK_CLOSED;
+	}
+
+	// Signal handlers must not clobber errno
+	const int savedErrno = errno;
+
+	int ret = 0;
+	uint32_t waitedMs = 0;
+	while (true) {
+		// Wait for the flush thread to finish the buffer it's currently writing, so the file stays in order
+		// It may also be in the middle of taking the active buffer from the producer
+		if (IsAnyBufferFlushing(sink) || sink->activeOwner.load() == kActiveOwnerFlushThread) {
+			if (waitedMs >= timeoutMs) {
+				errno = savedErrno;
+				return FXT_ERR_FLUSH_TIMEOUT;
+			}
+			EmergencySleep();
+			++waitedMs;
+			continue;
+		}
+
+		// We can't use FindOldestQueuedBuffer(), since we don't hold the lock
+		SinkBuffer *oldest = nullptr;
+		for (unsigned i = 0; i < sink->config.numBuffers; ++i) {
+			SinkBuffer *buffer = &sink->buffers[i];
+			if (buffer->state.load() == SinkBufferState::Queued && (oldest == nullptr || buffer->sequence < oldest->sequence)) {
+				oldest = buffer;
+			}
+		}
+		if (oldest == nullptr) {
+			break;
+		}
+
+		SinkBufferState expectedState = SinkBufferState::Queued;
+		if (!oldest->state.compare_exchange_strong(expectedState, SinkBufferState::Flushing)) {
+			// The flush thread claimed it first. It will notice the emergency flag and give it back
+			continue;
+		}
+		const int writeRet = EmergencyWriteBuffer(sink, oldest);
+		if (writeRet != 0 && ret == 0) {
+			ret = writeRet;
+		}
+		oldest->state.store(SinkBufferState::Written);
+	}
+
+	// The active buffer always holds the newest data
+	SinkBuffer *active = sink->active;
+	if (active != nullptr && active->used > 0) {
+		const int writeRet = EmergencyWriteBuffer(sink, active);
+		if (writeRet != 0 && ret == 0) {
+			ret = writeRet;
+		}
+		active->used = 0;
+	}
+
+	errno = savedErrno;
+	return ret;
+}
+
+DoubleBufferedSink::~DoubleBufferedSink() {
+	CloseDoubleBufferedSink(this);
+}
+
+void GetDoubleBufferedSinkMetrics(DoubleBufferedSink *sink, DoubleBufferedSinkMetrics *metrics) {
+	std::lock_guard<std::mutex> lock(sink->mutex);
+	*metrics = sink->metrics;
+}
+
+// Takes the partially filled active buffer away from the producer, unless it's in the middle of a record
+// With a pool, an empty buffer's page is given back too, if the producer has been idle for a whole interval
+// Returns true if the buffer was queued for flushing. Must be called with the sink mutex held
+static bool ReclaimIdleActiveBuffer(DoubleBufferedSink *sink, bool producerIdle) {
+	// Sequentially consistent, so either we see EmergencyFlush()'s flag, or it sees our claim and waits for us
+	uint32_t expected = kActiveOwnerNone;
+	if (!sink->activeOwner.compare_exchange_strong(expected, kActiveOwnerFlushThread)) {
+		// The producer is writing after all
+		return false;
+	}
+	if (sink->emergency.load()) {
+		sink->activeOwner.store(kActiveOwnerNone, std::memory_order_release);
+		return false;
+	}
+
+	bool queued = false;
+
+	SinkBuffer *buffer = sink->active;
+	if (buffer != nullptr && buffer->data != nullptr) {
+		if (buffer->used == 0) {
+			if (sink->config.pool != nullptr && producerIdle) {
+				ReleasePage(sink->config.pool, buffer->data);
+				buffer->data = nullptr;
+			}
+		} else {
+			SinkBuffer *next = FindFreeBuffer(sink);
+			if (next != nullptr) {
+				QueueActiveBuffer(sink, HandOffReason::Timer);
+				if (sink->config.pool != nullptr) {
+					++sink->metrics.idlePagesReclaimed;
+				}
+
+				next->used = 0;
+				next->state.store(SinkBufferState::Active, std::memory_order_relaxed);
+				sink->active = next;
+				queued = true;
+			}
+		}
+	}
+
+	sink->activeOwner.store(kActiveOwnerNone, std::memory_order_release);
+	return queued;
+}
+
+static void FlushThreadMain(DoubleBufferedSink *sink) {
+	const auto flushInterval = std::chrono::milliseconds(sink->config.flushIntervalMs);
+
+	if (sink->numaNode != kNumaNodeAny) {
+		// Keep the reads of the buffers local. If pinning fails, the flush thread just runs wherever the OS puts it
+		PinCurrentThreadToNumaNode(sink->numaNode);
+	}
+
+	std::unique_lock<std::mutex> lock(sink->mutex);
+	while (true) {
+		if (sink->emergency.load()) {
+			// EmergencyFlush() owns the buffers now
+			break;
+		}
+
+		SinkBuffer *buffer = FindOldestQueuedBuffer(sink);
+		if (buffer != nullptr) {
+			// EmergencyFlush() doesn't take the lock, so we have to claim the buffer, and then make sure it hasn't started
+			// It either sees our claim and waits for the write to finish, or we see its flag and back off
+			SinkBufferState expectedState = SinkBufferState::Queued;
+			const bool claimed = buffer->state.compare_exchange_strong(expectedState, SinkBufferState::Flushing);
+			if (!claimed || sink->emergency.load()) {
+				if (claimed) {
+					buffer->state.store(SinkBufferState::Queued);
+				}
+				break;
+			}
+			lock.unlock();
+
+			const auto flushStart = std::chrono::steady_clock::now();
+			uint64_t compressNs = 0;
+			size_t bytesToWrite = buffer->used;
+			int ret;
+			if (sink->config.compress) {
+				ret = CompressFrame(buffer->data, buffer->used, sink->frame, sink->frameCapacity, &bytesToWrite);
+				compressNs = ElapsedNs(flushStart, std::chrono::steady_clock::now());
+				if (ret == 0) {
+					ret = WriteAllToFd(sink->fd, sink->frame, bytesToWrite);
+				}
+			} else {
+				ret = WriteAllToFd(sink->fd, buffer->data, buffer->used);
+			}
+			const uint64_t latencyNs = ElapsedNs(flushStart, std::chrono::steady_clock::now());
+			if (ret != 0) {
+				// Only keep the first error. The data in this buffer is lost, but we still free it
+				// so the producer never blocks forever on a broken file descriptor
+				int expected = 0;
+				sink->flushError.compare_exchange_strong(expected, ret, std::memory_order_relaxed);
+			}
+			buffer->state.store(SinkBufferState::Written, std::memory_order_release);
+
+			lock.lock();
+			if (ret == 0) {
+				++sink->metrics.buffersFlushed;
+				sink->metrics.bytesFlushed += bytesToWrite;
+				sink->metrics.rawBytesFlushed += buffer->used;
+			}
+			sink->metrics.totalCompressNs += compressNs;
+			sink->metrics.totalFlushLatencyNs += latencyNs;
+			if (latencyNs > sink->metrics.maxFlushLatencyNs) {
+				sink->metrics.maxFlushLatencyNs = latencyNs;
+			}
+
+			if (sink->config.pool != nullptr) {
+				ReleasePage(sink->config.pool, buffer->data);
+				buffer->data = nullptr;
+			}
+			buffer->used = 0;
+			buffer->state.store(SinkBufferState::Free, std::memory_order_release);
+			--sink->queuedBuffers;
+			sink->freeCondition.notify_all();
+			continue;
+		}
+
+		if (sink->shutdown) {
+			break;
+		}
+
+		if (sink->config.flushIntervalMs == 0) {
+			sink->flushCondition.wait(lock);
+			continue;
+		}
+
+		// The producer writes to the active buffer without holding the lock. So we can only take it while the producer
+		// isn't part way through a record. Otherwise, we ask the producer to hand it off on its next write
+		const auto now = std::chrono::steady_clock::now();
+		if (now - sink->lastSwapTime >= flushInterval) {
+			// If the last request is still pending, the producer hasn't written anything for a whole interval
+			if (ReclaimIdleActiveBuffer(sink, sink->swapRequested.load(std::memory_order_relaxed))) {
+				continue;
+			}
+			sink->swapRequested.store(true, std::memory_order_relaxed);
+			sink->lastSwapTime = now;
+		}
+		sink->flushCondition.wait_until(lock, sink->lastSwapTime + flushInterval);
+	}
+}
+
+} // End of namespace fxt
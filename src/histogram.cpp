@@ -0,0 +1,148 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/histogram.h"
+
+namespace fxt {
+
+static unsigned MostSignificantBit(uint64_t value) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return (unsigned)index;
+#else
+	return 63 - (unsigned)__builtin_clzll(value);
+#endif
+}
+
+// Values below 2^subBucketBits get a bucket each. Past that, each power of two gets halfCount buckets
+static size_t GetBucketIndex(uint64_t value, unsigned subBucketBits) {
+	if (value < (uint64_t(1) << subBucketBits)) {
+		return (size_t)value;
+	}
+
+	const unsigned shift = MostSignificantBit(value) - subBucketBits + 1;
+	return ((size_t)shift << (subBucketBits - 1)) + (size_t)(value >> shift);
+}
+
+// The largest value that lands in the bucket
+static uint64_t GetBucketUpperBound(size_t index, unsigned subBucketBits) {
+	const size_t halfCount = size_t(1) << (subBucketBits - 1);
+	if (index < 2 * halfCount) {
+		return index;
+	}
+
+	const unsigned shift = (unsigned)(index / halfCount) - 1;
+	const uint64_t subBucket = index - ((size_t)shift << (subBucketBits - 1));
+	const uint64_t upper = ((subBucket + 1) << shift) - 1;
+	// The last bucket's bound wraps around
+	return upper < (subBucket << shift) ? UINT64_MAX : upper;
+}
+
+static internal::HistogramShard *GetHistogramShard(LatencyHistogram *histogram) {
+	static thread_local internal::ThreadSlots<internal::HistogramShard *> shards;
+
+	internal::HistogramShard *&shard = *internal::GetThreadSlot(&shards, histogram->slot);
+	if (shard != nullptr) {
+		return shard;
+	}
+
+	std::unique_ptr<internal::HistogramShard> newShard(new internal::HistogramShard());
+	newShard->counts.reset(new std::atomic<uint64_t>[histogram->numBuckets]);
+	for (size_t i = 0; i < histogram->numBuckets; ++i) {
+		newShard->counts[i].store(0, std::memory_order_relaxed);
+	}
+	newShard->reported.resize(histogram->numBuckets, 0);
+
+	std::lock_guard<std::mutex> lock(histogram->mutex);
+	shard = newShard.get();
+	histogram->shards.push_back(std::move(newShard));
+
+	return shard;
+}
+
+LatencyHistogram::~LatencyHistogram() {
+	internal::ReleaseThreadSlot<LatencyHistogram>(&slot);
+}
+
+int InitLatencyHistogram(LatencyHistogram *histogram, const char *category, const char *name, uint64_t counterID, HistogramConfig config) {
+	if (config.subBucketBits < 1 || config.subBucketBits > 16) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	histogram->category = category;
+	histogram->name = name;
+	histogram->counterID = counterID;
+	histogram->config = config;
+	histogram->numBuckets = (size_t)(66 - config.subBucketBits) << (config.subBucketBits - 1);
+	internal::AcquireThreadSlot<LatencyHistogram>(&histogram->slot);
+
+	return 0;
+}
+
+void RecordHistogramValue(LatencyHistogram *histogram, uint64_t value) {
+	internal::HistogramShard *shard = GetHistogramShard(histogram);
+
+	// Only this thread writes the count, so there's no need for an atomic increment
+	std::atomic<uint64_t> &count = shard->counts[GetBucketIndex(value, histogram->config.subBucketBits)];
+	count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void TakeHistogramSnapshot(LatencyHistogram *histogram, HistogramSnapshot *snapshot) {
+	*snapshot = HistogramSnapshot();
+
+	std::vector<uint64_t> merged(histogram->numBuckets, 0);
+	uint64_t total = 0;
+	{
+		std::lock_guard<std::mutex> lock(histogram->mutex);
+
+		for (const auto &shard : histogram->shards) {
+			for (size_t i = 0; i < histogram->numBuckets; ++i) {
+				const uint64_t count = shard->counts[i].load(std::memory_order_relaxed);
+				merged[i] += count - shard->reported[i];
+				total += count - shard->reported[i];
+				shard->reported[i] = count;
+			}
+		}
+	}
+	if (total == 0) {
+		return;
+	}
+
+	const uint64_t ranks[3] = {
+		(total * 50 + 99) / 100,
+		(total * 90 + 99) / 100,
+		(total * 99 + 99) / 100,
+	};
+	uint64_t *percentiles[3] = { &snapshot->p50, &snapshot->p90, &snapshot->p99 };
+	uint64_t seen = 0;
+	unsigned nextRank = 0;
+	for (size_t i = 0; i < histogram->numBuckets; ++i) {
+		if (merged[i] == 0) {
+			continue;
+		}
+
+		seen += merged[i];
+		const uint64_t value = GetBucketUpperBound(i, histogram->config.subBucketBits);
+		while (nextRank < 3 && seen >= ranks[nextRank]) {
+			*percentiles[nextRank++] = value;
+		}
+		snapshot->max = value;
+	}
+	snapshot->count = total;
+}
+
+int AddHistogramCounterEvent(Writer *writer, LatencyHistogram *histogram, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp) {
+	HistogramSnapshot snapshot;
+	TakeHistogramSnapshot(histogram, &snapshot);
+	if (snapshot.count == 0) {
+		return 0;
+	}
+
+	return FXT_ADD_COUNTER_EVENT(writer, histogram->category.c_str(), histogram->name.c_str(), processID, threadID, timestamp, histogram->counterID, "p50", snapshot.p50, "p90", snapshot.p90, "p99", snapshot.p99, "max", snapshot.max, "count", snapshot.count);
+}
+
+} // End of namespace fxt
@@ -0,0 +1,526 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/io_uring_sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <new>
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#	define FXT_HAS_IO_URING_SYSCALLS 1
+#else
+#	define FXT_HAS_IO_URING_SYSCALLS 0
+#endif
+
+namespace fxt {
+
+using internal::IoUring;
+using internal::IoUringSinkBuffer;
+
+// O_DIRECT needs the file offset, length, and memory of every write to be aligned, but a short write can end mid-block.
+// So only whole blocks count as written, and the rest of the last block is written again. Those bytes haven't changed,
+// so writing them twice is harmless. Returns 0 if not even one block was written
+static size_t AlignedProgress(size_t written, size_t alignment) {
+	return written & ~(alignment - 1);
+}
+
+// The alignment that every write must keep. 1 for buffered IO
+static size_t WriteAlignment(const IoUringSink *sink) {
+	return sink->config.useDirectIO ? sink->config.alignment : 1;
+}
+
+static int PwriteAll(int fd, const uint8_t *data, size_t len, uint64_t offset, size_t alignment) {
+	while (len > 0) {
+		const ssize_t written = pwrite(fd, data, len, (off_t)offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return FXT_ERR_WRITE_TO_STREAM_FAILED;
+		}
+
+		const size_t progress = AlignedProgress((size_t)written, alignment);
+		if (progress == 0) {
+			return FXT_ERR_WRITE_TO_STREAM_FAILED;
+		}
+
+		data += progress;
+		len -= progress;
+		offset += progress;
+	}
+
+	return 0;
+}
+
+static void SetError(IoUringSink *sink, int error) {
+	// Only keep the first error
+	if (sink->error == 0) {
+		sink->error = error;
+	}
+}
+
+// io_uring helpers
+
+static void DestroyRing(IoUring *ring) {
+	if (ring->sqes != nullptr) {
+		munmap(ring->sqes, ring->sqesSize);
+	}
+	if (ring->cqRing != nullptr && ring->cqRing != ring->sqRing) {
+		munmap(ring->cqRing, ring->cqRingSize);
+	}
+	if (ring->sqRing != nullptr) {
+		munmap(ring->sqRing, ring->sqRingSize);
+	}
+	if (ring->ringFd >= 0) {
+		close(ring->ringFd);
+	}
+
+	*ring = IoUring();
+}
+
+#if FXT_HAS_IO_URING_SYSCALLS
+
+static bool SetupRing(IoUring *ring, unsigned entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	const int ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (ringFd < 0) {
+		// ENOSYS on old kernels. EPERM when it's been disabled
+		return false;
+	}
+	ring->ringFd = ringFd;
+
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	const bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMmap) {
+		if (ring->cqRingSize > ring->sqRingSize) {
+			ring->sqRingSize = ring->cqRingSize;
+		}
+		ring->cqRingSize = ring->sqRingSize;
+	}
+
+	void *sqRing = mmap(nullptr, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+	if (sqRing == MAP_FAILED) {
+		DestroyRing(ring);
+		return false;
+	}
+	ring->sqRing = sqRing;
+
+	if (singleMmap) {
+		ring->cqRing = sqRing;
+	} else {
+		void *cqRing = mmap(nullptr, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+		if (cqRing == MAP_FAILED) {
+			DestroyRing(ring);
+			return false;
+		}
+		ring->cqRing = cqRing;
+	}
+
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes = mmap(nullptr, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		DestroyRing(ring);
+		return false;
+	}
+	ring->sqes = sqes;
+
+	uint8_t *sqBase = (uint8_t *)ring->sqRing;
+	ring->sqHead = (unsigned *)(sqBase + params.sq_off.head);
+	ring->sqTail = (unsigned *)(sqBase + params.sq_off.tail);
+	ring->sqMask = (unsigned *)(sqBase + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned *)(sqBase + params.sq_off.array);
+
+	uint8_t *cqBase = (uint8_t *)ring->cqRing;
+	ring->cqHead = (unsigned *)(cqBase + params.cq_off.head);
+	ring->cqTail = (unsigned *)(cqBase + params.cq_off.tail);
+	ring->cqMask = (unsigned *)(cqBase + params.cq_off.ring_mask);
+	ring->cqes = cqBase + params.cq_off.cqes;
+
+	return true;
+}
+
+static int EnterRing(IoUring *ring, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+	while (true) {
+		const int ret = (int)syscall(__NR_io_uring_enter, ring->ringFd, toSubmit, minComplete, flags, nullptr, 0);
+		if (ret >= 0) {
+			return 0;
+		}
+		if (errno != EINTR) {
+			return FXT_ERR_WRITE_TO_STREAM_FAILED;
+		}
+	}
+}
+
+static int SubmitRingWrite(IoUringSink *sink, unsigned bufferIndex) {
+	IoUring *ring = &sink->ring;
+	IoUringSinkBuffer *buffer = &sink->buffers[bufferIndex];
+
+	buffer->iov.iov_base = buffer->data + buffer->pendingStart;
+	buffer->iov.iov_len = buffer->used - buffer->pendingStart;
+
+	// We are the only submitter, so the tail can't move underneath us
+	// And we never have more writes in flight than there are buffers, so the queue can't be full
+	const unsigned tail = *ring->sqTail;
+	const unsigned index = tail & *ring->sqMask;
+
+	struct io_uring_sqe *sqe = &((struct io_uring_sqe *)ring->sqes)[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = sink->fd;
+	sqe->addr = (uint64_t)(uintptr_t)&buffer->iov;
+	sqe->len = 1;
+	sqe->off = buffer->offset + buffer->pendingStart;
+	sqe->user_data = bufferIndex;
+
+	ring->sqArray[index] = index;
+	__atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	return EnterRing(ring, 1, 0, 0);
+}
+
+static void HandleCompletion(IoUringSink *sink, unsigned bufferIndex, int result) {
+	IoUringSinkBuffer *buffer = &sink->buffers[bufferIndex];
+
+	if (result == -EINTR || result == -EAGAIN) {
+		if (SubmitRingWrite(sink, bufferIndex) == 0) {
+			return;
+		}
+		result = -EIO;
+	}
+
+	if (result > 0) {
+		const size_t progress = AlignedProgress((size_t)result, WriteAlignment(sink));
+		buffer->pendingStart += progress;
+		if (progress == 0) {
+			result = -EIO;
+		} else if (buffer->pendingStart < buffer->used) {
+			// Short write. Send the rest
+			if (SubmitRingWrite(sink, bufferIndex) == 0) {
+				return;
+			}
+			result = -EIO;
+		}
+	} else if (buffer->pendingStart < buffer->used) {
+		SetError(sink, FXT_ERR_WRITE_TO_STREAM_FAILED);
+	}
+
+	if (result < 0) {
+		SetError(sink, FXT_ERR_WRITE_TO_STREAM_FAILED);
+	}
+
+	buffer->inFlight = false;
+	--sink->inFlight;
+}
+
+// Processes every available completion. If wait is true, blocks until there is at least one
+static int ReapCompletions(IoUringSink *sink, bool wait) {
+	IoUring *ring = &sink->ring;
+
+	unsigned head = *ring->cqHead;
+	unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+	if (head == tail && wait) {
+		const int ret = EnterRing(ring, 0, 1, IORING_ENTER_GETEVENTS);
+		if (ret != 0) {
+			return ret;
+		}
+		tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+	}
+
+	while (head != tail) {
+		const struct io_uring_cqe *cqe = &((const struct io_uring_cqe *)ring->cqes)[head & *ring->cqMask];
+		const unsigned bufferIndex = (unsigned)cqe->user_data;
+		const int result = cqe->res;
+
+		// Release the slot before handling it, since handling it may submit a new write
+		++head;
+		__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+		HandleCompletion(sink, bufferIndex, result);
+	}
+
+	return 0;
+}
+
+#else
+
+static bool SetupRing(IoUring *ring, unsigned entries) {
+	(void)ring;
+	(void)entries;
+	return false;
+}
+
+static int SubmitRingWrite(IoUringSink *sink, unsigned bufferIndex) {
+	(void)sink;
+	(void)bufferIndex;
+	return FXT_ERR_WRITE_TO_STREAM_FAILED;
+}
+
+static int ReapCompletions(IoUringSink *sink, bool wait) {
+	(void)sink;
+	(void)wait;
+	return FXT_ERR_WRITE_TO_STREAM_FAILED;
+}
+
+#endif
+
+// Sink helpers
+
+static void FreeBuffers(IoUringSink *sink) {
+	if (sink->buffers == nullptr) {
+		return;
+	}
+
+	for (unsigned i = 0; i < sink->config.numBuffers; ++i) {
+		free(sink->buffers[i].data);
+	}
+	delete[] sink->buffers;
+	sink->buffers = nullptr;
+}
+
+static int WaitForBuffer(IoUringSink *sink, unsigned bufferIndex) {
+	while (sink->buffers[bufferIndex].inFlight) {
+		const int ret = ReapCompletions(sink, true);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int WaitForAllBuffers(IoUringSink *sink) {
+	while (sink->inFlight > 0) {
+		const int ret = ReapCompletions(sink, true);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return sink->error;
+}
+
+// Writes the active buffer at the next file offset, and moves on to the next buffer
+static int SubmitActiveBuffer(IoUringSink *sink) {
+	IoUringSinkBuffer *buffer = &sink->buffers[sink->active];
+	buffer->offset = sink->nextOffset;
+	buffer->pendingStart = 0;
+	sink->nextOffset += buffer->used;
+
+	int ret;
+	if (sink->usingIoUring) {
+		buffer->inFlight = true;
+		++sink->inFlight;
+		ret = SubmitRingWrite(sink, sink->active);
+		if (ret != 0) {
+			buffer->inFlight = false;
+			--sink->inFlight;
+		}
+	} else {
+		ret = PwriteAll(sink->fd, buffer->data, buffer->used, buffer->offset, WriteAlignment(sink));
+	}
+	if (ret != 0) {
+		SetError(sink, ret);
+		return ret;
+	}
+
+	sink->active = (sink->active + 1) % sink->config.numBuffers;
+	ret = WaitForBuffer(sink, sink->active);
+	if (ret != 0) {
+		SetError(sink, ret);
+		return ret;
+	}
+	sink->buffers[sink->active].used = 0;
+
+	return sink->error;
+}
+
+int OpenIoUringSink(IoUringSink *sink, const char *path, IoUringSinkConfig config) {
+	if (config.numBuffers < 2 || config.bufferSize == 0) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (config.alignment == 0 || (config.alignment & (config.alignment - 1)) != 0 || config.alignment < sizeof(void *)) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (config.useDirectIO && (config.bufferSize % config.alignment) != 0) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (sink->fd >= 0) {
+		// Already open
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	sink->config = config;
+	sink->buffers = new (std::nothrow) IoUringSinkBuffer[config.numBuffers];
+	if (sink->buffers == nullptr) {
+		return FXT_ERR_OUT_OF_MEMORY;
+	}
+	memset(sink->buffers, 0, sizeof(IoUringSinkBuffer) * config.numBuffers);
+	for (unsigned i = 0; i < config.numBuffers; ++i) {
+		void *data = nullptr;
+		if (posix_memalign(&data, config.alignment, config.bufferSize) != 0) {
+			FreeBuffers(sink);
+			return FXT_ERR_OUT_OF_MEMORY;
+		}
+		sink->buffers[i].data = (uint8_t *)data;
+	}
+
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	if (config.useDirectIO) {
+		flags |= O_DIRECT;
+	}
+	sink->fd = open(path, flags, 0644);
+	if (sink->fd < 0) {
+		FreeBuffers(sink);
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	sink->active = 0;
+	sink->inFlight = 0;
+	sink->nextOffset = 0;
+	sink->error = 0;
+	sink->usingIoUring = !config.forcePwrite && SetupRing(&sink->ring, config.numBuffers);
+
+	return 0;
+}
+
+int WriteToIoUringSink(void *userContext, const void *data, size_t len) {
+	IoUringSink *sink = (IoUringSink *)userContext;
+
+	if (sink->error != 0) {
+		return sink->error;
+	}
+	if (sink->fd < 0) {
+		return FXT_ERR_SINK_CLOSED;
+	}
+
+	// Opportunistically retire finished writes, so errors surface early
+	if (sink->inFlight > 0) {
+		ReapCompletions(sink, false);
+	}
+
+	const uint8_t *src = (const uint8_t *)data;
+	const size_t bufferSize = sink->config.bufferSize;
+	while (len > 0) {
+		IoUringSinkBuffer *buffer = &sink->buffers[sink->active];
+
+		const size_t space = bufferSize - buffer->used;
+		const size_t toCopy = len < space ? len : space;
+		memcpy(buffer->data + buffer->used, src, toCopy);
+		buffer->used += toCopy;
+		src += toCopy;
+		len -= toCopy;
+
+		if (buffer->used == bufferSize) {
+			const int ret = SubmitActiveBuffer(sink);
+			if (ret != 0) {
+				return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int FlushAndWait(IoUringSink *sink) {
+	if (sink->fd < 0) {
+		return sink->error;
+	}
+
+	if (!sink->config.useDirectIO && sink->buffers[sink->active].used > 0) {
+		const int ret = SubmitActiveBuffer(sink);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return WaitForAllBuffers(sink);
+}
+
+int CloseIoUringSink(IoUringSink *sink) {
+	if (sink->fd < 0) {
+		return sink->error;
+	}
+
+	IoUringSinkBuffer *tail = &sink->buffers[sink->active];
+	const uint64_t fileLength = sink->nextOffset + tail->used;
+	if (tail->used > 0 && sink->error == 0) {
+		if (sink->config.useDirectIO) {
+			// O_DIRECT writes must be a multiple of the alignment
+			// So we zero pad the tail, and then truncate the file back down to the real length
+			const size_t alignment = sink->config.alignment;
+			const size_t paddedLength = (tail->used + alignment - 1) & ~(alignment - 1);
+			memset(tail->data + tail->used, 0, paddedLength - tail->used);
+			tail->used = paddedLength;
+		}
+		SubmitActiveBuffer(sink);
+	}
+
+	WaitForAllBuffers(sink);
+
+	if (sink->config.useDirectIO && sink->error == 0) {
+		if (ftruncate(sink->fd, (off_t)fileLength) != 0) {
+			SetError(sink, FXT_ERR_WRITE_TO_STREAM_FAILED);
+		}
+	}
+
+	DestroyRing(&sink->ring);
+	sink->usingIoUring = false;
+	FreeBuffers(sink);
+
+	if (close(sink->fd) != 0) {
+		SetError(sink, FXT_ERR_WRITE_TO_STREAM_FAILED);
+	}
+	sink->fd = -1;
+
+	return sink->error;
+}
+
+int EmergencyFlush(IoUringSink *sink) {
+	if (sink->fd < 0 || sink->buffers == nullptr) {
+		return FXT_ERR_SINK_CLOSED;
+	}
+
+	// Signal handlers must not clobber errno
+	const int savedErrno = errno;
+
+	IoUringSinkBuffer *tail = &sink->buffers[sink->active];
+	size_t length = tail->used;
+	if (sink->config.useDirectIO) {
+		const size_t alignment = sink->config.alignment;
+		const size_t paddedLength = (length + alignment - 1) & ~(alignment - 1);
+		memset(tail->data + length, 0, paddedLength - length);
+		length = paddedLength;
+	}
+
+	int ret = 0;
+	if (length > 0) {
+		ret = PwriteAll(sink->fd, tail->data, length, sink->nextOffset, WriteAlignment(sink));
+	}
+	tail->used = 0;
+
+	// Don't let the producer write anything more, and make sure CloseIoUringSink() doesn't touch the file again
+	SetError(sink, ret != 0 ? ret : FXT_ERR_SINK_CLOSED);
+
+	errno = savedErrno;
+	return ret;
+}
+
+IoUringSink::~IoUringSink() {
+	CloseIoUringSink(this);
+}
+
+} // End of namespace fxt
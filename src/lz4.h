@@ -0,0 +1,254 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+/**
+ * A minimal, single-header codec for the LZ4 block format. This is our own implementation, not the reference library
+ * https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+ *
+ * The output is a standard LZ4 block, so it can be decoded by any LZ4 implementation (IE, LZ4_decompress_safe()). The
+ * tests decode blocks produced by the reference implementation, to keep the two compatible. The compressor is a greedy, single-probe hash matcher, similar to LZ4's default "fast" mode. Each block is
+ * independent. There is no dictionary or history carried between blocks.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace fxt::lz4 {
+
+static constexpr size_t kMinMatch = 4;
+// The last 5 bytes of a block are always literals
+static constexpr size_t kLastLiterals = 5;
+// The last match must start at least 12 bytes before the end of the block
+static constexpr size_t kMatchFindLimit = 12;
+static constexpr size_t kMaxDistance = 65535;
+
+static constexpr unsigned kHashLog = 12;
+static constexpr size_t kHashTableSize = (size_t)1 << kHashLog;
+
+/**
+ * @brief The largest supported input to CompressBlock()
+ */
+static constexpr size_t kMaxInputSize = 0x7E000000;
+
+/**
+ * @brief The worst case size of a compressed block. IE, for incompressible input
+ */
+inline constexpr size_t CompressBound(size_t srcSize) {
+	return srcSize + (srcSize / 255) + 16;
+}
+
+inline uint32_t Read32(const uint8_t *ptr) {
+	uint32_t value;
+	memcpy(&value, ptr, sizeof(value));
+	return value;
+}
+
+inline uint32_t HashSequence(uint32_t sequence) {
+	return (sequence * 2654435761u) >> (32 - kHashLog);
+}
+
+inline uint8_t *WriteLengthExtension(uint8_t *op, size_t len) {
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+
+	return op;
+}
+
+/**
+ * @brief Compresses src into a single LZ4 block
+ *
+ * @param src            The data to compress
+ * @param srcSize        The length of src. Must be at most kMaxInputSize
+ * @param dst            The buffer for the compressed block
+ * @param dstCapacity    The size of dst. CompressBound(srcSize) always fits
+ * @param hashTable      Scratch space of kHashTableSize entries
+ * @return               The size of the compressed block. 0 if it didn't fit in dst
+ */
+inline size_t CompressBlock(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstCapacity, uint32_t *hashTable) {
+	uint8_t *op = dst;
+	uint8_t *const oend = dst + dstCapacity;
+	const uint8_t *anchor = src;
+	const uint8_t *const iend = src + srcSize;
+
+	if (srcSize > kMatchFindLimit) {
+		memset(hashTable, 0, kHashTableSize * sizeof(uint32_t));
+
+		const uint8_t *const matchFindLimit = iend - kMatchFindLimit;
+		const uint8_t *const matchLimit = iend - kLastLiterals;
+
+		const uint8_t *ip = src + 1;
+		while (ip < matchFindLimit) {
+			const uint32_t sequence = Read32(ip);
+			const uint32_t hash = HashSequence(sequence);
+			const uint8_t *match = src + hashTable[hash];
+			hashTable[hash] = (uint32_t)(ip - src);
+
+			if (match >= ip || (size_t)(ip - match) > kMaxDistance || Read32(match) != sequence) {
+				// Skip ahead faster the longer we go without a match, so incompressible data stays cheap
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			// Extend the match in both directions
+			while (ip > anchor && match > src && ip[-1] == match[-1]) {
+				--ip;
+				--match;
+			}
+			const uint8_t *matchEnd = ip + kMinMatch;
+			const uint8_t *matchCursor = match + kMinMatch;
+			while (matchEnd < matchLimit && *matchEnd == *matchCursor) {
+				++matchEnd;
+				++matchCursor;
+			}
+
+			const size_t literalLen = (size_t)(ip - anchor);
+			const size_t matchLen = (size_t)(matchEnd - ip) - kMinMatch;
+			const size_t worstCase = 1 + (literalLen / 255 + 1) + literalLen + 2 + (matchLen / 255 + 1);
+			if (worstCase > (size_t)(oend - op)) {
+				return 0;
+			}
+
+			uint8_t *token = op++;
+			if (literalLen >= 15) {
+				*token = 15 << 4;
+				op = WriteLengthExtension(op, literalLen - 15);
+			} else {
+				*token = (uint8_t)(literalLen << 4);
+			}
+			memcpy(op, anchor, literalLen);
+			op += literalLen;
+
+			const size_t offset = (size_t)(ip - match);
+			*op++ = (uint8_t)(offset & 0xFF);
+			*op++ = (uint8_t)(offset >> 8);
+
+			if (matchLen >= 15) {
+				*token |= 15;
+				op = WriteLengthExtension(op, matchLen - 15);
+			} else {
+				*token |= (uint8_t)matchLen;
+			}
+
+			ip = matchEnd;
+			anchor = ip;
+
+			// Prime the table with a position inside the match, which often starts the next one
+			if (ip < matchFindLimit) {
+				hashTable[HashSequence(Read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+			}
+		}
+	}
+
+	// The rest of the block is literals
+	const size_t literalLen = (size_t)(iend - anchor);
+	const size_t worstCase = 1 + (literalLen / 255 + 1) + literalLen;
+	if (worstCase > (size_t)(oend - op)) {
+		return 0;
+	}
+
+	uint8_t *token = op++;
+	if (literalLen >= 15) {
+		*token = 15 << 4;
+		op = WriteLengthExtension(op, literalLen - 15);
+	} else {
+		*token = (uint8_t)(literalLen << 4);
+	}
+	memcpy(op, anchor, literalLen);
+	op += literalLen;
+
+	return (size_t)(op - dst);
+}
+
+inline bool ReadLengthExtension(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+	uint8_t byte;
+	do {
+		if (*ip >= iend) {
+			return false;
+		}
+		byte = *(*ip)++;
+		*len += byte;
+	} while (byte == 255);
+
+	return true;
+}
+
+/**
+ * @brief Decompresses a single LZ4 block. Malformed input is detected, and never reads or writes out of bounds
+ *
+ * @param src            The compressed block
+ * @param srcSize        The length of src
+ * @param dst            The buffer for the decompressed data
+ * @param dstCapacity    The size of dst
+ * @return               The decompressed size. -1 if the block is malformed, or doesn't fit in dst
+ */
+inline int64_t DecompressBlock(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstCapacity) {
+	const uint8_t *ip = src;
+	const uint8_t *const iend = src + srcSize;
+	uint8_t *op = dst;
+	uint8_t *const oend = dst + dstCapacity;
+
+	while (true) {
+		if (ip >= iend) {
+			return -1;
+		}
+		const uint8_t token = *ip++;
+
+		size_t literalLen = token >> 4;
+		if (literalLen == 15 && !ReadLengthExtension(&ip, iend, &literalLen)) {
+			return -1;
+		}
+		if (literalLen > (size_t)(iend - ip) || literalLen > (size_t)(oend - op)) {
+			return -1;
+		}
+		memcpy(op, ip, literalLen);
+		ip += literalLen;
+		op += literalLen;
+
+		if (ip == iend) {
+			// The last sequence has no match
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return -1;
+		}
+		const size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - dst)) {
+			return -1;
+		}
+
+		size_t matchLen = token & 15;
+		if (matchLen == 15 && !ReadLengthExtension(&ip, iend, &matchLen)) {
+			return -1;
+		}
+		matchLen += kMinMatch;
+		if (matchLen > (size_t)(oend - op)) {
+			return -1;
+		}
+
+		const uint8_t *match = op - offset;
+		if (offset >= matchLen) {
+			memcpy(op, match, matchLen);
+			op += matchLen;
+		} else {
+			// The match overlaps the output. IE, a repeating pattern. So it has to be copied byte by byte
+			for (size_t i = 0; i < matchLen; ++i) {
+				*op++ = *match++;
+			}
+		}
+	}
+
+	return (int64_t)(op - dst);
+}
+
+} // End of namespace fxt::lz4
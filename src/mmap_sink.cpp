@@ -0,0 +1,188 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/mmap_sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace fxt {
+
+static void SetError(MmapSink *sink, int error) {
+	// Only keep the first error
+	if (sink->error == 0) {
+		sink->error = error;
+	}
+}
+
+// Reserves the disk blocks for [offset, offset + len), so we don't get SIGBUS from a full disk when writing to the mapping
+static int PreallocateExtent(int fd, uint64_t offset, size_t len) {
+#if defined(__linux__)
+	int ret;
+	do {
+		ret = posix_fallocate(fd, (off_t)offset, (off_t)len);
+	} while (ret == EINTR);
+	if (ret == 0) {
+		return 0;
+	}
+	if (ret != EOPNOTSUPP && ret != EINVAL) {
+		return FXT_ERR_WRITE_TO_STREAM_FAILED;
+	}
+	// Some file systems don't support fallocate. Fall through and just grow the file
+#endif
+
+	if (ftruncate(fd, (off_t)(offset + len)) != 0) {
+		return FXT_ERR_WRITE_TO_STREAM_FAILED;
+	}
+
+	return 0;
+}
+
+// Allocates and maps the extent starting at offset
+static int MapExtent(MmapSink *sink, uint64_t offset) {
+	const size_t extentSize = sink->config.extentSize;
+
+	int ret = PreallocateExtent(sink->fd, offset, extentSize);
+	if (ret != 0) {
+		return ret;
+	}
+
+	void *mapping = mmap(nullptr, extentSize, PROT_READ | PROT_WRITE, MAP_SHARED, sink->fd, (off_t)offset);
+	if (mapping == MAP_FAILED) {
+		return FXT_ERR_WRITE_TO_STREAM_FAILED;
+	}
+#if defined(MADV_SEQUENTIAL)
+	madvise(mapping, extentSize, MADV_SEQUENTIAL);
+#endif
+
+	sink->mapping = (uint8_t *)mapping;
+	sink->mappingOffset = offset;
+	sink->mappingUsed = 0;
+
+	return 0;
+}
+
+static void UnmapExtent(MmapSink *sink) {
+	if (sink->mapping != nullptr) {
+		munmap(sink->mapping, sink->config.extentSize);
+		sink->mapping = nullptr;
+	}
+}
+
+int OpenMmapSink(MmapSink *sink, const char *path, MmapSinkConfig config) {
+	const long pageSize = sysconf(_SC_PAGESIZE);
+	if (config.extentSize == 0 || pageSize <= 0 || (config.extentSize % (size_t)pageSize) != 0) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (sink->fd >= 0) {
+		// Already open
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	sink->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (sink->fd < 0) {
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	sink->config = config;
+	sink->error = 0;
+
+	const int ret = MapExtent(sink, 0);
+	if (ret != 0) {
+		close(sink->fd);
+		sink->fd = -1;
+		return ret;
+	}
+
+	return 0;
+}
+
+int WriteToMmapSink(void *userContext, const void *data, size_t len) {
+	MmapSink *sink = (MmapSink *)userContext;
+
+	if (sink->error != 0) {
+		return sink->error;
+	}
+	if (sink->mapping == nullptr) {
+		return FXT_ERR_SINK_CLOSED;
+	}
+
+	const uint8_t *src = (const uint8_t *)data;
+	const size_t extentSize = sink->config.extentSize;
+	while (len > 0) {
+		if (sink->mappingUsed == extentSize) {
+			// Grow the file by the next extent
+			// The unmapped pages stay in the page cache, so the kernel will write them back on its own schedule
+			const uint64_t nextOffset = sink->mappingOffset + extentSize;
+			UnmapExtent(sink);
+
+			const int ret = MapExtent(sink, nextOffset);
+			if (ret != 0) {
+				SetError(sink, ret);
+				return ret;
+			}
+		}
+
+		const size_t space = extentSize - sink->mappingUsed;
+		const size_t toCopy = len < space ? len : space;
+		memcpy(sink->mapping + sink->mappingUsed, src, toCopy);
+		sink->mappingUsed += toCopy;
+		src += toCopy;
+		len -= toCopy;
+	}
+
+	return 0;
+}
+
+int FlushAndWait(MmapSink *sink) {
+	if (sink->mapping == nullptr) {
+		return sink->error;
+	}
+
+	if (msync(sink->mapping, sink->config.extentSize, MS_SYNC) != 0) {
+		SetError(sink, FXT_ERR_WRITE_TO_STREAM_FAILED);
+	}
+	// Extents we already unmapped aren't covered by the msync. The page cache still holds their dirty pages
+#if defined(__linux__)
+	const int syncRet = fdatasync(sink->fd);
+#else
+	const int syncRet = fsync(sink->fd);
+#endif
+	if (syncRet != 0) {
+		SetError(sink, FXT_ERR_WRITE_TO_STREAM_FAILED);
+	}
+
+	return sink->error;
+}
+
+int CloseMmapSink(MmapSink *sink) {
+	if (sink->fd < 0) {
+		return sink->error;
+	}
+
+	const uint64_t fileLength = sink->mappingOffset + sink->mappingUsed;
+	UnmapExtent(sink);
+
+	// Trim off the unused part of the preallocated extent
+	if (ftruncate(sink->fd, (off_t)fileLength) != 0) {
+		SetError(sink, FXT_ERR_WRITE_TO_STREAM_FAILED);
+	}
+	if (close(sink->fd) != 0) {
+		SetError(sink, FXT_ERR_WRITE_TO_STREAM_FAILED);
+	}
+	sink->fd = -1;
+
+	return sink->error;
+}
+
+MmapSink::~MmapSink() {
+	CloseMmapSink(this);
+}
+
+} // End of namespace fxt
@@ -0,0 +1,206 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/numa.h"
+
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#	include <pthread.h>
+#	include <sched.h>
+#	include <sys/mman.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#endif
+
+namespace fxt {
+
+#if defined(__linux__)
+
+// From linux/mempolicy.h. We call the syscalls directly, so we don't have to depend on libnuma
+static constexpr int kMpolBind = 2;
+static constexpr unsigned kMpolMfMove = 1 << 1;
+
+// Parses a sysfs list like "0-3,8-11", and calls func for each index in it
+template <typename Func>
+static bool ForEachInSysfsList(const char *path, Func func) {
+	FILE *file = fopen(path, "r");
+	if (file == nullptr) {
+		return false;
+	}
+
+	char line[4096];
+	const bool readLine = fgets(line, sizeof(line), file) != nullptr;
+	fclose(file);
+	if (!readLine) {
+		return false;
+	}
+
+	const char *cursor = line;
+	while (*cursor >= '0' && *cursor <= '9') {
+		char *end;
+		const long first = strtol(cursor, &end, 10);
+		long last = first;
+		if (*end == '-') {
+			last = strtol(end + 1, &end, 10);
+		}
+		for (long i = first; i <= last; ++i) {
+			func((int)i);
+		}
+
+		cursor = end;
+		if (*cursor == ',') {
+			++cursor;
+		}
+	}
+
+	return true;
+}
+
+int GetNumaNodeCount() {
+	int maxNode = 0;
+	ForEachInSysfsList("/sys/devices/system/node/online", [&](int node) {
+		if (node > maxNode) {
+			maxNode = node;
+		}
+	});
+
+	return maxNode + 1;
+}
+
+int GetCurrentNumaNode() {
+	unsigned cpu = 0;
+	unsigned node = 0;
+	if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+		return 0;
+	}
+
+	return (int)node;
+}
+
+int PinCurrentThreadToNumaNode(int node) {
+	if (node < 0 || node >= GetNumaNodeCount()) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	char path[128];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	const bool found = ForEachInSysfsList(path, [&](int cpu) {
+		if (cpu < CPU_SETSIZE) {
+			CPU_SET(cpu, &cpus);
+		}
+	});
+	if (!found || CPU_COUNT(&cpus) == 0) {
+		// A memory-only node
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	return 0;
+}
+
+namespace internal {
+
+uint8_t *AllocateOnNumaNode(size_t size, int node) {
+	if (node < 0) {
+		return new (std::nothrow) uint8_t[size];
+	}
+
+	void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) {
+		return nullptr;
+	}
+
+	// Placement is only an optimization. If the policy is refused, IE, by a container's seccomp filter, carry on
+	const unsigned long numBits = sizeof(unsigned long) * 8;
+	unsigned long nodeMask[16] = {};
+	if ((size_t)node < sizeof(nodeMask) * 8) {
+		nodeMask[node / numBits] = 1ul << (node % numBits);
+		syscall(SYS_mbind, ptr, size, kMpolBind, nodeMask, sizeof(nodeMask) * 8, kMpolMfMove);
+	}
+
+	// Fault the pages in now, so they land on the node before the producer starts writing
+	memset(ptr, 0, size);
+
+	return (uint8_t *)ptr;
+}
+
+void FreeOnNumaNode(uint8_t *ptr, size_t size, int node) {
+	if (ptr == nullptr) {
+		return;
+	}
+	if (node < 0) {
+		delete[] ptr;
+		return;
+	}
+
+	munmap(ptr, size);
+}
+
+} // End of namespace internal
+
+#else
+
+int GetNumaNodeCount() {
+	return 1;
+}
+
+int GetCurrentNumaNode() {
+	return 0;
+}
+
+int PinCurrentThreadToNumaNode(int node) {
+	return node == 0 ? 0 : FXT_ERR_INVALID_CONFIG;
+}
+
+namespace internal {
+
+uint8_t *AllocateOnNumaNode(size_t size, int node) {
+	(void)node;
+	return new (std::nothrow) uint8_t[size];
+}
+
+void FreeOnNumaNode(uint8_t *ptr, size_t size, int node) {
+	(void)size;
+	(void)node;
+	delete[] ptr;
+}
+
+} // End of namespace internal
+
+#endif
+
+namespace internal {
+
+int ResolveNumaNode(int node, int *resolved) {
+	if (node == kNumaNodeAny) {
+		*resolved = kNumaNodeAny;
+		return 0;
+	}
+	if (node == kNumaNodeLocal) {
+		*resolved = GetCurrentNumaNode();
+		return 0;
+	}
+	if (node < 0 || node >= GetNumaNodeCount()) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	*resolved = node;
+	return 0;
+}
+
+} // End of namespace internal
+
+} // End of namespace fxt
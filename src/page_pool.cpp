@@ -0,0 +1,143 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/page_pool.h"
+
+#include <chrono>
+#include <new>
+
+namespace fxt {
+
+int InitPagePool(PagePool *pool, PagePoolConfig config) {
+	if (config.pageSize == 0 || config.budgetBytes / config.pageSize < 2) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	std::lock_guard<std::mutex> lock(pool->mutex);
+	if (pool->maxPages != 0 || pool->pagesInUse != 0) {
+		// Already initialized, or still has pages out from before it was destroyed
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	pool->config = config;
+	pool->maxPages = config.budgetBytes / config.pageSize;
+	pool->freePages.reserve(pool->maxPages);
+	pool->allocatedPages = 0;
+	pool->pagesInUse = 0;
+	pool->peakPagesInUse = 0;
+	pool->waits = 0;
+	pool->waitNs = 0;
+	pool->timeouts = 0;
+
+	return 0;
+}
+
+void DestroyPagePool(PagePool *pool) {
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+
+		for (uint8_t *page : pool->freePages) {
+			delete[] page;
+		}
+		pool->freePages.clear();
+		// The pages still in use are freed as they are released
+		pool->allocatedPages = pool->pagesInUse;
+		pool->maxPages = 0;
+	}
+	pool->pageReleased.notify_all();
+}
+
+PagePool::~PagePool() {
+	DestroyPagePool(this);
+}
+
+int AcquirePage(PagePool *pool, uint8_t **page) {
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	if (pool->maxPages == 0) {
+		return FXT_ERR_SINK_CLOSED;
+	}
+
+	if (pool->freePages.empty() && pool->allocatedPages == pool->maxPages) {
+		const auto pageAvailable = [&]() {
+			return !pool->freePages.empty() || pool->maxPages == 0;
+		};
+
+		const auto waitStart = std::chrono::steady_clock::now();
+		bool acquired = true;
+		if (pool->config.acquireTimeoutMs == 0) {
+			pool->pageReleased.wait(lock, pageAvailable);
+		} else {
+			acquired = pool->pageReleased.wait_for(lock, std::chrono::milliseconds(pool->config.acquireTimeoutMs), pageAvailable);
+		}
+
+		++pool->waits;
+		pool->waitNs += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - waitStart).count();
+
+		if (pool->maxPages == 0) {
+			// Destroyed while we were waiting
+			return FXT_ERR_SINK_CLOSED;
+		}
+		if (!acquired) {
+			++pool->timeouts;
+			return FXT_ERR_POOL_EXHAUSTED;
+		}
+	}
+
+	if (!pool->freePages.empty()) {
+		*page = pool->freePages.back();
+		pool->freePages.pop_back();
+	} else {
+		*page = new (std::nothrow) uint8_t[pool->config.pageSize];
+		if (*page == nullptr) {
+			return FXT_ERR_OUT_OF_MEMORY;
+		}
+		++pool->allocatedPages;
+	}
+
+	++pool->pagesInUse;
+	if (pool->pagesInUse > pool->peakPagesInUse) {
+		pool->peakPagesInUse = pool->pagesInUse;
+	}
+
+	return 0;
+}
+
+void ReleasePage(PagePool *pool, uint8_t *page) {
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		--pool->pagesInUse;
+		if (pool->maxPages == 0) {
+			// The pool has been destroyed, so nobody is going to take the page again
+			delete[] page;
+			--pool->allocatedPages;
+			return;
+		}
+		pool->freePages.push_back(page);
+	}
+	pool->pageReleased.notify_one();
+}
+
+void GetPagePoolMetrics(PagePool *pool, PagePoolMetrics *metrics) {
+	std::lock_guard<std::mutex> lock(pool->mutex);
+
+	const uint64_t pageSize = pool->config.pageSize;
+	metrics->budgetBytes = pool->maxPages * pageSize;
+	metrics->allocatedBytes = pool->allocatedPages * pageSize;
+	metrics->inUseBytes = pool->pagesInUse * pageSize;
+	metrics->peakInUseBytes = pool->peakPagesInUse * pageSize;
+	metrics->waits = pool->waits;
+	metrics->waitNs = pool->waitNs;
+	metrics->timeouts = pool->timeouts;
+}
+
+int AddPagePoolCounterEvent(Writer *writer, PagePool *pool, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp) {
+	PagePoolMetrics metrics;
+	GetPagePoolMetrics(pool, &metrics);
+
+	return FXT_ADD_COUNTER_EVENT(writer, "fxt", "Trace Memory", processID, threadID, timestamp, 0,
+	                             "inUseBytes", metrics.inUseBytes, "allocatedBytes", metrics.allocatedBytes, "budgetBytes", metrics.budgetBytes);
+}
+
+} // End of namespace fxt
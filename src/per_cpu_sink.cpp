@@ -0,0 +1,463 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/per_cpu_sink.h"
+
+#include "fxt/internal/records.h"
+
+#include <chrono>
+#include <errno.h>
+#include <new>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__has_include)
+#	if __has_include(<sys/rseq.h>)
+#		include <sys/rseq.h>
+#		define FXT_HAS_RSEQ 1
+#	endif
+#endif
+
+namespace fxt {
+
+static bool IsPowerOfTwo(size_t value) {
+	return value != 0 && (value & (value - 1)) == 0;
+}
+
+static int WriteAllToFd(int fd, const uint8_t *data, size_t len) {
+	while (len > 0) {
+		const ssize_t written = write(fd, data, len);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return FXT_ERR_WRITE_TO_STREAM_FAILED;
+		}
+
+		data += written;
+		len -= (size_t)written;
+	}
+
+	return 0;
+}
+
+static int WriteToFd(void *userContext, const void *data, size_t len) {
+	return WriteAllToFd(*(const int *)userContext, (const uint8_t *)data, len);
+}
+
+#if defined(FXT_HAS_RSEQ)
+
+// glibc registers an rseq area for every thread, at a fixed offset from the thread pointer
+static struct rseq *GetRseqArea() {
+	uint8_t *threadPointer;
+	__asm__("movq %%fs:0, %0" : "=r"(threadPointer));
+	return (struct rseq *)(threadPointer + __rseq_offset);
+}
+
+static bool IsRseqRegistered() {
+	return __rseq_size != 0 && (int32_t)GetRseqArea()->cpu_id >= 0;
+}
+
+enum class ReserveResult {
+	Reserved,
+	Full,
+	Restart,
+};
+
+// Reserves len bytes in the buffer of the given CPU. This only works if the thread stays on that CPU, and isn't
+// preempted, from the check of cpu_id up to the final store. If either happens, the kernel moves the thread to the
+// abort handler instead, and we try again. Same as librseq's rseq_cmpeqv_storev(), with a capacity check in the middle
+static ReserveResult RseqReserve(struct rseq *rseqArea, uint32_t cpu, uint64_t *reservedPos, const uint64_t *consumedPos, uint64_t len, uint64_t capacity, uint64_t *pos) {
+	__asm__ goto(
+	        ".pushsection __rseq_cs, \"aw\"\n\t"
+	        ".balign 32\n\t"
+	        "3:\n\t"
+	        ".long 0x0, 0x0\n\t"
+	        ".quad 1f, (2f - 1f), 4f\n\t"
+	        ".popsection\n\t"
+	        "leaq 3b(%%rip), %%rax\n\t"
+	        "movq %%rax, %c[rseqCsOffset](%[rseqArea])\n\t"
+	        "1:\n\t"
+	        "cmpl %[cpu], %c[cpuIdOffset](%[rseqArea])\n\t"
+	        "jnz %l[restart]\n\t"
+	        "movq (%[reservedPos]), %%rax\n\t"
+	        "movq %%rax, (%[pos])\n\t"
+	        "addq %[len], %%rax\n\t"
+	        "movq %%rax, %%rcx\n\t"
+	        "subq (%[consumedPos]), %%rcx\n\t"
+	        "cmpq %[capacity], %%rcx\n\t"
+	        "ja %l[full]\n\t"
+	        // The commit. Once this is stored, the space belongs to us, whatever happens next
+	        "movq %%rax, (%[reservedPos])\n\t"
+	        "2:\n\t"
+	        ".pushsection __rseq_failure, \"ax\"\n\t"
+	        // The kernel checks for the signature right before the abort handler
+	        ".byte 0x0f, 0xb9, 0x3d\n\t"
+	        ".long %c[signature]\n\t"
+	        "4:\n\t"
+	        "jmp %l[restart]\n\t"
+	        ".popsection\n\t"
+	        :
+	        : [rseqArea] "r"(rseqArea),
+	          [cpu] "r"(cpu),
+	          [reservedPos] "r"(reservedPos),
+	          [consumedPos] "r"(consumedPos),
+	          [len] "r"(len),
+	          [capacity] "r"(capacity),
+	          [pos] "r"(pos),
+	          [rseqCsOffset] "i"(offsetof(struct rseq, rseq_cs)),
+	          [cpuIdOffset] "i"(offsetof(struct rseq, cpu_id)),
+	          [signature] "i"(RSEQ_SIG)
+	        : "memory", "cc", "rax", "rcx"
+	        : restart, full);
+	return ReserveResult::Reserved;
+restart:
+	return ReserveResult::Restart;
+full:
+	return ReserveResult::Full;
+}
+
+#endif
+
+static void FreeBuffers(PerCpuSink *sink) {
+	if (sink->buffers == nullptr) {
+		return;
+	}
+
+	for (unsigned i = 0; i < sink->numBuffers; ++i) {
+		delete[] sink->buffers[i].data;
+	}
+	delete[] sink->buffers;
+
+	sink->buffers = nullptr;
+	sink->numBuffers = 0;
+}
+
+static void DrainThreadMain(PerCpuSink *sink);
+
+int OpenPerCpuSink(PerCpuSink *sink, int fd, PerCpuSinkConfig config) {
+	if (!IsPowerOfTwo(config.bufferSize)) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (sink->buffers != nullptr) {
+		// Already open
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	// The header records go straight to the file, so they come before anything from the CPU buffers
+	Writer headerWriter(&fd, WriteToFd);
+	int ret = WriteMagicNumberRecord(&headerWriter);
+	if (ret == 0 && config.providerName != nullptr) {
+		ret = AddProviderInfoRecord(&headerWriter, config.providerID, config.providerName);
+	}
+	if (ret == 0 && config.numTicksPerSecond != 0) {
+		ret = AddInitializationRecord(&headerWriter, config.numTicksPerSecond);
+	}
+	if (ret != 0) {
+		return ret;
+	}
+
+	const long numCpus = sysconf(_SC_NPROCESSORS_CONF);
+	sink->numBuffers = numCpus > 0 ? (unsigned)numCpus : 1;
+	sink->buffers = new (std::nothrow) internal::PerCpuBuffer[sink->numBuffers];
+	if (sink->buffers == nullptr) {
+		sink->numBuffers = 0;
+		return FXT_ERR_OUT_OF_MEMORY;
+	}
+	for (unsigned i = 0; i < sink->numBuffers; ++i) {
+		sink->buffers[i].data = new (std::nothrow) uint8_t[config.bufferSize];
+		if (sink->buffers[i].data == nullptr) {
+			FreeBuffers(sink);
+			return FXT_ERR_OUT_OF_MEMORY;
+		}
+	}
+
+	sink->config = config;
+	sink->fd = fd;
+#if defined(FXT_HAS_RSEQ)
+	// glibc registers rseq for every thread or none, so checking the opening thread is enough
+	sink->useRseq = config.useRseq && IsRseqRegistered();
+#else
+	sink->useRseq = false;
+#endif
+	sink->droppedRecords.store(0, std::memory_order_relaxed);
+	sink->droppedBytes.store(0, std::memory_order_relaxed);
+	sink->rseqRestarts.store(0, std::memory_order_relaxed);
+	sink->drainError.store(0, std::memory_order_relaxed);
+	sink->drainRequests = 0;
+	sink->drainsCompleted = 0;
+	sink->shutdown = false;
+	sink->bytesFlushed = headerWriter.bytesWritten;
+
+	sink->drainThread = std::thread(DrainThreadMain, sink);
+
+	return 0;
+}
+
+PerCpuSink::~PerCpuSink() {
+	ClosePerCpuSink(this);
+}
+
+static int ResetInternTablesBeforeRecord(Writer *writer, void *userContext) {
+	(void)userContext;
+
+	ResetInternTables(writer);
+	return 0;
+}
+
+int AttachPerCpuSinkProducer(PerCpuSinkProducer *producer, Writer *writer, PerCpuSink *sink) {
+	if (writer->writeFunc != WriteToPerCpuSink || writer->userContext != producer) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (sink->buffers == nullptr) {
+		return FXT_ERR_SINK_CLOSED;
+	}
+
+	producer->sink = sink;
+	producer->writer = writer;
+	producer->staging.clear();
+	producer->completeEnd = 0;
+
+	writer->recordBoundaryFunc = ResetInternTablesBeforeRecord;
+	writer->recordBoundaryContext = producer;
+	ResetInternTables(writer);
+
+	return 0;
+}
+
+static void DropRecord(PerCpuSink *sink, size_t len) {
+	sink->droppedRecords.fetch_add(1, std::memory_order_relaxed);
+	sink->droppedBytes.fetch_add(len, std::memory_order_relaxed);
+
+	// Get the drain thread going, rather than waiting for the timer
+	std::lock_guard<std::mutex> lock(sink->mutex);
+	++sink->drainRequests;
+	sink->drainCondition.notify_one();
+}
+
+static void CopyToBuffer(PerCpuSink *sink, internal::PerCpuBuffer *buffer, uint64_t pos, const uint8_t *data, size_t len) {
+	const size_t capacity = sink->config.bufferSize;
+	const size_t offset = (size_t)(pos & (capacity - 1));
+	const size_t firstPart = len < capacity - offset ? len : capacity - offset;
+
+	memcpy(buffer->data + offset, data, firstPart);
+	if (firstPart < len) {
+		memcpy(buffer->data, data + firstPart, len - firstPart);
+	}
+
+	// The drain thread only writes out a buffer once every reservation in it has been committed
+	buffer->committedBytes.fetch_add(len, std::memory_order_release);
+}
+
+static void AppendToCpuBuffer(PerCpuSink *sink, const uint8_t *data, size_t len) {
+	const uint64_t capacity = sink->config.bufferSize;
+	if (len > capacity) {
+		DropRecord(sink, len);
+		return;
+	}
+
+#if defined(FXT_HAS_RSEQ)
+	if (sink->useRseq) {
+		struct rseq *rseqArea = GetRseqArea();
+		while (true) {
+			const uint32_t cpu = __atomic_load_n(&rseqArea->cpu_id_start, __ATOMIC_RELAXED);
+			if (cpu >= sink->numBuffers) {
+				// CPUs that were hotplugged after we counted them
+				DropRecord(sink, len);
+				return;
+			}
+
+			internal::PerCpuBuffer *buffer = &sink->buffers[cpu];
+			uint64_t pos;
+			const ReserveResult result = RseqReserve(rseqArea, cpu, (uint64_t *)&buffer->reservedPos, (const uint64_t *)&buffer->consumedPos, len, capacity, &pos);
+			if (result == ReserveResult::Reserved) {
+				CopyToBuffer(sink, buffer, pos, data, len);
+				return;
+			}
+			if (result == ReserveResult::Full) {
+				DropRecord(sink, len);
+				return;
+			}
+
+			sink->rseqRestarts.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+#endif
+
+	// Other threads can share the buffer, since we may be preempted or migrated at any point
+	const int cpu = sched_getcpu();
+	internal::PerCpuBuffer *buffer = &sink->buffers[(unsigned)(cpu < 0 ? 0 : cpu) % sink->numBuffers];
+	uint64_t pos = buffer->reservedPos.load(std::memory_order_relaxed);
+	do {
+		// pos may be stale, and behind consumedPos. Comparing this way round can't underflow, and the CAS retries it
+		if (pos + len > buffer->consumedPos.load(std::memory_order_acquire) + capacity) {
+			DropRecord(sink, len);
+			return;
+		}
+	} while (!buffer->reservedPos.compare_exchange_weak(pos, pos + len, std::memory_order_relaxed));
+
+	CopyToBuffer(sink, buffer, pos, data, len);
+}
+
+int WriteToPerCpuSink(void *userContext, const void *data, size_t len) {
+	PerCpuSinkProducer *producer = (PerCpuSinkProducer *)userContext;
+
+	if (producer->sink == nullptr || producer->sink->buffers == nullptr) {
+		return FXT_ERR_SINK_CLOSED;
+	}
+
+	producer->staging.insert(producer->staging.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+
+	// Each record comes in over several writes, so find out how much of the staging area is whole records
+	while (producer->staging.size() - producer->completeEnd >= sizeof(uint64_t)) {
+		uint64_t header;
+		memcpy(&header, producer->staging.data() + producer->completeEnd, sizeof(header));
+		const uint64_t recordSize = internal::WordsToBytes(internal::GetRecordSizeInWords(header));
+		if (recordSize == 0) {
+			producer->staging.clear();
+			producer->completeEnd = 0;
+			return FXT_ERR_INVALID_TRACE;
+		}
+		if (producer->staging.size() - producer->completeEnd < recordSize) {
+			break;
+		}
+		producer->completeEnd += recordSize;
+
+		// String and Thread records belong to the record that follows them, so they have to go in together
+		const internal::RecordType type = internal::RecordFields::Type::Get<internal::RecordType>(header);
+		if (producer->completeEnd == producer->staging.size() && type != internal::RecordType::String && type != internal::RecordType::Thread) {
+			AppendToCpuBuffer(producer->sink, producer->staging.data(), producer->staging.size());
+			producer->staging.clear();
+			producer->completeEnd = 0;
+		}
+	}
+
+	return 0;
+}
+
+// Writes out everything committed to a buffer. Returns false if there are appends in flight, and wait is false
+static bool DrainBuffer(PerCpuSink *sink, internal::PerCpuBuffer *buffer, bool wait) {
+	uint64_t reserved;
+	while (true) {
+		// committedBytes has to be read first. If it matches the reservations made after it was read, every reservation
+		// up to that point has been copied in, even if they were committed out of order
+		const uint64_t committed = buffer->committedBytes.load(std::memory_order_acquire);
+		reserved = buffer->reservedPos.load(std::memory_order_acquire);
+		if (committed == reserved) {
+			break;
+		}
+		if (!wait) {
+			return false;
+		}
+		std::this_thread::yield();
+	}
+
+	const uint64_t consumed = buffer->consumedPos.load(std::memory_order_relaxed);
+	if (reserved == consumed) {
+		return true;
+	}
+
+	const size_t capacity = sink->config.bufferSize;
+	const size_t offset = (size_t)(consumed & (capacity - 1));
+	const size_t len = (size_t)(reserved - consumed);
+	const size_t firstPart = len < capacity - offset ? len : capacity - offset;
+
+	int ret = WriteAllToFd(sink->fd, buffer->data + offset, firstPart);
+	if (ret == 0 && firstPart < len) {
+		ret = WriteAllToFd(sink->fd, buffer->data, len - firstPart);
+	}
+	if (ret != 0) {
+		// Only keep the first error. The data is lost, but we still free up the space, so the producers can keep going
+		int expected = 0;
+		sink->drainError.compare_exchange_strong(expected, ret, std::memory_order_relaxed);
+	}
+
+	buffer->consumedPos.store(reserved, std::memory_order_release);
+
+	std::lock_guard<std::mutex> lock(sink->mutex);
+	if (ret == 0) {
+		sink->bytesFlushed += len;
+	}
+
+	return true;
+}
+
+static void DrainThreadMain(PerCpuSink *sink) {
+	const auto flushInterval = std::chrono::milliseconds(sink->config.flushIntervalMs);
+
+	std::unique_lock<std::mutex> lock(sink->mutex);
+	while (true) {
+		const uint64_t requests = sink->drainRequests;
+		const bool stopping = sink->shutdown;
+		// Timer drains skip buffers that are in the middle of an append. Requested drains wait for them to finish
+		const bool wait = stopping || requests != sink->drainsCompleted;
+		lock.unlock();
+
+		for (unsigned i = 0; i < sink->numBuffers; ++i) {
+			DrainBuffer(sink, &sink->buffers[i], wait);
+		}
+
+		lock.lock();
+		sink->drainsCompleted = requests;
+		sink->drainedCondition.notify_all();
+		if (stopping) {
+			break;
+		}
+		if (sink->drainRequests != requests || sink->shutdown) {
+			continue;
+		}
+
+		if (sink->config.flushIntervalMs == 0) {
+			sink->drainCondition.wait(lock);
+		} else {
+			sink->drainCondition.wait_for(lock, flushInterval);
+		}
+	}
+}
+
+int FlushPerCpuSink(PerCpuSink *sink) {
+	std::unique_lock<std::mutex> lock(sink->mutex);
+	if (sink->buffers == nullptr || sink->shutdown) {
+		return sink->drainError.load(std::memory_order_relaxed);
+	}
+
+	const uint64_t ticket = ++sink->drainRequests;
+	sink->drainCondition.notify_one();
+	sink->drainedCondition.wait(lock, [&] { return sink->drainsCompleted >= ticket; });
+
+	return sink->drainError.load(std::memory_order_relaxed);
+}
+
+int ClosePerCpuSink(PerCpuSink *sink) {
+	if (sink->buffers == nullptr) {
+		return sink->drainError.load(std::memory_order_relaxed);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(sink->mutex);
+		sink->shutdown = true;
+		sink->drainCondition.notify_one();
+	}
+	sink->drainThread.join();
+
+	FreeBuffers(sink);
+	sink->fd = -1;
+
+	return sink->drainError.load(std::memory_order_relaxed);
+}
+
+void GetPerCpuSinkMetrics(PerCpuSink *sink, PerCpuSinkMetrics *metrics) {
+	{
+		std::lock_guard<std::mutex> lock(sink->mutex);
+		metrics->bytesFlushed = sink->bytesFlushed;
+	}
+	metrics->droppedRecords = sink->droppedRecords.load(std::memory_order_relaxed);
+	metrics->droppedBytes = sink->droppedBytes.load(std::memory_order_relaxed);
+	metrics->rseqRestarts = sink->rseqRestarts.load(std::memory_order_relaxed);
+}
+
+} // End of namespace fxt
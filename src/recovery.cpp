@@ -0,0 +1,171 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/recovery.h"
+
+#include "fxt/internal/fields.h"
+#include "fxt/internal/records.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+namespace fxt {
+
+int ScanTrace(const void *data, size_t len, TraceRecoveryResult *result) {
+	*result = {};
+
+	const uint8_t *bytes = (const uint8_t *)data;
+	uint64_t header;
+	if (len < sizeof(header)) {
+		return FXT_ERR_INVALID_TRACE;
+	}
+	memcpy(&header, bytes, sizeof(header));
+	if (header != internal::kMagicNumberRecord) {
+		return FXT_ERR_INVALID_TRACE;
+	}
+
+	size_t offset = 0;
+	while (len - offset >= sizeof(header)) {
+		memcpy(&header, bytes + offset, sizeof(header));
+
+		const uint64_t recordSize = internal::WordsToBytes(internal::GetRecordSizeInWords(header));
+		if (recordSize == 0 || recordSize > len - offset) {
+			break;
+		}
+
+		offset += recordSize;
+		++result->recordCount;
+	}
+
+	result->validBytes = offset;
+	result->discardedBytes = len - offset;
+
+	return 0;
+}
+
+// Payload data can contain the magic number, but it's very unlikely to be followed by valid header records too. A real
+// checkpoint is followed by its Initialization record, with only Provider records in between
+static bool IsFollowedByInitialization(const uint8_t *bytes, size_t len, size_t offset) {
+	offset += sizeof(uint64_t);
+	while (len - offset >= sizeof(uint64_t)) {
+		uint64_t header;
+		memcpy(&header, bytes + offset, sizeof(header));
+		const uint64_t recordSize = internal::WordsToBytes(internal::GetRecordSizeInWords(header));
+		if (recordSize == 0 || recordSize > len - offset) {
+			return false;
+		}
+
+		const internal::RecordType type = internal::RecordFields::Type::Get<internal::RecordType>(header);
+		if (type == internal::RecordType::Initialization) {
+			return true;
+		}
+		if (type != internal::RecordType::Metadata) {
+			return false;
+		}
+		const internal::MetadataType metadataType = internal::MetadataRecordFields::MetadataType::Get<internal::MetadataType>(header);
+		if (metadataType != internal::MetadataType::ProviderInfo && metadataType != internal::MetadataType::ProviderSection) {
+			return false;
+		}
+
+		offset += recordSize;
+	}
+
+	return false;
+}
+
+size_t FindNextCheckpoint(const void *data, size_t len, size_t offset) {
+	const uint8_t *bytes = (const uint8_t *)data;
+
+	for (offset = internal::Pad(offset); offset + sizeof(uint64_t) <= len; offset += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, bytes + offset, sizeof(word));
+		if (word == internal::kMagicNumberRecord && IsFollowedByInitialization(bytes, len, offset)) {
+			return offset;
+		}
+	}
+
+	return len;
+}
+
+int RecoverTraceFile(const char *inputPath, const char *outputPath, TraceRecoveryResult *result) {
+	TraceRecoveryResult scan = {};
+
+	FILE *input = fopen(inputPath, "rb");
+	if (input == nullptr) {
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	uint64_t header;
+	if (fread(&header, 1, sizeof(header), input) != sizeof(header) || header != internal::kMagicNumberRecord) {
+		fclose(input);
+		return FXT_ERR_INVALID_TRACE;
+	}
+
+	FILE *output = fopen(outputPath, "wb");
+	if (output == nullptr) {
+		fclose(input);
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	int ret = 0;
+	std::vector<uint8_t> record;
+	size_t headerRead = sizeof(header);
+	while (headerRead == sizeof(header)) {
+		const uint64_t recordSize = internal::WordsToBytes(internal::GetRecordSizeInWords(header));
+		if (recordSize == 0) {
+			scan.discardedBytes += sizeof(header);
+			break;
+		}
+
+		// Buffer the whole record, so we only ever write complete records
+		record.resize(recordSize);
+		memcpy(record.data(), &header, sizeof(header));
+		const size_t bodyRead = fread(record.data() + sizeof(header), 1, recordSize - sizeof(header), input);
+		if (bodyRead != recordSize - sizeof(header)) {
+			scan.discardedBytes += sizeof(header) + bodyRead;
+			break;
+		}
+
+		if (fwrite(record.data(), 1, recordSize, output) != recordSize) {
+			ret = FXT_ERR_WRITE_TO_STREAM_FAILED;
+			break;
+		}
+		scan.validBytes += recordSize;
+		++scan.recordCount;
+
+		headerRead = fread(&header, 1, sizeof(header), input);
+		if (headerRead != sizeof(header)) {
+			scan.discardedBytes += headerRead;
+		}
+	}
+
+	if (ret == 0 && ferror(input)) {
+		ret = FXT_ERR_READ_FROM_STREAM_FAILED;
+	}
+	if (ret == 0) {
+		// Count the rest of the file, so the caller can see how much was thrown away
+		uint8_t chunk[4096];
+		size_t read;
+		while ((read = fread(chunk, 1, sizeof(chunk), input)) > 0) {
+			scan.discardedBytes += read;
+		}
+	}
+
+	fclose(input);
+	if (fclose(output) != 0 && ret == 0) {
+		ret = FXT_ERR_WRITE_TO_STREAM_FAILED;
+	}
+
+	if (result != nullptr) {
+		*result = scan;
+	}
+
+	return ret;
+}
+
+} // End of namespace fxt
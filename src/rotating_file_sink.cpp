@@ -0,0 +1,190 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/rotating_file_sink.h"
+
+namespace fxt {
+
+static void SetError(RotatingFileSink *sink, int error) {
+	// Only keep the first error
+	if (sink->error == 0) {
+		sink->error = error;
+	}
+}
+
+static int CloseChunk(RotatingFileSink *sink) {
+	if (sink->file == nullptr) {
+		return 0;
+	}
+
+	const int ret = fclose(sink->file);
+	sink->file = nullptr;
+	if (ret != 0) {
+		SetError(sink, FXT_ERR_WRITE_TO_STREAM_FAILED);
+		return FXT_ERR_WRITE_TO_STREAM_FAILED;
+	}
+
+	return 0;
+}
+
+// Opens the next chunk, and makes it self-contained
+static int OpenNextChunk(RotatingFileSink *sink) {
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "-%04u.fxt", sink->nextChunkIndex);
+	const std::string path = sink->basePath + suffix;
+
+	sink->file = fopen(path.c_str(), "wb");
+	if (sink->file == nullptr) {
+		SetError(sink, FXT_ERR_OPEN_FAILED);
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	++sink->nextChunkIndex;
+	sink->chunkBytes = 0;
+	if (sink->config.maxChunkDurationMs != 0) {
+		sink->chunkStartTime = std::chrono::steady_clock::now();
+	}
+
+	// The header records go through the writer, like everything else
+	Writer *writer = sink->writer;
+	int ret = WriteMagicNumberRecord(writer);
+	if (ret != 0) {
+		return ret;
+	}
+	ret = AddProviderInfoRecord(writer, sink->config.providerID, sink->providerName.c_str());
+	if (ret != 0) {
+		return ret;
+	}
+	ret = AddProviderSectionRecord(writer, sink->config.providerID);
+	if (ret != 0) {
+		return ret;
+	}
+	// After the first chunk, carry over the writer's current rate. With a clock attached, that's the clock's rate, and
+	// the writer won't write it again on its own, since the clock hasn't changed
+	ret = AddInitializationRecord(writer, writer->numTicksPerSecond != 0 ? writer->numTicksPerSecond : sink->config.numTicksPerSecond);
+	if (ret != 0) {
+		return ret;
+	}
+
+	// Nothing written to earlier chunks can be referenced from this one
+	ResetInternTables(writer);
+
+	return 0;
+}
+
+static bool IsChunkFull(RotatingFileSink *sink) {
+	if (sink->config.maxChunkBytes != 0 && sink->chunkBytes >= sink->config.maxChunkBytes) {
+		return true;
+	}
+	if (sink->config.maxChunkDurationMs != 0) {
+		const auto maxDuration = std::chrono::milliseconds(sink->config.maxChunkDurationMs);
+		if (std::chrono::steady_clock::now() - sink->chunkStartTime >= maxDuration) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static int OnRecordBoundary(Writer *writer, void *userContext) {
+	(void)writer;
+	RotatingFileSink *sink = (RotatingFileSink *)userContext;
+
+	if (sink->error != 0) {
+		return sink->error;
+	}
+	if (!IsChunkFull(sink)) {
+		return 0;
+	}
+
+	return RotateChunk(sink);
+}
+
+int OpenRotatingFileSink(RotatingFileSink *sink, Writer *writer, RotatingFileSinkConfig config) {
+	if (config.basePath == nullptr || config.providerName == nullptr || writer == nullptr) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (writer->userContext != sink || writer->writeFunc != WriteToRotatingFileSink) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (sink->file != nullptr) {
+		// Already open
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	sink->config = config;
+	sink->basePath = config.basePath;
+	sink->providerName = config.providerName;
+	// Don't keep pointers to the caller's strings
+	sink->config.basePath = nullptr;
+	sink->config.providerName = nullptr;
+
+	sink->writer = writer;
+	sink->nextChunkIndex = 0;
+	sink->error = 0;
+
+	const int ret = OpenNextChunk(sink);
+	if (ret != 0) {
+		CloseChunk(sink);
+		sink->writer = nullptr;
+		return ret;
+	}
+
+	writer->recordBoundaryFunc = OnRecordBoundary;
+	writer->recordBoundaryContext = sink;
+
+	return 0;
+}
+
+int WriteToRotatingFileSink(void *userContext, const void *data, size_t len) {
+	RotatingFileSink *sink = (RotatingFileSink *)userContext;
+
+	if (sink->error != 0) {
+		return sink->error;
+	}
+	if (sink->file == nullptr) {
+		return FXT_ERR_SINK_CLOSED;
+	}
+
+	if (fwrite(data, 1, len, sink->file) != len) {
+		SetError(sink, FXT_ERR_WRITE_TO_STREAM_FAILED);
+		return FXT_ERR_WRITE_TO_STREAM_FAILED;
+	}
+	sink->chunkBytes += len;
+
+	return 0;
+}
+
+int RotateChunk(RotatingFileSink *sink) {
+	if (sink->file == nullptr) {
+		return sink->error != 0 ? sink->error : FXT_ERR_SINK_CLOSED;
+	}
+
+	int ret = CloseChunk(sink);
+	if (ret != 0) {
+		return ret;
+	}
+
+	return OpenNextChunk(sink);
+}
+
+int CloseRotatingFileSink(RotatingFileSink *sink) {
+	if (sink->writer != nullptr && sink->writer->recordBoundaryContext == sink) {
+		sink->writer->recordBoundaryFunc = nullptr;
+		sink->writer->recordBoundaryContext = nullptr;
+	}
+	sink->writer = nullptr;
+
+	CloseChunk(sink);
+
+	return sink->error;
+}
+
+RotatingFileSink::~RotatingFileSink() {
+	CloseRotatingFileSink(this);
+}
+
+} // End of namespace fxt
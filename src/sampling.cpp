@@ -0,0 +1,197 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/sampling.h"
+
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+#include <atomic>
+
+namespace fxt {
+
+struct SamplerThreadState {
+	/**
+	 * @brief nullptr until the thread first uses the sampler
+	 */
+	internal::SamplerShard *shard = nullptr;
+
+	uint32_t oneInNCount = 0;
+	uint64_t randomState = 0;
+
+	double tokens = 0.0;
+	uint64_t lastRefill = 0;
+};
+
+static void InitSamplerThreadState(Sampler *sampler, SamplerThreadState *state);
+
+static SamplerThreadState *GetSamplerThreadState(Sampler *sampler) {
+	static thread_local internal::ThreadSlots<SamplerThreadState> states;
+
+	SamplerThreadState *state = internal::GetThreadSlot(&states, sampler->slot);
+	if (state->shard == nullptr) {
+		InitSamplerThreadState(sampler, state);
+	}
+	return state;
+}
+
+// splitmix64. Cheap, and good enough to decide what to drop
+static uint64_t NextRandom(uint64_t *state) {
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+static uint64_t ReadRateLimitTime(const Sampler *sampler, uint64_t *ticksPerSecond) {
+	if (sampler->config.clock != nullptr) {
+		*ticksPerSecond = sampler->config.clock->ticksPerSecond.load(std::memory_order_relaxed);
+		return ReadClock(sampler->config.clock);
+	}
+
+	*ticksPerSecond = 1000000000;
+	return internal::ReadMonotonicNs();
+}
+
+static double GetBurst(const Sampler *sampler) {
+	return (double)(sampler->config.burst != 0 ? sampler->config.burst : sampler->config.maxEventsPerSecond);
+}
+
+static void InitSamplerThreadState(Sampler *sampler, SamplerThreadState *state) {
+	// Seed each thread differently, so they don't all keep the same events
+	state->randomState = (uint64_t)(uintptr_t)state ^ internal::ReadMonotonicNs();
+	uint64_t ticksPerSecond;
+	state->lastRefill = ReadRateLimitTime(sampler, &ticksPerSecond);
+	state->tokens = GetBurst(sampler);
+
+	std::unique_ptr<internal::SamplerShard> newShard(new internal::SamplerShard());
+
+	std::lock_guard<std::mutex> lock(sampler->mutex);
+	newShard->counterID = sampler->shards.size() + 1;
+	state->shard = newShard.get();
+	sampler->shards.push_back(std::move(newShard));
+}
+
+Sampler::~Sampler() {
+	internal::ReleaseThreadSlot<Sampler>(&slot);
+}
+
+int InitSampler(Sampler *sampler, const char *category, SamplingConfig config) {
+	if (config.oneInN == 0) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (!(config.probability >= 0.0 && config.probability <= 1.0)) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	sampler->category = category;
+	sampler->counterName = std::string("Sampling: ") + category;
+	sampler->config = config;
+	internal::AcquireThreadSlot<Sampler>(&sampler->slot);
+
+	// 2^64 doesn't fit, so a probability of 1 skips the draw entirely
+	if (config.probability < 1.0) {
+		sampler->probabilityThreshold = (uint64_t)(config.probability * 18446744073709551616.0);
+	} else {
+		sampler->probabilityThreshold = UINT64_MAX;
+	}
+
+	return 0;
+}
+
+bool SampleEvent(Sampler *sampler) {
+	SamplerThreadState *state = GetSamplerThreadState(sampler);
+	const SamplingConfig &config = sampler->config;
+
+	bool keep = true;
+	if (config.oneInN > 1) {
+		keep = state->oneInNCount == 0;
+		if (++state->oneInNCount == config.oneInN) {
+			state->oneInNCount = 0;
+		}
+	}
+	if (keep && sampler->probabilityThreshold != UINT64_MAX) {
+		keep = NextRandom(&state->randomState) < sampler->probabilityThreshold;
+	}
+	if (keep && config.maxEventsPerSecond != 0) {
+		uint64_t ticksPerSecond;
+		const uint64_t now = ReadRateLimitTime(sampler, &ticksPerSecond);
+		if (now > state->lastRefill && ticksPerSecond != 0) {
+			const double burst = GetBurst(sampler);
+			state->tokens += (double)(now - state->lastRefill) * (double)config.maxEventsPerSecond / (double)ticksPerSecond;
+			if (state->tokens > burst) {
+				state->tokens = burst;
+			}
+			state->lastRefill = now;
+		}
+
+		if (state->tokens >= 1.0) {
+			state->tokens -= 1.0;
+		} else {
+			keep = false;
+		}
+	}
+
+	// Only this thread writes the counts, so there's no need for an atomic increment
+	std::atomic<uint64_t> &count = keep ? state->shard->kept : state->shard->sampledOut;
+	count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	return keep;
+}
+
+int AddSamplerCounterEvent(Writer *writer, Sampler *sampler, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp) {
+	const internal::SamplerShard *shard = GetSamplerThreadState(sampler)->shard;
+	const uint64_t kept = shard->kept.load(std::memory_order_relaxed);
+	const uint64_t sampledOut = shard->sampledOut.load(std::memory_order_relaxed);
+
+	return FXT_ADD_COUNTER_EVENT(writer, "fxt", sampler->counterName.c_str(), processID, threadID, timestamp, shard->counterID, "kept", kept, "sampledOut", sampledOut);
+}
+
+int AddSamplerTotalCounterEvent(Writer *writer, Sampler *sampler, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp) {
+	uint64_t kept = 0;
+	uint64_t sampledOut = 0;
+	{
+		std::lock_guard<std::mutex> lock(sampler->mutex);
+
+		for (const auto &shard : sampler->shards) {
+			kept += shard->kept.load(std::memory_order_relaxed);
+			sampledOut += shard->sampledOut.load(std::memory_order_relaxed);
+		}
+	}
+
+	return FXT_ADD_COUNTER_EVENT(writer, "fxt", sampler->counterName.c_str(), processID, threadID, timestamp, 0, "kept", kept, "sampledOut", sampledOut);
+}
+
+int InitCorrelationSampler(CorrelationSampler *sampler, const char *category, double probability, uint64_t seed) {
+	if (!(probability >= 0.0 && probability <= 1.0)) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	sampler->category = category;
+	sampler->probability = probability;
+	sampler->seed = seed;
+	if (probability < 1.0) {
+		sampler->threshold = (uint64_t)(probability * 18446744073709551616.0);
+	} else {
+		sampler->threshold = UINT64_MAX;
+	}
+
+	return 0;
+}
+
+bool SampleCorrelationID(const CorrelationSampler *sampler, uint64_t correlationID) {
+	if (sampler->threshold == UINT64_MAX) {
+		return true;
+	}
+
+	// Hash a fixed byte order, so processes on machines of either endianness agree
+	uint8_t bytes[8];
+	for (unsigned i = 0; i < 8; ++i) {
+		bytes[i] = (uint8_t)(correlationID >> (i * 8));
+	}
+	return XXH3_64bits_withSeed(bytes, sizeof(bytes), sampler->seed) < sampler->threshold;
+}
+
+} // End of namespace fxt
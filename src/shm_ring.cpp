@@ -0,0 +1,336 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/shm_ring.h"
+
+#include "fxt/internal/records.h"
+
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <new>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace fxt {
+
+static bool IsPowerOfTwo(size_t value) {
+	return value != 0 && (value & (value - 1)) == 0;
+}
+
+static void SetError(ShmRingSink *sink, int error) {
+	// Only keep the first error
+	if (sink->error == 0) {
+		sink->error = error;
+	}
+}
+
+int OpenShmRingSink(ShmRingSink *sink, const char *name, ShmRingSinkConfig config) {
+	if (name == nullptr || !IsPowerOfTwo(config.capacity) || config.providerName == nullptr) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (sink->header != nullptr) {
+		// Already open
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	// Replace any leftover ring from an earlier run, rather than appending to a collector's view of it
+	shm_unlink(name);
+	const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	const size_t mappingSize = internal::ShmRingDataOffset() + config.capacity;
+	if (ftruncate(fd, (off_t)mappingSize) != 0) {
+		close(fd);
+		shm_unlink(name);
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	void *mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	// The mapping keeps the object alive on its own
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		shm_unlink(name);
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	internal::ShmRingHeader *header = new (mapping) internal::ShmRingHeader();
+	header->version = internal::kShmRingVersion;
+	header->providerID = (uint32_t)config.providerID;
+	header->capacity = config.capacity;
+	header->producerPid = (int64_t)getpid();
+	snprintf(header->providerName, sizeof(header->providerName), "%s", config.providerName);
+	header->closed.store(0, std::memory_order_relaxed);
+	header->publishedPos.store(0, std::memory_order_relaxed);
+	header->consumedPos.store(0, std::memory_order_relaxed);
+	header->magic.store(internal::kShmRingMagic, std::memory_order_release);
+
+	sink->config = config;
+	sink->name = name;
+	sink->header = header;
+	sink->data = (uint8_t *)mapping + internal::ShmRingDataOffset();
+	sink->mappingSize = mappingSize;
+	sink->writePos = 0;
+	sink->recordRemaining = 0;
+	sink->partialHeaderLen = 0;
+	sink->error = 0;
+
+	return 0;
+}
+
+// Waits until the ring has room for len more bytes past writePos
+static int WaitForSpace(ShmRingSink *sink, uint64_t len) {
+	const uint64_t capacity = sink->config.capacity;
+	if (sink->writePos + len - sink->header->consumedPos.load(std::memory_order_acquire) <= capacity) {
+		return 0;
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	const auto timeout = std::chrono::milliseconds(sink->config.fullTimeoutMs);
+	unsigned spins = 0;
+	while (sink->writePos + len - sink->header->consumedPos.load(std::memory_order_acquire) > capacity) {
+		if (spins < 64) {
+			++spins;
+			std::this_thread::yield();
+			continue;
+		}
+		if (sink->config.fullTimeoutMs != 0 && std::chrono::steady_clock::now() - start > timeout) {
+			return FXT_ERR_FLUSH_TIMEOUT;
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+
+	return 0;
+}
+
+static void CopyToRing(ShmRingSink *sink, const uint8_t *src, size_t len) {
+	const uint64_t mask = sink->config.capacity - 1;
+	const size_t offset = (size_t)(sink->writePos & mask);
+	const size_t firstPart = len < sink->config.capacity - offset ? len : sink->config.capacity - offset;
+
+	memcpy(sink->data + offset, src, firstPart);
+	if (firstPart < len) {
+		memcpy(sink->data, src + firstPart, len - firstPart);
+	}
+	sink->writePos += len;
+}
+
+int WriteToShmRingSink(void *userContext, const void *data, size_t len) {
+	ShmRingSink *sink = (ShmRingSink *)userContext;
+
+	if (sink->error != 0) {
+		return sink->error;
+	}
+	if (sink->header == nullptr) {
+		return FXT_ERR_SINK_CLOSED;
+	}
+
+	const uint8_t *src = (const uint8_t *)data;
+	while (len > 0) {
+		if (sink->recordRemaining == 0) {
+			// Start of a new record. We need the whole header to know how much room it needs
+			const size_t wanted = sizeof(sink->partialHeader) - sink->partialHeaderLen;
+			const size_t toCopy = len < wanted ? len : wanted;
+			memcpy(sink->partialHeader + sink->partialHeaderLen, src, toCopy);
+			sink->partialHeaderLen += toCopy;
+			src += toCopy;
+			len -= toCopy;
+			if (sink->partialHeaderLen < sizeof(sink->partialHeader)) {
+				return 0;
+			}
+
+			uint64_t header;
+			memcpy(&header, sink->partialHeader, sizeof(header));
+			const uint64_t recordSize = internal::WordsToBytes(internal::GetRecordSizeInWords(header));
+			if (recordSize == 0) {
+				SetError(sink, FXT_ERR_INVALID_TRACE);
+				return sink->error;
+			}
+			if (recordSize > sink->config.capacity) {
+				SetError(sink, FXT_ERR_INVALID_CONFIG);
+				return sink->error;
+			}
+
+			// Reserve the whole record up front, so the rest of it never has to wait
+			const int ret = WaitForSpace(sink, recordSize);
+			if (ret != 0) {
+				SetError(sink, ret);
+				return ret;
+			}
+
+			CopyToRing(sink, sink->partialHeader, sizeof(sink->partialHeader));
+			sink->partialHeaderLen = 0;
+			sink->recordRemaining = recordSize - sizeof(sink->partialHeader);
+		} else {
+			const size_t toCopy = len < sink->recordRemaining ? len : (size_t)sink->recordRemaining;
+			CopyToRing(sink, src, toCopy);
+			sink->recordRemaining -= toCopy;
+			src += toCopy;
+			len -= toCopy;
+		}
+
+		if (sink->recordRemaining == 0) {
+			sink->header->publishedPos.store(sink->writePos, std::memory_order_release);
+		}
+	}
+
+	return 0;
+}
+
+int CloseShmRingSink(ShmRingSink *sink) {
+	if (sink->header == nullptr) {
+		return sink->error;
+	}
+
+	sink->header->closed.store(1, std::memory_order_release);
+	munmap(sink->header, sink->mappingSize);
+	sink->header = nullptr;
+	sink->data = nullptr;
+
+	return sink->error;
+}
+
+ShmRingSink::~ShmRingSink() {
+	CloseShmRingSink(this);
+}
+
+int OpenShmRingReader(ShmRingReader *reader, Collector *collector, const char *name) {
+	if (reader->header != nullptr) {
+		// Already open
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	const int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || (size_t)info.st_size < internal::ShmRingDataOffset()) {
+		// The producer may not have sized it yet
+		close(fd);
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	const size_t mappingSize = (size_t)info.st_size;
+	void *mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	internal::ShmRingHeader *header = (internal::ShmRingHeader *)mapping;
+	if (header->magic.load(std::memory_order_acquire) != internal::kShmRingMagic) {
+		// The producer is still filling in the header
+		munmap(mapping, mappingSize);
+		return FXT_ERR_OPEN_FAILED;
+	}
+	if (header->version != internal::kShmRingVersion || !IsPowerOfTwo(header->capacity) || internal::ShmRingDataOffset() + header->capacity != mappingSize) {
+		munmap(mapping, mappingSize);
+		return FXT_ERR_INVALID_TRACE;
+	}
+
+	char providerName[sizeof(header->providerName) + 1];
+	memcpy(providerName, header->providerName, sizeof(header->providerName));
+	providerName[sizeof(header->providerName)] = '\0';
+
+	const int ret = AddCollectorStream(collector, header->providerID, providerName, &reader->streamIndex);
+	if (ret != 0) {
+		munmap(mapping, mappingSize);
+		return ret;
+	}
+
+	reader->name = name;
+	reader->header = header;
+	reader->data = (const uint8_t *)mapping + internal::ShmRingDataOffset();
+	reader->mappingSize = mappingSize;
+	reader->finished = false;
+
+	return 0;
+}
+
+static bool IsProducerGone(const internal::ShmRingHeader *header) {
+	if (header->closed.load(std::memory_order_acquire) != 0) {
+		return true;
+	}
+
+	// The producer crashed, or exited without closing the sink
+	return kill((pid_t)header->producerPid, 0) != 0 && errno == ESRCH;
+}
+
+int PollShmRingReader(ShmRingReader *reader, Collector *collector, size_t *bytesCollected) {
+	if (bytesCollected != nullptr) {
+		*bytesCollected = 0;
+	}
+	if (reader->header == nullptr || reader->finished) {
+		return 0;
+	}
+
+	internal::ShmRingHeader *header = reader->header;
+
+	// Check this first. If the producer is gone now, nothing can be published after the load below
+	const bool producerGone = IsProducerGone(header);
+
+	const uint64_t capacity = header->capacity;
+	const uint64_t consumed = header->consumedPos.load(std::memory_order_relaxed);
+	const uint64_t published = header->publishedPos.load(std::memory_order_acquire);
+	if (published - consumed > capacity) {
+		return FXT_ERR_INVALID_TRACE;
+	}
+
+	const size_t len = (size_t)(published - consumed);
+	if (len > 0) {
+		const size_t offset = (size_t)(consumed & (capacity - 1));
+
+		int ret;
+		if (offset + len <= capacity) {
+			ret = CollectRecords(collector, reader->streamIndex, reader->data + offset, len);
+		} else {
+			// A record may straddle the end of the ring
+			const size_t firstPart = (size_t)capacity - offset;
+			reader->scratch.resize(len);
+			memcpy(reader->scratch.data(), reader->data + offset, firstPart);
+			memcpy(reader->scratch.data() + firstPart, reader->data, len - firstPart);
+			ret = CollectRecords(collector, reader->streamIndex, reader->scratch.data(), len);
+		}
+		if (ret != 0) {
+			return ret;
+		}
+
+		header->consumedPos.store(published, std::memory_order_release);
+		if (bytesCollected != nullptr) {
+			*bytesCollected = len;
+		}
+	}
+
+	if (producerGone) {
+		reader->finished = true;
+		shm_unlink(reader->name.c_str());
+	}
+
+	return 0;
+}
+
+void CloseShmRingReader(ShmRingReader *reader) {
+	if (reader->header != nullptr) {
+		munmap(reader->header, reader->mappingSize);
+		reader->header = nullptr;
+		reader->data = nullptr;
+	}
+}
+
+ShmRingReader::~ShmRingReader() {
+	CloseShmRingReader(this);
+}
+
+} // End of namespace fxt
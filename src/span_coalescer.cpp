@@ -0,0 +1,148 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/span_coalescer.h"
+
+#include <string.h>
+
+namespace fxt {
+
+struct SpanRun {
+	Writer *writer = nullptr;
+	const char *category;
+	const char *name;
+	KernelObjectID processID;
+	KernelObjectID threadID;
+	uint64_t beginTimestamp;
+	uint64_t endTimestamp;
+
+	uint64_t count = 0;
+	uint64_t totalDuration;
+	uint64_t maxDuration;
+};
+
+static SpanRun *GetSpanRun(const SpanCoalescer *coalescer) {
+	static thread_local internal::ThreadSlots<SpanRun> runs;
+
+	return internal::GetThreadSlot(&runs, coalescer->slot);
+}
+
+static bool SameString(const char *a, const char *b) {
+	// Literals are usually the same pointer, so that's checked first
+	return a == b || strcmp(a, b) == 0;
+}
+
+static uint64_t TicksToNs(const Writer *writer, uint64_t ticks) {
+	if (writer->numTicksPerSecond == 0 || writer->numTicksPerSecond == 1000000000) {
+		return ticks;
+	}
+	return (uint64_t)((double)ticks * 1e9 / (double)writer->numTicksPerSecond);
+}
+
+static int WriteSpanRun(SpanRun *run) {
+	if (run->count == 0) {
+		return 0;
+	}
+
+	const uint64_t count = run->count;
+	run->count = 0;
+	if (run->writer->pendingRecordContext == run) {
+		run->writer->pendingRecordFunc = nullptr;
+		run->writer->pendingRecordContext = nullptr;
+	}
+
+	if (count == 1) {
+		return AddDurationCompleteEvent(run->writer, run->category, run->name, run->processID, run->threadID, run->beginTimestamp, run->endTimestamp);
+	}
+	return FXT_ADD_DURATION_COMPLETE_EVENT(run->writer, run->category, run->name, run->processID, run->threadID, run->beginTimestamp, run->endTimestamp, "count", count, "total_ns", TicksToNs(run->writer, run->totalDuration), "max_ns", TicksToNs(run->writer, run->maxDuration));
+}
+
+// Called by the writer when something else is about to be written
+static int WritePendingSpanRun(Writer *writer, void *userContext) {
+	(void)writer;
+	return WriteSpanRun((SpanRun *)userContext);
+}
+
+SpanCoalescer::~SpanCoalescer() {
+	internal::ReleaseThreadSlot<SpanCoalescer>(&slot);
+}
+
+int InitSpanCoalescer(SpanCoalescer *coalescer, SpanCoalescerConfig config) {
+	coalescer->config = config;
+	internal::AcquireThreadSlot<SpanCoalescer>(&coalescer->slot);
+
+	return 0;
+}
+
+int AddCoalescedSpan(SpanCoalescer *coalescer, Writer *writer, const char *category, const char *name, KernelObjectID processID, KernelObjectID threadID, uint64_t beginTimestamp, uint64_t endTimestamp) {
+	const SpanCoalescerConfig &config = coalescer->config;
+	SpanRun *run = GetSpanRun(coalescer);
+
+	const uint64_t duration = endTimestamp > beginTimestamp ? endTimestamp - beginTimestamp : 0;
+	// Anything else written to the writer since the last span would have written the run already. So the run can't be
+	// extended across other records
+	if (run->count != 0) {
+		const bool extends = run->writer == writer &&
+		                     duration <= config.maxSpanDuration &&
+		                     (config.maxCount == 0 || run->count < config.maxCount) &&
+		                     beginTimestamp >= run->endTimestamp &&
+		                     beginTimestamp - run->endTimestamp <= config.maxGap &&
+		                     run->processID == processID &&
+		                     run->threadID == threadID &&
+		                     SameString(run->category, category) &&
+		                     SameString(run->name, name);
+		if (extends) {
+			run->endTimestamp = endTimestamp;
+			++run->count;
+			run->totalDuration += duration;
+			if (duration > run->maxDuration) {
+				run->maxDuration = duration;
+			}
+			return 0;
+		}
+
+		const int ret = WriteSpanRun(run);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	if (duration > config.maxSpanDuration) {
+		return AddDurationCompleteEvent(writer, category, name, processID, threadID, beginTimestamp, endTimestamp);
+	}
+
+	// The writer only holds back one record at a time. IE, another coalescer's run
+	const int ret = WritePendingRecord(writer);
+	if (ret != 0) {
+		return ret;
+	}
+	writer->pendingRecordFunc = WritePendingSpanRun;
+	writer->pendingRecordContext = run;
+
+	run->writer = writer;
+	run->category = category;
+	run->name = name;
+	run->processID = processID;
+	run->threadID = threadID;
+	run->beginTimestamp = beginTimestamp;
+	run->endTimestamp = endTimestamp;
+	run->count = 1;
+	run->totalDuration = duration;
+	run->maxDuration = duration;
+
+	return 0;
+}
+
+int FlushCoalescedSpans(SpanCoalescer *coalescer, Writer *writer) {
+	SpanRun *run = GetSpanRun(coalescer);
+	if (run->count == 0 || run->writer != writer) {
+		return 0;
+	}
+
+	return WriteSpanRun(run);
+}
+
+} // End of namespace fxt
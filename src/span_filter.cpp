@@ -0,0 +1,133 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/span_filter.h"
+
+#include "fxt/internal/stored_args.h"
+
+#include <string.h>
+
+namespace fxt {
+
+struct SpanFrame {
+	const char *category;
+	const char *name;
+	KernelObjectID processID;
+	KernelObjectID threadID;
+	uint64_t beginTimestamp;
+	std::vector<internal::StoredArgument> args;
+};
+
+struct SpanFilterThreadState {
+	// Frames past depth are kept around, so their argument storage is reused by later spans
+	std::vector<SpanFrame> frames;
+	size_t depth = 0;
+	std::vector<RecordArgument> loadedArgs;
+
+	uint64_t emitted = 0;
+	uint64_t suppressed = 0;
+};
+
+static SpanFilterThreadState *GetSpanFilterThreadState(const SpanFilter *filter) {
+	static thread_local internal::ThreadSlots<SpanFilterThreadState> states;
+
+	return internal::GetThreadSlot(&states, filter->slot);
+}
+
+SpanFilter::~SpanFilter() {
+	internal::ReleaseThreadSlot<SpanFilter>(&slot);
+}
+
+int InitSpanFilter(SpanFilter *filter, uint64_t minDuration) {
+	filter->minDuration = minDuration;
+	filter->categoryMinDurations.clear();
+	internal::AcquireThreadSlot<SpanFilter>(&filter->slot);
+
+	return 0;
+}
+
+int SetSpanFilterCategoryMinDuration(SpanFilter *filter, const char *category, uint64_t minDuration) {
+	for (auto &entry : filter->categoryMinDurations) {
+		if (entry.first == category) {
+			entry.second = minDuration;
+			return 0;
+		}
+	}
+
+	filter->categoryMinDurations.emplace_back(category, minDuration);
+	return 0;
+}
+
+bool internal::KeepFilteredSpan(SpanFilter *filter, const char *category, uint64_t beginTimestamp, uint64_t endTimestamp) {
+	uint64_t minDuration = filter->minDuration;
+	for (const auto &entry : filter->categoryMinDurations) {
+		if (strcmp(entry.first.c_str(), category) == 0) {
+			minDuration = entry.second;
+			break;
+		}
+	}
+
+	SpanFilterThreadState *state = GetSpanFilterThreadState(filter);
+	if (endTimestamp < beginTimestamp || endTimestamp - beginTimestamp < minDuration) {
+		++state->suppressed;
+		return false;
+	}
+
+	++state->emitted;
+	return true;
+}
+
+int BeginFilteredSpan(SpanFilter *filter, Writer *writer, const char *category, const char *name, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp, std::initializer_list<RecordArgument> args) {
+	int ret = ResolveTimestamp(writer, &timestamp);
+	if (ret != 0) {
+		return ret;
+	}
+
+	SpanFilterThreadState *state = GetSpanFilterThreadState(filter);
+	if (state->depth == state->frames.size()) {
+		state->frames.emplace_back();
+	}
+
+	SpanFrame *frame = &state->frames[state->depth++];
+	frame->category = category;
+	frame->name = name;
+	frame->processID = processID;
+	frame->threadID = threadID;
+	frame->beginTimestamp = timestamp;
+	frame->args.clear();
+	internal::StoreArguments(&frame->args, args.begin(), args.size());
+
+	return 0;
+}
+
+int EndFilteredSpan(SpanFilter *filter, Writer *writer, uint64_t timestamp, std::initializer_list<RecordArgument> args) {
+	SpanFilterThreadState *state = GetSpanFilterThreadState(filter);
+	if (state->depth == 0) {
+		return FXT_ERR_UNBALANCED_SPAN;
+	}
+
+	const SpanFrame *frame = &state->frames[--state->depth];
+	int ret = ResolveTimestamp(writer, &timestamp);
+	if (ret != 0) {
+		return ret;
+	}
+	if (!internal::KeepFilteredSpan(filter, frame->category, frame->beginTimestamp, timestamp)) {
+		return 0;
+	}
+
+	internal::LoadArguments(frame->args, &state->loadedArgs);
+	state->loadedArgs.insert(state->loadedArgs.end(), args.begin(), args.end());
+
+	return AddDurationCompleteEvent(writer, frame->category, frame->name, frame->processID, frame->threadID, frame->beginTimestamp, timestamp, state->loadedArgs.data(), state->loadedArgs.size());
+}
+
+int AddSpanFilterCounterEvent(Writer *writer, SpanFilter *filter, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp) {
+	const SpanFilterThreadState *state = GetSpanFilterThreadState(filter);
+
+	return FXT_ADD_COUNTER_EVENT(writer, "fxt", "Span Filter", processID, threadID, timestamp, filter->slot.index, "emitted", state->emitted, "suppressed", state->suppressed);
+}
+
+} // End of namespace fxt
@@ -0,0 +1,215 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/tail_sampling.h"
+
+#include "fxt/thread_identity.h"
+
+#include <string.h>
+
+namespace fxt {
+
+int InitTailSampler(TailSampler *sampler, Writer *writer, TailSamplingConfig config) {
+	if (config.maxRequests == 0 || config.maxEventsPerRequest == 0) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	int ret = InitCorrelationSampler(&sampler->randomKeep, "", config.keepProbability, config.seed);
+	if (ret != 0) {
+		return ret;
+	}
+
+	sampler->writer = writer;
+	sampler->config = config;
+
+	return 0;
+}
+
+static bool IsErrorValue(const RecordArgumentValue &value) {
+	switch (value.type) {
+	case internal::ArgumentType::Null:
+		return false;
+	case internal::ArgumentType::Int32:
+		return value.int32Value != 0;
+	case internal::ArgumentType::UInt32:
+		return value.uint32Value != 0;
+	case internal::ArgumentType::Int64:
+		return value.int64Value != 0;
+	case internal::ArgumentType::UInt64:
+		return value.uint64Value != 0;
+	case internal::ArgumentType::Double:
+		return value.doubleValue != 0.0;
+	case internal::ArgumentType::Bool:
+		return value.boolValue;
+	default:
+		return true;
+	}
+}
+
+// The sampler mutex must be held
+static void EraseRequest(TailSampler *sampler, std::unordered_map<uint64_t, internal::TailSampledRequestState>::iterator request) {
+	sampler->lru.erase(request->second.lruPosition);
+	sampler->requests.erase(request);
+}
+
+int internal::StageTailSampledEvent(TailSampler *sampler, EventType type, const char *category, const char *name, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp, uint64_t correlationID, std::initializer_list<RecordArgument> args) {
+	// Resolve everything that depends on where the event happened. The events are written later, from whichever thread
+	// finishes the request
+	if (processID == kCurrentProcess || threadID == kCurrentThread) {
+		KernelObjectID currentProcessID;
+		KernelObjectID currentThreadID;
+		GetCurrentThreadIdentity(&currentProcessID, &currentThreadID);
+		processID = processID == kCurrentProcess ? currentProcessID : processID;
+		threadID = threadID == kCurrentThread ? currentThreadID : threadID;
+	}
+
+	std::lock_guard<std::mutex> lock(sampler->mutex);
+
+	// Resolved with the lock held, since it may write an Initialization record
+	int ret = ResolveTimestamp(sampler->writer, &timestamp);
+	if (ret != 0) {
+		return ret;
+	}
+
+	auto found = sampler->requests.find(correlationID);
+	if (found == sampler->requests.end()) {
+		if (sampler->requests.size() == sampler->config.maxRequests) {
+			EraseRequest(sampler, sampler->requests.find(sampler->lru.front()));
+			++sampler->requestsEvicted;
+		}
+
+		found = sampler->requests.emplace(correlationID, TailSampledRequestState()).first;
+		found->second.beginTimestamp = timestamp;
+		found->second.lruPosition = sampler->lru.insert(sampler->lru.end(), correlationID);
+	} else {
+		sampler->lru.splice(sampler->lru.end(), sampler->lru, found->second.lruPosition);
+	}
+
+	TailSampledRequestState *request = &found->second;
+	if (timestamp < request->beginTimestamp) {
+		request->beginTimestamp = timestamp;
+	}
+	if (timestamp > request->endTimestamp) {
+		request->endTimestamp = timestamp;
+	}
+
+	const char *errorArgName = sampler->config.errorArgName;
+	for (const RecordArgument &arg : args) {
+		if (errorArgName != nullptr && strcmp(arg.name, errorArgName) == 0 && IsErrorValue(arg.value)) {
+			request->hasError = true;
+		}
+	}
+
+	if (request->events.size() == sampler->config.maxEventsPerRequest) {
+		++sampler->eventsDropped;
+		return 0;
+	}
+
+	TailSampledEvent event;
+	event.type = type;
+	event.category = category;
+	event.name = name;
+	event.processID = processID;
+	event.threadID = threadID;
+	event.timestamp = timestamp;
+	StoreArguments(&event.args, args.begin(), args.size());
+	request->events.push_back(std::move(event));
+
+	return 0;
+}
+
+static int WriteTailSampledEvent(Writer *writer, const internal::TailSampledEvent &event, uint64_t correlationID) {
+	std::vector<RecordArgument> args;
+	internal::LoadArguments(event.args, &args);
+
+	const char *category = event.category.c_str();
+	const char *name = event.name.c_str();
+	switch (event.type) {
+	case internal::EventType::AsyncBegin:
+		return AddAsyncBeginEvent(writer, category, name, event.processID, event.threadID, event.timestamp, correlationID, args.data(), args.size());
+	case internal::EventType::AsyncInstant:
+		return AddAsyncInstantEvent(writer, category, name, event.processID, event.threadID, event.timestamp, correlationID, args.data(), args.size());
+	case internal::EventType::AsyncEnd:
+		return AddAsyncEndEvent(writer, category, name, event.processID, event.threadID, event.timestamp, correlationID, args.data(), args.size());
+	case internal::EventType::FlowBegin:
+		return AddFlowBeginEvent(writer, category, name, event.processID, event.threadID, event.timestamp, correlationID, args.data(), args.size());
+	case internal::EventType::FlowStep:
+		return AddFlowStepEvent(writer, category, name, event.processID, event.threadID, event.timestamp, correlationID, args.data(), args.size());
+	case internal::EventType::FlowEnd:
+		return AddFlowEndEvent(writer, category, name, event.processID, event.threadID, event.timestamp, correlationID, args.data(), args.size());
+	default:
+		return FXT_ERR_INVALID_ARG_TYPE;
+	}
+}
+
+int FinishTailSampledRequest(TailSampler *sampler, uint64_t correlationID, bool failed, bool *kept) {
+	if (kept != nullptr) {
+		*kept = false;
+	}
+
+	std::lock_guard<std::mutex> lock(sampler->mutex);
+
+	const auto found = sampler->requests.find(correlationID);
+	if (found == sampler->requests.end()) {
+		++sampler->requestsDiscarded;
+		return 0;
+	}
+
+	const internal::TailSampledRequestState &state = found->second;
+	TailSampledRequest request;
+	request.correlationID = correlationID;
+	request.beginTimestamp = state.beginTimestamp;
+	request.endTimestamp = state.endTimestamp;
+	request.failed = failed || state.hasError;
+	request.numEvents = state.events.size();
+
+	bool keep;
+	if (sampler->config.policy != nullptr) {
+		keep = sampler->config.policy(&request, sampler->config.policyContext);
+	} else {
+		keep = request.failed || request.endTimestamp - request.beginTimestamp >= sampler->config.minLatency || SampleCorrelationID(&sampler->randomKeep, correlationID);
+	}
+
+	int ret = 0;
+	if (keep) {
+		for (const internal::TailSampledEvent &event : state.events) {
+			ret = WriteTailSampledEvent(sampler->writer, event, correlationID);
+			if (ret != 0) {
+				break;
+			}
+		}
+		++sampler->requestsKept;
+	} else {
+		++sampler->requestsDiscarded;
+	}
+
+	EraseRequest(sampler, found);
+	if (kept != nullptr) {
+		*kept = keep;
+	}
+
+	return ret;
+}
+
+void DiscardTailSampledRequests(TailSampler *sampler) {
+	std::lock_guard<std::mutex> lock(sampler->mutex);
+
+	sampler->requestsDiscarded += sampler->requests.size();
+	sampler->requests.clear();
+	sampler->lru.clear();
+}
+
+void GetTailSamplerMetrics(TailSampler *sampler, TailSamplerMetrics *metrics) {
+	std::lock_guard<std::mutex> lock(sampler->mutex);
+
+	metrics->requestsKept = sampler->requestsKept;
+	metrics->requestsDiscarded = sampler->requestsDiscarded;
+	metrics->requestsEvicted = sampler->requestsEvicted;
+	metrics->eventsDropped = sampler->eventsDropped;
+	metrics->requestsStaged = sampler->requests.size();
+}
+
+} // End of namespace fxt
@@ -0,0 +1,79 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/thread_identity.h"
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#if defined(_WIN32)
+#	define WIN32_LEAN_AND_MEAN
+#	include <windows.h>
+#else
+#	include <pthread.h>
+#	include <unistd.h>
+#endif
+#if defined(__linux__)
+#	include <sys/syscall.h>
+#endif
+
+namespace fxt {
+
+// Bumped in the child of every fork(). Starts at 1, so a zeroed cache is always stale
+static std::atomic<uint64_t> gForkGeneration { 1 };
+
+#if !defined(_WIN32)
+static void OnForkChild() {
+	gForkGeneration.fetch_add(1, std::memory_order_relaxed);
+}
+
+static const int gForkHandlerRegistered = pthread_atfork(nullptr, nullptr, OnForkChild);
+#endif
+
+static void LookUpThreadIdentity(internal::ThreadIdentity *identity) {
+#if defined(_WIN32)
+	identity->processID = (KernelObjectID)GetCurrentProcessId();
+	identity->threadID = (KernelObjectID)GetCurrentThreadId();
+#elif defined(__linux__)
+	identity->processID = (KernelObjectID)getpid();
+	identity->threadID = (KernelObjectID)syscall(SYS_gettid);
+#elif defined(__APPLE__)
+	uint64_t threadID;
+	pthread_threadid_np(nullptr, &threadID);
+	identity->processID = (KernelObjectID)getpid();
+	identity->threadID = (KernelObjectID)threadID;
+#else
+	identity->processID = (KernelObjectID)getpid();
+	identity->threadID = (KernelObjectID)std::hash<std::thread::id>()(std::this_thread::get_id());
+#endif
+}
+
+namespace internal {
+
+ThreadIdentity *GetThreadIdentity() {
+	static thread_local ThreadIdentity identity;
+
+	const uint64_t forkGeneration = gForkGeneration.load(std::memory_order_relaxed);
+	if (identity.forkGeneration != forkGeneration) {
+		LookUpThreadIdentity(&identity);
+		identity.forkGeneration = forkGeneration;
+		// The child doesn't share the parent's writer state
+		identity.writer = nullptr;
+	}
+
+	return &identity;
+}
+
+} // End of namespace internal
+
+void GetCurrentThreadIdentity(KernelObjectID *processID, KernelObjectID *threadID) {
+	const internal::ThreadIdentity *identity = internal::GetThreadIdentity();
+	*processID = identity->processID;
+	*threadID = identity->threadID;
+}
+
+} // End of namespace fxt
@@ -0,0 +1,537 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/unix_socket.h"
+
+#include "fxt/clock.h"
+#include "fxt/internal/records.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if defined(MSG_NOSIGNAL)
+#	define FXT_SEND_FLAGS MSG_NOSIGNAL
+#else
+#	define FXT_SEND_FLAGS 0
+#endif
+
+namespace fxt {
+
+static void SetError(UnixSocketSink *sink, int error) {
+	// Only keep the first error
+	if (sink->error == 0) {
+		sink->error = error;
+	}
+}
+
+static int SetNonBlocking(int fd) {
+	const int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int CreateSocket() {
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+#if defined(SO_NOSIGPIPE)
+	const int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+	return fd;
+}
+
+static int MakeAddress(const char *path, sockaddr_un *address) {
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address->sun_path)) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	strcpy(address->sun_path, path);
+
+	return 0;
+}
+
+// Sends as much of the in-flight buffer as the socket will take right now
+static int SendPending(UnixSocketSink *sink) {
+	while (sink->sendingOffset < sink->sending.size()) {
+		const ssize_t sent = send(sink->fd, sink->sending.data() + sink->sendingOffset, sink->sending.size() - sink->sendingOffset, MSG_DONTWAIT | FXT_SEND_FLAGS);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			SetError(sink, FXT_ERR_WRITE_TO_STREAM_FAILED);
+			return sink->error;
+		}
+
+		sink->sendingOffset += (size_t)sent;
+		sink->metrics.bytesSent += (uint64_t)sent;
+	}
+
+	return 0;
+}
+
+// Throws away the buffered records, and makes the stream decodable again without them
+static int DropBuffer(UnixSocketSink *sink) {
+	++sink->metrics.droppedBuffers;
+	sink->metrics.droppedBytes += sink->buffer.size();
+	sink->buffer.clear();
+
+	Writer *writer = sink->writer;
+	int ret = WriteCheckpoint(writer);
+	if (ret != 0) {
+		return ret;
+	}
+
+	// Read from the writer's clock, so the counter lines up with the records around it
+	return FXT_ADD_COUNTER_EVENT(writer, "fxt", "Dropped", sink->config.processID, sink->config.threadID, kTimestampNow, 0,
+	                             "buffers", sink->metrics.droppedBuffers, "bytes", sink->metrics.droppedBytes);
+}
+
+int FlushUnixSocketSink(UnixSocketSink *sink) {
+	if (sink->error != 0) {
+		return sink->error;
+	}
+	if (sink->fd < 0) {
+		return FXT_ERR_SINK_CLOSED;
+	}
+
+	int ret = SendPending(sink);
+	if (ret != 0) {
+		return ret;
+	}
+	if (sink->buffer.empty()) {
+		return 0;
+	}
+
+	sink->lastSendTime = std::chrono::steady_clock::now();
+	if (sink->sendingOffset < sink->sending.size()) {
+		// The collector is behind. Never wait for it
+		sink->inRecordBoundary = true;
+		ret = DropBuffer(sink);
+		sink->inRecordBoundary = false;
+		if (ret != 0) {
+			SetError(sink, ret);
+		}
+		return ret;
+	}
+
+	sink->sending.swap(sink->buffer);
+	sink->sendingOffset = 0;
+	sink->buffer.clear();
+
+	return SendPending(sink);
+}
+
+static bool IsFlushIntervalUp(UnixSocketSink *sink) {
+	if (sink->config.flushIntervalMs == 0 || sink->buffer.empty()) {
+		return false;
+	}
+
+	const auto flushInterval = std::chrono::milliseconds(sink->config.flushIntervalMs);
+	return std::chrono::steady_clock::now() - sink->lastSendTime >= flushInterval;
+}
+
+static int OnRecordBoundary(Writer *writer, void *userContext) {
+	(void)writer;
+	UnixSocketSink *sink = (UnixSocketSink *)userContext;
+
+	if (sink->error != 0) {
+		return sink->error;
+	}
+	if (sink->inRecordBoundary) {
+		return 0;
+	}
+
+	if (sink->buffer.size() >= sink->config.bufferSize) {
+		return FlushUnixSocketSink(sink);
+	}
+	if (IsFlushIntervalUp(sink)) {
+		// A partially filled buffer is only worth sending if it doesn't have to be dropped
+		const int ret = SendPending(sink);
+		if (ret != 0 || sink->sendingOffset < sink->sending.size()) {
+			return ret;
+		}
+		return FlushUnixSocketSink(sink);
+	}
+
+	return 0;
+}
+
+int OpenUnixSocketSink(UnixSocketSink *sink, Writer *writer, const char *path, UnixSocketSinkConfig config) {
+	if (path == nullptr || config.providerName == nullptr || writer == nullptr || config.bufferSize == 0) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (writer->userContext != sink || writer->writeFunc != WriteToUnixSocketSink || writer->clock == nullptr) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (sink->fd >= 0) {
+		// Already open
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	sockaddr_un address;
+	int ret = MakeAddress(path, &address);
+	if (ret != 0) {
+		return ret;
+	}
+
+	const int fd = CreateSocket();
+	if (fd < 0) {
+		return FXT_ERR_OPEN_FAILED;
+	}
+	if (connect(fd, (const sockaddr *)&address, sizeof(address)) != 0) {
+		close(fd);
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	// The hello is tiny, so it's fine to block on it. Everything after is non-blocking
+	internal::UnixSocketHello hello;
+	memset(&hello, 0, sizeof(hello));
+	hello.magic = internal::kUnixSocketHelloMagic;
+	hello.version = internal::kUnixSocketVersion;
+	hello.providerID = config.providerID;
+	snprintf(hello.providerName, sizeof(hello.providerName), "%s", config.providerName);
+	if (send(fd, &hello, sizeof(hello), FXT_SEND_FLAGS) != (ssize_t)sizeof(hello) || SetNonBlocking(fd) != 0) {
+		close(fd);
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	sink->config = config;
+	sink->providerName = config.providerName;
+	// Don't keep pointers to the caller's strings
+	sink->config.providerName = nullptr;
+
+	sink->writer = writer;
+	sink->fd = fd;
+	sink->buffer.clear();
+	sink->buffer.reserve(config.bufferSize);
+	sink->sending.clear();
+	sink->sending.reserve(config.bufferSize);
+	sink->sendingOffset = 0;
+	sink->lastSendTime = std::chrono::steady_clock::now();
+	sink->inRecordBoundary = false;
+	sink->metrics = {};
+	sink->error = 0;
+
+	writer->recordBoundaryFunc = OnRecordBoundary;
+	writer->recordBoundaryContext = sink;
+
+	return 0;
+}
+
+int WriteToUnixSocketSink(void *userContext, const void *data, size_t len) {
+	UnixSocketSink *sink = (UnixSocketSink *)userContext;
+
+	if (sink->error != 0) {
+		return sink->error;
+	}
+	if (sink->fd < 0) {
+		return FXT_ERR_SINK_CLOSED;
+	}
+
+	sink->buffer.insert(sink->buffer.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+	return 0;
+}
+
+// Blocks until the in-flight buffer has been taken by the socket, or the deadline passes
+static int SendPendingUntil(UnixSocketSink *sink, std::chrono::steady_clock::time_point deadline) {
+	while (true) {
+		const int ret = SendPending(sink);
+		if (ret != 0 || sink->sendingOffset == sink->sending.size()) {
+			return ret;
+		}
+
+		const auto now = std::chrono::steady_clock::now();
+		if (now >= deadline) {
+			return FXT_ERR_FLUSH_TIMEOUT;
+		}
+
+		pollfd pfd;
+		pfd.fd = sink->fd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		poll(&pfd, 1, (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1);
+	}
+}
+
+int CloseUnixSocketSink(UnixSocketSink *sink) {
+	if (sink->writer != nullptr && sink->writer->recordBoundaryContext == sink) {
+		sink->writer->recordBoundaryFunc = nullptr;
+		sink->writer->recordBoundaryContext = nullptr;
+	}
+	sink->writer = nullptr;
+
+	if (sink->fd < 0) {
+		return sink->error;
+	}
+
+	if (sink->error == 0) {
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(sink->config.closeTimeoutMs);
+		int ret = SendPendingUntil(sink, deadline);
+		if (ret == 0 && !sink->buffer.empty()) {
+			sink->sending.swap(sink->buffer);
+			sink->sendingOffset = 0;
+			sink->buffer.clear();
+			ret = SendPendingUntil(sink, deadline);
+		}
+		if (ret != 0) {
+			SetError(sink, ret);
+		}
+	}
+
+	close(sink->fd);
+	sink->fd = -1;
+
+	return sink->error;
+}
+
+UnixSocketSink::~UnixSocketSink() {
+	CloseUnixSocketSink(this);
+}
+
+int OpenUnixSocketCollector(UnixSocketCollector *collector, const char *path) {
+	if (path == nullptr) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+	if (collector->listenFd >= 0) {
+		// Already open
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	sockaddr_un address;
+	const int ret = MakeAddress(path, &address);
+	if (ret != 0) {
+		return ret;
+	}
+
+	const int fd = CreateSocket();
+	if (fd < 0) {
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	// Replace a socket file left behind by an earlier collector
+	unlink(path);
+	if (bind(fd, (const sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0 || SetNonBlocking(fd) != 0) {
+		close(fd);
+		return FXT_ERR_OPEN_FAILED;
+	}
+
+	collector->path = path;
+	collector->listenFd = fd;
+	collector->clients.clear();
+	collector->receiveBuffer.resize(256 * 1024);
+
+	return 0;
+}
+
+static void AcceptClients(UnixSocketCollector *socketCollector) {
+	while (true) {
+		const int fd = accept(socketCollector->listenFd, nullptr, nullptr);
+		if (fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// EAGAIN once the backlog is empty. Anything else is the client's problem
+			return;
+		}
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		if (SetNonBlocking(fd) != 0) {
+			close(fd);
+			continue;
+		}
+
+		UnixSocketClient client;
+		client.fd = fd;
+		client.streamIndex = 0;
+		client.receivedHello = false;
+		socketCollector->clients.push_back(std::move(client));
+	}
+}
+
+// Returns the length of the complete records at the start of data, or -1 if the data isn't FXT records
+static int64_t FindCompleteRecords(const uint8_t *data, size_t len) {
+	size_t offset = 0;
+	while (len - offset >= sizeof(uint64_t)) {
+		uint64_t header;
+		memcpy(&header, data + offset, sizeof(header));
+		const uint64_t recordSize = internal::WordsToBytes(internal::GetRecordSizeInWords(header));
+		if (recordSize == 0) {
+			return -1;
+		}
+		if (recordSize > len - offset) {
+			break;
+		}
+		offset += recordSize;
+	}
+
+	return (int64_t)offset;
+}
+
+// Copies the complete records out of newly received data, and keeps the rest for later
+// Returns false if the client should be disconnected
+static bool ConsumeClientData(UnixSocketClient *client, Collector *collector, const uint8_t *data, size_t len, int *error) {
+	if (!client->receivedHello) {
+		const size_t wanted = sizeof(internal::UnixSocketHello) - client->partial.size();
+		const size_t toCopy = len < wanted ? len : wanted;
+		client->partial.insert(client->partial.end(), data, data + toCopy);
+		data += toCopy;
+		len -= toCopy;
+		if (client->partial.size() < sizeof(internal::UnixSocketHello)) {
+			return true;
+		}
+
+		internal::UnixSocketHello hello;
+		memcpy(&hello, client->partial.data(), sizeof(hello));
+		client->partial.clear();
+		if (hello.magic != internal::kUnixSocketHelloMagic || hello.version != internal::kUnixSocketVersion) {
+			return false;
+		}
+		hello.providerName[sizeof(hello.providerName) - 1] = '\0';
+
+		const int ret = AddCollectorStream(collector, hello.providerID, hello.providerName, &client->streamIndex);
+		if (ret != 0) {
+			*error = ret;
+			return false;
+		}
+		client->receivedHello = true;
+	}
+
+	// Skip the copy into the partial buffer when nothing is left over from last time
+	if (!client->partial.empty()) {
+		client->partial.insert(client->partial.end(), data, data + len);
+		data = client->partial.data();
+		len = client->partial.size();
+	}
+
+	const int64_t complete = FindCompleteRecords(data, len);
+	if (complete < 0) {
+		return false;
+	}
+	if (complete > 0) {
+		const int ret = CollectRecords(collector, client->streamIndex, data, (size_t)complete);
+		if (ret != 0) {
+			*error = ret;
+			return false;
+		}
+	}
+
+	if (!client->partial.empty()) {
+		client->partial.erase(client->partial.begin(), client->partial.begin() + complete);
+	} else {
+		client->partial.assign(data + complete, data + len);
+	}
+
+	return true;
+}
+
+// Returns false once the client has disconnected, or should be disconnected
+static bool ReceiveFromClient(UnixSocketCollector *socketCollector, UnixSocketClient *client, Collector *collector, size_t *bytesCollected, int *error) {
+	while (true) {
+		const ssize_t received = recv(client->fd, socketCollector->receiveBuffer.data(), socketCollector->receiveBuffer.size(), 0);
+		if (received < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		if (received == 0) {
+			// Any partial record left over was cut off by the client going away
+			return false;
+		}
+
+		*bytesCollected += (size_t)received;
+		if (!ConsumeClientData(client, collector, socketCollector->receiveBuffer.data(), (size_t)received, error)) {
+			return false;
+		}
+	}
+}
+
+int PollUnixSocketCollector(UnixSocketCollector *socketCollector, Collector *collector, uint32_t timeoutMs, size_t *bytesCollected) {
+	if (bytesCollected != nullptr) {
+		*bytesCollected = 0;
+	}
+	if (socketCollector->listenFd < 0) {
+		return FXT_ERR_SINK_CLOSED;
+	}
+
+	std::vector<pollfd> pfds(socketCollector->clients.size() + 1);
+	pfds[0].fd = socketCollector->listenFd;
+	pfds[0].events = POLLIN;
+	pfds[0].revents = 0;
+	for (size_t i = 0; i < socketCollector->clients.size(); ++i) {
+		pfds[i + 1].fd = socketCollector->clients[i].fd;
+		pfds[i + 1].events = POLLIN;
+		pfds[i + 1].revents = 0;
+	}
+
+	const int numReady = poll(pfds.data(), (nfds_t)pfds.size(), (int)timeoutMs);
+	if (numReady < 0) {
+		return errno == EINTR ? 0 : FXT_ERR_READ_FROM_STREAM_FAILED;
+	}
+	if (numReady == 0) {
+		return 0;
+	}
+
+	size_t received = 0;
+	int error = 0;
+	std::vector<UnixSocketClient> &clients = socketCollector->clients;
+	for (size_t i = clients.size(); i-- > 0;) {
+		if (pfds[i + 1].revents == 0) {
+			continue;
+		}
+		if (!ReceiveFromClient(socketCollector, &clients[i], collector, &received, &error)) {
+			close(clients[i].fd);
+			clients.erase(clients.begin() + (ptrdiff_t)i);
+		}
+		if (error != 0) {
+			break;
+		}
+	}
+
+	// Accept after reading, so the pollfd indices still line up with the clients
+	if (pfds[0].revents != 0) {
+		AcceptClients(socketCollector);
+	}
+
+	if (bytesCollected != nullptr) {
+		*bytesCollected = received;
+	}
+	return error;
+}
+
+void CloseUnixSocketCollector(UnixSocketCollector *collector) {
+	for (const UnixSocketClient &client : collector->clients) {
+		close(client.fd);
+	}
+	collector->clients.clear();
+
+	if (collector->listenFd >= 0) {
+		close(collector->listenFd);
+		collector->listenFd = -1;
+		unlink(collector->path.c_str());
+	}
+}
+
+UnixSocketCollector::~UnixSocketCollector() {
+	CloseUnixSocketCollector(this);
+}
+
+} // End of namespace fxt
@@ -6,6 +6,9 @@
 
 #include "fxt/writer.h"
 
+#include "fxt/clock.h"
+#include "fxt/thread_identity.h"
+
 #define XXH_INLINE_ALL
 #include "xxhash.h"
 
@@ -33,6 +36,113 @@ static int WriteUInt64ToStream(Writer *writer, uint64_t val);
 static int WriteBytesToStream(Writer *writer, const void *val, size_t len);
 static int WriteZeroPadding(Writer *writer, size_t count);
 
+// Must be called before anything is written for a record that isn't a Magic Number, Provider, or Initialization record
+static int BeginRecord(Writer *writer) {
+	if (writer->pendingRecordFunc != nullptr) {
+		const int ret = WritePendingRecord(writer);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	if (writer->recordBoundaryFunc != nullptr) {
+		const int ret = writer->recordBoundaryFunc(writer, writer->recordBoundaryContext);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	if (writer->checkpointIntervalBytes != 0 && writer->bytesWritten - writer->lastCheckpointOffset >= writer->checkpointIntervalBytes) {
+		return WriteCheckpoint(writer);
+	}
+
+	return 0;
+}
+
+// Must be called before BeginRecord(), since it may need to write an Initialization record first
+int ResolveTimestamp(Writer *writer, uint64_t *timestamp) {
+	if (*timestamp != kTimestampNow) {
+		return 0;
+	}
+	if (writer->clock == nullptr) {
+		return FXT_ERR_INVALID_CONFIG;
+	}
+
+	const uint64_t generation = writer->clock->generation.load(std::memory_order_acquire);
+	if (generation != writer->clockGeneration) {
+		const int ret = AddInitializationRecord(writer, writer->clock->ticksPerSecond.load(std::memory_order_relaxed));
+		if (ret != 0) {
+			return ret;
+		}
+		writer->clockGeneration = generation;
+	}
+
+	*timestamp = ReadClock(writer->clock);
+	return 0;
+}
+
+int WritePendingRecord(Writer *writer) {
+	const PendingRecordFunc pendingRecordFunc = writer->pendingRecordFunc;
+	if (pendingRecordFunc == nullptr) {
+		return 0;
+	}
+
+	// Cleared first, since the pending record goes through BeginRecord() too
+	writer->pendingRecordFunc = nullptr;
+	return pendingRecordFunc(writer, writer->pendingRecordContext);
+}
+
+void ResetInternTables(Writer *writer) {
+	// The lookups only probe up to the next index, so this invalidates every entry
+	writer->nextStringIndex = 0;
+	writer->nextThreadIndex = 0;
+}
+
+int WriteCheckpoint(Writer *writer) {
+	int ret = WritePendingRecord(writer);
+	if (ret != 0) {
+		return ret;
+	}
+
+	writer->lastCheckpointOffset = writer->bytesWritten;
+
+	ret = WriteMagicNumberRecord(writer);
+	if (ret != 0) {
+		return ret;
+	}
+
+	if (writer->numTicksPerSecond != 0) {
+		ret = AddInitializationRecord(writer, writer->numTicksPerSecond);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	// Each piece has to define its provider, not just refer to it
+	const ProviderID currentProviderID = writer->providerID;
+	const bool hadProvider = writer->hasProvider;
+	if (writer->hasProviderName) {
+		char providerName[sizeof(writer->providerName)];
+		memcpy(providerName, writer->providerName, sizeof(providerName));
+		ret = AddProviderInfoRecord(writer, writer->namedProviderID, providerName);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	if (hadProvider && (!writer->hasProviderName || currentProviderID != writer->namedProviderID)) {
+		ret = AddProviderSectionRecord(writer, currentProviderID);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	// The intern tables only hold hashes, so we can't write the strings out again here
+	// Instead, we start a new epoch, and each string / thread is written again the first time it's used
+	ResetInternTables(writer);
+
+	return 0;
+}
+
 int WriteMagicNumberRecord(Writer *writer) {
 	const char fxtMagic[] = { 0x10, 0x00, 0x04, 0x46, 0x78, 0x54, 0x16, 0x00 };
 	return WriteBytesToStream(writer, fxtMagic, ArraySize(fxtMagic));
@@ -47,6 +157,12 @@ int AddProviderInfoRecord(Writer *writer, ProviderID providerID, const char *pro
 		return FXT_ERR_STR_TOO_LONG;
 	}
 
+	// A held back record belongs to the current provider
+	int ret = WritePendingRecord(writer);
+	if (ret != 0) {
+		return ret;
+	}
+
 	// Write the header
 	const uint64_t sizeInWords = 1 + (paddedStrLen / 8);
 	const uint64_t header = internal::ProviderInfoMetadataRecordFields::Type::Make(ToUnderlyingType(internal::RecordType::Metadata)) |
@@ -54,7 +170,7 @@ int AddProviderInfoRecord(Writer *writer, ProviderID providerID, const char *pro
 	                        internal::ProviderInfoMetadataRecordFields::MetadataType::Make(ToUnderlyingType(internal::MetadataType::ProviderInfo)) |
 	                        internal::ProviderInfoMetadataRecordFields::ProviderID::Make(providerID) |
 	                        internal::ProviderInfoMetadataRecordFields::NameLength::Make(strLen);
-	int ret = WriteUInt64ToStream(writer, header);
+	ret = WriteUInt64ToStream(writer, header);
 	if (ret != 0) {
 		return ret;
 	}
@@ -73,20 +189,36 @@ int AddProviderInfoRecord(Writer *writer, ProviderID providerID, const char *pro
 		}
 	}
 
+	writer->providerID = providerID;
+	writer->hasProvider = true;
+	writer->namedProviderID = providerID;
+	memcpy(writer->providerName, providerName, strLen);
+	writer->providerName[strLen] = '\0';
+	writer->hasProviderName = true;
+
 	return 0;
 }
 
 int AddProviderSectionRecord(Writer *writer, ProviderID providerID) {
+	// A held back record belongs to the current provider
+	int ret = WritePendingRecord(writer);
+	if (ret != 0) {
+		return ret;
+	}
+
 	const uint64_t sizeInWords = 1;
 	const uint64_t header = internal::ProviderSectionMetadataRecordFields::Type::Make(ToUnderlyingType(internal::RecordType::Metadata)) |
 	                        internal::ProviderSectionMetadataRecordFields::RecordSize::Make(sizeInWords) |
 	                        internal::ProviderSectionMetadataRecordFields::MetadataType::Make(ToUnderlyingType(internal::MetadataType::ProviderSection)) |
 	                        internal::ProviderSectionMetadataRecordFields::ProviderID::Make(providerID);
-	int ret = WriteUInt64ToStream(writer, header);
+	ret = WriteUInt64ToStream(writer, header);
 	if (ret != 0) {
 		return ret;
 	}
 
+	writer->providerID = providerID;
+	writer->hasProvider = true;
+
 	return 0;
 }
 
@@ -106,10 +238,16 @@ int AddProviderEventRecord(Writer *writer, ProviderID providerID, ProviderEventT
 }
 
 int AddInitializationRecord(Writer *writer, uint64_t numTicksPerSecond) {
+	// A held back record's timestamps are in the old rate
+	int ret = WritePendingRecord(writer);
+	if (ret != 0) {
+		return ret;
+	}
+
 	const uint64_t sizeInWords = 2;
 	const uint64_t header = internal::InitializationRecordFields::Type::Make(ToUnderlyingType(internal::RecordType::Initialization)) |
 	                        internal::InitializationRecordFields::RecordSize::Make(sizeInWords);
-	int ret = WriteUInt64ToStream(writer, header);
+	ret = WriteUInt64ToStream(writer, header);
 	if (ret != 0) {
 		return ret;
 	}
@@ -119,6 +257,8 @@ int AddInitializationRecord(Writer *writer, uint64_t numTicksPerSecond) {
 		return ret;
 	}
 
+	writer->numTicksPerSecond = numTicksPerSecond;
+
 	return 0;
 }
 
@@ -624,8 +764,13 @@ int WriteArg(Writer *writer, const RecordArgument *arg, unsigned *wordsWritten)
 int SetProcessName(Writer *writer, KernelObjectID processID, const char *name) {
 	// TODO: Just use an inline string
 	//       It's unlikely we'll ever get use of this string again
+	int ret = BeginRecord(writer);
+	if (ret != 0) {
+		return ret;
+	}
+
 	uint16_t nameIndex;
-	int ret = GetOrCreateStringIndex(writer, name, &nameIndex);
+	ret = GetOrCreateStringIndex(writer, name, &nameIndex);
 	if (ret != 0) {
 		return ret;
 	}
@@ -655,8 +800,13 @@ int SetProcessName(Writer *writer, KernelObjectID processID, const char *name) {
 int SetThreadName(Writer *writer, KernelObjectID processID, KernelObjectID threadID, const char *name) {
 	// TODO: Just use an inline string
 	//       It's unlikely we'll ever get use of this string again
+	int ret = BeginRecord(writer);
+	if (ret != 0) {
+		return ret;
+	}
+
 	uint16_t nameIndex;
-	int ret = GetOrCreateStringIndex(writer, name, &nameIndex);
+	ret = GetOrCreateStringIndex(writer, name, &nameIndex);
 	if (ret != 0) {
 		return ret;
 	}
@@ -697,9 +847,52 @@ int SetThreadName(Writer *writer, KernelObjectID processID, KernelObjectID threa
 	return 0;
 }
 
+// Same as GetOrCreateThreadIndex(), but resolves kCurrentProcess / kCurrentThread from the thread's identity cache
+// When both are passed, the cache also remembers the index, and we can skip hashing and probing the thread table
+static int ResolveThreadIndex(Writer *writer, KernelObjectID processID, KernelObjectID threadID, uint16_t *threadIndex) {
+	if (processID != kCurrentProcess && threadID != kCurrentThread) {
+		return GetOrCreateThreadIndex(writer, processID, threadID, threadIndex);
+	}
+
+	internal::ThreadIdentity *identity = internal::GetThreadIdentity();
+	if (processID != kCurrentProcess || threadID != kCurrentThread) {
+		return GetOrCreateThreadIndex(writer, processID == kCurrentProcess ? identity->processID : processID, threadID == kCurrentThread ? identity->threadID : threadID, threadIndex);
+	}
+
+	uint16_t max = writer->nextThreadIndex;
+	if (writer->nextThreadIndex > ArraySize(writer->threadTable)) {
+		max = ArraySize(writer->threadTable);
+	}
+	if (identity->writer == writer && identity->threadIndex != 0 && identity->threadIndex <= max && writer->threadTable[identity->threadIndex - 1] == identity->threadHash) {
+		*threadIndex = identity->threadIndex;
+		return 0;
+	}
+
+	const int ret = GetOrCreateThreadIndex(writer, identity->processID, identity->threadID, threadIndex);
+	if (ret != 0) {
+		return ret;
+	}
+
+	identity->writer = writer;
+	identity->threadIndex = *threadIndex;
+	identity->threadHash = writer->threadTable[*threadIndex - 1];
+
+	return 0;
+}
+
 static int WriteEventHeaderAndGenericData(Writer *writer, internal::EventType eventType, const char *category, const char *name, KernelObjectID processID, KernelObjectID threadID, uint64_t timestamp, unsigned extraSizeInWords, const RecordArgument *args, size_t numArgs) {
+	int ret = ResolveTimestamp(writer, &timestamp);
+	if (ret != 0) {
+		return ret;
+	}
+
+	ret = BeginRecord(writer);
+	if (ret != 0) {
+		return ret;
+	}
+
 	uint16_t categoryIndex;
-	int ret = GetOrCreateStringIndex(writer, category, &categoryIndex);
+	ret = GetOrCreateStringIndex(writer, category, &categoryIndex);
 	if (ret != 0) {
 		return ret;
 	}
@@ -711,7 +904,7 @@ static int WriteEventHeaderAndGenericData(Writer *writer, internal::EventType ev
 	}
 
 	uint16_t threadIndex;
-	ret = GetOrCreateThreadIndex(writer, processID, threadID, &threadIndex);
+	ret = ResolveThreadIndex(writer, processID, threadID, &threadIndex);
 	if (ret != 0) {
 		return ret;
 	}
@@ -820,8 +1013,19 @@ int AddDurationCompleteEvent(Writer *writer, const char *category, const char *n
 }
 
 int AddDurationCompleteEvent(Writer *writer, const char *category, const char *name, KernelObjectID processID, KernelObjectID threadID, uint64_t beginTimestamp, uint64_t endTimestamp, const RecordArgument *args, size_t numArgs) {
+	// Both are resolved before anything is written, since resolving can write the clock's Initialization record. The
+	// begin goes first, so when both are "now", the end is never before it
+	int ret = ResolveTimestamp(writer, &beginTimestamp);
+	if (ret != 0) {
+		return ret;
+	}
+	ret = ResolveTimestamp(writer, &endTimestamp);
+	if (ret != 0) {
+		return ret;
+	}
+
 	constexpr unsigned extraSizeInWords = 1;
-	int ret = WriteEventHeaderAndGenericData(writer, internal::EventType::DurationComplete, category, name, processID, threadID, beginTimestamp, extraSizeInWords, args, numArgs);
+	ret = WriteEventHeaderAndGenericData(writer, internal::EventType::DurationComplete, category, name, processID, threadID, beginTimestamp, extraSizeInWords, args, numArgs);
 	if (ret != 0) {
 		return ret;
 	}
@@ -977,8 +1181,13 @@ int AddBlobRecord(Writer *writer, const char *name, void *data, size_t dataLen,
 		return FXT_ERR_DATA_TOO_LONG;
 	}
 
+	int ret = BeginRecord(writer);
+	if (ret != 0) {
+		return ret;
+	}
+
 	uint16_t nameIndex;
-	int ret = GetOrCreateStringIndex(writer, name, &nameIndex);
+	ret = GetOrCreateStringIndex(writer, name, &nameIndex);
 	if (ret != 0) {
 		return ret;
 	}
@@ -1024,14 +1233,19 @@ int AddUserspaceObjectRecord(Writer *writer, const char *name, KernelObjectID pr
 }
 
 int AddUserspaceObjectRecord(Writer *writer, const char *name, KernelObjectID processID, KernelObjectID threadID, uintptr_t pointerValue, const RecordArgument *args, size_t numArgs) {
+	int ret = BeginRecord(writer);
+	if (ret != 0) {
+		return ret;
+	}
+
 	uint16_t nameIndex;
-	int ret = GetOrCreateStringIndex(writer, name, &nameIndex);
+	ret = GetOrCreateStringIndex(writer, name, &nameIndex);
 	if (ret != 0) {
 		return ret;
 	}
 
 	uint16_t threadIndex;
-	ret = GetOrCreateThreadIndex(writer, processID, threadID, &threadIndex);
+	ret = ResolveThreadIndex(writer, processID, threadID, &threadIndex);
 	if (ret != 0) {
 		return ret;
 	}
@@ -1097,7 +1311,17 @@ int AddContextSwitchRecord(Writer *writer, uint16_t cpuNumber, uint8_t outgoingT
 	                        internal::ContextSwitchRecordFields::CpuNumber::Make(cpuNumber) |
 	                        internal::ContextSwitchRecordFields::OutgoingThreadState::Make(outgoingThreadState) |
 	                        internal::ContextSwitchRecordFields::EventType::Make(ToUnderlyingType(internal::SchedulingRecordType::ContextSwitch));
-	int ret = WriteUInt64ToStream(writer, header);
+	int ret = ResolveTimestamp(writer, &timestamp);
+	if (ret != 0) {
+		return ret;
+	}
+
+	ret = BeginRecord(writer);
+	if (ret != 0) {
+		return ret;
+	}
+
+	ret = WriteUInt64ToStream(writer, header);
 	if (ret != 0) {
 		return ret;
 	}
@@ -1151,7 +1375,17 @@ int AddFiberSwitchRecord(Writer *writer, KernelObjectID processID, KernelObjectI
 	                        internal::FiberSwitchRecordFields::RecordSize::Make(sizeInWords) |
 	                        internal::FiberSwitchRecordFields::ArgumentCount::Make(numArgs) |
 	                        internal::FiberSwitchRecordFields::EventType::Make(ToUnderlyingType(internal::SchedulingRecordType::FiberSwitch));
-	int ret = WriteUInt64ToStream(writer, header);
+	int ret = ResolveTimestamp(writer, &timestamp);
+	if (ret != 0) {
+		return ret;
+	}
+
+	ret = BeginRecord(writer);
+	if (ret != 0) {
+		return ret;
+	}
+
+	ret = WriteUInt64ToStream(writer, header);
 	if (ret != 0) {
 		return ret;
 	}
@@ -1206,7 +1440,17 @@ int AddThreadWakeupRecord(Writer *writer, uint16_t cpuNumber, KernelObjectID wak
 	                        internal::ThreadWakeupRecordFields::ArgumentCount::Make(numArgs) |
 	                        internal::ThreadWakeupRecordFields::CpuNumber::Make(cpuNumber) |
 	                        internal::ThreadWakeupRecordFields::EventType::Make(ToUnderlyingType(internal::SchedulingRecordType::ThreadWakeup));
-	int ret = WriteUInt64ToStream(writer, header);
+	int ret = ResolveTimestamp(writer, &timestamp);
+	if (ret != 0) {
+		return ret;
+	}
+
+	ret = BeginRecord(writer);
+	if (ret != 0) {
+		return ret;
+	}
+
+	ret = WriteUInt64ToStream(writer, header);
 	if (ret != 0) {
 		return ret;
 	}
@@ -1250,16 +1494,19 @@ static int WriteUInt64ToStream(Writer *writer, uint64_t val) {
 	buffer[6] = uint8_t(val >> 48);
 	buffer[7] = uint8_t(val >> 56);
 
+	writer->bytesWritten += sizeof(buffer);
 	return writer->writeFunc(writer->userContext, buffer, sizeof(buffer));
 }
 
 static int WriteBytesToStream(Writer *writer, const void *val, size_t len) {
+	writer->bytesWritten += len;
 	return writer->writeFunc(writer->userContext, (uint8_t *)val, len);
 }
 
 static int WriteZeroPadding(Writer *writer, size_t count) {
 	uint8_t zero = 0;
 
+	writer->bytesWritten += count;
 	for (size_t i = 0; i < count; ++i) {
 		int ret = writer->writeFunc(writer->userContext, &zero, 1);
 		if (ret != 0) {
@@ -0,0 +1,142 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/category.h"
+
+#include "trace_checks.h"
+
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include <vector>
+
+FXT_DEFINE_CATEGORY(Enabled, "enabled", true);
+FXT_DEFINE_CATEGORY(CompiledOut, "compiled out", false);
+FXT_DEFINE_CATEGORY(Filtered, "filtered", true);
+
+static_assert(FXT_CATEGORY_COMPILED_IN(Enabled), "");
+static_assert(!FXT_CATEGORY_COMPILED_IN(CompiledOut), "");
+
+static int gEvaluations = 0;
+
+static int CountEvaluation() {
+	return ++gEvaluations;
+}
+
+TEST_CASE("TestCompiledOutCategory", "[category]") {
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	writer.clock = &clock;
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+
+	std::vector<uint8_t> expected = trace;
+	fxt::Writer expectedWriter(&expected, WriteToVector);
+
+	gEvaluations = 0;
+	FXT_CATEGORY_ADD_INSTANT_EVENT(CompiledOut, &writer, "Foo", 3, 45, CountEvaluation(), "value", CountEvaluation());
+	FXT_CATEGORY_ADD_COUNTER_EVENT(CompiledOut, &writer, "Foo", 3, 45, 100, CountEvaluation(), "value", 1);
+	FXT_CATEGORY_ADD_DURATION_BEGIN_EVENT(CompiledOut, &writer, "Foo", 3, 45, CountEvaluation());
+	FXT_CATEGORY_ADD_FLOW_STEP_EVENT(CompiledOut, &writer, "Foo", 3, 45, 100, CountEvaluation());
+	{
+		FXT_CATEGORY_SCOPE(CompiledOut, (CountEvaluation(), &writer), "Scope", "value", CountEvaluation());
+	}
+	REQUIRE(gEvaluations == 0);
+	REQUIRE(trace == expected);
+
+	FXT_CATEGORY_ADD_INSTANT_EVENT(Enabled, &writer, "Foo", 3, 45, 100, "value", CountEvaluation());
+	REQUIRE(FXT_ADD_INSTANT_EVENT(&expectedWriter, "enabled", "Foo", 3, 45, 100, "value", 1) == 0);
+	FXT_CATEGORY_ADD_DURATION_BEGIN_EVENT(Enabled, &writer, "Bar", 3, 45, 200);
+	REQUIRE(AddDurationBeginEvent(&expectedWriter, "enabled", "Bar", 3, 45, 200, {}) == 0);
+	REQUIRE(gEvaluations == 1);
+	REQUIRE(trace == expected);
+
+	{
+		FXT_CATEGORY_SCOPE(Enabled, &writer, "Scope", "value", CountEvaluation());
+	}
+	REQUIRE(gEvaluations == 2);
+	REQUIRE(CheckTraceIsSelfContained(trace) == 3);
+}
+
+TEST_CASE("TestRuntimeCategoryFilter", "[category]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+
+	std::vector<uint8_t> expected = trace;
+	fxt::Writer expectedWriter(&expected, WriteToVector);
+
+	REQUIRE(fxt::IsCategoryEnabled("filtered"));
+	REQUIRE(fxt::SetCategoryEnabled("filtered", false, &writer, 3, 45, 100) == 0);
+	REQUIRE(FXT_ADD_INSTANT_EVENT(&expectedWriter, "fxt", "Category Filter", 3, 45, 100, "category", "filtered", "enabled", false) == 0);
+	REQUIRE_FALSE(fxt::IsCategoryEnabled("filtered"));
+	REQUIRE_FALSE(FXT_CATEGORY_ENABLED(Filtered));
+	REQUIRE(FXT_CATEGORY_ENABLED(Enabled));
+
+	// Nothing is evaluated while it's off
+	gEvaluations = 0;
+	FXT_CATEGORY_ADD_INSTANT_EVENT(Filtered, &writer, "Foo", 3, 45, 200, "value", CountEvaluation());
+	{
+		FXT_CATEGORY_SCOPE(Filtered, &writer, "Scope", "value", CountEvaluation());
+	}
+	REQUIRE(gEvaluations == 0);
+
+	// Without a writer, there's no marker
+	REQUIRE(fxt::SetCategoryEnabled("filtered", true, nullptr, 0, 0, 0) == 0);
+	FXT_CATEGORY_ADD_INSTANT_EVENT(Filtered, &writer, "Foo", 3, 45, 300, "value", CountEvaluation());
+	REQUIRE(FXT_ADD_INSTANT_EVENT(&expectedWriter, "filtered", "Foo", 3, 45, 300, "value", 1) == 0);
+	REQUIRE(gEvaluations == 1);
+	REQUIRE(trace == expected);
+
+	// Categories can be turned off before they are defined
+	REQUIRE(fxt::SetCategoryEnabled("not defined yet", false, nullptr, 0, 0, 0) == 0);
+	REQUIRE(fxt::internal::RegisterCategory("not defined yet") == fxt::internal::RegisterCategory("not defined yet"));
+	REQUIRE_FALSE(fxt::IsCategoryEnabled("not defined yet"));
+}
+
+// A compiled out category costs the same as the empty loop, even with arguments that would be expensive to compute
+// A category turned off at runtime costs a load and a branch per event
+// Run with: fxt-test "[category][benchmark]"
+TEST_CASE("BenchmarkCompiledOutCategory", "[.][category][benchmark]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+
+	volatile uint64_t sink = 0;
+	BENCHMARK("Empty loop") {
+		for (uint64_t i = 0; i < 1000; ++i) {
+			sink = i;
+		}
+	};
+	BENCHMARK("Compiled out category") {
+		for (uint64_t i = 0; i < 1000; ++i) {
+			sink = i;
+			FXT_CATEGORY_ADD_INSTANT_EVENT(CompiledOut, &writer, "Foo", 3, 45, i, "value", CountEvaluation());
+			FXT_CATEGORY_ADD_DURATION_COMPLETE_EVENT(CompiledOut, &writer, "Foo", 3, 45, i, i + 1, "value", CountEvaluation());
+		}
+	};
+	REQUIRE(fxt::SetCategoryEnabled("filtered", false, nullptr, 0, 0, 0) == 0);
+	BENCHMARK("Category off at runtime") {
+		for (uint64_t i = 0; i < 1000; ++i) {
+			sink = i;
+			FXT_CATEGORY_ADD_INSTANT_EVENT(Filtered, &writer, "Foo", 3, 45, i, "value", CountEvaluation());
+			FXT_CATEGORY_ADD_DURATION_COMPLETE_EVENT(Filtered, &writer, "Foo", 3, 45, i, i + 1, "value", CountEvaluation());
+		}
+	};
+	REQUIRE(fxt::SetCategoryEnabled("filtered", true, nullptr, 0, 0, 0) == 0);
+
+	BENCHMARK("Enabled category") {
+		trace.clear();
+		for (uint64_t i = 0; i < 1000; ++i) {
+			sink = i;
+			FXT_CATEGORY_ADD_INSTANT_EVENT(Enabled, &writer, "Foo", 3, 45, i, "value", i);
+			FXT_CATEGORY_ADD_DURATION_COMPLETE_EVENT(Enabled, &writer, "Foo", 3, 45, i, i + 1, "value", i);
+		}
+	};
+}
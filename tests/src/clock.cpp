@@ -0,0 +1,154 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/clock.h"
+
+#include "fxt/writer.h"
+
+#include "trace_checks.h"
+
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// Returns the value of every Initialization record, and the timestamp of every event, in stream order
+// Also checks that every Duration Complete event ends at or after its begin
+static void ReadClockRecords(const std::vector<uint8_t> &trace, std::vector<uint64_t> *ticksPerSecond, std::vector<uint64_t> *timestamps) {
+	using namespace fxt::internal;
+
+	for (size_t offset = 0; offset < trace.size();) {
+		uint64_t header;
+		memcpy(&header, trace.data() + offset, sizeof(header));
+
+		uint64_t value;
+		switch (RecordFields::Type::Get<RecordType>(header)) {
+		case RecordType::Initialization:
+			memcpy(&value, trace.data() + offset + 8, sizeof(value));
+			ticksPerSecond->push_back(value);
+			break;
+		case RecordType::Event:
+			memcpy(&value, trace.data() + offset + 8, sizeof(value));
+			timestamps->push_back(value);
+			if (EventRecordFields::EventType::Get<EventType>(header) == EventType::DurationComplete) {
+				// The end timestamp is the last word. A span can't end before it begins
+				uint64_t endTimestamp;
+				memcpy(&endTimestamp, trace.data() + offset + WordsToBytes(GetRecordSizeInWords(header)) - 8, sizeof(endTimestamp));
+				REQUIRE(endTimestamp >= value);
+			}
+			break;
+		default:
+			break;
+		}
+
+		offset += WordsToBytes(GetRecordSizeInWords(header));
+	}
+}
+
+TEST_CASE("TestClockCalibration", "[clock]") {
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+	REQUIRE(clock.ticksPerSecond > 0);
+
+	const uint64_t start = ReadClock(&clock);
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	const uint64_t end = ReadClock(&clock);
+
+	// Sleeps only have a lower bound, so be generous above
+	const double elapsedMs = (double)(end - start) * 1000.0 / (double)clock.ticksPerSecond;
+	REQUIRE(elapsedMs >= 45.0);
+	REQUIRE(elapsedMs < 1000.0);
+
+	fxt::ClockConfig config;
+	config.useCycleCounter = false;
+	fxt::Clock monotonic;
+	REQUIRE(InitClock(&monotonic, config) == 0);
+	REQUIRE(monotonic.ticksPerSecond == 1000000000);
+}
+
+TEST_CASE("TestWriterReadsClock", "[clock]") {
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(AddInstantEvent(&writer, "Foo", "Bar", 3, 45, fxt::kTimestampNow) == FXT_ERR_INVALID_CONFIG);
+	writer.clock = &clock;
+
+	// No Initialization record of our own. The writer adds the clock's
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddProviderInfoRecord(&writer, 1234, "Test Provider") == 0);
+	REQUIRE(AddInstantEvent(&writer, "Foo", "Bar", 3, 45, fxt::kTimestampNow) == 0);
+	REQUIRE(AddDurationCompleteEvent(&writer, "Foo", "Baz", 3, 45, fxt::kTimestampNow, fxt::kTimestampNow) == 0);
+	REQUIRE(CheckTraceIsSelfContained(trace) == 2);
+
+	// A rate this far off is always outside the tolerance
+	const bool useCycleCounter = clock.useCycleCounter;
+	const uint64_t calibrated = clock.ticksPerSecond;
+	clock.ticksPerSecond = calibrated / 2;
+	bool recalibrated;
+	REQUIRE(RecalibrateClock(&clock, &recalibrated) == 0);
+	REQUIRE(recalibrated == useCycleCounter);
+	REQUIRE(FXT_ADD_INSTANT_EVENT(&writer, "Foo", "Bar", 3, 45, fxt::kTimestampNow, "index", 2) == 0);
+
+	std::vector<uint64_t> ticksPerSecond;
+	std::vector<uint64_t> timestamps;
+	ReadClockRecords(trace, &ticksPerSecond, &timestamps);
+	REQUIRE(timestamps.size() == 3);
+	REQUIRE(timestamps[0] <= timestamps[1]);
+	REQUIRE(timestamps[1] <= timestamps[2]);
+	if (useCycleCounter) {
+		REQUIRE(ticksPerSecond.size() == 2);
+		REQUIRE(ticksPerSecond[0] == calibrated);
+		REQUIRE(ticksPerSecond[1] == clock.ticksPerSecond);
+	} else {
+		REQUIRE(ticksPerSecond.size() == 1);
+	}
+}
+
+TEST_CASE("TestRecalibrationKeepsTimeContinuous", "[clock]") {
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+	if (!clock.useCycleCounter) {
+		return;
+	}
+
+	// Pretend the clock has been running for 10 hours, and the first calibration was 1000 ppm fast, so the
+	// recalibration adopts a new rate
+	const uint64_t calibrated = clock.ticksPerSecond;
+	clock.tickOffset += calibrated * 60 * 60 * 10;
+	clock.ticksPerSecond = calibrated + calibrated / 1000;
+	const uint64_t before = ReadClock(&clock);
+	const double beforeNs = (double)before * 1e9 / (double)clock.ticksPerSecond;
+
+	bool recalibrated;
+	REQUIRE(RecalibrateClock(&clock, &recalibrated) == 0);
+	REQUIRE(recalibrated);
+
+	// Rescaling all 10 hours with the new rate would move time by 36 seconds. Only the time since the recalibration
+	// should be in the new rate
+	const uint64_t after = ReadClock(&clock);
+	const double afterNs = (double)after * 1e9 / (double)clock.ticksPerSecond;
+	REQUIRE(afterNs >= beforeNs);
+	REQUIRE(afterNs - beforeNs < 5000000.0);
+}
+
+// Reading the clock, compared to the OS monotonic clock it is calibrated against
+// Run with: fxt-test "[clock][benchmark]"
+TEST_CASE("BenchmarkClock", "[.][clock][benchmark]") {
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+
+	BENCHMARK(clock.useCycleCounter ? "ReadClock (cycle counter)" : "ReadClock (monotonic)") {
+		return ReadClock(&clock);
+	};
+	BENCHMARK("steady_clock::now") {
+		return std::chrono::steady_clock::now();
+	};
+}
@@ -0,0 +1,270 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/collector.h"
+
+#include "fxt/writer.h"
+
+#include "trace_checks.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// Writes an event every 20 ticks, starting at firstTimestamp, with the provider's name as the event name
+static std::vector<uint8_t> WriteTimestampedStream(const char *name, uint64_t firstTimestamp, unsigned numEvents) {
+	std::vector<uint8_t> stream;
+	fxt::Writer writer(&stream, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+	for (unsigned i = 0; i < numEvents; ++i) {
+		REQUIRE(AddInstantEvent(&writer, "Foo", name, 3, 45, firstTimestamp + i * 20) == 0);
+	}
+
+	return stream;
+}
+
+// Decodes the String tables of each provider, and checks every event resolves to the name of its own provider
+// Returns the event timestamps, in the order they were written
+static std::vector<uint64_t> ReadEventTimestamps(const std::vector<uint8_t> &trace, const std::map<uint64_t, std::string> &providerNames) {
+	using namespace fxt::internal;
+
+	std::map<uint64_t, std::map<uint16_t, std::string>> strings;
+	uint64_t currentProvider = 0;
+	std::vector<uint64_t> timestamps;
+	for (size_t offset = 0; offset < trace.size();) {
+		uint64_t header;
+		memcpy(&header, trace.data() + offset, sizeof(header));
+
+		const RecordType type = RecordFields::Type::Get<RecordType>(header);
+		if (type == RecordType::Metadata) {
+			const MetadataType metadataType = MetadataRecordFields::MetadataType::Get<MetadataType>(header);
+			if (metadataType == MetadataType::ProviderInfo) {
+				currentProvider = ProviderInfoMetadataRecordFields::ProviderID::Get<uint64_t>(header);
+			} else if (metadataType == MetadataType::ProviderSection) {
+				currentProvider = ProviderSectionMetadataRecordFields::ProviderID::Get<uint64_t>(header);
+			}
+		} else if (type == RecordType::String) {
+			strings[currentProvider][StringRecordFields::StringIndex::Get<uint16_t>(header)] = std::string((const char *)trace.data() + offset + 8, StringRecordFields::StringLength::Get<size_t>(header));
+		} else if (type == RecordType::Event) {
+			REQUIRE(strings[currentProvider].at(EventRecordFields::NameStringRef::Get<uint16_t>(header)) == providerNames.at(currentProvider));
+
+			uint64_t timestamp;
+			memcpy(&timestamp, trace.data() + offset + 8, sizeof(timestamp));
+			timestamps.push_back(timestamp);
+		}
+
+		offset += WordsToBytes(GetRecordSizeInWords(header));
+	}
+
+	return timestamps;
+}
+
+// Feeds the streams to the collector in blocks of records, the way they come out of per-thread buffers
+static void CollectInBlocks(fxt::Collector *collector, const std::vector<std::vector<uint8_t>> &streams, size_t blockSize) {
+	std::vector<size_t> offsets(streams.size(), 0);
+	bool done = false;
+	while (!done) {
+		done = true;
+		for (unsigned i = 0; i < (unsigned)streams.size(); ++i) {
+			// Cut on a record boundary
+			size_t end = offsets[i];
+			while (end < streams[i].size() && end - offsets[i] < blockSize) {
+				uint64_t header;
+				memcpy(&header, streams[i].data() + end, sizeof(header));
+				end += fxt::internal::WordsToBytes(fxt::internal::GetRecordSizeInWords(header));
+			}
+
+			REQUIRE(CollectRecords(collector, i, streams[i].data() + offsets[i], end - offsets[i]) == 0);
+			offsets[i] = end;
+			done = done && end == streams[i].size();
+		}
+	}
+}
+
+TEST_CASE("TestCollectorSeparatesProviders", "[collector]") {
+	std::vector<uint8_t> first;
+	fxt::Writer firstWriter(&first, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&firstWriter) == 0);
+	REQUIRE(AddInitializationRecord(&firstWriter, 1000) == 0);
+	REQUIRE(AddInstantEvent(&firstWriter, "Foo", "First", 3, 45, 100) == 0);
+
+	std::vector<uint8_t> second;
+	fxt::Writer secondWriter(&second, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&secondWriter) == 0);
+	REQUIRE(AddInitializationRecord(&secondWriter, 1000) == 0);
+	REQUIRE(AddInstantEvent(&secondWriter, "Foo", "Second", 4, 46, 100) == 0);
+	REQUIRE(AddInstantEvent(&secondWriter, "Foo", "Second", 4, 46, 200) == 0);
+
+	std::vector<uint8_t> merged;
+	fxt::Collector collector(&merged, WriteToVector);
+	unsigned firstStream;
+	unsigned secondStream;
+	REQUIRE(AddCollectorStream(&collector, 1, "First", &firstStream) == 0);
+	REQUIRE(AddCollectorStream(&collector, 2, "Second", &secondStream) == 0);
+
+	REQUIRE(CollectRecords(&collector, firstStream, first.data(), first.size()) == 0);
+	REQUIRE(CollectRecords(&collector, secondStream, second.data(), second.size()) == 0);
+
+	const std::map<uint64_t, unsigned> counts = CountEventsPerProvider(merged);
+	REQUIRE(counts.size() == 2);
+	REQUIRE(counts.at(1) == 1);
+	REQUIRE(counts.at(2) == 2);
+
+	// Magic numbers are dropped, so they aren't counted
+	REQUIRE(collector.streams[firstStream].recordsCollected == 5);
+	REQUIRE(collector.streams[secondStream].recordsCollected == 6);
+
+	// Partial records are rejected
+	REQUIRE(CollectRecords(&collector, firstStream, first.data(), first.size() - 8) == FXT_ERR_INVALID_TRACE);
+}
+
+TEST_CASE("TestCollectorDropsProducerProviderRecords", "[collector]") {
+	// Both producers call themselves the same provider. The collector files them under the providers it was given
+	std::vector<std::vector<uint8_t>> streams(2);
+	for (unsigned i = 0; i < 2; ++i) {
+		fxt::Writer writer(&streams[i], WriteToVector);
+		WriteTestHeader(&writer);
+		WriteTestEvents(&writer, 45 + i, 0, 50 + 50 * i);
+	}
+
+	for (const bool orderByTimestamp : { false, true }) {
+		std::vector<uint8_t> merged;
+		fxt::Collector collector(&merged, WriteToVector);
+		collector.orderByTimestamp = orderByTimestamp;
+		unsigned stream;
+		REQUIRE(AddCollectorStream(&collector, 1, "First", &stream) == 0);
+		REQUIRE(AddCollectorStream(&collector, 2, "Second", &stream) == 0);
+
+		CollectInBlocks(&collector, streams, 256);
+		REQUIRE(FlushCollector(&collector) == 0);
+
+		// Every event's strings and thread resolve in its own provider's tables
+		const std::map<uint64_t, unsigned> counts = CountEventsPerProvider(merged);
+		REQUIRE(counts.size() == 2);
+		REQUIRE(counts.at(1) == 150);
+		REQUIRE(counts.at(2) == 300);
+	}
+}
+
+TEST_CASE("TestCollectorOrdersByTimestamp", "[collector]") {
+	// The streams interleave in time, but arrive in blocks
+	const std::vector<std::vector<uint8_t>> streams = {
+		WriteTimestampedStream("First", 0, 100),
+		WriteTimestampedStream("Second", 5, 100),
+		WriteTimestampedStream("Third", 10, 100),
+	};
+	const std::map<uint64_t, std::string> providerNames = {
+		{ 1, "First" },
+		{ 2, "Second" },
+		{ 3, "Third" },
+	};
+
+	std::vector<uint8_t> merged;
+	fxt::Collector collector(&merged, WriteToVector);
+	collector.orderByTimestamp = true;
+	collector.reorderWindow = 1000;
+	for (const auto &provider : providerNames) {
+		unsigned stream;
+		REQUIRE(AddCollectorStream(&collector, provider.first, provider.second.c_str(), &stream) == 0);
+	}
+
+	CollectInBlocks(&collector, streams, 256);
+	REQUIRE(FlushCollector(&collector) == 0);
+
+	const std::vector<uint64_t> timestamps = ReadEventTimestamps(merged, providerNames);
+	REQUIRE(timestamps.size() == 300);
+	for (size_t i = 1; i < timestamps.size(); ++i) {
+		REQUIRE(timestamps[i - 1] <= timestamps[i]);
+	}
+	REQUIRE(collector.lateRecords == 0);
+
+	const std::map<uint64_t, unsigned> counts = CountEventsPerProvider(merged);
+	REQUIRE(counts.size() == 3);
+	REQUIRE(counts.at(1) == 100);
+}
+
+TEST_CASE("TestCollectorOrdersDurationCompleteByEnd", "[collector]") {
+	// Like FXT_SCOPE(), each child span is written before the parent that encloses it
+	std::vector<std::vector<uint8_t>> streams;
+	for (uint64_t firstTimestamp : { 0, 7 }) {
+		std::vector<uint8_t> stream;
+		fxt::Writer writer(&stream, WriteToVector);
+		REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+		REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+		for (uint64_t i = 0; i < 100; ++i) {
+			const uint64_t begin = firstTimestamp + i * 100;
+			REQUIRE(AddDurationCompleteEvent(&writer, "Foo", "Child", 3, 45, begin + 10, begin + 20) == 0);
+			REQUIRE(AddDurationCompleteEvent(&writer, "Foo", "Parent", 3, 45, begin, begin + 30) == 0);
+		}
+		streams.push_back(stream);
+	}
+
+	std::vector<uint8_t> merged;
+	fxt::Collector collector(&merged, WriteToVector);
+	collector.orderByTimestamp = true;
+	collector.reorderWindow = 1000;
+	unsigned stream;
+	REQUIRE(AddCollectorStream(&collector, 1, "First", &stream) == 0);
+	REQUIRE(AddCollectorStream(&collector, 2, "Second", &stream) == 0);
+
+	CollectInBlocks(&collector, streams, 256);
+	REQUIRE(FlushCollector(&collector) == 0);
+	REQUIRE(collector.lateRecords == 0);
+
+	// The end timestamp is the last word of the record
+	std::vector<uint64_t> endTimestamps;
+	for (size_t offset = 0; offset < merged.size();) {
+		uint64_t header;
+		memcpy(&header, merged.data() + offset, sizeof(header));
+		const size_t recordSize = fxt::internal::WordsToBytes(fxt::internal::GetRecordSizeInWords(header));
+		if (fxt::internal::RecordFields::Type::Get<fxt::internal::RecordType>(header) == fxt::internal::RecordType::Event) {
+			uint64_t timestamp;
+			memcpy(&timestamp, merged.data() + offset + recordSize - sizeof(timestamp), sizeof(timestamp));
+			endTimestamps.push_back(timestamp);
+		}
+		offset += recordSize;
+	}
+	REQUIRE(endTimestamps.size() == 400);
+	for (size_t i = 1; i < endTimestamps.size(); ++i) {
+		REQUIRE(endTimestamps[i - 1] <= endTimestamps[i]);
+	}
+
+	const std::map<uint64_t, unsigned> counts = CountEventsPerProvider(merged);
+	REQUIRE(counts.at(1) == 200);
+	REQUIRE(counts.at(2) == 200);
+}
+
+TEST_CASE("TestCollectorCountsLateRecords", "[collector]") {
+	// The second stream lags a long way behind the first
+	const std::vector<uint8_t> first = WriteTimestampedStream("First", 1000, 10);
+	const std::vector<uint8_t> second = WriteTimestampedStream("Second", 0, 10);
+	const std::map<uint64_t, std::string> providerNames = {
+		{ 1, "First" },
+		{ 2, "Second" },
+	};
+
+	std::vector<uint8_t> merged;
+	fxt::Collector collector(&merged, WriteToVector);
+	collector.orderByTimestamp = true;
+	collector.reorderWindow = 100;
+	unsigned firstStream;
+	unsigned secondStream;
+	REQUIRE(AddCollectorStream(&collector, 1, "First", &firstStream) == 0);
+	REQUIRE(AddCollectorStream(&collector, 2, "Second", &secondStream) == 0);
+
+	REQUIRE(CollectRecords(&collector, firstStream, first.data(), first.size()) == 0);
+	REQUIRE(CollectRecords(&collector, secondStream, second.data(), second.size()) == 0);
+	REQUIRE(FlushCollector(&collector) == 0);
+
+	// Everything from the first stream older than its newest event minus the window went out before the second showed up
+	REQUIRE(collector.lateRecords == 10);
+	REQUIRE(ReadEventTimestamps(merged, providerNames).size() == 20);
+	REQUIRE(CountEventsPerProvider(merged).at(2) == 10);
+}
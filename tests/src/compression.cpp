@@ -0,0 +1,246 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/compression.h"
+
+#include "fxt/double_buffered_sink.h"
+#include "fxt/writer.h"
+
+#include "trace_checks.h"
+
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#	define fileno _fileno
+#endif
+
+struct MemoryStream {
+	const std::vector<uint8_t> *data;
+	size_t offset;
+};
+
+static int ReadFromMemory(void *userContext, void *data, size_t len, size_t *bytesRead) {
+	MemoryStream *stream = (MemoryStream *)userContext;
+
+	const size_t available = stream->data->size() - stream->offset;
+	*bytesRead = len < available ? len : available;
+	memcpy(data, stream->data->data() + stream->offset, *bytesRead);
+	stream->offset += *bytesRead;
+	return 0;
+}
+
+static int ReadFromFile(void *userContext, void *data, size_t len, size_t *bytesRead) {
+	*bytesRead = fread(data, 1, len, (FILE *)userContext);
+	return 0;
+}
+
+static std::vector<uint8_t> DecompressAll(const std::vector<uint8_t> &compressed, int *result) {
+	MemoryStream stream = { &compressed, 0 };
+	fxt::DecompressingReader reader(&stream, ReadFromMemory);
+
+	std::vector<uint8_t> decompressed;
+	uint8_t chunk[1000];
+	size_t bytesRead;
+	do {
+		*result = ReadDecompressed(&reader, chunk, sizeof(chunk), &bytesRead);
+		decompressed.insert(decompressed.end(), chunk, chunk + bytesRead);
+	} while (*result == 0 && bytesRead > 0);
+
+	return decompressed;
+}
+
+TEST_CASE("TestCompressedFramesRoundTrip", "[compression]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	WriteTestTrace(&writer, 1000);
+
+	// Random bytes don't compress, so they have to fall back to a stored frame
+	std::vector<uint8_t> noise(5000);
+	uint32_t state = 12345;
+	for (uint8_t &byte : noise) {
+		state = state * 1664525u + 1013904223u;
+		byte = (uint8_t)(state >> 24);
+	}
+
+	const std::vector<std::vector<uint8_t>> inputs = {
+		std::vector<uint8_t>(trace.begin(), trace.begin() + 1),
+		std::vector<uint8_t>(trace.begin(), trace.begin() + 13),
+		std::vector<uint8_t>(trace.begin(), trace.begin() + 100),
+		trace,
+		std::vector<uint8_t>(70000, 'a'),
+		noise,
+	};
+
+	std::vector<uint8_t> compressed;
+	std::vector<uint8_t> expected;
+	for (const std::vector<uint8_t> &input : inputs) {
+		std::vector<uint8_t> frame(fxt::GetMaxCompressedFrameSize(input.size()));
+		size_t frameSize;
+		REQUIRE(fxt::CompressFrame(input.data(), input.size(), frame.data(), frame.size(), &frameSize) == 0);
+
+		compressed.insert(compressed.end(), frame.begin(), frame.begin() + frameSize);
+		expected.insert(expected.end(), input.begin(), input.end());
+	}
+	REQUIRE(compressed.size() < expected.size() / 3);
+
+	int result;
+	REQUIRE(DecompressAll(compressed, &result) == expected);
+	REQUIRE(result == 0);
+
+	// Each frame decodes on its own, and a partial frame at the end is reported, after everything before it
+	std::vector<uint8_t> truncated(compressed.begin(), compressed.end() - 10);
+	const std::vector<uint8_t> recovered = DecompressAll(truncated, &result);
+	REQUIRE(result == FXT_ERR_INVALID_TRACE);
+	REQUIRE(recovered.size() == expected.size() - noise.size());
+	REQUIRE(memcmp(recovered.data(), expected.data(), recovered.size()) == 0);
+}
+
+// Wraps a block in a frame, the way CompressFrame() would
+static void AppendFrame(std::vector<uint8_t> *frames, fxt::CompressionCodec codec, const std::vector<uint8_t> &raw, const std::vector<uint8_t> &payload) {
+	fxt::internal::CompressedFrameHeader header;
+	fxt::internal::InitCompressedFrameHeader(&header, codec, raw.data(), raw.size(), payload.size());
+
+	const uint8_t *headerBytes = (const uint8_t *)&header;
+	frames->insert(frames->end(), headerBytes, headerBytes + sizeof(header));
+	frames->insert(frames->end(), payload.begin(), payload.end());
+}
+
+TEST_CASE("TestDecompressReferenceLZ4Blocks", "[compression]") {
+	// Blocks from LZ4_compress_default() of the reference implementation, version 1.9.4
+	const std::string overlapping = "abcabcabcabcabcabcabcabcabcabcabcabcabcabcabcabc!";
+
+	// 20 random bytes, 600 'x', the first 12 random bytes again, and "tail!". So there are literal and match lengths
+	// with extension bytes
+	std::vector<uint8_t> longRuns;
+	uint32_t state = 12345;
+	for (int i = 0; i < 20; ++i) {
+		state = state * 1664525u + 1013904223u;
+		longRuns.push_back((uint8_t)(state >> 24));
+	}
+	longRuns.insert(longRuns.end(), 600, 'x');
+	longRuns.insert(longRuns.end(), longRuns.begin(), longRuns.begin() + 12);
+	longRuns.insert(longRuns.end(), { 't', 'a', 'i', 'l', '!' });
+
+	const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> vectors = {
+		{
+		        { 'F', 'X', 'T' },
+		        { 0x30, 0x46, 0x58, 0x54 },
+		},
+		{
+		        std::vector<uint8_t>(overlapping.begin(), overlapping.end()),
+		        { 0x3f, 0x61, 0x62, 0x63, 0x03, 0x00, 0x16, 0x50, 0x63, 0x61, 0x62, 0x63, 0x21 },
+		},
+		{
+		        longRuns,
+		        {
+		                0xff, 0x06, 0x05, 0x04, 0x8b, 0xa2, 0xe8, 0x1c, 0x7e, 0x8c, 0x98, 0xc8, 0x0a, 0xbe, 0xf7, 0x12, 0xb3, 0x75, 0x65,
+		                0xf5, 0x67, 0xf3, 0x78, 0x01, 0x00, 0xff, 0xff, 0x46, 0x08, 0x6c, 0x02, 0x50, 0x74, 0x61, 0x69, 0x6c, 0x21,
+		        },
+		},
+	};
+
+	std::vector<uint8_t> frames;
+	std::vector<uint8_t> expected;
+	for (const auto &vector : vectors) {
+		AppendFrame(&frames, fxt::CompressionCodec::LZ4, vector.first, vector.second);
+		expected.insert(expected.end(), vector.first.begin(), vector.first.end());
+	}
+
+	int result;
+	REQUIRE(DecompressAll(frames, &result) == expected);
+	REQUIRE(result == 0);
+}
+
+TEST_CASE("TestDecompressRejectsOversizedFrame", "[compression]") {
+	const std::vector<uint8_t> raw(100, 'a');
+	std::vector<uint8_t> frames;
+	AppendFrame(&frames, fxt::CompressionCodec::Stored, raw, raw);
+
+	// Claim a raw size over the reader's limit, but under the format's
+	fxt::internal::CompressedFrameHeader header;
+	memcpy(&header, frames.data(), sizeof(header));
+	header.rawSize = 1024 * 1024 * 1024;
+	memcpy(frames.data(), &header, sizeof(header));
+
+	MemoryStream stream = { &frames, 0 };
+	fxt::DecompressingReader reader(&stream, ReadFromMemory);
+	uint8_t chunk[100];
+	size_t bytesRead;
+	REQUIRE(ReadDecompressed(&reader, chunk, sizeof(chunk), &bytesRead) == FXT_ERR_INVALID_TRACE);
+	REQUIRE(bytesRead == 0);
+	REQUIRE(reader.raw.capacity() == 0);
+}
+
+TEST_CASE("TestDoubleBufferedSinkCompression", "[compression]") {
+	std::vector<uint8_t> expected;
+	fxt::Writer directWriter(&expected, WriteToVector);
+	WriteTestTrace(&directWriter, 2000);
+
+	FILE *file = tmpfile();
+	REQUIRE(file != nullptr);
+
+	fxt::DoubleBufferedSinkConfig config;
+	config.bufferSize = 16 * 1024;
+	config.flushIntervalMs = 0;
+	config.compress = true;
+
+	fxt::DoubleBufferedSink sink;
+	REQUIRE(InitDoubleBufferedSink(&sink, fileno(file), config) == 0);
+	fxt::Writer writer(&sink, fxt::WriteToDoubleBufferedSink);
+	WriteTestTrace(&writer, 2000);
+	REQUIRE(FlushAndWait(&sink) == 0);
+
+	fxt::DoubleBufferedSinkMetrics metrics;
+	GetDoubleBufferedSinkMetrics(&sink, &metrics);
+	REQUIRE(CloseDoubleBufferedSink(&sink) == 0);
+	REQUIRE(metrics.rawBytesFlushed == expected.size());
+	REQUIRE(metrics.bytesFlushed < expected.size() / 2);
+
+	REQUIRE(fseek(file, 0, SEEK_SET) == 0);
+	fxt::DecompressingReader reader(file, ReadFromFile);
+	std::vector<uint8_t> decompressed(expected.size() + 1);
+	size_t bytesRead;
+	REQUIRE(ReadDecompressed(&reader, decompressed.data(), decompressed.size(), &bytesRead) == 0);
+	REQUIRE(bytesRead == expected.size());
+	decompressed.resize(bytesRead);
+	REQUIRE(decompressed == expected);
+
+	fclose(file);
+}
+
+// CPU cost of compressing a buffer, against the bytes it saves
+// Run with: fxt-test "[compression][benchmark]"
+TEST_CASE("BenchmarkCompression", "[.][compression][benchmark]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	WriteTestTrace(&writer, 40000);
+	trace.resize(4 * 1024 * 1024 < trace.size() ? 4 * 1024 * 1024 : trace.size());
+
+	std::vector<uint8_t> frame(fxt::GetMaxCompressedFrameSize(trace.size()));
+	size_t frameSize = 0;
+	REQUIRE(fxt::CompressFrame(trace.data(), trace.size(), frame.data(), frame.size(), &frameSize) == 0);
+	WARN("Compressing " << trace.size() << " bytes to " << frameSize << " bytes (" << (double)trace.size() / (double)frameSize << "x)");
+
+	BENCHMARK("compress") {
+		return fxt::CompressFrame(trace.data(), trace.size(), frame.data(), frame.size(), &frameSize);
+	};
+
+	std::vector<uint8_t> compressed(frame.begin(), frame.begin() + frameSize);
+	std::vector<uint8_t> decompressed(trace.size());
+	BENCHMARK("decompress") {
+		MemoryStream stream = { &compressed, 0 };
+		fxt::DecompressingReader reader(&stream, ReadFromMemory);
+		size_t bytesRead;
+		return ReadDecompressed(&reader, decompressed.data(), decompressed.size(), &bytesRead);
+	};
+}
@@ -0,0 +1,238 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/counter_aggregator.h"
+
+#include "trace_checks.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <thread>
+#include <vector>
+
+TEST_CASE("TestAggregatedCounterIntervals", "[counter_aggregator]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+
+	std::vector<uint8_t> expected = trace;
+	fxt::Writer expectedWriter(&expected, WriteToVector);
+
+	fxt::CounterAggregatorConfig config;
+	config.intervalMs = 0;
+	config.processID = 3;
+	config.threadID = 45;
+	fxt::CounterAggregator aggregator;
+	REQUIRE(InitCounterAggregator(&aggregator, &writer, config) == 0);
+
+	fxt::AggregatedCounter *queueDepth;
+	REQUIRE(RegisterAggregatedCounter(&aggregator, "Network", "Send Queue Depth", 1, true, &queueDepth) == 0);
+	fxt::AggregatedCounter *bytesSent;
+	REQUIRE(RegisterAggregatedCounter(&aggregator, "Network", "Bytes Sent", 2, false, &bytesSent) == 0);
+
+	// Only the depth goes up and down, so only it tracks min / max. The depth rises to 5, then drains to 2
+	for (int i = 0; i < 5; ++i) {
+		AddToAggregatedCounter(queueDepth, 1);
+	}
+	for (int i = 0; i < 3; ++i) {
+		AddToAggregatedCounter(queueDepth, -1);
+	}
+	AddToAggregatedCounter(bytesSent, 1500);
+	AddToAggregatedCounter(bytesSent, 500);
+
+	REQUIRE(FlushCounterAggregator(&aggregator, 100) == 0);
+	REQUIRE(FXT_ADD_COUNTER_EVENT(&expectedWriter, "Network", "Send Queue Depth", 3, 45, 100, 1, "min", int64_t(0), "max", int64_t(5), "last", int64_t(2), "sum", int64_t(2)) == 0);
+	REQUIRE(FXT_ADD_COUNTER_EVENT(&expectedWriter, "Network", "Bytes Sent", 3, 45, 100, 2, "last", int64_t(2000), "sum", int64_t(2000)) == 0);
+	REQUIRE(trace == expected);
+
+	// The next interval starts from the last reported value
+	AddToAggregatedCounter(queueDepth, -2);
+	AddToAggregatedCounter(bytesSent, 100);
+
+	REQUIRE(FlushCounterAggregator(&aggregator, 200) == 0);
+	REQUIRE(FXT_ADD_COUNTER_EVENT(&expectedWriter, "Network", "Send Queue Depth", 3, 45, 200, 1, "min", int64_t(0), "max", int64_t(2), "last", int64_t(0), "sum", int64_t(-2)) == 0);
+	REQUIRE(FXT_ADD_COUNTER_EVENT(&expectedWriter, "Network", "Bytes Sent", 3, 45, 200, 2, "last", int64_t(2100), "sum", int64_t(100)) == 0);
+	REQUIRE(trace == expected);
+
+	// Set works like a gauge
+	SetAggregatedCounter(queueDepth, 10);
+	SetAggregatedCounter(queueDepth, 7);
+
+	REQUIRE(FlushCounterAggregator(&aggregator, 300) == 0);
+	REQUIRE(FXT_ADD_COUNTER_EVENT(&expectedWriter, "Network", "Send Queue Depth", 3, 45, 300, 1, "min", int64_t(0), "max", int64_t(10), "last", int64_t(7), "sum", int64_t(7)) == 0);
+	REQUIRE(FXT_ADD_COUNTER_EVENT(&expectedWriter, "Network", "Bytes Sent", 3, 45, 300, 2, "last", int64_t(2100), "sum", int64_t(0)) == 0);
+	REQUIRE(trace == expected);
+	REQUIRE(CheckTraceIsSelfContained(trace) == 6);
+}
+
+TEST_CASE("TestCounterAggregatorThread", "[counter_aggregator]") {
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	writer.clock = &clock;
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+
+	fxt::CounterAggregatorConfig config;
+	config.intervalMs = 1;
+	fxt::CounterAggregator aggregator;
+	REQUIRE(InitCounterAggregator(&aggregator, &writer, config) == 0);
+
+	fxt::AggregatedCounter *counter;
+	REQUIRE(RegisterAggregatedCounter(&aggregator, "Network", "Bytes Sent", 1, false, &counter) == 0);
+
+	// Updates from many threads are never lost
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < 4; ++i) {
+		threads.emplace_back([counter]() {
+			for (int j = 0; j < 100000; ++j) {
+				AddToAggregatedCounter(counter, 1);
+			}
+		});
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+
+	REQUIRE(counter->value.load() == 400000);
+
+	REQUIRE(CloseCounterAggregator(&aggregator) == 0);
+	const size_t closedSize = trace.size();
+	REQUIRE(CheckTraceIsSelfContained(trace) >= 1);
+
+	// Closing again doesn't write anything
+	REQUIRE(CloseCounterAggregator(&aggregator) == 0);
+	REQUIRE(trace.size() == closedSize);
+	REQUIRE(FlushCounterAggregator(&aggregator, fxt::kTimestampNow) == FXT_ERR_INVALID_CONFIG);
+}
+
+TEST_CASE("TestCounterAggregatorClosesOnDestruction", "[counter_aggregator]") {
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	writer.clock = &clock;
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+
+	{
+		fxt::CounterAggregator aggregator;
+		REQUIRE(InitCounterAggregator(&aggregator, &writer, fxt::CounterAggregatorConfig()) == 0);
+
+		fxt::AggregatedCounter *counter;
+		REQUIRE(RegisterAggregatedCounter(&aggregator, "Network", "Bytes Sent", 1, false, &counter) == 0);
+		AddToAggregatedCounter(counter, 5);
+	}
+
+	// The thread was joined, and the counter written one last time
+	REQUIRE(CheckTraceIsSelfContained(trace) == 1);
+}
+
+TEST_CASE("TestCounterAggregatorReportsHistograms", "[counter_aggregator]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+
+	std::vector<uint8_t> expected = trace;
+	fxt::Writer expectedWriter(&expected, WriteToVector);
+
+	fxt::LatencyHistogram histogram;
+	REQUIRE(InitLatencyHistogram(&histogram, "Requests", "Latency", 2, fxt::HistogramConfig()) == 0);
+
+	fxt::CounterAggregatorConfig config;
+	config.intervalMs = 0;
+	config.processID = 3;
+	config.threadID = 45;
+	fxt::CounterAggregator aggregator;
+	REQUIRE(RegisterAggregatedHistogram(&aggregator, &histogram) == FXT_ERR_INVALID_CONFIG);
+	REQUIRE(InitCounterAggregator(&aggregator, &writer, config) == 0);
+	REQUIRE(RegisterAggregatedHistogram(&aggregator, &histogram) == 0);
+
+	// Small values get a bucket each, so the percentiles are exact
+	for (uint64_t i = 1; i <= 10; ++i) {
+		RecordHistogramValue(&histogram, i);
+	}
+
+	REQUIRE(FlushCounterAggregator(&aggregator, 100) == 0);
+	REQUIRE(FXT_ADD_COUNTER_EVENT(&expectedWriter, "Requests", "Latency", 3, 45, 100, 2, "p50", uint64_t(5), "p90", uint64_t(9), "p99", uint64_t(10), "max", uint64_t(10), "count", uint64_t(10)) == 0);
+	REQUIRE(trace == expected);
+
+	// Nothing was recorded in this interval, so nothing is written
+	REQUIRE(FlushCounterAggregator(&aggregator, 200) == 0);
+	REQUIRE(trace == expected);
+
+	RecordHistogramValue(&histogram, 7);
+	REQUIRE(FlushCounterAggregator(&aggregator, 300) == 0);
+	REQUIRE(CheckTraceIsSelfContained(trace) == 2);
+
+	// Nothing is left to write, so closing doesn't need a clock
+	REQUIRE(CloseCounterAggregator(&aggregator) == 0);
+	REQUIRE(aggregator.histograms.empty());
+}
+
+TEST_CASE("TestCounterAggregatorReportsSamplers", "[counter_aggregator]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+
+	std::vector<uint8_t> expected = trace;
+	fxt::Writer expectedWriter(&expected, WriteToVector);
+
+	fxt::SamplingConfig samplingConfig;
+	samplingConfig.oneInN = 4;
+	fxt::Sampler sampler;
+	REQUIRE(InitSampler(&sampler, "Hot", samplingConfig) == 0);
+
+	fxt::CounterAggregatorConfig config;
+	config.intervalMs = 0;
+	config.processID = 3;
+	config.threadID = 45;
+	fxt::CounterAggregator aggregator;
+	REQUIRE(RegisterAggregatedSampler(&aggregator, &sampler) == FXT_ERR_INVALID_CONFIG);
+	REQUIRE(InitCounterAggregator(&aggregator, &writer, config) == 0);
+	REQUIRE(RegisterAggregatedSampler(&aggregator, &sampler) == 0);
+
+	// Each thread counts on its own, and writes its own counts under its own counter ID
+	std::vector<uint8_t> threadTraces[2];
+	int threadResults[2] = { -1, -1 };
+	std::thread threads[2];
+	for (unsigned i = 0; i < 2; ++i) {
+		threads[i] = std::thread([&sampler, &threadTraces, &threadResults, i]() {
+			for (unsigned j = 0; j < 8 * (i + 1); ++j) {
+				fxt::SampleEvent(&sampler);
+			}
+
+			fxt::Writer threadWriter(&threadTraces[i], WriteToVector);
+			threadResults[i] = AddSamplerCounterEvent(&threadWriter, &sampler, 3, 46, 50);
+		});
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+	REQUIRE(threadResults[0] == 0);
+	REQUIRE(threadResults[1] == 0);
+
+	REQUIRE(sampler.shards.size() == 2);
+	REQUIRE(sampler.shards[0]->counterID != sampler.shards[1]->counterID);
+	REQUIRE(threadTraces[0] != threadTraces[1]);
+
+	// The aggregator writes the sum over both threads
+	REQUIRE(FlushCounterAggregator(&aggregator, 100) == 0);
+	REQUIRE(FXT_ADD_COUNTER_EVENT(&expectedWriter, "fxt", "Sampling: Hot", 3, 45, 100, 0, "kept", uint64_t(6), "sampledOut", uint64_t(18)) == 0);
+	REQUIRE(trace == expected);
+
+	// The totals are written once more on close, with the current time
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+	writer.clock = &clock;
+	REQUIRE(CloseCounterAggregator(&aggregator) == 0);
+	REQUIRE(aggregator.samplers.empty());
+	REQUIRE(CheckTraceIsSelfContained(trace) == 2);
+}
@@ -0,0 +1,183 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/double_buffered_sink.h"
+#include "fxt/writer.h"
+
+#include "trace_checks.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <signal.h>
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#	define fileno _fileno
+#endif
+
+TEST_CASE("TestDoubleBufferedSinkMatchesDirectWrite", "[double_buffered_sink]") {
+	std::vector<uint8_t> expected;
+	fxt::Writer directWriter(&expected, WriteToVector);
+	WriteTestTrace(&directWriter, 200);
+
+	FILE *file = tmpfile();
+	REQUIRE(file != nullptr);
+
+	// Use tiny buffers so we exercise the buffer swapping and producer stalls
+	fxt::DoubleBufferedSinkConfig config;
+	config.bufferSize = 100;
+	config.numBuffers = 3;
+	config.flushIntervalMs = 0;
+
+	fxt::DoubleBufferedSink sink;
+	REQUIRE(InitDoubleBufferedSink(&sink, fileno(file), config) == 0);
+
+	fxt::Writer writer(&sink, fxt::WriteToDoubleBufferedSink);
+	WriteTestTrace(&writer, 200);
+
+	REQUIRE(FlushAndWait(&sink) == 0);
+
+	fxt::DoubleBufferedSinkMetrics metrics;
+	GetDoubleBufferedSinkMetrics(&sink, &metrics);
+	REQUIRE(metrics.bytesFlushed == expected.size());
+	REQUIRE(metrics.buffersFlushed == (expected.size() + config.bufferSize - 1) / config.bufferSize);
+	REQUIRE(metrics.fullSwaps == expected.size() / config.bufferSize);
+	REQUIRE(metrics.maxQueuedBuffers >= 1);
+	REQUIRE(metrics.maxQueuedBuffers <= config.numBuffers);
+
+	REQUIRE(ReadWholeFile(file) == expected);
+
+	REQUIRE(CloseDoubleBufferedSink(&sink) == 0);
+	// Closing twice is a no-op
+	REQUIRE(CloseDoubleBufferedSink(&sink) == 0);
+	// Writing after close fails
+	REQUIRE(WriteMagicNumberRecord(&writer) == FXT_ERR_SINK_CLOSED);
+
+	fclose(file);
+}
+
+TEST_CASE("TestDoubleBufferedSinkTimerFlushesPartialBuffer", "[double_buffered_sink]") {
+	FILE *file = tmpfile();
+	REQUIRE(file != nullptr);
+
+	fxt::DoubleBufferedSinkConfig config;
+	config.bufferSize = 64 * 1024;
+	config.flushIntervalMs = 5;
+
+	fxt::DoubleBufferedSink sink;
+	REQUIRE(InitDoubleBufferedSink(&sink, fileno(file), config) == 0);
+
+	fxt::Writer writer(&sink, fxt::WriteToDoubleBufferedSink);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+
+	// The buffer is nowhere near full. So only the timer can get the data to the file
+	fxt::DoubleBufferedSinkMetrics metrics = {};
+	for (int i = 0; i < 200 && metrics.bytesFlushed == 0; ++i) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+		GetDoubleBufferedSinkMetrics(&sink, &metrics);
+	}
+
+	REQUIRE(metrics.timerSwaps > 0);
+	REQUIRE(metrics.bytesFlushed >= 8);
+
+	REQUIRE(CloseDoubleBufferedSink(&sink) == 0);
+	fclose(file);
+}
+
+TEST_CASE("TestDoubleBufferedSinkTimerFlushesIdleProducer", "[double_buffered_sink]") {
+	FILE *file = tmpfile();
+	REQUIRE(file != nullptr);
+
+	fxt::DoubleBufferedSinkConfig config;
+	config.bufferSize = 64 * 1024;
+	config.flushIntervalMs = 5;
+
+	fxt::DoubleBufferedSink sink;
+	REQUIRE(InitDoubleBufferedSink(&sink, fileno(file), config) == 0);
+
+	fxt::Writer writer(&sink, fxt::WriteToDoubleBufferedSink);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+
+	// The producer never writes again, so the flush thread has to take the buffer itself
+	fxt::DoubleBufferedSinkMetrics metrics = {};
+	for (int i = 0; i < 200 && metrics.bytesFlushed == 0; ++i) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		GetDoubleBufferedSinkMetrics(&sink, &metrics);
+	}
+
+	REQUIRE(metrics.timerSwaps == 1);
+	REQUIRE(metrics.bytesFlushed == 8);
+	REQUIRE(metrics.idlePagesReclaimed == 0);
+
+	// The producer carries on in the next buffer
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+	REQUIRE(CloseDoubleBufferedSink(&sink) == 0);
+	REQUIRE(ReadWholeFile(file).size() == 24);
+	fclose(file);
+}
+
+#if !defined(_WIN32)
+static fxt::DoubleBufferedSink *g_crashingSink = nullptr;
+static int g_emergencyFlushResult = -1;
+
+static void EmergencyFlushHandler(int signal) {
+	(void)signal;
+	g_emergencyFlushResult = EmergencyFlush(g_crashingSink, 1000);
+}
+
+TEST_CASE("TestDoubleBufferedSinkEmergencyFlushFromSignalHandler", "[double_buffered_sink]") {
+	std::vector<uint8_t> expected;
+	fxt::Writer directWriter(&expected, WriteToVector);
+	WriteTestTrace(&directWriter, 200);
+
+	FILE *file = tmpfile();
+	REQUIRE(file != nullptr);
+
+	fxt::DoubleBufferedSinkConfig config;
+	config.bufferSize = 100;
+	config.numBuffers = 3;
+	config.flushIntervalMs = 0;
+
+	fxt::DoubleBufferedSink sink;
+	REQUIRE(InitDoubleBufferedSink(&sink, fileno(file), config) == 0);
+
+	fxt::Writer writer(&sink, fxt::WriteToDoubleBufferedSink);
+	WriteTestTrace(&writer, 200);
+
+	// Nothing has been flushed explicitly, so the tail of the trace is still sitting in the buffers
+	struct sigaction action = {};
+	struct sigaction previousAction = {};
+	action.sa_handler = EmergencyFlushHandler;
+	sigemptyset(&action.sa_mask);
+	REQUIRE(sigaction(SIGUSR1, &action, &previousAction) == 0);
+
+	g_crashingSink = &sink;
+	raise(SIGUSR1);
+	sigaction(SIGUSR1, &previousAction, nullptr);
+
+	REQUIRE(g_emergencyFlushResult == 0);
+	REQUIRE(ReadWholeFile(file) == expected);
+
+	// The sink is unusable afterwards, but can still be closed cleanly
+	REQUIRE(WriteMagicNumberRecord(&writer) == FXT_ERR_SINK_CLOSED);
+	REQUIRE(EmergencyFlush(&sink, 1000) == FXT_ERR_SINK_CLOSED);
+	REQUIRE(CloseDoubleBufferedSink(&sink) == 0);
+
+	fclose(file);
+}
+#endif
+
+TEST_CASE("TestDoubleBufferedSinkRejectsInvalidConfig", "[double_buffered_sink]") {
+	fxt::DoubleBufferedSinkConfig config;
+	config.numBuffers = 1;
+
+	fxt::DoubleBufferedSink sink;
+	REQUIRE(InitDoubleBufferedSink(&sink, 1, config) == FXT_ERR_INVALID_CONFIG);
+}
@@ -0,0 +1,146 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/histogram.h"
+
+#include "trace_checks.h"
+
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include <thread>
+#include <vector>
+
+TEST_CASE("TestHistogramPercentiles", "[histogram]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+
+	std::vector<uint8_t> expected = trace;
+	fxt::Writer expectedWriter(&expected, WriteToVector);
+
+	fxt::LatencyHistogram histogram;
+	REQUIRE(InitLatencyHistogram(&histogram, "Requests", "Latency", 7, fxt::HistogramConfig()) == 0);
+
+	// Nothing recorded, nothing written
+	REQUIRE(AddHistogramCounterEvent(&writer, &histogram, 3, 45, 100) == 0);
+	REQUIRE(trace == expected);
+
+	// Small values get a bucket each, so they are exact
+	for (uint64_t value = 1; value <= 20; ++value) {
+		RecordHistogramValue(&histogram, value);
+	}
+	REQUIRE(AddHistogramCounterEvent(&writer, &histogram, 3, 45, 200) == 0);
+	REQUIRE(FXT_ADD_COUNTER_EVENT(&expectedWriter, "Requests", "Latency", 3, 45, 200, 7, "p50", uint64_t(10), "p90", uint64_t(18), "p99", uint64_t(20), "max", uint64_t(20), "count", uint64_t(20)) == 0);
+	REQUIRE(trace == expected);
+
+	// Values from several threads are merged, and only the new ones are reported
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < 4; ++i) {
+		threads.emplace_back([&histogram]() {
+			for (uint64_t value = 1; value <= 100000; ++value) {
+				RecordHistogramValue(&histogram, value * 1000);
+			}
+		});
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+
+	// The error is at most 1 / 32 of the value, and only ever upwards
+	const auto checkValue = [](uint64_t reported, uint64_t real) {
+		REQUIRE(reported >= real);
+		REQUIRE(reported <= real + real / 32);
+	};
+
+	fxt::HistogramSnapshot snapshot;
+	TakeHistogramSnapshot(&histogram, &snapshot);
+	REQUIRE(snapshot.count == 400000);
+	checkValue(snapshot.p50, 50000 * 1000);
+	checkValue(snapshot.p90, 90000 * 1000);
+	checkValue(snapshot.p99, 99000 * 1000);
+	checkValue(snapshot.max, 100000 * 1000);
+
+	TakeHistogramSnapshot(&histogram, &snapshot);
+	REQUIRE(snapshot.count == 0);
+}
+
+TEST_CASE("TestHistogramScope", "[histogram]") {
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	writer.clock = &clock;
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+
+	fxt::LatencyHistogram histogram;
+	REQUIRE(InitLatencyHistogram(&histogram, "Requests", "Latency", 7, fxt::HistogramConfig()) == 0);
+	for (int i = 0; i < 10; ++i) {
+		FXT_HISTOGRAM_SCOPE(&histogram, &clock);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	fxt::HistogramSnapshot snapshot;
+	TakeHistogramSnapshot(&histogram, &snapshot);
+	REQUIRE(snapshot.count == 10);
+	REQUIRE(snapshot.p50 >= 1000000);
+
+	RecordHistogramValue(&histogram, 10);
+	REQUIRE(AddHistogramCounterEvent(&writer, &histogram, fxt::kCurrentProcess, fxt::kCurrentThread, fxt::kTimestampNow) == 0);
+	REQUIRE(CheckTraceIsSelfContained(trace) == 1);
+}
+
+TEST_CASE("TestHistogramReusesFreedSlot", "[histogram]") {
+	size_t freedIndex;
+	{
+		fxt::HistogramConfig config;
+		config.subBucketBits = 2;
+		fxt::LatencyHistogram histogram;
+		REQUIRE(InitLatencyHistogram(&histogram, "Requests", "Small", 7, config) == 0);
+		RecordHistogramValue(&histogram, 10);
+		freedIndex = histogram.slot.index;
+	}
+
+	// The new histogram takes over the index, but not the old histogram's shard on this thread
+	fxt::LatencyHistogram histogram;
+	REQUIRE(InitLatencyHistogram(&histogram, "Requests", "Latency", 7, fxt::HistogramConfig()) == 0);
+	REQUIRE(histogram.slot.index == freedIndex);
+
+	fxt::HistogramSnapshot snapshot;
+	TakeHistogramSnapshot(&histogram, &snapshot);
+	REQUIRE(snapshot.count == 0);
+
+	RecordHistogramValue(&histogram, 1000000);
+	TakeHistogramSnapshot(&histogram, &snapshot);
+	REQUIRE(snapshot.count == 1);
+	REQUIRE(histogram.shards.size() == 1);
+}
+
+// Recording a value, compared to writing an event per span
+// Run with: fxt-test "[histogram][benchmark]"
+TEST_CASE("BenchmarkHistogram", "[.][histogram][benchmark]") {
+	std::vector<uint8_t> trace;
+	trace.reserve(64 * 1024 * 1024);
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+
+	fxt::LatencyHistogram histogram;
+	REQUIRE(InitLatencyHistogram(&histogram, "Requests", "Latency", 7, fxt::HistogramConfig()) == 0);
+
+	BENCHMARK("Every span") {
+		trace.clear();
+		for (uint64_t i = 0; i < 1000; ++i) {
+			AddDurationCompleteEvent(&writer, "Requests", "Request", 3, 45, i * 10, i * 10 + i);
+		}
+		return trace.size();
+	};
+	BENCHMARK("Histogram") {
+		for (uint64_t i = 0; i < 1000; ++i) {
+			RecordHistogramValue(&histogram, i);
+		}
+	};
+}
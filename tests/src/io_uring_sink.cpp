@@ -0,0 +1,177 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/io_uring_sink.h"
+#include "fxt/writer.h"
+
+#include "trace_checks.h"
+
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+static void RunRoundTrip(fxt::IoUringSinkConfig config) {
+	std::vector<uint8_t> expected;
+	fxt::Writer directWriter(&expected, WriteToVector);
+	WriteTestTrace(&directWriter, 1000);
+
+	const std::string path = MakeTempPath();
+
+	fxt::IoUringSink sink;
+	const int ret = OpenIoUringSink(&sink, path.c_str(), config);
+	if (ret == FXT_ERR_OPEN_FAILED && config.useDirectIO) {
+		unlink(path.c_str());
+		SKIP("The temp directory doesn't support O_DIRECT");
+	}
+	REQUIRE(ret == 0);
+
+	fxt::Writer writer(&sink, fxt::WriteToIoUringSink);
+	WriteTestTrace(&writer, 1000);
+	REQUIRE(CloseIoUringSink(&sink) == 0);
+
+	REQUIRE(ReadWholeFile(path) == expected);
+	unlink(path.c_str());
+}
+
+TEST_CASE("TestIoUringSinkMatchesDirectWrite", "[io_uring_sink]") {
+	fxt::IoUringSinkConfig config;
+	config.bufferSize = 4096;
+	config.numBuffers = 3;
+
+	RunRoundTrip(config);
+}
+
+TEST_CASE("TestIoUringSinkPwriteFallbackMatchesDirectWrite", "[io_uring_sink]") {
+	fxt::IoUringSinkConfig config;
+	config.bufferSize = 4096;
+	config.numBuffers = 3;
+	config.forcePwrite = true;
+
+	RunRoundTrip(config);
+}
+
+TEST_CASE("TestIoUringSinkDirectIOTrimsUnalignedTail", "[io_uring_sink]") {
+	fxt::IoUringSinkConfig config;
+	config.bufferSize = 8192;
+	config.numBuffers = 4;
+	config.useDirectIO = true;
+
+	// The trace is not a multiple of the alignment, so the tail must be padded and then trimmed
+	RunRoundTrip(config);
+}
+
+TEST_CASE("TestIoUringSinkEmergencyFlushWritesActiveBuffer", "[io_uring_sink]") {
+	std::vector<uint8_t> expected;
+	fxt::Writer directWriter(&expected, WriteToVector);
+	WriteTestTrace(&directWriter, 1000);
+
+	fxt::IoUringSinkConfig config;
+	config.bufferSize = 4096;
+	config.numBuffers = 3;
+
+	const std::string path = MakeTempPath();
+
+	fxt::IoUringSink sink;
+	REQUIRE(OpenIoUringSink(&sink, path.c_str(), config) == 0);
+
+	fxt::Writer writer(&sink, fxt::WriteToIoUringSink);
+	WriteTestTrace(&writer, 1000);
+	// The trace doesn't end on a buffer boundary, so the tail is still in the active buffer
+	REQUIRE(expected.size() % config.bufferSize != 0);
+
+	REQUIRE(EmergencyFlush(&sink) == 0);
+	REQUIRE(WriteMagicNumberRecord(&writer) == FXT_ERR_SINK_CLOSED);
+	CloseIoUringSink(&sink);
+
+	REQUIRE(ReadWholeFile(path) == expected);
+	unlink(path.c_str());
+}
+
+static constexpr uint64_t kNumEvents = 400000;
+static constexpr size_t kBufferSize = 1024 * 1024;
+
+// A trace of instant events, without the per-event REQUIRE overhead
+static int WriteBenchmarkTrace(fxt::Writer *writer) {
+	int ret = WriteMagicNumberRecord(writer);
+	ret |= AddProviderInfoRecord(writer, 1234, "Test Provider");
+	ret |= AddInitializationRecord(writer, 1000);
+
+	for (uint64_t i = 0; i < kNumEvents; ++i) {
+		ret |= FXT_ADD_INSTANT_EVENT(writer, "Bar", "Tick", 3, 45, i * 100, "index", i);
+	}
+
+	return ret;
+}
+
+// Throughput comparison against the plain buffered write(2) path
+// Run with: fxt-test "[io_uring_sink][benchmark]"
+TEST_CASE("BenchmarkIoUringSink", "[.][io_uring_sink][benchmark]") {
+	std::vector<uint8_t> measure;
+	fxt::Writer measureWriter(&measure, WriteToVector);
+	REQUIRE(WriteBenchmarkTrace(&measureWriter) == 0);
+	WARN("Each iteration writes " << measure.size() << " bytes");
+
+	const std::string path = MakeTempPath();
+
+	BENCHMARK("buffered write(2)") {
+		struct BufferedFd {
+			int fd;
+			size_t used;
+			std::vector<uint8_t> buffer;
+		};
+		BufferedFd context = { open(path.c_str(), O_WRONLY | O_TRUNC), 0, std::vector<uint8_t>(kBufferSize) };
+
+		fxt::Writer writer(&context, [](void *userContext, const void *data, size_t len) -> int {
+			BufferedFd *context = (BufferedFd *)userContext;
+			if (context->used + len > kBufferSize) {
+				if (write(context->fd, context->buffer.data(), context->used) != (ssize_t)context->used) {
+					return FXT_ERR_WRITE_TO_STREAM_FAILED;
+				}
+				context->used = 0;
+			}
+			memcpy(context->buffer.data() + context->used, data, len);
+			context->used += len;
+			return 0;
+		});
+		int ret = WriteBenchmarkTrace(&writer);
+		if (write(context.fd, context.buffer.data(), context.used) != (ssize_t)context.used) {
+			ret = FXT_ERR_WRITE_TO_STREAM_FAILED;
+		}
+		return ret | close(context.fd);
+	};
+
+	const auto runSink = [&](bool useDirectIO, bool forcePwrite) {
+		fxt::IoUringSinkConfig config;
+		config.bufferSize = kBufferSize;
+		config.useDirectIO = useDirectIO;
+		config.forcePwrite = forcePwrite;
+
+		fxt::IoUringSink sink;
+		REQUIRE(OpenIoUringSink(&sink, path.c_str(), config) == 0);
+		fxt::Writer writer(&sink, fxt::WriteToIoUringSink);
+		const int ret = WriteBenchmarkTrace(&writer);
+		return ret | CloseIoUringSink(&sink);
+	};
+
+	BENCHMARK("io_uring") {
+		return runSink(false, false);
+	};
+	BENCHMARK("io_uring + O_DIRECT") {
+		return runSink(true, false);
+	};
+	BENCHMARK("pwrite fallback") {
+		return runSink(false, true);
+	};
+
+	unlink(path.c_str());
+}
@@ -0,0 +1,58 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/mmap_sink.h"
+#include "fxt/writer.h"
+
+#include "trace_checks.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+TEST_CASE("TestMmapSinkGrowsAndTrimsToExactLength", "[mmap_sink]") {
+	std::vector<uint8_t> expected;
+	fxt::Writer directWriter(&expected, WriteToVector);
+	WriteTestTrace(&directWriter, 1000);
+
+	fxt::MmapSinkConfig config;
+	config.extentSize = (size_t)sysconf(_SC_PAGESIZE);
+	// Make sure the trace spans several extents
+	REQUIRE(expected.size() > config.extentSize * 4);
+
+	const std::string path = MakeTempPath();
+
+	fxt::MmapSink sink;
+	REQUIRE(OpenMmapSink(&sink, path.c_str(), config) == 0);
+
+	fxt::Writer writer(&sink, fxt::WriteToMmapSink);
+	WriteTestTrace(&writer, 1000);
+	REQUIRE(FlushAndWait(&sink) == 0);
+	REQUIRE(CloseMmapSink(&sink) == 0);
+	REQUIRE(CloseMmapSink(&sink) == 0);
+
+	REQUIRE(ReadWholeFile(path) == expected);
+	REQUIRE(fxt::WriteToMmapSink(&sink, expected.data(), 8) == FXT_ERR_SINK_CLOSED);
+	unlink(path.c_str());
+}
+
+TEST_CASE("TestMmapSinkInvalidConfig", "[mmap_sink]") {
+	const std::string path = MakeTempPath();
+
+	fxt::MmapSinkConfig config;
+	config.extentSize = (size_t)sysconf(_SC_PAGESIZE) + 8;
+
+	fxt::MmapSink sink;
+	REQUIRE(OpenMmapSink(&sink, path.c_str(), config) == FXT_ERR_INVALID_CONFIG);
+
+	config.extentSize = 0;
+	REQUIRE(OpenMmapSink(&sink, path.c_str(), config) == FXT_ERR_INVALID_CONFIG);
+	unlink(path.c_str());
+}
@@ -0,0 +1,127 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/numa.h"
+
+#include "fxt/double_buffered_sink.h"
+#include "fxt/writer.h"
+
+#include "trace_checks.h"
+
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+#	define fileno _fileno
+#endif
+
+TEST_CASE("TestNumaTopology", "[numa]") {
+	const int nodeCount = fxt::GetNumaNodeCount();
+	REQUIRE(nodeCount >= 1);
+
+	const int currentNode = fxt::GetCurrentNumaNode();
+	REQUIRE(currentNode >= 0);
+	REQUIRE(currentNode < nodeCount);
+
+	REQUIRE(fxt::PinCurrentThreadToNumaNode(nodeCount) == FXT_ERR_INVALID_CONFIG);
+	REQUIRE(fxt::PinCurrentThreadToNumaNode(-1) == FXT_ERR_INVALID_CONFIG);
+}
+
+TEST_CASE("TestNumaLocalDoubleBufferedSink", "[numa]") {
+	std::vector<uint8_t> expected;
+	fxt::Writer directWriter(&expected, WriteToVector);
+	WriteTestTrace(&directWriter, 500);
+
+	FILE *file = tmpfile();
+	REQUIRE(file != nullptr);
+
+	fxt::DoubleBufferedSinkConfig config;
+	config.bufferSize = 4096;
+	config.flushIntervalMs = 0;
+	config.numaNode = fxt::kNumaNodeLocal;
+
+	fxt::DoubleBufferedSink sink;
+	REQUIRE(InitDoubleBufferedSink(&sink, fileno(file), config) == 0);
+	REQUIRE(sink.numaNode >= 0);
+	REQUIRE(sink.numaNode < fxt::GetNumaNodeCount());
+
+#if defined(__linux__)
+	// Ask the kernel where the first page of each buffer actually is. This can be refused in a sandbox, so only check on success
+	for (unsigned i = 0; i < config.numBuffers; ++i) {
+		void *page = sink.buffers[i].data;
+		int status = -1;
+		if (syscall(SYS_move_pages, 0, 1ul, &page, nullptr, &status, 0) == 0 && status >= 0) {
+			REQUIRE(status == sink.numaNode);
+		}
+	}
+#endif
+
+	fxt::Writer writer(&sink, fxt::WriteToDoubleBufferedSink);
+	WriteTestTrace(&writer, 500);
+	REQUIRE(CloseDoubleBufferedSink(&sink) == 0);
+
+	REQUIRE(ReadWholeFile(file) == expected);
+	fclose(file);
+}
+
+TEST_CASE("TestNumaInvalidNode", "[numa]") {
+	FILE *file = tmpfile();
+	REQUIRE(file != nullptr);
+
+	fxt::DoubleBufferedSinkConfig config;
+	config.numaNode = fxt::GetNumaNodeCount();
+
+	fxt::DoubleBufferedSink sink;
+	REQUIRE(InitDoubleBufferedSink(&sink, fileno(file), config) == FXT_ERR_INVALID_CONFIG);
+
+	config.numaNode = -3;
+	REQUIRE(InitDoubleBufferedSink(&sink, fileno(file), config) == FXT_ERR_INVALID_CONFIG);
+
+	fclose(file);
+}
+
+// Cost of writing into buffers on each node, from a producer pinned to node 0. The nodes other than 0 show the remote
+// memory penalty. A single node box can be split into fake nodes by booting with numa=fake=2
+// Run with: fxt-test "[numa][benchmark]"
+TEST_CASE("BenchmarkNumaPlacement", "[.][numa][benchmark]") {
+	REQUIRE(fxt::PinCurrentThreadToNumaNode(0) == 0);
+
+	const int nodeCount = fxt::GetNumaNodeCount();
+	for (int node = 0; node < nodeCount; ++node) {
+		FILE *file = tmpfile();
+		REQUIRE(file != nullptr);
+
+		fxt::DoubleBufferedSinkConfig config;
+		config.bufferSize = 4 * 1024 * 1024;
+		config.flushIntervalMs = 0;
+		config.numaNode = node;
+
+		fxt::DoubleBufferedSink sink;
+		if (InitDoubleBufferedSink(&sink, fileno(file), config) != 0) {
+			// A memory-only node
+			fclose(file);
+			continue;
+		}
+		fxt::Writer writer(&sink, fxt::WriteToDoubleBufferedSink);
+
+		const std::string name = "write 1000 events to node " + std::to_string(node);
+		BENCHMARK(name.c_str()) {
+			WriteTestTrace(&writer, 1000);
+		};
+
+		REQUIRE(CloseDoubleBufferedSink(&sink) == 0);
+		fclose(file);
+	}
+}
@@ -0,0 +1,275 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/page_pool.h"
+
+#include "fxt/double_buffered_sink.h"
+#include "fxt/writer.h"
+
+#include "trace_checks.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <stdio.h>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#	define fileno _fileno
+#endif
+
+TEST_CASE("TestPagePoolBudget", "[page_pool]") {
+	fxt::PagePool pool;
+	fxt::PagePoolConfig config;
+	config.pageSize = 4096;
+	config.budgetBytes = 4096;
+	REQUIRE(InitPagePool(&pool, config) == FXT_ERR_INVALID_CONFIG);
+
+	config.budgetBytes = 3 * 4096;
+	REQUIRE(InitPagePool(&pool, config) == 0);
+
+	uint8_t *pages[3];
+	for (uint8_t *&page : pages) {
+		REQUIRE(AcquirePage(&pool, &page) == 0);
+	}
+
+	// The budget is used up, so the next acquire has to wait for a release
+	std::thread releaser([&]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		ReleasePage(&pool, pages[1]);
+	});
+	uint8_t *extra;
+	REQUIRE(AcquirePage(&pool, &extra) == 0);
+	releaser.join();
+	REQUIRE(extra == pages[1]);
+
+	fxt::PagePoolMetrics metrics;
+	GetPagePoolMetrics(&pool, &metrics);
+	REQUIRE(metrics.budgetBytes == 3 * 4096);
+	REQUIRE(metrics.allocatedBytes == 3 * 4096);
+	REQUIRE(metrics.inUseBytes == 3 * 4096);
+	REQUIRE(metrics.waits == 1);
+
+	ReleasePage(&pool, pages[0]);
+	ReleasePage(&pool, extra);
+	ReleasePage(&pool, pages[2]);
+	GetPagePoolMetrics(&pool, &metrics);
+	REQUIRE(metrics.inUseBytes == 0);
+	REQUIRE(metrics.peakInUseBytes == 3 * 4096);
+
+	DestroyPagePool(&pool);
+}
+
+TEST_CASE("TestPagePoolAcquireTimeout", "[page_pool]") {
+	fxt::PagePool pool;
+	fxt::PagePoolConfig config;
+	config.pageSize = 4096;
+	config.budgetBytes = 2 * 4096;
+	config.acquireTimeoutMs = 10;
+	REQUIRE(InitPagePool(&pool, config) == 0);
+
+	uint8_t *pages[2];
+	for (uint8_t *&page : pages) {
+		REQUIRE(AcquirePage(&pool, &page) == 0);
+	}
+
+	// Nobody releases a page, so we give up instead of waiting forever
+	uint8_t *extra;
+	REQUIRE(AcquirePage(&pool, &extra) == FXT_ERR_POOL_EXHAUSTED);
+
+	fxt::PagePoolMetrics metrics;
+	GetPagePoolMetrics(&pool, &metrics);
+	REQUIRE(metrics.waits == 1);
+	REQUIRE(metrics.timeouts == 1);
+	REQUIRE(metrics.inUseBytes == 2 * 4096);
+
+	ReleasePage(&pool, pages[0]);
+	REQUIRE(AcquirePage(&pool, &extra) == 0);
+	REQUIRE(extra == pages[0]);
+
+	ReleasePage(&pool, extra);
+	ReleasePage(&pool, pages[1]);
+}
+
+TEST_CASE("TestPagePoolTimeoutStopsSink", "[page_pool]") {
+	fxt::PagePool pool;
+	fxt::PagePoolConfig poolConfig;
+	poolConfig.pageSize = 4096;
+	poolConfig.budgetBytes = 2 * 4096;
+	poolConfig.acquireTimeoutMs = 10;
+	REQUIRE(InitPagePool(&pool, poolConfig) == 0);
+
+	// Someone else holds the whole budget
+	uint8_t *pages[2];
+	for (uint8_t *&page : pages) {
+		REQUIRE(AcquirePage(&pool, &page) == 0);
+	}
+
+	FILE *file = tmpfile();
+	REQUIRE(file != nullptr);
+	fxt::DoubleBufferedSinkConfig config;
+	config.pool = &pool;
+	fxt::DoubleBufferedSink sink;
+	REQUIRE(InitDoubleBufferedSink(&sink, fileno(file), config) == 0);
+
+	fxt::Writer writer(&sink, fxt::WriteToDoubleBufferedSink);
+	REQUIRE(WriteMagicNumberRecord(&writer) == FXT_ERR_POOL_EXHAUSTED);
+
+	// Later writes fail too, even once pages are free, since the stream may have been cut mid-record
+	ReleasePage(&pool, pages[0]);
+	REQUIRE(WriteMagicNumberRecord(&writer) == FXT_ERR_POOL_EXHAUSTED);
+	REQUIRE(CloseDoubleBufferedSink(&sink) == FXT_ERR_POOL_EXHAUSTED);
+	REQUIRE(ReadWholeFile(file).empty());
+
+	ReleasePage(&pool, pages[1]);
+	fclose(file);
+}
+
+TEST_CASE("TestPagePoolDestroyWakesWaiters", "[page_pool]") {
+	fxt::PagePool pool;
+	fxt::PagePoolConfig config;
+	config.pageSize = 4096;
+	config.budgetBytes = 2 * 4096;
+	REQUIRE(InitPagePool(&pool, config) == 0);
+
+	uint8_t *pages[2];
+	for (uint8_t *&page : pages) {
+		REQUIRE(AcquirePage(&pool, &page) == 0);
+	}
+
+	// The waiter has no timeout, so only the destroy can get it out
+	int waiterResult = 0;
+	std::thread waiter([&]() {
+		uint8_t *page;
+		waiterResult = AcquirePage(&pool, &page);
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+	DestroyPagePool(&pool);
+	waiter.join();
+	REQUIRE(waiterResult == FXT_ERR_SINK_CLOSED);
+
+	// The pages still out are freed as they come back, rather than going into the dead pool
+	fxt::PagePoolMetrics metrics;
+	GetPagePoolMetrics(&pool, &metrics);
+	REQUIRE(metrics.allocatedBytes == 2 * 4096);
+	REQUIRE(InitPagePool(&pool, config) == FXT_ERR_INVALID_CONFIG);
+
+	ReleasePage(&pool, pages[0]);
+	ReleasePage(&pool, pages[1]);
+	GetPagePoolMetrics(&pool, &metrics);
+	REQUIRE(metrics.allocatedBytes == 0);
+	REQUIRE(metrics.inUseBytes == 0);
+	REQUIRE(pool.freePages.empty());
+	REQUIRE(AcquirePage(&pool, &pages[0]) == FXT_ERR_SINK_CLOSED);
+
+	// Once every page is back, the pool can be used again
+	REQUIRE(InitPagePool(&pool, config) == 0);
+}
+
+TEST_CASE("TestPagePoolSharedBySinks", "[page_pool]") {
+	fxt::PagePool pool;
+	fxt::PagePoolConfig poolConfig;
+	poolConfig.pageSize = 4096;
+	poolConfig.budgetBytes = 8 * 4096;
+	REQUIRE(InitPagePool(&pool, poolConfig) == 0);
+
+	// Twice as many sinks as there are pages. The idle ones have to give their pages back for the busy one to progress
+	const unsigned numSinks = 16;
+	std::vector<FILE *> files;
+	std::vector<std::unique_ptr<fxt::DoubleBufferedSink>> sinks;
+	std::vector<std::unique_ptr<fxt::Writer>> writers;
+	std::vector<std::vector<uint8_t>> expected(numSinks);
+	std::vector<std::unique_ptr<fxt::Writer>> expectedWriters;
+	for (unsigned i = 0; i < numSinks; ++i) {
+		files.push_back(tmpfile());
+		REQUIRE(files.back() != nullptr);
+
+		fxt::DoubleBufferedSinkConfig config;
+		config.pool = &pool;
+		config.numBuffers = 8;
+		// Long enough that setting up the other sinks can't take two intervals, and let the timer reclaim every idle page
+		// before sink 0 ever needs one
+		config.flushIntervalMs = 20;
+
+		sinks.emplace_back(new fxt::DoubleBufferedSink());
+		REQUIRE(InitDoubleBufferedSink(sinks.back().get(), fileno(files.back()), config) == 0);
+		REQUIRE(sinks.back()->config.bufferSize == poolConfig.pageSize);
+		writers.emplace_back(new fxt::Writer(sinks.back().get(), fxt::WriteToDoubleBufferedSink));
+
+		expectedWriters.emplace_back(new fxt::Writer(&expected[i], WriteToVector));
+		WriteTestHeader(writers.back().get());
+		WriteTestHeader(expectedWriters.back().get());
+		WriteTestEvents(writers.back().get(), i, 0, 5);
+		WriteTestEvents(expectedWriters.back().get(), i, 0, 5);
+	}
+
+	// Every sink now holds a partially filled page, so sink 0 can only get more once the others are reclaimed
+	WriteTestEvents(writers[0].get(), 0, 5, 2000);
+	WriteTestEvents(expectedWriters[0].get(), 0, 5, 2000);
+
+	fxt::PagePoolMetrics poolMetrics;
+	GetPagePoolMetrics(&pool, &poolMetrics);
+	REQUIRE(poolMetrics.allocatedBytes <= poolConfig.budgetBytes);
+	REQUIRE(poolMetrics.peakInUseBytes <= poolConfig.budgetBytes);
+	REQUIRE(poolMetrics.waits > 0);
+
+	uint64_t idlePagesReclaimed = 0;
+	for (unsigned i = 0; i < numSinks; ++i) {
+		fxt::DoubleBufferedSinkMetrics metrics;
+		GetDoubleBufferedSinkMetrics(sinks[i].get(), &metrics);
+		idlePagesReclaimed += metrics.idlePagesReclaimed;
+
+		REQUIRE(CloseDoubleBufferedSink(sinks[i].get()) == 0);
+		REQUIRE(ReadWholeFile(files[i]) == expected[i]);
+		fclose(files[i]);
+	}
+	REQUIRE(idlePagesReclaimed > 0);
+
+	GetPagePoolMetrics(&pool, &poolMetrics);
+	REQUIRE(poolMetrics.inUseBytes == 0);
+}
+
+TEST_CASE("TestPagePoolCounterEvent", "[page_pool]") {
+	fxt::PagePool pool;
+	fxt::PagePoolConfig poolConfig;
+	poolConfig.pageSize = 4096;
+	poolConfig.budgetBytes = 4 * 4096;
+	REQUIRE(InitPagePool(&pool, poolConfig) == 0);
+
+	uint8_t *page;
+	REQUIRE(AcquirePage(&pool, &page) == 0);
+
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	WriteTestHeader(&writer);
+	REQUIRE(AddPagePoolCounterEvent(&writer, &pool, 3, 45, 100) == 0);
+	REQUIRE(CheckTraceIsSelfContained(trace) == 1);
+
+	ReleasePage(&pool, page);
+}
+
+TEST_CASE("TestPagePoolInvalidSinkConfig", "[page_pool]") {
+	FILE *file = tmpfile();
+	REQUIRE(file != nullptr);
+
+	// Not initialized yet
+	fxt::PagePool pool;
+	fxt::DoubleBufferedSinkConfig config;
+	config.pool = &pool;
+
+	fxt::DoubleBufferedSink sink;
+	REQUIRE(InitDoubleBufferedSink(&sink, fileno(file), config) == FXT_ERR_INVALID_CONFIG);
+
+	// Without the timer, an idle sink would never give back its page
+	REQUIRE(InitPagePool(&pool, fxt::PagePoolConfig()) == 0);
+	config.flushIntervalMs = 0;
+	REQUIRE(InitDoubleBufferedSink(&sink, fileno(file), config) == FXT_ERR_INVALID_CONFIG);
+
+	fclose(file);
+}
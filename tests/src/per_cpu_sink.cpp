@@ -0,0 +1,214 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/per_cpu_sink.h"
+
+#include "trace_checks.h"
+
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Catch2 assertions aren't thread safe, so this returns the first error instead
+static int WriteWorkerEvents(fxt::PerCpuSink *sink, uint64_t threadID, uint64_t numEvents) {
+	fxt::PerCpuSinkProducer producer;
+	fxt::Writer writer(&producer, fxt::WriteToPerCpuSink);
+	int ret = AttachPerCpuSinkProducer(&producer, &writer, sink);
+	if (ret != 0) {
+		return ret;
+	}
+
+	// A different name on each thread, so a String record that got separated from its event would show up
+	const std::string name = "Worker " + std::to_string(threadID);
+	for (uint64_t i = 0; i < numEvents && ret == 0; ++i) {
+		ret = AddInstantEvent(&writer, "Test", name.c_str(), 3, threadID, i);
+	}
+
+	return ret;
+}
+
+static void RunWorkerThreads(fxt::PerCpuSink *sink, unsigned numThreads, uint64_t numEvents) {
+	std::vector<int> results(numThreads, 0);
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < numThreads; ++i) {
+		threads.emplace_back([=, &results] { results[i] = WriteWorkerEvents(sink, 100 + i, numEvents); });
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+	for (int result : results) {
+		REQUIRE(result == 0);
+	}
+}
+
+// Decodes the String / Thread state of the stream, and checks that every event resolves to the name of its own thread
+// Returns the number of events from each thread
+static std::map<uint64_t, unsigned> CountEventsPerThread(const std::vector<uint8_t> &trace) {
+	using namespace fxt::internal;
+
+	std::map<uint16_t, std::string> strings;
+	std::map<uint16_t, uint64_t> threads;
+	std::map<uint64_t, unsigned> counts;
+	for (size_t offset = 0; offset < trace.size();) {
+		uint64_t header;
+		memcpy(&header, trace.data() + offset, sizeof(header));
+
+		switch (RecordFields::Type::Get<RecordType>(header)) {
+		case RecordType::String:
+			strings[StringRecordFields::StringIndex::Get<uint16_t>(header)] = std::string((const char *)trace.data() + offset + 8, StringRecordFields::StringLength::Get<size_t>(header));
+			break;
+		case RecordType::Thread: {
+			uint64_t threadID;
+			memcpy(&threadID, trace.data() + offset + 16, sizeof(threadID));
+			threads[ThreadRecordFields::ThreadIndex::Get<uint16_t>(header)] = threadID;
+			break;
+		}
+		case RecordType::Event: {
+			const uint64_t threadID = threads.at(EventRecordFields::ThreadRef::Get<uint16_t>(header));
+			REQUIRE(strings.at(EventRecordFields::NameStringRef::Get<uint16_t>(header)) == "Worker " + std::to_string(threadID));
+			++counts[threadID];
+			break;
+		}
+		default:
+			break;
+		}
+
+		offset += WordsToBytes(GetRecordSizeInWords(header));
+	}
+
+	return counts;
+}
+
+static void RunInterleavedThreads(bool useRseq) {
+	FILE *file = tmpfile();
+	REQUIRE(file != nullptr);
+
+	fxt::PerCpuSinkConfig config;
+	config.bufferSize = 4 * 1024 * 1024;
+	config.flushIntervalMs = 1;
+	config.useRseq = useRseq;
+	config.providerID = 1234;
+	config.providerName = "Test Provider";
+	config.numTicksPerSecond = 1000;
+
+	fxt::PerCpuSink sink;
+	REQUIRE(OpenPerCpuSink(&sink, fileno(file), config) == 0);
+	if (!useRseq) {
+		REQUIRE_FALSE(sink.useRseq);
+	}
+
+	const unsigned numThreads = 8;
+	const uint64_t numEvents = 2000;
+	RunWorkerThreads(&sink, numThreads, numEvents);
+
+	REQUIRE(FlushPerCpuSink(&sink) == 0);
+	fxt::PerCpuSinkMetrics metrics;
+	GetPerCpuSinkMetrics(&sink, &metrics);
+	REQUIRE(ClosePerCpuSink(&sink) == 0);
+	REQUIRE(metrics.droppedRecords == 0);
+
+	const std::vector<uint8_t> trace = ReadWholeFile(file);
+	REQUIRE(metrics.bytesFlushed == trace.size());
+	REQUIRE(CheckTraceIsSelfContained(trace) == numThreads * numEvents);
+
+	const std::map<uint64_t, unsigned> counts = CountEventsPerThread(trace);
+	REQUIRE(counts.size() == numThreads);
+	for (const auto &count : counts) {
+		REQUIRE(count.second == numEvents);
+	}
+
+	fclose(file);
+}
+
+TEST_CASE("TestPerCpuSinkInterleavedThreads", "[per_cpu_sink]") {
+	SECTION("rseq, if available") {
+		RunInterleavedThreads(true);
+	}
+	SECTION("Atomic reservation") {
+		RunInterleavedThreads(false);
+	}
+}
+
+TEST_CASE("TestPerCpuSinkDropsWhenFull", "[per_cpu_sink]") {
+	FILE *file = tmpfile();
+	REQUIRE(file != nullptr);
+
+	fxt::PerCpuSinkConfig config;
+	config.bufferSize = 4096;
+	config.flushIntervalMs = 0;
+	config.numTicksPerSecond = 1000;
+
+	fxt::PerCpuSink sink;
+	REQUIRE(OpenPerCpuSink(&sink, fileno(file), config) == 0);
+
+	const uint64_t numEvents = 5000;
+	REQUIRE(WriteWorkerEvents(&sink, 45, numEvents) == 0);
+
+	fxt::PerCpuSinkMetrics metrics;
+	REQUIRE(ClosePerCpuSink(&sink) == 0);
+	GetPerCpuSinkMetrics(&sink, &metrics);
+	REQUIRE(metrics.droppedRecords > 0);
+
+	// Whatever was dropped, every record that made it still decodes on its own
+	const std::vector<uint8_t> trace = ReadWholeFile(file);
+	REQUIRE(CheckTraceIsSelfContained(trace) + metrics.droppedRecords == numEvents);
+	REQUIRE(CountEventsPerThread(trace).at(45) + metrics.droppedRecords == numEvents);
+
+	fclose(file);
+}
+
+TEST_CASE("TestPerCpuSinkInvalidConfig", "[per_cpu_sink]") {
+	FILE *file = tmpfile();
+	REQUIRE(file != nullptr);
+
+	fxt::PerCpuSinkConfig config;
+	config.bufferSize = 1000;
+
+	fxt::PerCpuSink sink;
+	REQUIRE(OpenPerCpuSink(&sink, fileno(file), config) == FXT_ERR_INVALID_CONFIG);
+
+	// A writer that isn't set up to write to the producer
+	config.bufferSize = 4096;
+	REQUIRE(OpenPerCpuSink(&sink, fileno(file), config) == 0);
+	fxt::PerCpuSinkProducer producer;
+	fxt::Writer writer(&sink, fxt::WriteToPerCpuSink);
+	REQUIRE(AttachPerCpuSinkProducer(&producer, &writer, &sink) == FXT_ERR_INVALID_CONFIG);
+	REQUIRE(ClosePerCpuSink(&sink) == 0);
+
+	fclose(file);
+}
+
+// Appending from several threads at once, with rseq and with the atomic fallback
+// Run with: fxt-test "[per_cpu_sink][benchmark]"
+TEST_CASE("BenchmarkPerCpuSink", "[.][per_cpu_sink][benchmark]") {
+	FILE *file = fopen("/dev/null", "wb");
+	REQUIRE(file != nullptr);
+
+	for (bool useRseq : { true, false }) {
+		fxt::PerCpuSinkConfig config;
+		config.bufferSize = 16 * 1024 * 1024;
+		config.flushIntervalMs = 1;
+		config.useRseq = useRseq;
+
+		fxt::PerCpuSink sink;
+		REQUIRE(OpenPerCpuSink(&sink, fileno(file), config) == 0);
+
+		const std::string name = std::string(sink.useRseq ? "rseq" : "atomic") + ", 4 threads x 10000 events";
+		BENCHMARK(name.c_str()) {
+			RunWorkerThreads(&sink, 4, 10000);
+		};
+
+		REQUIRE(ClosePerCpuSink(&sink) == 0);
+	}
+
+	fclose(file);
+}
@@ -0,0 +1,117 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/recovery.h"
+#include "fxt/writer.h"
+
+#include "trace_checks.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Writes a small trace, and records the offset where each record ends
+static void WriteTraceWithRecordEnds(std::vector<uint8_t> *trace, std::vector<size_t> *recordEnds) {
+	fxt::Writer writer(trace, WriteToVector);
+
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	recordEnds->push_back(trace->size());
+	REQUIRE(AddProviderInfoRecord(&writer, 1234, "Test Provider") == 0);
+	recordEnds->push_back(trace->size());
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+	recordEnds->push_back(trace->size());
+
+	for (uint64_t i = 0; i < 5; ++i) {
+		// The first event also interns its strings and thread, which are records of their own
+		// So only check the offset after the whole event
+		REQUIRE(FXT_ADD_INSTANT_EVENT(&writer, "Bar", "Tick", 3, 45, i * 100, "index", i, "name", "value") == 0);
+		recordEnds->push_back(trace->size());
+	}
+	uint8_t blob[37] = {};
+	REQUIRE(AddBlobRecord(&writer, "Blob", blob, sizeof(blob), fxt::BlobType::Data) == 0);
+	recordEnds->push_back(trace->size());
+}
+
+TEST_CASE("TestScanTraceTrimsPartialRecord", "[recovery]") {
+	std::vector<uint8_t> trace;
+	std::vector<size_t> recordEnds;
+	WriteTraceWithRecordEnds(&trace, &recordEnds);
+
+	fxt::TraceRecoveryResult result;
+	REQUIRE(fxt::ScanTrace(trace.data(), trace.size(), &result) == 0);
+	REQUIRE(result.validBytes == trace.size());
+	REQUIRE(result.discardedBytes == 0);
+
+	// Cut the trace at every possible length
+	for (size_t len = 8; len <= trace.size(); ++len) {
+		size_t expectedValid = 0;
+		for (size_t end : recordEnds) {
+			if (end <= len) {
+				expectedValid = end;
+			}
+		}
+
+		REQUIRE(fxt::ScanTrace(trace.data(), len, &result) == 0);
+		// String and thread records can end in between the offsets we tracked
+		REQUIRE(result.validBytes >= expectedValid);
+		REQUIRE(result.validBytes <= len);
+		REQUIRE(result.validBytes + result.discardedBytes == len);
+		REQUIRE(result.validBytes % 8 == 0);
+	}
+
+	// A zero-filled tail, like the one left by a preallocated file, is not a record
+	std::vector<uint8_t> padded = trace;
+	padded.resize(trace.size() + 4096, 0);
+	REQUIRE(fxt::ScanTrace(padded.data(), padded.size(), &result) == 0);
+	REQUIRE(result.validBytes == trace.size());
+	REQUIRE(result.discardedBytes == 4096);
+
+	REQUIRE(fxt::ScanTrace(trace.data() + 8, trace.size() - 8, &result) == FXT_ERR_INVALID_TRACE);
+}
+
+TEST_CASE("TestRecoverTraceFile", "[recovery]") {
+	std::vector<uint8_t> trace;
+	std::vector<size_t> recordEnds;
+	WriteTraceWithRecordEnds(&trace, &recordEnds);
+
+	// Cut the blob record in half. The blob's name string record just before it is still complete
+	const size_t blobRecordSize = 8 + 40;
+	const size_t lastComplete = trace.size() - blobRecordSize;
+	const size_t truncatedLength = lastComplete + (trace.size() - lastComplete) / 2;
+
+	const std::string inputPath = "fxt-recovery-input.fxt";
+	const std::string outputPath = "fxt-recovery-output.fxt";
+
+	FILE *input = fopen(inputPath.c_str(), "wb");
+	REQUIRE(input != nullptr);
+	REQUIRE(fwrite(trace.data(), 1, truncatedLength, input) == truncatedLength);
+	fclose(input);
+
+	fxt::TraceRecoveryResult result;
+	REQUIRE(fxt::RecoverTraceFile(inputPath.c_str(), outputPath.c_str(), &result) == 0);
+	REQUIRE(result.validBytes == lastComplete);
+	REQUIRE(result.discardedBytes == truncatedLength - lastComplete);
+
+	std::vector<uint8_t> recovered(trace.size());
+	FILE *output = fopen(outputPath.c_str(), "rb");
+	REQUIRE(output != nullptr);
+	recovered.resize(fread(recovered.data(), 1, recovered.size(), output));
+	fclose(output);
+
+	REQUIRE(recovered.size() == lastComplete);
+	REQUIRE(std::vector<uint8_t>(trace.begin(), trace.begin() + lastComplete) == recovered);
+
+	// The recovered trace is complete, so recovering it again is a no-op
+	fxt::TraceRecoveryResult rescan;
+	REQUIRE(fxt::ScanTrace(recovered.data(), recovered.size(), &rescan) == 0);
+	REQUIRE(rescan.validBytes == recovered.size());
+	REQUIRE(rescan.recordCount == result.recordCount);
+
+	remove(inputPath.c_str());
+	remove(outputPath.c_str());
+}
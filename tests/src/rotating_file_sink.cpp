@@ -0,0 +1,138 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/rotating_file_sink.h"
+
+#include "fxt/clock.h"
+#include "fxt/writer.h"
+
+#include "trace_checks.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char *kBasePath = "fxt-rotating-test";
+
+static std::string ChunkPath(unsigned index) {
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "-%04u.fxt", index);
+	return std::string(kBasePath) + suffix;
+}
+
+static void RemoveChunks() {
+	for (unsigned i = 0; remove(ChunkPath(i).c_str()) == 0; ++i) {
+	}
+}
+
+TEST_CASE("TestRotatingFileSinkChunksAreSelfContained", "[rotating_file_sink]") {
+	fxt::RotatingFileSinkConfig config;
+	config.basePath = kBasePath;
+	config.maxChunkBytes = 1024;
+	config.providerID = 1234;
+	config.providerName = "Test Provider";
+
+	fxt::RotatingFileSink sink;
+	fxt::Writer writer(&sink, fxt::WriteToRotatingFileSink);
+	REQUIRE(OpenRotatingFileSink(&sink, &writer, config) == 0);
+
+	REQUIRE(SetProcessName(&writer, 3, "Test.exe") == 0);
+	const unsigned kNumEvents = 300;
+	for (unsigned i = 0; i < kNumEvents; ++i) {
+		REQUIRE(AddDurationBeginEvent(&writer, "Foo", "Root", 3, 45 + (i % 3), i * 100) == 0);
+		REQUIRE(FXT_ADD_INSTANT_EVENT(&writer, "Bar", "Tick", 3, 45 + (i % 3), i * 100 + 10, "index", i) == 0);
+		REQUIRE(AddDurationEndEvent(&writer, "Foo", "Root", 3, 45 + (i % 3), i * 100 + 50) == 0);
+	}
+	REQUIRE(CloseRotatingFileSink(&sink) == 0);
+	REQUIRE(writer.recordBoundaryFunc == nullptr);
+
+	REQUIRE(sink.nextChunkIndex > 5);
+	unsigned totalEvents = 0;
+	for (unsigned i = 0; i < sink.nextChunkIndex; ++i) {
+		const std::vector<uint8_t> chunk = ReadWholeFile(ChunkPath(i));
+		totalEvents += CheckTraceIsSelfContained(chunk);
+
+		// Chunks only end at record boundaries, so one record can push it over the limit
+		if (i + 1 < sink.nextChunkIndex) {
+			REQUIRE(chunk.size() >= config.maxChunkBytes);
+			REQUIRE(chunk.size() < config.maxChunkBytes + 256);
+		}
+	}
+	REQUIRE(totalEvents == kNumEvents * 3);
+
+	RemoveChunks();
+}
+
+TEST_CASE("TestRotatingFileSinkRotatesOnTime", "[rotating_file_sink]") {
+	fxt::RotatingFileSinkConfig config;
+	config.basePath = kBasePath;
+	config.maxChunkBytes = 0;
+	config.maxChunkDurationMs = 5;
+
+	fxt::RotatingFileSink sink;
+	fxt::Writer writer(&sink, fxt::WriteToRotatingFileSink);
+	REQUIRE(OpenRotatingFileSink(&sink, &writer, config) == 0);
+
+	REQUIRE(AddInstantEvent(&writer, "Foo", "Before", 3, 45, 0) == 0);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	REQUIRE(AddInstantEvent(&writer, "Foo", "After", 3, 45, 100) == 0);
+	REQUIRE(CloseRotatingFileSink(&sink) == 0);
+
+	REQUIRE(sink.nextChunkIndex == 2);
+	REQUIRE(CheckTraceIsSelfContained(ReadWholeFile(ChunkPath(0))) == 1);
+	REQUIRE(CheckTraceIsSelfContained(ReadWholeFile(ChunkPath(1))) == 1);
+
+	RemoveChunks();
+}
+
+TEST_CASE("TestRotatingFileSinkKeepsClockRate", "[rotating_file_sink]") {
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+	// Make sure the rate differs from the sink's default, even when the clock falls back to the monotonic clock
+	clock.ticksPerSecond = 2500000000;
+
+	fxt::RotatingFileSinkConfig config;
+	config.basePath = kBasePath;
+	config.maxChunkBytes = 1024;
+
+	fxt::RotatingFileSink sink;
+	fxt::Writer writer(&sink, fxt::WriteToRotatingFileSink);
+	writer.clock = &clock;
+	REQUIRE(OpenRotatingFileSink(&sink, &writer, config) == 0);
+
+	for (unsigned i = 0; i < 300; ++i) {
+		REQUIRE(FXT_ADD_INSTANT_EVENT(&writer, "Bar", "Tick", 3, 45, fxt::kTimestampNow, "index", i) == 0);
+	}
+	REQUIRE(CloseRotatingFileSink(&sink) == 0);
+
+	REQUIRE(sink.nextChunkIndex > 5);
+	for (unsigned i = 0; i < sink.nextChunkIndex; ++i) {
+		const std::vector<uint8_t> chunk = ReadWholeFile(ChunkPath(i));
+		REQUIRE(CheckTraceIsSelfContained(chunk) > 0);
+
+		// Every event in the chunk has to be decoded with the clock's rate
+		uint64_t ticksPerSecond = 0;
+		for (size_t offset = 0; offset < chunk.size();) {
+			uint64_t header;
+			memcpy(&header, chunk.data() + offset, sizeof(header));
+
+			const fxt::internal::RecordType type = fxt::internal::RecordFields::Type::Get<fxt::internal::RecordType>(header);
+			if (type == fxt::internal::RecordType::Initialization) {
+				memcpy(&ticksPerSecond, chunk.data() + offset + 8, sizeof(ticksPerSecond));
+			} else if (type == fxt::internal::RecordType::Event) {
+				REQUIRE(ticksPerSecond == 2500000000);
+			}
+
+			offset += fxt::internal::WordsToBytes(fxt::internal::GetRecordSizeInWords(header));
+		}
+	}
+
+	RemoveChunks();
+}
@@ -0,0 +1,167 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/sampling.h"
+
+#include "trace_checks.h"
+
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include <vector>
+
+TEST_CASE("TestSamplerOneInN", "[sampling]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+
+	std::vector<uint8_t> expected = trace;
+	fxt::Writer expectedWriter(&expected, WriteToVector);
+
+	fxt::SamplingConfig config;
+	config.oneInN = 4;
+	fxt::Sampler sampler;
+	REQUIRE(InitSampler(&sampler, "Hot", config) == 0);
+
+	for (uint64_t i = 0; i < 10; ++i) {
+		// Begin and End are kept or dropped together
+		const bool sampled = FXT_SAMPLED_ADD_DURATION_BEGIN_EVENT(&sampler, &writer, "Span", 3, 45, i * 10, "index", i);
+		FXT_SAMPLED_ADD_DURATION_END_EVENT(&sampler, sampled, &writer, "Span", 3, 45, i * 10 + 5);
+		REQUIRE(sampled == (i % 4 == 0));
+		if (sampled) {
+			REQUIRE(FXT_ADD_DURATION_BEGIN_EVENT(&expectedWriter, "Hot", "Span", 3, 45, i * 10, "index", i) == 0);
+			REQUIRE(AddDurationEndEvent(&expectedWriter, "Hot", "Span", 3, 45, i * 10 + 5, {}) == 0);
+		}
+	}
+
+	REQUIRE(AddSamplerCounterEvent(&writer, &sampler, 3, 45, 200) == 0);
+	// The first thread to use the sampler gets counter ID 1
+	REQUIRE(FXT_ADD_COUNTER_EVENT(&expectedWriter, "fxt", "Sampling: Hot", 3, 45, 200, 1, "kept", uint64_t(3), "sampledOut", uint64_t(7)) == 0);
+	REQUIRE(trace == expected);
+	REQUIRE(CheckTraceIsSelfContained(trace) == 7);
+}
+
+TEST_CASE("TestSamplerProbability", "[sampling]") {
+	fxt::SamplingConfig config;
+	config.probability = 0.0;
+	fxt::Sampler none;
+	REQUIRE(InitSampler(&none, "None", config) == 0);
+
+	config.probability = 0.25;
+	fxt::Sampler quarter;
+	REQUIRE(InitSampler(&quarter, "Quarter", config) == 0);
+
+	unsigned kept = 0;
+	for (unsigned i = 0; i < 10000; ++i) {
+		REQUIRE_FALSE(fxt::SampleEvent(&none));
+		if (fxt::SampleEvent(&quarter)) {
+			++kept;
+		}
+	}
+	REQUIRE(kept > 2000);
+	REQUIRE(kept < 3000);
+
+	config.probability = 1.5;
+	fxt::Sampler invalid;
+	REQUIRE(InitSampler(&invalid, "Invalid", config) == FXT_ERR_INVALID_CONFIG);
+}
+
+TEST_CASE("TestSamplerRateLimit", "[sampling]") {
+	fxt::SamplingConfig config;
+	config.maxEventsPerSecond = 1;
+	config.burst = 5;
+	fxt::Sampler sampler;
+	REQUIRE(InitSampler(&sampler, "Limited", config) == 0);
+
+	// Nowhere near a second passes, so only the burst gets through
+	unsigned kept = 0;
+	for (unsigned i = 0; i < 1000; ++i) {
+		if (fxt::SampleEvent(&sampler)) {
+			++kept;
+		}
+	}
+	REQUIRE(kept == 5);
+}
+
+TEST_CASE("TestCorrelationSamplerKeepsWholeChains", "[sampling]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+
+	std::vector<uint8_t> expected = trace;
+	fxt::Writer expectedWriter(&expected, WriteToVector);
+
+	fxt::CorrelationSampler sampler;
+	REQUIRE(InitCorrelationSampler(&sampler, "Requests", 0.25, fxt::kDefaultCorrelationSamplingSeed) == 0);
+	// Stands in for another process, configured the same way
+	fxt::CorrelationSampler otherSampler;
+	REQUIRE(InitCorrelationSampler(&otherSampler, "Requests", 0.25, fxt::kDefaultCorrelationSamplingSeed) == 0);
+
+	unsigned kept = 0;
+	for (uint64_t id = 0; id < 1000; ++id) {
+		const bool sampled = fxt::SampleCorrelationID(&sampler, id);
+		REQUIRE(fxt::SampleCorrelationID(&otherSampler, id) == sampled);
+		if (sampled) {
+			++kept;
+		}
+
+		FXT_CORRELATED_ADD_ASYNC_BEGIN_EVENT(&sampler, &writer, "Request", 3, 45, id, id);
+		FXT_CORRELATED_ADD_FLOW_BEGIN_EVENT(&sampler, &writer, "Hop", 3, 45, id, id);
+		FXT_CORRELATED_ADD_FLOW_END_EVENT(&otherSampler, &writer, "Hop", 3, 46, id + 1, id);
+		FXT_CORRELATED_ADD_ASYNC_END_EVENT(&otherSampler, &writer, "Request", 3, 46, id + 2, id, "id", id);
+		if (sampled) {
+			REQUIRE(AddAsyncBeginEvent(&expectedWriter, "Requests", "Request", 3, 45, id, id, {}) == 0);
+			REQUIRE(AddFlowBeginEvent(&expectedWriter, "Requests", "Hop", 3, 45, id, id, {}) == 0);
+			REQUIRE(AddFlowEndEvent(&expectedWriter, "Requests", "Hop", 3, 46, id + 1, id, {}) == 0);
+			REQUIRE(FXT_ADD_ASYNC_END_EVENT(&expectedWriter, "Requests", "Request", 3, 46, id + 2, id, "id", id) == 0);
+		}
+	}
+	REQUIRE(kept > 150);
+	REQUIRE(kept < 350);
+	REQUIRE(trace == expected);
+
+	// A different seed picks a different set of IDs
+	fxt::CorrelationSampler reseeded;
+	REQUIRE(InitCorrelationSampler(&reseeded, "Requests", 0.25, 1234) == 0);
+	unsigned differences = 0;
+	for (uint64_t id = 0; id < 1000; ++id) {
+		if (fxt::SampleCorrelationID(&reseeded, id) != fxt::SampleCorrelationID(&sampler, id)) {
+			++differences;
+		}
+	}
+	REQUIRE(differences > 0);
+}
+
+// The cost of deciding, compared to writing every event
+// Run with: fxt-test "[sampling][benchmark]"
+TEST_CASE("BenchmarkSampler", "[.][sampling][benchmark]") {
+	std::vector<uint8_t> trace;
+	trace.reserve(64 * 1024 * 1024);
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+
+	fxt::SamplingConfig config;
+	config.oneInN = 100;
+	fxt::Sampler sampler;
+	REQUIRE(InitSampler(&sampler, "Hot", config) == 0);
+
+	BENCHMARK("Every event") {
+		trace.clear();
+		for (uint64_t i = 0; i < 1000; ++i) {
+			FXT_ADD_INSTANT_EVENT(&writer, "Hot", "Event", 3, 45, i, "index", i);
+		}
+		return trace.size();
+	};
+	BENCHMARK("1 in 100") {
+		trace.clear();
+		for (uint64_t i = 0; i < 1000; ++i) {
+			FXT_SAMPLED_ADD_INSTANT_EVENT(&sampler, &writer, "Event", 3, 45, i, "index", i);
+		}
+		return trace.size();
+	};
+}
@@ -0,0 +1,112 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/scope.h"
+
+#include "trace_checks.h"
+
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include <string.h>
+#include <vector>
+
+TEST_CASE("TestScopeWritesDurationComplete", "[scope]") {
+	using namespace fxt::internal;
+
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	writer.clock = &clock;
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+
+	const uint64_t before = ReadClock(&clock);
+	{
+		int count = 0;
+		FXT_SCOPE(&writer, "Foo", "Bar", "count", count);
+		FXT_SCOPE(&writer, "Foo", "Nested");
+		for (int i = 0; i < 3; ++i) {
+			++count;
+		}
+	}
+	const uint64_t after = ReadClock(&clock);
+
+	// One record per scope, inner scope first
+	REQUIRE(CheckTraceIsSelfContained(trace) == 2);
+
+	std::vector<uint64_t> eventOffsets;
+	for (size_t offset = 0; offset < trace.size();) {
+		uint64_t header;
+		memcpy(&header, trace.data() + offset, sizeof(header));
+		if (RecordFields::Type::Get<RecordType>(header) == RecordType::Event) {
+			REQUIRE(EventRecordFields::EventType::Get<EventType>(header) == EventType::DurationComplete);
+			eventOffsets.push_back(offset);
+		}
+		offset += WordsToBytes(GetRecordSizeInWords(header));
+	}
+	REQUIRE(eventOffsets.size() == 2);
+
+	uint64_t header;
+	uint64_t innerBegin;
+	uint64_t innerEnd;
+	memcpy(&innerBegin, trace.data() + eventOffsets[0] + 8, sizeof(innerBegin));
+	memcpy(&innerEnd, trace.data() + eventOffsets[0] + 16, sizeof(innerEnd));
+	uint64_t outerBegin;
+	uint64_t outerEnd;
+	memcpy(&header, trace.data() + eventOffsets[1], sizeof(header));
+	memcpy(&outerBegin, trace.data() + eventOffsets[1] + 8, sizeof(outerBegin));
+	memcpy(&outerEnd, trace.data() + eventOffsets[1] + WordsToBytes(GetRecordSizeInWords(header)) - 8, sizeof(outerEnd));
+
+	REQUIRE(before <= outerBegin);
+	REQUIRE(outerBegin <= innerBegin);
+	REQUIRE(innerBegin <= innerEnd);
+	REQUIRE(innerEnd <= outerEnd);
+	REQUIRE(outerEnd <= after);
+
+	// The argument is evaluated on exit, so it has the final count
+	fxt::KernelObjectID processID;
+	fxt::KernelObjectID threadID;
+	fxt::GetCurrentThreadIdentity(&processID, &threadID);
+
+	std::vector<uint8_t> expected;
+	fxt::Writer expectedWriter(&expected, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&expectedWriter) == 0);
+	REQUIRE(AddInitializationRecord(&expectedWriter, clock.ticksPerSecond) == 0);
+	REQUIRE(AddDurationCompleteEvent(&expectedWriter, "Foo", "Nested", processID, threadID, innerBegin, innerEnd) == 0);
+	REQUIRE(FXT_ADD_DURATION_COMPLETE_EVENT(&expectedWriter, "Foo", "Bar", processID, threadID, outerBegin, outerEnd, "count", 3) == 0);
+	REQUIRE(trace == expected);
+}
+
+// A scope, compared to the Begin / End pair it replaces
+// Run with: fxt-test "[scope][benchmark]"
+TEST_CASE("BenchmarkScope", "[.][scope][benchmark]") {
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+
+	std::vector<uint8_t> trace;
+	trace.reserve(64 * 1024 * 1024);
+	fxt::Writer writer(&trace, WriteToVector);
+	writer.clock = &clock;
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+
+	BENCHMARK("Begin / End") {
+		trace.clear();
+		for (int i = 0; i < 1000; ++i) {
+			FXT_ADD_DURATION_BEGIN_EVENT(&writer, "Foo", "Bar", fxt::kCurrentProcess, fxt::kCurrentThread, fxt::kTimestampNow, "index", i);
+			FXT_ADD_DURATION_END_EVENT(&writer, "Foo", "Bar", fxt::kCurrentProcess, fxt::kCurrentThread, fxt::kTimestampNow, "index", i);
+		}
+		return trace.size();
+	};
+	BENCHMARK("FXT_SCOPE") {
+		trace.clear();
+		for (int i = 0; i < 1000; ++i) {
+			FXT_SCOPE(&writer, "Foo", "Bar", "index", i);
+		}
+		return trace.size();
+	};
+}
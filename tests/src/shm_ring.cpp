@@ -0,0 +1,152 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/shm_ring.h"
+
+#include "fxt/collector.h"
+#include "fxt/writer.h"
+
+#include "trace_checks.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+static void WriteEvents(fxt::Writer *writer, unsigned numEvents) {
+	for (unsigned i = 0; i < numEvents; ++i) {
+		REQUIRE(FXT_ADD_INSTANT_EVENT(writer, "Foo", "Tick", 3, 45, i * 100, "index", i) == 0);
+	}
+}
+
+TEST_CASE("TestShmRingMergesProcesses", "[shm_ring]") {
+	fxt::ShmRingSinkConfig config;
+	config.capacity = 64 * 1024;
+
+	config.providerID = 1;
+	config.providerName = "First";
+	fxt::ShmRingSink firstSink;
+	REQUIRE(OpenShmRingSink(&firstSink, "/fxt-test-ring-first", config) == 0);
+	fxt::Writer firstWriter(&firstSink, fxt::WriteToShmRingSink);
+
+	config.providerID = 2;
+	config.providerName = "Second";
+	fxt::ShmRingSink secondSink;
+	REQUIRE(OpenShmRingSink(&secondSink, "/fxt-test-ring-second", config) == 0);
+	fxt::Writer secondWriter(&secondSink, fxt::WriteToShmRingSink);
+
+	std::vector<uint8_t> merged;
+	fxt::Collector collector(&merged, WriteToVector);
+	fxt::ShmRingReader firstReader;
+	fxt::ShmRingReader secondReader;
+	REQUIRE(OpenShmRingReader(&firstReader, &collector, "/fxt-test-ring-first") == 0);
+	REQUIRE(OpenShmRingReader(&secondReader, &collector, "/fxt-test-ring-second") == 0);
+	REQUIRE(collector.streams[firstReader.streamIndex].providerName == "First");
+	REQUIRE(collector.streams[secondReader.streamIndex].providerID == 2);
+
+	REQUIRE(WriteMagicNumberRecord(&firstWriter) == 0);
+	REQUIRE(AddInitializationRecord(&firstWriter, 1000) == 0);
+	REQUIRE(WriteMagicNumberRecord(&secondWriter) == 0);
+	REQUIRE(AddInitializationRecord(&secondWriter, 1000) == 0);
+
+	WriteEvents(&firstWriter, 10);
+	REQUIRE(PollShmRingReader(&firstReader, &collector, nullptr) == 0);
+	WriteEvents(&secondWriter, 20);
+	REQUIRE(PollShmRingReader(&secondReader, &collector, nullptr) == 0);
+	WriteEvents(&firstWriter, 5);
+	WriteEvents(&secondWriter, 5);
+
+	REQUIRE(CloseShmRingSink(&firstSink) == 0);
+	REQUIRE(CloseShmRingSink(&secondSink) == 0);
+	REQUIRE(PollShmRingReader(&firstReader, &collector, nullptr) == 0);
+	REQUIRE(PollShmRingReader(&secondReader, &collector, nullptr) == 0);
+	REQUIRE(firstReader.finished);
+	REQUIRE(secondReader.finished);
+
+	const std::map<uint64_t, unsigned> counts = CountEventsPerProvider(merged);
+	REQUIRE(counts.size() == 2);
+	REQUIRE(counts.at(1) == 15);
+	REQUIRE(counts.at(2) == 25);
+
+	// The collector removes the rings once they are drained
+	fxt::ShmRingReader reopened;
+	REQUIRE(OpenShmRingReader(&reopened, &collector, "/fxt-test-ring-first") == FXT_ERR_OPEN_FAILED);
+}
+
+TEST_CASE("TestShmRingOnlyPublishesCompleteRecords", "[shm_ring]") {
+	fxt::ShmRingSink sink;
+	fxt::ShmRingSinkConfig config;
+	config.capacity = 4096;
+	REQUIRE(OpenShmRingSink(&sink, "/fxt-test-ring-partial", config) == 0);
+
+	std::vector<uint8_t> merged;
+	fxt::Collector collector(&merged, WriteToVector);
+	fxt::ShmRingReader reader;
+	REQUIRE(OpenShmRingReader(&reader, &collector, "/fxt-test-ring-partial") == 0);
+
+	std::vector<uint8_t> record;
+	fxt::Writer recordWriter(&record, WriteToVector);
+	REQUIRE(AddInitializationRecord(&recordWriter, 1000) == 0);
+	REQUIRE(record.size() == 16);
+
+	// Split in the middle of the header, and again in the payload
+	size_t collected;
+	REQUIRE(fxt::WriteToShmRingSink(&sink, record.data(), 3) == 0);
+	REQUIRE(PollShmRingReader(&reader, &collector, &collected) == 0);
+	REQUIRE(collected == 0);
+	REQUIRE(fxt::WriteToShmRingSink(&sink, record.data() + 3, 9) == 0);
+	REQUIRE(PollShmRingReader(&reader, &collector, &collected) == 0);
+	REQUIRE(collected == 0);
+	REQUIRE(fxt::WriteToShmRingSink(&sink, record.data() + 12, 4) == 0);
+	REQUIRE(PollShmRingReader(&reader, &collector, &collected) == 0);
+	REQUIRE(collected == 16);
+
+	REQUIRE(CloseShmRingSink(&sink) == 0);
+	REQUIRE(PollShmRingReader(&reader, &collector, nullptr) == 0);
+	REQUIRE(reader.finished);
+}
+
+TEST_CASE("TestShmRingWrapsWhileCollecting", "[shm_ring]") {
+	fxt::ShmRingSink sink;
+	fxt::ShmRingSinkConfig config;
+	config.capacity = 4096;
+	config.providerID = 7;
+	REQUIRE(OpenShmRingSink(&sink, "/fxt-test-ring-wrap", config) == 0);
+
+	std::vector<uint8_t> merged;
+	fxt::Collector collector(&merged, WriteToVector);
+	fxt::ShmRingReader reader;
+	REQUIRE(OpenShmRingReader(&reader, &collector, "/fxt-test-ring-wrap") == 0);
+
+	std::atomic<int> collectorError(0);
+	std::thread collectorThread([&]() {
+		while (!reader.finished) {
+			const int ret = PollShmRingReader(&reader, &collector, nullptr);
+			if (ret != 0) {
+				collectorError = ret;
+				return;
+			}
+			std::this_thread::yield();
+		}
+	});
+
+	// Many times the capacity, so the producer has to wait for the collector
+	const unsigned kNumEvents = 2000;
+	fxt::Writer writer(&sink, fxt::WriteToShmRingSink);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+	WriteEvents(&writer, kNumEvents);
+	REQUIRE(CloseShmRingSink(&sink) == 0);
+
+	collectorThread.join();
+	REQUIRE(collectorError == 0);
+	REQUIRE(merged.size() > config.capacity * 4);
+
+	const std::map<uint64_t, unsigned> counts = CountEventsPerProvider(merged);
+	REQUIRE(counts.size() == 1);
+	REQUIRE(counts.at(7) == kNumEvents);
+}
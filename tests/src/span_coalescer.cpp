@@ -0,0 +1,198 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/span_coalescer.h"
+
+#include "trace_checks.h"
+
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Returns the begin and end timestamps of every Duration Complete event, in stream order
+static std::vector<std::pair<uint64_t, uint64_t>> ReadDurationCompleteSpans(const std::vector<uint8_t> &trace) {
+	using namespace fxt::internal;
+
+	std::vector<std::pair<uint64_t, uint64_t>> spans;
+	for (size_t offset = 0; offset < trace.size();) {
+		uint64_t header;
+		memcpy(&header, trace.data() + offset, sizeof(header));
+		const size_t recordSize = WordsToBytes(GetRecordSizeInWords(header));
+
+		if (RecordFields::Type::Get<RecordType>(header) == RecordType::Event && EventRecordFields::EventType::Get<EventType>(header) == EventType::DurationComplete) {
+			uint64_t begin;
+			uint64_t end;
+			memcpy(&begin, trace.data() + offset + 8, sizeof(begin));
+			memcpy(&end, trace.data() + offset + recordSize - 8, sizeof(end));
+			spans.emplace_back(begin, end);
+		}
+
+		offset += recordSize;
+	}
+
+	return spans;
+}
+
+TEST_CASE("TestSpanCoalescerMergesRuns", "[span_coalescer]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	// 2 ticks per ns
+	REQUIRE(AddInitializationRecord(&writer, 2000000000) == 0);
+
+	std::vector<uint8_t> expected = trace;
+	fxt::Writer expectedWriter(&expected, WriteToVector);
+
+	fxt::SpanCoalescerConfig config;
+	config.maxGap = 5;
+	config.maxSpanDuration = 100;
+	config.maxCount = 3;
+	fxt::SpanCoalescer coalescer;
+	REQUIRE(InitSpanCoalescer(&coalescer, config) == 0);
+
+	// Equal strings at different addresses still merge
+	const std::string name = "Acquire";
+	REQUIRE(AddCoalescedSpan(&coalescer, &writer, "Locks", "Acquire", 3, 45, 1000, 1010) == 0);
+	REQUIRE(AddCoalescedSpan(&coalescer, &writer, "Locks", name.c_str(), 3, 45, 1012, 1030) == 0);
+	REQUIRE(AddCoalescedSpan(&coalescer, &writer, "Locks", "Acquire", 3, 45, 1030, 1034) == 0);
+	// Past maxCount
+	REQUIRE(AddCoalescedSpan(&coalescer, &writer, "Locks", "Acquire", 3, 45, 1035, 1040) == 0);
+	// The gap is too big
+	REQUIRE(AddCoalescedSpan(&coalescer, &writer, "Locks", "Acquire", 3, 45, 1100, 1110) == 0);
+	// Another thread
+	REQUIRE(AddCoalescedSpan(&coalescer, &writer, "Locks", "Acquire", 3, 46, 1111, 1112) == 0);
+	// Too long to merge
+	REQUIRE(AddCoalescedSpan(&coalescer, &writer, "Locks", "Acquire", 3, 46, 1112, 1300) == 0);
+	REQUIRE(FlushCoalescedSpans(&coalescer, &writer) == 0);
+	REQUIRE(FlushCoalescedSpans(&coalescer, &writer) == 0);
+
+	REQUIRE(FXT_ADD_DURATION_COMPLETE_EVENT(&expectedWriter, "Locks", "Acquire", 3, 45, 1000, 1034, "count", uint64_t(3), "total_ns", uint64_t(16), "max_ns", uint64_t(9)) == 0);
+	REQUIRE(AddDurationCompleteEvent(&expectedWriter, "Locks", "Acquire", 3, 45, 1035, 1040) == 0);
+	REQUIRE(AddDurationCompleteEvent(&expectedWriter, "Locks", "Acquire", 3, 45, 1100, 1110) == 0);
+	REQUIRE(AddDurationCompleteEvent(&expectedWriter, "Locks", "Acquire", 3, 46, 1111, 1112) == 0);
+	REQUIRE(AddDurationCompleteEvent(&expectedWriter, "Locks", "Acquire", 3, 46, 1112, 1300) == 0);
+	REQUIRE(trace == expected);
+	REQUIRE(CheckTraceIsSelfContained(trace) == 5);
+}
+
+TEST_CASE("TestCoalescedScope", "[span_coalescer]") {
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	writer.clock = &clock;
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+
+	fxt::SpanCoalescerConfig config;
+	config.maxGap = UINT64_MAX;
+	config.maxSpanDuration = UINT64_MAX;
+	fxt::SpanCoalescer coalescer;
+	REQUIRE(InitSpanCoalescer(&coalescer, config) == 0);
+
+	for (int i = 0; i < 100; ++i) {
+		FXT_COALESCED_SCOPE(&coalescer, &writer, "Parser", "ParseField");
+	}
+	REQUIRE(FlushCoalescedSpans(&coalescer, &writer) == 0);
+	REQUIRE(CheckTraceIsSelfContained(trace) == 1);
+}
+
+TEST_CASE("TestSpanCoalescerStopsAtOtherRecords", "[span_coalescer]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000000000) == 0);
+
+	std::vector<uint8_t> expected = trace;
+	fxt::Writer expectedWriter(&expected, WriteToVector);
+
+	fxt::SpanCoalescerConfig config;
+	config.maxGap = 10;
+	fxt::SpanCoalescer coalescer;
+	REQUIRE(InitSpanCoalescer(&coalescer, config) == 0);
+
+	// The parent ends between the second and third child. The run is written before it, and not extended past it
+	REQUIRE(AddCoalescedSpan(&coalescer, &writer, "Parser", "ParseField", 3, 45, 1000, 1010) == 0);
+	REQUIRE(AddCoalescedSpan(&coalescer, &writer, "Parser", "ParseField", 3, 45, 1012, 1020) == 0);
+	REQUIRE(AddDurationCompleteEvent(&writer, "Parser", "ParseRecord", 3, 45, 995, 1025) == 0);
+	REQUIRE(AddCoalescedSpan(&coalescer, &writer, "Parser", "ParseField", 3, 45, 1026, 1030) == 0);
+	REQUIRE(FlushCoalescedSpans(&coalescer, &writer) == 0);
+	REQUIRE(writer.pendingRecordFunc == nullptr);
+
+	REQUIRE(FXT_ADD_DURATION_COMPLETE_EVENT(&expectedWriter, "Parser", "ParseField", 3, 45, 1000, 1020, "count", uint64_t(2), "total_ns", uint64_t(18), "max_ns", uint64_t(10)) == 0);
+	REQUIRE(AddDurationCompleteEvent(&expectedWriter, "Parser", "ParseRecord", 3, 45, 995, 1025) == 0);
+	REQUIRE(AddDurationCompleteEvent(&expectedWriter, "Parser", "ParseField", 3, 45, 1026, 1030) == 0);
+	REQUIRE(trace == expected);
+}
+
+TEST_CASE("TestCoalescedScopesInsideScopes", "[span_coalescer]") {
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	writer.clock = &clock;
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+
+	fxt::SpanCoalescerConfig config;
+	config.maxGap = UINT64_MAX;
+	config.maxSpanDuration = UINT64_MAX;
+	fxt::SpanCoalescer coalescer;
+	REQUIRE(InitSpanCoalescer(&coalescer, config) == 0);
+
+	// Nothing is written when the parent is entered, but the run before it still has to end there
+	for (int i = 0; i < 3; ++i) {
+		FXT_COALESCED_SCOPE(&coalescer, &writer, "Parser", "ParseField");
+	}
+	{
+		FXT_SCOPE(&writer, "Parser", "ParseRecord");
+		for (int i = 0; i < 3; ++i) {
+			FXT_COALESCED_SCOPE(&coalescer, &writer, "Parser", "ParseField");
+		}
+	}
+	REQUIRE(FlushCoalescedSpans(&coalescer, &writer) == 0);
+
+	// The run before the parent, the run inside it, and then the parent itself
+	const std::vector<std::pair<uint64_t, uint64_t>> spans = ReadDurationCompleteSpans(trace);
+	REQUIRE(spans.size() == 3);
+	const std::pair<uint64_t, uint64_t> parent = spans[2];
+	REQUIRE(spans[0].second <= parent.first);
+	REQUIRE(spans[1].first >= parent.first);
+	REQUIRE(spans[1].second <= parent.second);
+	REQUIRE(CheckTraceIsSelfContained(trace) == 3);
+}
+
+// A hot loop of tiny spans, coalesced, compared to writing every one
+// Run with: fxt-test "[span_coalescer][benchmark]"
+TEST_CASE("BenchmarkSpanCoalescer", "[.][span_coalescer][benchmark]") {
+	std::vector<uint8_t> trace;
+	trace.reserve(64 * 1024 * 1024);
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+
+	fxt::SpanCoalescer coalescer;
+	REQUIRE(InitSpanCoalescer(&coalescer, fxt::SpanCoalescerConfig()) == 0);
+
+	BENCHMARK("Every span") {
+		trace.clear();
+		for (uint64_t i = 0; i < 1000; ++i) {
+			AddDurationCompleteEvent(&writer, "Parser", "ParseField", 3, 45, i * 10, i * 10 + 5);
+		}
+		return trace.size();
+	};
+	BENCHMARK("Coalesced") {
+		trace.clear();
+		for (uint64_t i = 0; i < 1000; ++i) {
+			AddCoalescedSpan(&coalescer, &writer, "Parser", "ParseField", 3, 45, i * 10, i * 10 + 5);
+		}
+		FlushCoalescedSpans(&coalescer, &writer);
+		return trace.size();
+	};
+}
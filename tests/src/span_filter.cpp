@@ -0,0 +1,100 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/span_filter.h"
+
+#include "trace_checks.h"
+
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include <string>
+#include <vector>
+
+TEST_CASE("TestSpanFilterDropsShortSpans", "[span_filter]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+
+	std::vector<uint8_t> expected = trace;
+	fxt::Writer expectedWriter(&expected, WriteToVector);
+
+	fxt::SpanFilter filter;
+	REQUIRE(InitSpanFilter(&filter, 100) == 0);
+	REQUIRE(SetSpanFilterCategoryMinDuration(&filter, "Locks", 10) == 0);
+
+	REQUIRE(FXT_FILTERED_ADD_DURATION_BEGIN_EVENT(&filter, &writer, "Frame", "Update", 3, 45, 1000, "frame", 7) == 0);
+	{
+		// Long enough for its category, short for the default
+		std::string name = "lock name";
+		REQUIRE(FXT_FILTERED_ADD_DURATION_BEGIN_EVENT(&filter, &writer, "Locks", "Acquire", 3, 45, 1010, "lock", name.c_str()) == 0);
+	}
+	REQUIRE(FXT_FILTERED_ADD_DURATION_END_EVENT(&filter, &writer, 1030) == 0);
+	// Too short
+	REQUIRE(FXT_FILTERED_ADD_DURATION_BEGIN_EVENT(&filter, &writer, "Frame", "Tiny", 3, 45, 1040) == 0);
+	REQUIRE(FXT_FILTERED_ADD_DURATION_BEGIN_EVENT(&filter, &writer, "Locks", "Acquire", 3, 45, 1041) == 0);
+	REQUIRE(FXT_FILTERED_ADD_DURATION_END_EVENT(&filter, &writer, 1042) == 0);
+	REQUIRE(FXT_FILTERED_ADD_DURATION_END_EVENT(&filter, &writer, 1050) == 0);
+	REQUIRE(FXT_FILTERED_ADD_DURATION_END_EVENT(&filter, &writer, 1200, "objects", 12) == 0);
+	REQUIRE(FXT_FILTERED_ADD_DURATION_END_EVENT(&filter, &writer, 1300) == FXT_ERR_UNBALANCED_SPAN);
+
+	// Children are written first, with the timestamps that nest them in their parent
+	REQUIRE(FXT_ADD_DURATION_COMPLETE_EVENT(&expectedWriter, "Locks", "Acquire", 3, 45, 1010, 1030, "lock", "lock name") == 0);
+	REQUIRE(FXT_ADD_DURATION_COMPLETE_EVENT(&expectedWriter, "Frame", "Update", 3, 45, 1000, 1200, "frame", 7, "objects", 12) == 0);
+	REQUIRE(AddSpanFilterCounterEvent(&writer, &filter, 3, 45, 1300) == 0);
+	REQUIRE(FXT_ADD_COUNTER_EVENT(&expectedWriter, "fxt", "Span Filter", 3, 45, 1300, filter.slot.index, "emitted", uint64_t(2), "suppressed", uint64_t(2)) == 0);
+	REQUIRE(trace == expected);
+	REQUIRE(CheckTraceIsSelfContained(trace) == 3);
+}
+
+TEST_CASE("TestFilteredScope", "[span_filter]") {
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	writer.clock = &clock;
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+
+	fxt::SpanFilter filter;
+	REQUIRE(InitSpanFilter(&filter, UINT64_MAX) == 0);
+	REQUIRE(SetSpanFilterCategoryMinDuration(&filter, "Everything", 0) == 0);
+	{
+		FXT_FILTERED_SCOPE(&filter, &writer, "Nothing", "Dropped");
+		FXT_FILTERED_SCOPE(&filter, &writer, "Everything", "Kept", "value", 1);
+	}
+	REQUIRE(CheckTraceIsSelfContained(trace) == 1);
+}
+
+// Short spans, filtered out, compared to writing all of them
+// Run with: fxt-test "[span_filter][benchmark]"
+TEST_CASE("BenchmarkSpanFilter", "[.][span_filter][benchmark]") {
+	std::vector<uint8_t> trace;
+	trace.reserve(64 * 1024 * 1024);
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+
+	fxt::SpanFilter filter;
+	REQUIRE(InitSpanFilter(&filter, 1000) == 0);
+
+	BENCHMARK("Begin / End") {
+		trace.clear();
+		for (uint64_t i = 0; i < 1000; ++i) {
+			FXT_ADD_DURATION_BEGIN_EVENT(&writer, "Foo", "Bar", 3, 45, i * 10, "index", i);
+			FXT_ADD_DURATION_END_EVENT(&writer, "Foo", "Bar", 3, 45, i * 10 + 1);
+		}
+		return trace.size();
+	};
+	BENCHMARK("Filtered") {
+		trace.clear();
+		for (uint64_t i = 0; i < 1000; ++i) {
+			FXT_FILTERED_ADD_DURATION_BEGIN_EVENT(&filter, &writer, "Foo", "Bar", 3, 45, i * 10, "index", i);
+			FXT_FILTERED_ADD_DURATION_END_EVENT(&filter, &writer, i * 10 + 1);
+		}
+		return trace.size();
+	};
+}
@@ -0,0 +1,111 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/tail_sampling.h"
+
+#include "trace_checks.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <string>
+#include <vector>
+
+TEST_CASE("TestTailSamplerKeepsSlowAndFailedRequests", "[tail_sampling]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+
+	std::vector<uint8_t> expected = trace;
+	fxt::Writer expectedWriter(&expected, WriteToVector);
+
+	fxt::TailSamplingConfig config;
+	config.minLatency = 100;
+	fxt::TailSampler sampler;
+	REQUIRE(InitTailSampler(&sampler, &writer, config) == 0);
+
+	// Fast, so it's dropped
+	REQUIRE(FXT_TAIL_SAMPLED_ADD_ASYNC_BEGIN_EVENT(&sampler, "Requests", "Request", 3, 45, 1000, 1) == 0);
+	// Slow. The string argument has to outlive the caller's copy
+	{
+		std::string path = "/slow";
+		REQUIRE(FXT_TAIL_SAMPLED_ADD_ASYNC_BEGIN_EVENT(&sampler, "Requests", "Request", 3, 45, 1010, 2, "path", path.c_str()) == 0);
+	}
+	REQUIRE(FXT_TAIL_SAMPLED_ADD_FLOW_BEGIN_EVENT(&sampler, "Requests", "Hop", 3, 45, 1020, 2) == 0);
+	REQUIRE(FXT_TAIL_SAMPLED_ADD_ASYNC_END_EVENT(&sampler, "Requests", "Request", 3, 45, 1030, 1) == 0);
+	// Fast, but it failed
+	REQUIRE(FXT_TAIL_SAMPLED_ADD_ASYNC_BEGIN_EVENT(&sampler, "Requests", "Request", 3, 46, 1040, 3) == 0);
+	REQUIRE(FXT_TAIL_SAMPLED_ADD_ASYNC_END_EVENT(&sampler, "Requests", "Request", 3, 46, 1050, 3, "error", true) == 0);
+	REQUIRE(FXT_TAIL_SAMPLED_ADD_FLOW_END_EVENT(&sampler, "Requests", "Hop", 3, 46, 1200, 2) == 0);
+	REQUIRE(FXT_TAIL_SAMPLED_ADD_ASYNC_END_EVENT(&sampler, "Requests", "Request", 3, 45, 1210, 2, "error", false) == 0);
+	REQUIRE(trace == expected);
+
+	bool kept;
+	REQUIRE(FinishTailSampledRequest(&sampler, 1, false, &kept) == 0);
+	REQUIRE_FALSE(kept);
+	REQUIRE(FinishTailSampledRequest(&sampler, 3, false, &kept) == 0);
+	REQUIRE(kept);
+	REQUIRE(FinishTailSampledRequest(&sampler, 2, false, &kept) == 0);
+	REQUIRE(kept);
+
+	REQUIRE(AddAsyncBeginEvent(&expectedWriter, "Requests", "Request", 3, 46, 1040, 3, {}) == 0);
+	REQUIRE(FXT_ADD_ASYNC_END_EVENT(&expectedWriter, "Requests", "Request", 3, 46, 1050, 3, "error", true) == 0);
+	REQUIRE(FXT_ADD_ASYNC_BEGIN_EVENT(&expectedWriter, "Requests", "Request", 3, 45, 1010, 2, "path", "/slow") == 0);
+	REQUIRE(AddFlowBeginEvent(&expectedWriter, "Requests", "Hop", 3, 45, 1020, 2, {}) == 0);
+	REQUIRE(AddFlowEndEvent(&expectedWriter, "Requests", "Hop", 3, 46, 1200, 2, {}) == 0);
+	REQUIRE(FXT_ADD_ASYNC_END_EVENT(&expectedWriter, "Requests", "Request", 3, 45, 1210, 2, "error", false) == 0);
+	REQUIRE(trace == expected);
+	REQUIRE(CheckTraceIsSelfContained(trace) == 6);
+
+	fxt::TailSamplerMetrics metrics;
+	GetTailSamplerMetrics(&sampler, &metrics);
+	REQUIRE(metrics.requestsKept == 2);
+	REQUIRE(metrics.requestsDiscarded == 1);
+	REQUIRE(metrics.requestsStaged == 0);
+}
+
+TEST_CASE("TestTailSamplerBoundsMemory", "[tail_sampling]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+
+	std::vector<uint8_t> expected = trace;
+	fxt::Writer expectedWriter(&expected, WriteToVector);
+
+	fxt::TailSamplingConfig config;
+	config.keepProbability = 1.0;
+	config.maxRequests = 2;
+	config.maxEventsPerRequest = 2;
+	fxt::TailSampler sampler;
+	REQUIRE(InitTailSampler(&sampler, &writer, config) == 0);
+
+	REQUIRE(FXT_TAIL_SAMPLED_ADD_ASYNC_BEGIN_EVENT(&sampler, "Requests", "Request", 3, 45, 100, 1) == 0);
+	REQUIRE(FXT_TAIL_SAMPLED_ADD_ASYNC_BEGIN_EVENT(&sampler, "Requests", "Request", 3, 45, 110, 2) == 0);
+	// Touching request 1 makes request 2 the least recently used
+	REQUIRE(FXT_TAIL_SAMPLED_ADD_ASYNC_INSTANT_EVENT(&sampler, "Requests", "Step", 3, 45, 120, 1) == 0);
+	REQUIRE(FXT_TAIL_SAMPLED_ADD_ASYNC_END_EVENT(&sampler, "Requests", "Request", 3, 45, 130, 1) == 0);
+	REQUIRE(FXT_TAIL_SAMPLED_ADD_ASYNC_BEGIN_EVENT(&sampler, "Requests", "Request", 3, 45, 140, 3) == 0);
+
+	fxt::TailSamplerMetrics metrics;
+	GetTailSamplerMetrics(&sampler, &metrics);
+	REQUIRE(metrics.requestsEvicted == 1);
+	REQUIRE(metrics.eventsDropped == 1);
+	REQUIRE(metrics.requestsStaged == 2);
+
+	bool kept;
+	REQUIRE(FinishTailSampledRequest(&sampler, 2, false, &kept) == 0);
+	REQUIRE_FALSE(kept);
+	REQUIRE(FinishTailSampledRequest(&sampler, 1, false, &kept) == 0);
+	REQUIRE(kept);
+	REQUIRE(AddAsyncBeginEvent(&expectedWriter, "Requests", "Request", 3, 45, 100, 1, {}) == 0);
+	REQUIRE(AddAsyncInstantEvent(&expectedWriter, "Requests", "Step", 3, 45, 120, 1, {}) == 0);
+	REQUIRE(trace == expected);
+
+	DiscardTailSampledRequests(&sampler);
+	GetTailSamplerMetrics(&sampler, &metrics);
+	REQUIRE(metrics.requestsStaged == 0);
+}
@@ -0,0 +1,150 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/thread_identity.h"
+
+#include "fxt/writer.h"
+
+#include "trace_checks.h"
+
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include <string.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#	include <sys/syscall.h>
+#	include <sys/wait.h>
+#	include <unistd.h>
+#endif
+
+// Returns the process ID / thread ID of every Thread record, in stream order
+static std::vector<std::pair<uint64_t, uint64_t>> ReadThreadRecords(const std::vector<uint8_t> &trace) {
+	using namespace fxt::internal;
+
+	std::vector<std::pair<uint64_t, uint64_t>> threads;
+	for (size_t offset = 0; offset < trace.size();) {
+		uint64_t header;
+		memcpy(&header, trace.data() + offset, sizeof(header));
+
+		if (RecordFields::Type::Get<RecordType>(header) == RecordType::Thread) {
+			uint64_t processID;
+			uint64_t threadID;
+			memcpy(&processID, trace.data() + offset + 8, sizeof(processID));
+			memcpy(&threadID, trace.data() + offset + 16, sizeof(threadID));
+			threads.emplace_back(processID, threadID);
+		}
+
+		offset += WordsToBytes(GetRecordSizeInWords(header));
+	}
+
+	return threads;
+}
+
+TEST_CASE("TestThreadIdentity", "[thread_identity]") {
+	fxt::KernelObjectID processID;
+	fxt::KernelObjectID threadID;
+	fxt::GetCurrentThreadIdentity(&processID, &threadID);
+#if defined(__linux__)
+	REQUIRE(processID == (fxt::KernelObjectID)getpid());
+	REQUIRE(threadID == (fxt::KernelObjectID)syscall(SYS_gettid));
+#endif
+
+	fxt::KernelObjectID otherProcessID;
+	fxt::KernelObjectID otherThreadID;
+	std::thread other([&]() { fxt::GetCurrentThreadIdentity(&otherProcessID, &otherThreadID); });
+	other.join();
+	REQUIRE(otherProcessID == processID);
+	REQUIRE(otherThreadID != threadID);
+}
+
+TEST_CASE("TestWriterUsesThreadIdentity", "[thread_identity]") {
+	fxt::KernelObjectID processID;
+	fxt::KernelObjectID threadID;
+	fxt::GetCurrentThreadIdentity(&processID, &threadID);
+
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+	for (uint64_t i = 0; i < 10; ++i) {
+		REQUIRE(AddInstantEvent(&writer, "Foo", "Bar", fxt::kCurrentProcess, fxt::kCurrentThread, i) == 0);
+	}
+	// Mixing in explicit IDs for the same thread resolves to the same record
+	REQUIRE(AddInstantEvent(&writer, "Foo", "Bar", processID, threadID, 10) == 0);
+	REQUIRE(AddInstantEvent(&writer, "Foo", "Bar", processID, fxt::kCurrentThread, 11) == 0);
+
+	// A reset has to invalidate the remembered index
+	ResetInternTables(&writer);
+	REQUIRE(FXT_ADD_INSTANT_EVENT(&writer, "Foo", "Bar", fxt::kCurrentProcess, fxt::kCurrentThread, 12, "index", 12) == 0);
+
+	// So does another thread taking over the slot
+	ResetInternTables(&writer);
+	REQUIRE(AddInstantEvent(&writer, "Foo", "Bar", 3, 45, 13) == 0);
+	REQUIRE(AddInstantEvent(&writer, "Foo", "Bar", fxt::kCurrentProcess, fxt::kCurrentThread, 14) == 0);
+
+	REQUIRE(CheckTraceIsSelfContained(trace) == 15);
+
+	const std::vector<std::pair<uint64_t, uint64_t>> threads = ReadThreadRecords(trace);
+	REQUIRE(threads.size() == 4);
+	REQUIRE(threads[0] == std::make_pair(processID, threadID));
+	REQUIRE(threads[1] == std::make_pair(processID, threadID));
+	REQUIRE(threads[2] == std::make_pair<uint64_t, uint64_t>(3, 45));
+	REQUIRE(threads[3] == std::make_pair(processID, threadID));
+}
+
+#if defined(__linux__)
+TEST_CASE("TestThreadIdentityAfterFork", "[thread_identity]") {
+	// Fill the parent's cache first, so the child inherits a stale one
+	fxt::KernelObjectID parentProcessID;
+	fxt::KernelObjectID parentThreadID;
+	fxt::GetCurrentThreadIdentity(&parentProcessID, &parentThreadID);
+	REQUIRE(parentProcessID == (fxt::KernelObjectID)getpid());
+
+	const pid_t child = fork();
+	REQUIRE(child >= 0);
+	if (child == 0) {
+		// Catch2 isn't fork safe, so the child reports through its exit code
+		fxt::KernelObjectID processID;
+		fxt::KernelObjectID threadID;
+		fxt::GetCurrentThreadIdentity(&processID, &threadID);
+		const bool refreshed = processID == (fxt::KernelObjectID)getpid() && threadID == (fxt::KernelObjectID)syscall(SYS_gettid);
+		_exit(refreshed ? 0 : 1);
+	}
+
+	int status;
+	REQUIRE(waitpid(child, &status, 0) == child);
+	REQUIRE(WIFEXITED(status));
+	REQUIRE(WEXITSTATUS(status) == 0);
+}
+#endif
+
+// Writing events with explicit IDs looked up on every call, compared to the identity cache
+// Run with: fxt-test "[thread_identity][benchmark]"
+TEST_CASE("BenchmarkThreadIdentity", "[.][thread_identity][benchmark]") {
+	std::vector<uint8_t> trace;
+	fxt::Writer writer(&trace, WriteToVector);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+
+#if defined(__linux__)
+	BENCHMARK("getpid / gettid per event") {
+		trace.clear();
+		for (uint64_t i = 0; i < 1000; ++i) {
+			AddInstantEvent(&writer, "Foo", "Bar", (fxt::KernelObjectID)getpid(), (fxt::KernelObjectID)syscall(SYS_gettid), i);
+		}
+	};
+#endif
+	BENCHMARK("Identity cache") {
+		trace.clear();
+		for (uint64_t i = 0; i < 1000; ++i) {
+			AddInstantEvent(&writer, "Foo", "Bar", fxt::kCurrentProcess, fxt::kCurrentThread, i);
+		}
+	};
+}
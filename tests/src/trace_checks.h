@@ -0,0 +1,226 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#pragma once
+
+#include "fxt/internal/records.h"
+#include "fxt/recovery.h"
+#include "fxt/writer.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#	include <unistd.h>
+#endif
+
+// A WriteFunc that appends to the std::vector<uint8_t> passed as the user context
+inline int WriteToVector(void *userContext, const void *data, size_t len) {
+	std::vector<uint8_t> *buffer = (std::vector<uint8_t> *)userContext;
+
+	buffer->insert(buffer->end(), (const uint8_t *)data, (const uint8_t *)data + len);
+	return 0;
+}
+
+// The Magic Number, Provider Info, and Initialization records that every test trace starts with
+inline void WriteTestHeader(fxt::Writer *writer) {
+	REQUIRE(WriteMagicNumberRecord(writer) == 0);
+	REQUIRE(AddProviderInfoRecord(writer, 1234, "Test Provider") == 0);
+	REQUIRE(AddInitializationRecord(writer, 1000) == 0);
+}
+
+// Writes events [first, first + count) on the given thread. Each one is a Begin, an Instant with an argument, and an End
+inline void WriteTestEvents(fxt::Writer *writer, uint64_t threadID, uint64_t first, uint64_t count) {
+	for (uint64_t i = first; i < first + count; ++i) {
+		REQUIRE(AddDurationBeginEvent(writer, "Foo", "Root", 3, threadID, i * 100) == 0);
+		REQUIRE(FXT_ADD_INSTANT_EVENT(writer, "Bar", "Tick", 3, threadID, i * 100 + 10, "index", i) == 0);
+		REQUIRE(AddDurationEndEvent(writer, "Foo", "Root", 3, threadID, i * 100 + 50) == 0);
+	}
+}
+
+// A whole trace of numEvents events, for comparing what a sink wrote against writing to a vector directly
+inline void WriteTestTrace(fxt::Writer *writer, uint64_t numEvents) {
+	WriteTestHeader(writer);
+	WriteTestEvents(writer, 45, 0, numEvents);
+}
+
+// Reads the file from the start
+inline std::vector<uint8_t> ReadWholeFile(FILE *file) {
+	std::vector<uint8_t> contents;
+
+	REQUIRE(fseek(file, 0, SEEK_SET) == 0);
+	uint8_t chunk[4096];
+	size_t read;
+	while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+		contents.insert(contents.end(), chunk, chunk + read);
+	}
+
+	return contents;
+}
+
+inline std::vector<uint8_t> ReadWholeFile(const std::string &path) {
+	FILE *file = fopen(path.c_str(), "rb");
+	REQUIRE(file != nullptr);
+	std::vector<uint8_t> contents = ReadWholeFile(file);
+	fclose(file);
+
+	return contents;
+}
+
+#if !defined(_WIN32)
+// Creates an empty file with a unique name in /tmp, and returns its path. The caller removes it
+inline std::string MakeTempPath() {
+	char path[] = "/tmp/fxt-test-XXXXXX";
+	const int fd = mkstemp(path);
+	REQUIRE(fd >= 0);
+	close(fd);
+
+	return path;
+}
+#endif
+
+// Checks that a piece of a trace can be decoded on its own. IE, it starts with a Magic Number record, has an
+// Initialization record before any events, and every provider / string / thread reference is defined in the piece itself
+// Returns the number of events in the piece
+inline unsigned CheckTraceIsSelfContained(const uint8_t *data, size_t len) {
+	using namespace fxt::internal;
+
+	fxt::TraceRecoveryResult scan;
+	REQUIRE(fxt::ScanTrace(data, len, &scan) == 0);
+	REQUIRE(scan.validBytes == len);
+
+	std::set<uint64_t> providers;
+	std::set<uint16_t> strings;
+	std::set<uint16_t> threads;
+	const auto checkStringRef = [&](uint16_t ref) {
+		// 0 is the empty string, and the high bit marks an inline string
+		if (ref != 0 && (ref & 0x8000) == 0) {
+			REQUIRE(strings.count(ref) == 1);
+		}
+	};
+
+	bool initialized = false;
+	unsigned numEvents = 0;
+	for (size_t offset = 0; offset < len;) {
+		uint64_t header;
+		memcpy(&header, data + offset, sizeof(header));
+		if (offset == 0) {
+			REQUIRE(header == kMagicNumberRecord);
+		}
+
+		switch (RecordFields::Type::Get<RecordType>(header)) {
+		case RecordType::Metadata: {
+			const MetadataType metadataType = MetadataRecordFields::MetadataType::Get<MetadataType>(header);
+			if (metadataType == MetadataType::ProviderInfo) {
+				providers.insert(ProviderInfoMetadataRecordFields::ProviderID::Get<uint64_t>(header));
+			} else if (metadataType == MetadataType::ProviderSection) {
+				REQUIRE(providers.count(ProviderSectionMetadataRecordFields::ProviderID::Get<uint64_t>(header)) == 1);
+			}
+			break;
+		}
+		case RecordType::Initialization:
+			initialized = true;
+			break;
+		case RecordType::String:
+			strings.insert(StringRecordFields::StringIndex::Get<uint16_t>(header));
+			break;
+		case RecordType::Thread:
+			threads.insert(ThreadRecordFields::ThreadIndex::Get<uint16_t>(header));
+			break;
+		case RecordType::Event: {
+			REQUIRE(initialized);
+			checkStringRef(EventRecordFields::CategoryStringRef::Get<uint16_t>(header));
+			checkStringRef(EventRecordFields::NameStringRef::Get<uint16_t>(header));
+			const uint16_t threadRef = EventRecordFields::ThreadRef::Get<uint16_t>(header);
+			if (threadRef != 0) {
+				REQUIRE(threads.count(threadRef) == 1);
+			}
+			++numEvents;
+			break;
+		}
+		case RecordType::KernelObject:
+			checkStringRef(KernelObjectRecordFields::NameStringRef::Get<uint16_t>(header));
+			break;
+		default:
+			break;
+		}
+
+		offset += WordsToBytes(GetRecordSizeInWords(header));
+	}
+
+	return numEvents;
+}
+
+inline unsigned CheckTraceIsSelfContained(const std::vector<uint8_t> &trace) {
+	return CheckTraceIsSelfContained(trace.data(), trace.size());
+}
+
+// Checks that a merged trace has a single Magic Number record at the start, every event is inside a provider section,
+// and every string / thread an event refers to is defined by the event's own provider
+// Returns the number of events filed under each provider
+inline std::map<uint64_t, unsigned> CountEventsPerProvider(const uint8_t *data, size_t len) {
+	using namespace fxt::internal;
+
+	fxt::TraceRecoveryResult scan;
+	REQUIRE(fxt::ScanTrace(data, len, &scan) == 0);
+	REQUIRE(scan.validBytes == len);
+
+	std::map<uint64_t, unsigned> counts;
+	std::map<uint64_t, std::set<uint16_t>> strings;
+	std::map<uint64_t, std::set<uint16_t>> threads;
+	bool inSection = false;
+	uint64_t currentProvider = 0;
+	const auto checkStringRef = [&](uint16_t ref) {
+		if (ref != 0 && (ref & 0x8000) == 0) {
+			REQUIRE(strings[currentProvider].count(ref) == 1);
+		}
+	};
+	for (size_t offset = 0; offset < len;) {
+		uint64_t header;
+		memcpy(&header, data + offset, sizeof(header));
+		REQUIRE((header == kMagicNumberRecord) == (offset == 0));
+
+		const RecordType type = RecordFields::Type::Get<RecordType>(header);
+		if (type == RecordType::Metadata) {
+			const MetadataType metadataType = MetadataRecordFields::MetadataType::Get<MetadataType>(header);
+			if (metadataType == MetadataType::ProviderInfo) {
+				currentProvider = ProviderInfoMetadataRecordFields::ProviderID::Get<uint64_t>(header);
+				inSection = true;
+			} else if (metadataType == MetadataType::ProviderSection) {
+				currentProvider = ProviderSectionMetadataRecordFields::ProviderID::Get<uint64_t>(header);
+				inSection = true;
+			}
+		} else if (type == RecordType::String) {
+			strings[currentProvider].insert(StringRecordFields::StringIndex::Get<uint16_t>(header));
+		} else if (type == RecordType::Thread) {
+			threads[currentProvider].insert(ThreadRecordFields::ThreadIndex::Get<uint16_t>(header));
+		} else if (type == RecordType::Event) {
+			REQUIRE(inSection);
+			checkStringRef(EventRecordFields::CategoryStringRef::Get<uint16_t>(header));
+			checkStringRef(EventRecordFields::NameStringRef::Get<uint16_t>(header));
+			const uint16_t threadRef = EventRecordFields::ThreadRef::Get<uint16_t>(header);
+			if (threadRef != 0) {
+				REQUIRE(threads[currentProvider].count(threadRef) == 1);
+			}
+			++counts[currentProvider];
+		}
+
+		offset += WordsToBytes(GetRecordSizeInWords(header));
+	}
+
+	return counts;
+}
+
+inline std::map<uint64_t, unsigned> CountEventsPerProvider(const std::vector<uint8_t> &trace) {
+	return CountEventsPerProvider(trace.data(), trace.size());
+}
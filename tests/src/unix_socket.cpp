@@ -0,0 +1,215 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+#include "fxt/unix_socket.h"
+
+#include "fxt/clock.h"
+#include "fxt/collector.h"
+#include "fxt/internal/records.h"
+#include "fxt/writer.h"
+
+#include "trace_checks.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Each test gets a socket in a fresh directory, so concurrent runs can't steal each other's socket
+static std::string MakeSocketPath() {
+	char dir[] = "/tmp/fxt-socket-XXXXXX";
+	REQUIRE(mkdtemp(dir) != nullptr);
+
+	return std::string(dir) + "/collector.sock";
+}
+
+// The collector removes the socket itself when it closes. This removes the directory around it
+static void RemoveSocketDirectory(const std::string &path) {
+	rmdir(path.substr(0, path.rfind('/')).c_str());
+}
+
+// Polls until every client has connected, sent everything, and disconnected
+static void CollectUntilDisconnected(fxt::UnixSocketCollector *socketCollector, fxt::Collector *collector, size_t numClients) {
+	while (collector->streams.size() < numClients || !socketCollector->clients.empty()) {
+		REQUIRE(PollUnixSocketCollector(socketCollector, collector, 10, nullptr) == 0);
+	}
+}
+
+TEST_CASE("TestUnixSocketMergesClients", "[unix_socket]") {
+	signal(SIGPIPE, SIG_IGN);
+
+	const std::string socketPath = MakeSocketPath();
+	fxt::UnixSocketCollector socketCollector;
+	REQUIRE(OpenUnixSocketCollector(&socketCollector, socketPath.c_str()) == 0);
+
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+
+	fxt::UnixSocketSinkConfig config;
+	config.bufferSize = 1024;
+
+	config.providerID = 1;
+	config.providerName = "First";
+	fxt::UnixSocketSink firstSink;
+	fxt::Writer firstWriter(&firstSink, fxt::WriteToUnixSocketSink);
+	firstWriter.clock = &clock;
+	REQUIRE(OpenUnixSocketSink(&firstSink, &firstWriter, socketPath.c_str(), config) == 0);
+
+	config.providerID = 2;
+	config.providerName = "Second";
+	fxt::UnixSocketSink secondSink;
+	fxt::Writer secondWriter(&secondSink, fxt::WriteToUnixSocketSink);
+	secondWriter.clock = &clock;
+	REQUIRE(OpenUnixSocketSink(&secondSink, &secondWriter, socketPath.c_str(), config) == 0);
+
+	REQUIRE(WriteMagicNumberRecord(&firstWriter) == 0);
+	REQUIRE(AddInitializationRecord(&firstWriter, 1000) == 0);
+	REQUIRE(WriteMagicNumberRecord(&secondWriter) == 0);
+	REQUIRE(AddInitializationRecord(&secondWriter, 1000) == 0);
+	for (unsigned i = 0; i < 100; ++i) {
+		REQUIRE(FXT_ADD_INSTANT_EVENT(&firstWriter, "Foo", "Tick", 3, 45, i * 100, "index", i) == 0);
+		if (i % 2 == 0) {
+			REQUIRE(FXT_ADD_INSTANT_EVENT(&secondWriter, "Bar", "Tock", 4, 46, i * 100, "index", i) == 0);
+		}
+	}
+	REQUIRE(CloseUnixSocketSink(&firstSink) == 0);
+	REQUIRE(CloseUnixSocketSink(&secondSink) == 0);
+	REQUIRE(firstSink.metrics.droppedBuffers == 0);
+	REQUIRE(secondSink.metrics.droppedBuffers == 0);
+
+	std::vector<uint8_t> merged;
+	fxt::Collector collector(&merged, WriteToVector);
+	CollectUntilDisconnected(&socketCollector, &collector, 2);
+
+	const std::map<uint64_t, unsigned> counts = CountEventsPerProvider(merged);
+	REQUIRE(counts.size() == 2);
+	REQUIRE(counts.at(1) == 100);
+	REQUIRE(counts.at(2) == 50);
+
+	CloseUnixSocketCollector(&socketCollector);
+	RemoveSocketDirectory(socketPath);
+}
+
+TEST_CASE("TestUnixSocketSinkDropsInsteadOfBlocking", "[unix_socket]") {
+	signal(SIGPIPE, SIG_IGN);
+
+	const std::string socketPath = MakeSocketPath();
+	fxt::UnixSocketCollector socketCollector;
+	REQUIRE(OpenUnixSocketCollector(&socketCollector, socketPath.c_str()) == 0);
+
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+
+	fxt::UnixSocketSinkConfig config;
+	config.bufferSize = 4096;
+	config.providerID = 1;
+	fxt::UnixSocketSink sink;
+	fxt::Writer writer(&sink, fxt::WriteToUnixSocketSink);
+	writer.clock = &clock;
+	REQUIRE(OpenUnixSocketSink(&sink, &writer, socketPath.c_str(), config) == 0);
+
+	// Nothing is reading from the socket yet, so it fills up, and the sink has to start dropping
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	const unsigned kNumEvents = 100000;
+	for (unsigned i = 0; i < kNumEvents; ++i) {
+		REQUIRE(FXT_ADD_INSTANT_EVENT(&writer, "Foo", "Tick", 3, 45 + (i % 4), fxt::kTimestampNow, "index", i) == 0);
+	}
+	REQUIRE(sink.metrics.droppedBuffers > 0);
+	REQUIRE(sink.metrics.droppedBytes > 0);
+
+	std::vector<uint8_t> merged;
+	fxt::Collector collector(&merged, WriteToVector);
+	std::atomic<int> closeResult(-1);
+	std::thread closeThread([&]() {
+		closeResult = CloseUnixSocketSink(&sink);
+	});
+	CollectUntilDisconnected(&socketCollector, &collector, 1);
+	closeThread.join();
+	REQUIRE(closeResult == 0);
+
+	// Everything that made it through can still be decoded on its own
+	const unsigned numEvents = CheckTraceIsSelfContained(merged);
+	REQUIRE(numEvents > 0);
+	REQUIRE(numEvents < kNumEvents);
+	REQUIRE(sink.metrics.bytesSent + sink.metrics.droppedBytes >= kNumEvents * 32);
+
+	CloseUnixSocketCollector(&socketCollector);
+	RemoveSocketDirectory(socketPath);
+}
+
+TEST_CASE("TestUnixSocketDropCounterIsCollected", "[unix_socket]") {
+	using namespace fxt::internal;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	const std::string socketPath = MakeSocketPath();
+	fxt::UnixSocketCollector socketCollector;
+	REQUIRE(OpenUnixSocketCollector(&socketCollector, socketPath.c_str()) == 0);
+
+	fxt::Clock clock;
+	REQUIRE(InitClock(&clock, fxt::ClockConfig()) == 0);
+
+	fxt::UnixSocketSinkConfig config;
+	config.bufferSize = 4096;
+	config.providerID = 1;
+	config.providerName = "Dropper";
+	fxt::UnixSocketSink sink;
+	fxt::Writer writer(&sink, fxt::WriteToUnixSocketSink);
+	writer.clock = &clock;
+	REQUIRE(OpenUnixSocketSink(&sink, &writer, socketPath.c_str(), config) == 0);
+
+	// Stop as soon as the first buffer is dropped. The "Dropped" counter then sits in the buffer that close sends
+	const uint64_t startTicks = ReadClock(&clock);
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	for (unsigned i = 0; i < 1000000 && sink.metrics.droppedBuffers == 0; ++i) {
+		REQUIRE(FXT_ADD_INSTANT_EVENT(&writer, "Foo", "Tick", 3, 45, fxt::kTimestampNow, "index", i) == 0);
+	}
+	REQUIRE(sink.metrics.droppedBuffers == 1);
+
+	std::vector<uint8_t> merged;
+	fxt::Collector collector(&merged, WriteToVector);
+	std::atomic<int> closeResult(-1);
+	std::thread closeThread([&]() {
+		closeResult = CloseUnixSocketSink(&sink);
+	});
+	CollectUntilDisconnected(&socketCollector, &collector, 1);
+	closeThread.join();
+	REQUIRE(closeResult == 0);
+	const uint64_t endTicks = ReadClock(&clock);
+
+	// The checkpoint after the drop re-announces the provider, which the collector folds into the existing section
+	const std::map<uint64_t, unsigned> counts = CountEventsPerProvider(merged);
+	REQUIRE(counts.size() == 1);
+	REQUIRE(counts.at(1) > 0);
+
+	// Every event, including the counter, is in the clock's ticks
+	unsigned numCounters = 0;
+	for (size_t offset = 0; offset < merged.size();) {
+		uint64_t header;
+		memcpy(&header, merged.data() + offset, sizeof(header));
+		if (RecordFields::Type::Get<RecordType>(header) == RecordType::Event) {
+			uint64_t timestamp;
+			memcpy(&timestamp, merged.data() + offset + sizeof(header), sizeof(timestamp));
+			REQUIRE(timestamp >= startTicks);
+			REQUIRE(timestamp <= endTicks);
+			if (EventRecordFields::EventType::Get<EventType>(header) == EventType::Counter) {
+				++numCounters;
+			}
+		}
+
+		offset += WordsToBytes(GetRecordSizeInWords(header));
+	}
+	REQUIRE(numCounters == 1);
+
+	CloseUnixSocketCollector(&socketCollector);
+	RemoveSocketDirectory(socketPath);
+}
@@ -6,6 +6,7 @@
 
 #include "fxt/writer.h"
 
+#include "trace_checks.h"
 #include "writer_test.h"
 
 #include "catch2/catch_test_macros.hpp"
@@ -188,3 +189,60 @@ TEST_CASE("TestOverflowingThreadTableWraps", "[write]") {
 	REQUIRE(GetOrCreateThreadIndex(&writer, 2, 1, &threadIndex) == 0);
 	REQUIRE(threadIndex == 1);
 }
+
+TEST_CASE("TestCheckpointsSplitTraceIntoIndependentPieces", "[write]") {
+	std::vector<uint8_t> buffer;
+
+	fxt::Writer writer(&buffer, WriteToVector);
+	writer.checkpointIntervalBytes = 2048;
+
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddProviderInfoRecord(&writer, 1234, "Test Provider") == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+
+	const unsigned kNumEvents = 500;
+	for (unsigned i = 0; i < kNumEvents; ++i) {
+		REQUIRE(AddDurationBeginEvent(&writer, "Foo", "Root", 3, 45 + (i % 5), i * 100) == 0);
+		REQUIRE(FXT_ADD_INSTANT_EVENT(&writer, "Bar", "Tick", 3, 45 + (i % 5), i * 100 + 10, "index", i) == 0);
+	}
+	REQUIRE(writer.bytesWritten == buffer.size());
+
+	// Split the trace at every checkpoint, and decode each piece on its own
+	unsigned numPieces = 0;
+	unsigned totalEvents = 0;
+	size_t start = fxt::FindNextCheckpoint(buffer.data(), buffer.size(), 0);
+	REQUIRE(start == 0);
+	while (start < buffer.size()) {
+		const size_t end = fxt::FindNextCheckpoint(buffer.data(), buffer.size(), start + 8);
+		// Checkpoints only happen at record boundaries, so they can't be much further apart than the interval
+		REQUIRE(end - start < writer.checkpointIntervalBytes + 256);
+
+		totalEvents += CheckTraceIsSelfContained(buffer.data() + start, end - start);
+		++numPieces;
+		start = end;
+	}
+
+	REQUIRE(numPieces > 10);
+	REQUIRE(totalEvents == kNumEvents * 2);
+}
+
+TEST_CASE("TestFindNextCheckpointSkipsMagicNumberInPayload", "[write]") {
+	std::vector<uint8_t> buffer;
+
+	fxt::Writer writer(&buffer, WriteToVector);
+
+	REQUIRE(WriteMagicNumberRecord(&writer) == 0);
+	REQUIRE(AddProviderInfoRecord(&writer, 1234, "Test Provider") == 0);
+	REQUIRE(AddInitializationRecord(&writer, 1000) == 0);
+
+	// The argument value is an aligned word equal to the magic number, followed by the next record
+	REQUIRE(FXT_ADD_INSTANT_EVENT(&writer, "Foo", "Bar", 3, 45, 100, "value", fxt::internal::kMagicNumberRecord) == 0);
+	REQUIRE(AddInstantEvent(&writer, "Foo", "Bar", 3, 45, 200) == 0);
+	REQUIRE(fxt::FindNextCheckpoint(buffer.data(), buffer.size(), 8) == buffer.size());
+
+	const size_t checkpoint = buffer.size();
+	REQUIRE(WriteCheckpoint(&writer) == 0);
+	REQUIRE(AddInstantEvent(&writer, "Foo", "Bar", 3, 45, 300) == 0);
+	REQUIRE(fxt::FindNextCheckpoint(buffer.data(), buffer.size(), 8) == checkpoint);
+	REQUIRE(CheckTraceIsSelfContained(buffer.data() + checkpoint, buffer.size() - checkpoint) == 1);
+}
@@ -0,0 +1,37 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+/**
+ * Decompresses a trace written with compression enabled, so it can be loaded by trace viewers
+ *
+ * Usage: fxt-decompress <input.fxtz> <output.fxt>
+ */
+
+#include "fxt/compression.h"
+
+#include <stdio.h>
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <input.fxtz> <output.fxt>\n", argv[0]);
+		return 2;
+	}
+
+	const int ret = fxt::DecompressTraceFile(argv[1], argv[2]);
+	switch (ret) {
+	case 0:
+		return 0;
+	case FXT_ERR_OPEN_FAILED:
+		fprintf(stderr, "Failed to open %s or %s\n", argv[1], argv[2]);
+		return 1;
+	case FXT_ERR_INVALID_TRACE:
+		fprintf(stderr, "%s is corrupt or truncated. Everything up to the bad frame was written to %s\n", argv[1], argv[2]);
+		return 1;
+	default:
+		fprintf(stderr, "Failed to decompress the trace: %d\n", ret);
+		return 1;
+	}
+}
@@ -0,0 +1,42 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+/**
+ * Trims the partial last record off of a truncated trace, so it can be loaded by trace viewers
+ *
+ * Usage: fxt-recover <input.fxt> <output.fxt>
+ */
+
+#include "fxt/recovery.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <input.fxt> <output.fxt>\n", argv[0]);
+		return 2;
+	}
+
+	fxt::TraceRecoveryResult result;
+	const int ret = fxt::RecoverTraceFile(argv[1], argv[2], &result);
+	switch (ret) {
+	case 0:
+		break;
+	case FXT_ERR_OPEN_FAILED:
+		fprintf(stderr, "Failed to open %s or %s\n", argv[1], argv[2]);
+		return 1;
+	case FXT_ERR_INVALID_TRACE:
+		fprintf(stderr, "%s is not an FXT trace\n", argv[1]);
+		return 1;
+	default:
+		fprintf(stderr, "Failed to recover the trace: %d\n", ret);
+		return 1;
+	}
+
+	printf("Recovered %" PRIu64 " records (%" PRIu64 " bytes). Discarded %" PRIu64 " trailing bytes\n", result.recordCount, result.validBytes, result.discardedBytes);
+	return 0;
+}
@@ -0,0 +1,115 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+/**
+ * Drains the shared memory rings of several processes into a single trace. Each process gets its own provider section
+ *
+ * Rings that don't exist yet are retried until they show up. The collector exits once every ring has been closed by its
+ * producer and drained, or on SIGINT / SIGTERM
+ *
+ * Usage: fxt-shm-collector <output.fxt> <ring name>...
+ */
+
+#include "fxt/collector.h"
+#include "fxt/shm_ring.h"
+
+#include <chrono>
+#include <memory>
+#include <signal.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+static volatile sig_atomic_t gStop = 0;
+
+static void OnStopSignal(int) {
+	gStop = 1;
+}
+
+static int WriteToFile(void *userContext, const void *data, size_t len) {
+	FILE *file = (FILE *)userContext;
+	if (fwrite(data, 1, len, file) != len) {
+		return FXT_ERR_WRITE_TO_STREAM_FAILED;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <output.fxt> <ring name>...\n", argv[0]);
+		return 2;
+	}
+
+	FILE *output = fopen(argv[1], "wb");
+	if (output == nullptr) {
+		fprintf(stderr, "Failed to open %s\n", argv[1]);
+		return 1;
+	}
+
+	signal(SIGINT, OnStopSignal);
+	signal(SIGTERM, OnStopSignal);
+
+	fxt::Collector collector(output, WriteToFile);
+
+	const int numRings = argc - 2;
+	std::vector<std::unique_ptr<fxt::ShmRingReader>> readers;
+	for (int i = 0; i < numRings; ++i) {
+		readers.emplace_back(new fxt::ShmRingReader());
+	}
+
+	int exitCode = 0;
+	bool stopping = false;
+	while (true) {
+		// Do one last pass after a stop signal, to pick up everything published so far
+		stopping = gStop != 0;
+
+		size_t totalCollected = 0;
+		int numFinished = 0;
+		for (int i = 0; i < numRings; ++i) {
+			fxt::ShmRingReader *reader = readers[i].get();
+			if (reader->header == nullptr) {
+				const int ret = OpenShmRingReader(reader, &collector, argv[i + 2]);
+				if (ret == FXT_ERR_OPEN_FAILED) {
+					continue;
+				}
+				if (ret != 0) {
+					fprintf(stderr, "%s is not an fxt ring: %d\n", argv[i + 2], ret);
+					exitCode = 1;
+					break;
+				}
+			}
+
+			size_t collected;
+			const int ret = PollShmRingReader(reader, &collector, &collected);
+			if (ret != 0) {
+				fprintf(stderr, "Failed to collect from %s: %d\n", argv[i + 2], ret);
+				exitCode = 1;
+				break;
+			}
+			totalCollected += collected;
+			if (reader->finished) {
+				++numFinished;
+			}
+		}
+
+		if (exitCode != 0 || stopping || numFinished == numRings) {
+			break;
+		}
+		if (totalCollected == 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	for (const auto &reader : readers) {
+		CloseShmRingReader(reader.get());
+	}
+	if (fclose(output) != 0) {
+		fprintf(stderr, "Failed to write %s\n", argv[1]);
+		return 1;
+	}
+
+	return exitCode;
+}
@@ -0,0 +1,83 @@
+/* FXT - A library for creating Fuschia Tracing System (FXT) files
+ *
+ * FXT is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2023
+ */
+
+/**
+ * Listens on a Unix domain socket, and merges the traces streamed by any number of UnixSocketSink clients into a single
+ * trace. Each client gets its own provider section
+ *
+ * Runs until SIGINT / SIGTERM
+ *
+ * Usage: fxt-socket-collector <socket path> <output.fxt>
+ */
+
+#include "fxt/collector.h"
+#include "fxt/unix_socket.h"
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+
+static volatile sig_atomic_t gStop = 0;
+
+static void OnStopSignal(int) {
+	gStop = 1;
+}
+
+static int WriteToFile(void *userContext, const void *data, size_t len) {
+	FILE *file = (FILE *)userContext;
+	if (fwrite(data, 1, len, file) != len) {
+		return FXT_ERR_WRITE_TO_STREAM_FAILED;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <socket path> <output.fxt>\n", argv[0]);
+		return 2;
+	}
+
+	FILE *output = fopen(argv[2], "wb");
+	if (output == nullptr) {
+		fprintf(stderr, "Failed to open %s\n", argv[2]);
+		return 1;
+	}
+
+	fxt::UnixSocketCollector socketCollector;
+	if (OpenUnixSocketCollector(&socketCollector, argv[1]) != 0) {
+		fprintf(stderr, "Failed to listen on %s\n", argv[1]);
+		fclose(output);
+		return 1;
+	}
+
+	// Clients disconnecting shouldn't take the collector down with them
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, OnStopSignal);
+	signal(SIGTERM, OnStopSignal);
+
+	fxt::Collector collector(output, WriteToFile);
+
+	int exitCode = 0;
+	while (gStop == 0) {
+		const int ret = PollUnixSocketCollector(&socketCollector, &collector, 100, nullptr);
+		if (ret != 0) {
+			fprintf(stderr, "Failed to collect: %d\n", ret);
+			exitCode = 1;
+			break;
+		}
+	}
+
+	CloseUnixSocketCollector(&socketCollector);
+	for (const fxt::CollectorStream &stream : collector.streams) {
+		printf("%s (%" PRIu64 "): %" PRIu64 " records\n", stream.providerName.c_str(), (uint64_t)stream.providerID, stream.recordsCollected);
+	}
+	if (fclose(output) != 0) {
+		fprintf(stderr, "Failed to write %s\n", argv[2]);
+		return 1;
+	}
+
+	return exitCode;
+}